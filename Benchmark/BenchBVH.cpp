@@ -0,0 +1,131 @@
+// BVH build, refit and query cost against the linear SIMD frustum culler.
+// Runs from esMain without creating a window and exits when done.
+#include "esUtil.h"
+#include "BVH.h"
+#include "FrustumCuller.h"
+#include "glm/gtc/matrix_transform.hpp"
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+using namespace RenderEngine;
+
+namespace {
+	const unsigned int kObjectCount = 50000;
+	const int kIterations = 20;
+
+	typedef std::chrono::high_resolution_clock Clock;
+
+	double Ms(Clock::time_point begin, Clock::time_point end)
+	{
+		return std::chrono::duration<double, std::milli>(end - begin).count();
+	}
+
+	struct Object
+	{
+		glm::vec3 center;
+		glm::vec3 extents;
+	};
+}
+
+int esMain(ESContext *esContext)
+{
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<float> position(-500.0f, 500.0f);
+	std::uniform_real_distribution<float> size(0.5f, 4.0f);
+	std::vector<Object> objects(kObjectCount);
+	for (auto& o : objects)
+	{
+		o.center = glm::vec3(position(rng), position(rng) * 0.1f, position(rng));
+		o.extents = glm::vec3(size(rng), size(rng), size(rng));
+	}
+
+	esLogMessage("BVH over %u objects, %d iterations\n", kObjectCount, kIterations);
+	BVH::Options serialOptions;
+	serialOptions.threadCount = 1;
+	BVH serial(serialOptions);
+	BVH parallel;
+	FrustumCuller culler;
+	for (auto& o : objects)
+	{
+		serial.Insert(o.center, o.extents);
+		parallel.Insert(o.center, o.extents);
+		culler.Add(o.center, o.extents, glm::length(o.extents));
+	}
+
+	auto t0 = Clock::now();
+	for (int i = 0; i < kIterations; ++i)
+		serial.Build();
+	auto t1 = Clock::now();
+	for (int i = 0; i < kIterations; ++i)
+		parallel.Build();
+	auto t2 = Clock::now();
+	const BVH::Stats& stats = parallel.GetStats();
+	esLogMessage("build     1 thread %7.2f ms  all threads %7.2f ms  nodes %u depth %u SAH %.2f\n",
+		Ms(t0, t1) / kIterations, Ms(t1, t2) / kIterations, stats.nodeCount, stats.depth, stats.builtCost);
+
+	// Move a tenth of the objects a little each iteration
+	std::uniform_real_distribution<float> jitter(-1.0f, 1.0f);
+	unsigned int buildsBefore = stats.buildCount;
+	double refitMs = 0;
+	for (int i = 0; i < kIterations; ++i)
+	{
+		for (unsigned int id = i % 10; id < kObjectCount; id += 10)
+		{
+			objects[id].center += glm::vec3(jitter(rng), jitter(rng), jitter(rng));
+			parallel.Update(id, objects[id].center, objects[id].extents);
+			culler.SetBounds(id, objects[id].center, objects[id].extents, glm::length(objects[id].extents));
+		}
+		auto r0 = Clock::now();
+		parallel.Commit();
+		refitMs += Ms(r0, Clock::now());
+	}
+	esLogMessage("refit 10%% %7.2f ms  SAH %.2f -> %.2f  rebuilds %u\n", refitMs / kIterations,
+		stats.builtCost, stats.cost, stats.buildCount - buildsBefore);
+
+	glm::mat4 proj = glm::perspective(glm::radians(60.0f), 16.0f / 9.0f, 0.1f, 300.0f);
+	glm::mat4 viewProj = proj * glm::lookAt(glm::vec3(0, 20, 0), glm::vec3(100, 0, 100), glm::vec3(0, 1, 0));
+	std::vector<unsigned char> visible;
+	std::vector<unsigned int> result;
+	t0 = Clock::now();
+	for (int i = 0; i < kIterations; ++i)
+		culler.Cull(viewProj, visible);
+	t1 = Clock::now();
+	for (int i = 0; i < kIterations; ++i)
+		parallel.QueryFrustum(viewProj, result);
+	t2 = Clock::now();
+	unsigned int linearVisible = culler.GetStats().tested - culler.GetStats().culled;
+	// The linear culler also rejects by sphere, so it may keep fewer objects
+	unsigned int missing = 0;
+	for (auto id : result)
+	{
+		missing += visible[id] ? 0 : 1;
+	}
+	unsigned int bvhVisible = (unsigned int)result.size();
+	esLogMessage("frustum   linear SIMD %7.3f ms (%u visible)  BVH %7.3f ms (%u visible) %s\n",
+		Ms(t0, t1) / kIterations, linearVisible, Ms(t1, t2) / kIterations, bvhVisible,
+		bvhVisible - missing == linearVisible ? "" : "MISMATCH");
+
+	t0 = Clock::now();
+	unsigned int sphereHits = 0;
+	for (int i = 0; i < kIterations * 100; ++i)
+	{
+		parallel.QuerySphere(objects[i].center, 20.0f, result);
+		sphereHits += (unsigned int)result.size();
+	}
+	t1 = Clock::now();
+	unsigned int rayHits = 0;
+	for (int i = 0; i < kIterations * 100; ++i)
+	{
+		unsigned int id;
+		float distance;
+		glm::vec3 dir(jitter(rng), jitter(rng) * 0.1f, jitter(rng));
+		rayHits += parallel.Raycast(glm::vec3(0, 0, 0), dir, 1000.0f, id, distance) ? 1 : 0;
+	}
+	t2 = Clock::now();
+	esLogMessage("sphere r=20 %7.4f ms/query (%.1f hits)  ray %7.4f ms/query (%u/%d hit)\n",
+		Ms(t0, t1) / (kIterations * 100), sphereHits / (kIterations * 100.0f),
+		Ms(t1, t2) / (kIterations * 100), rayHits, kIterations * 100);
+	exit(0);
+}
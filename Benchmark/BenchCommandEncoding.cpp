@@ -0,0 +1,283 @@
+// Command stream size and decode rate of ThreadBufferESDevice.
+// A client records frames into a shared ring without anything draining it,
+// then a server decodes them on the same thread against a null backend, so
+// the numbers are the encoder and decoder alone. The decode runs twice, with
+// the server bound to the backend through ESDevice's virtuals and bound to
+// NullESDevice itself, whose calls are direct and inlined.
+// As a baseline the same commands first go through the ring as the fixed-size
+// records the device wrote before it batched them: a 4 byte opcode, raw fields
+// and one submit per command, read back by a switch.
+// Runs from esMain without creating a window and exits when done.
+#include "esUtil.h"
+#include "ThreadBufferESDevice.h"
+#include "NullESDevice.h"
+#include "HandleTable.h"
+#include "RingBuffer.h"
+#include "glm/gtc/matrix_transform.hpp"
+#include <chrono>
+#include <vector>
+
+using namespace RenderEngine;
+
+namespace {
+	const unsigned int kFrames = 200;
+	const unsigned int kDrawsPerFrame = 500;
+	const unsigned int kDrawsPerMaterial = 10;
+	const unsigned int kMaterialCount = 8;
+	// Holds every frame, the server only starts once recording is done
+	const unsigned int kRingSize = 64 * 1024 * 1024;
+
+	typedef std::chrono::high_resolution_clock Clock;
+
+	double Ms(Clock::time_point begin, Clock::time_point end)
+	{
+		return std::chrono::duration<double, std::milli>(end - begin).count();
+	}
+
+	void Report(double bytes, unsigned int commands, double encodeMs, double decodeMs)
+	{
+		esLogMessage("ring      %9.0f bytes/frame  %6.2f bytes/command\n", bytes / kFrames, bytes / commands);
+		esLogMessage("encode    %9.3f ms/frame     %6.1f ns/command\n", encodeMs / kFrames, encodeMs * 1e6 / commands);
+		esLogMessage("decode    %9.3f ms/frame     %6.1f ns/command  %.1f M commands/s\n",
+			decodeMs / kFrames, decodeMs * 1e6 / commands, commands / (decodeMs * 1e3));
+	}
+
+	bool CheckDecoded(unsigned int frames, unsigned int draws)
+	{
+		if (frames != kFrames || draws != kFrames * kDrawsPerFrame)
+		{
+			esLogMessage("decoded %u frames and %u draws, expected %u and %u\n", frames, draws, kFrames, kFrames * kDrawsPerFrame);
+			return false;
+		}
+		return true;
+	}
+
+	enum LegacyCommand
+	{
+		kLegacyCmd_Clear,
+		kLegacyCmd_SetViewPort,
+		kLegacyCmd_UseMaterial,
+		kLegacyCmd_SetGPUProgramAsMat4,
+		kLegacyCmd_DrawVBO,
+		kLegacyCmd_DrawVBORange,
+		kLegacyCmd_Present,
+	};
+
+	struct LegacyDrawVBORangeData
+	{
+		unsigned int vbo;
+		unsigned int indexStart;
+		unsigned int indexCount;
+	};
+
+	// The records are written straight into the ring, so the encode time
+	// leaves out the device's own call, which the compact runs include
+	bool RunLegacyBaseline()
+	{
+		NullESDevice backend;
+		ESDevice* device = &backend;
+		RingBuffer ring;
+		ring.Create(kRingSize);
+
+		HandleAllocator handles;
+		HandleTable<GPUProgramParam*> params;
+		HandleTable<VBO*> vbos;
+		HandleTable<Material*> materialTable;
+		GPUProgram* program = backend.CreateGPUProgram("vs", "fs");
+		unsigned int mvp = handles.Allocate();
+		params.Set(mvp, backend.GetGPUProgramParam(program, "MVP"));
+		unsigned int vbo = handles.Allocate();
+		vbos.Set(vbo, backend.CreateVBO());
+		std::vector<unsigned int> materials;
+		for (unsigned int i = 0; i < kMaterialCount; ++i)
+		{
+			MaterialDesc desc(program);
+			desc.SetMat4(params.Get(mvp), glm::mat4(1.0f));
+			materials.push_back(handles.Allocate());
+			materialTable.Set(materials.back(), backend.CreateMaterial(desc));
+		}
+
+		unsigned long long bytesBefore = ring.GetBytesWritten();
+		unsigned int commands = 0;
+		auto e0 = Clock::now();
+		for (unsigned int frame = 0; frame < kFrames; ++frame)
+		{
+			ring.WriteValueType(kLegacyCmd_SetViewPort);
+			ring.WriteValueType(glm::ivec4(0, 0, 1280, 720));
+			ring.WriteSubmitData();
+			ring.WriteValueType(kLegacyCmd_Clear);
+			ring.WriteSubmitData();
+			commands += 2;
+			for (unsigned int draw = 0; draw < kDrawsPerFrame; ++draw)
+			{
+				if (draw % kDrawsPerMaterial == 0)
+				{
+					ring.WriteValueType(kLegacyCmd_UseMaterial);
+					ring.WriteValueType(materials[(draw / kDrawsPerMaterial) % kMaterialCount]);
+					ring.WriteSubmitData();
+					++commands;
+				}
+				ring.WriteValueType(kLegacyCmd_SetGPUProgramAsMat4);
+				ring.WriteValueType(mvp);
+				ring.WriteValueType(glm::translate(glm::mat4(1.0f), glm::vec3((float)draw, (float)frame, 0.0f)));
+				ring.WriteSubmitData();
+				if (draw % 2 == 0)
+				{
+					ring.WriteValueType(kLegacyCmd_DrawVBO);
+					ring.WriteValueType(vbo);
+				}
+				else
+				{
+					ring.WriteValueType(kLegacyCmd_DrawVBORange);
+					LegacyDrawVBORangeData data = { vbo, 0, 96 };
+					ring.WriteValueType(data);
+				}
+				ring.WriteSubmitData();
+				commands += 2;
+			}
+			ring.WriteValueType(kLegacyCmd_Present);
+			ring.WriteSubmitData();
+			++commands;
+		}
+		auto e1 = Clock::now();
+		double bytes = (double)(ring.GetBytesWritten() - bytesBefore);
+
+		auto d0 = Clock::now();
+		unsigned int frames = 0;
+		while (ring.IsReadDataAvailable())
+		{
+			switch (ring.ReadValueType<LegacyCommand>())
+			{
+			case kLegacyCmd_Clear:
+				device->Clear();
+				break;
+			case kLegacyCmd_SetViewPort:
+			{
+				glm::ivec4 rect = ring.ReadValueType<glm::ivec4>();
+				device->SetViewPort(rect.x, rect.y, rect.z, rect.w);
+				break;
+			}
+			case kLegacyCmd_UseMaterial:
+				device->UseMaterial(materialTable.Get(ring.ReadValueType<unsigned int>()));
+				break;
+			case kLegacyCmd_SetGPUProgramAsMat4:
+			{
+				unsigned int param = ring.ReadValueType<unsigned int>();
+				device->SetGPUProgramParamAsMat4(params.Get(param), ring.ReadValueType<glm::mat4>());
+				break;
+			}
+			case kLegacyCmd_DrawVBO:
+				device->DrawVBO(vbos.Get(ring.ReadValueType<unsigned int>()));
+				break;
+			case kLegacyCmd_DrawVBORange:
+			{
+				LegacyDrawVBORangeData data = ring.ReadValueType<LegacyDrawVBORangeData>();
+				device->DrawVBORange(vbos.Get(data.vbo), data.indexStart, data.indexCount);
+				break;
+			}
+			case kLegacyCmd_Present:
+				device->Present();
+				++frames;
+				break;
+			}
+			ring.ReadReleaseData();
+		}
+		auto d1 = Clock::now();
+
+		esLogMessage("%u frames of %u draws, %u commands, fixed-size records, backend called as ESDevice\n", kFrames, kDrawsPerFrame, commands);
+		Report(bytes, commands, Ms(e0, e1), Ms(d0, d1));
+		return CheckDecoded(frames, backend.GetDrawCount());
+	}
+
+	// The devices go out of scope before exit, so the shared ring is removed.
+	// Backend is the type the server's decoders call the null backend as.
+	template<class Backend>
+	bool RunBenchmark(const char* binding)
+	{
+		NullESDevice* backend = new NullESDevice();
+		ThreadBufferESDevice server(static_cast<Backend*>(backend), false, kRingSize);
+		ThreadBufferESDevice client(new NullESDevice(), false);
+		if (!server.ServeSharedBuffer("mtrender-bench") || !client.ConnectSharedBuffer("mtrender-bench"))
+		{
+			esLogMessage("needs shared memory, not available here\n");
+			client.Cleanup();
+			server.Cleanup();
+			return false;
+		}
+
+		GPUProgram* program = client.CreateGPUProgram("vs", "fs");
+		GPUProgramParam* mvp = client.GetGPUProgramParam(program, "MVP");
+		GPUProgramParam* tint = client.GetGPUProgramParam(program, "Tint");
+		VBO* vbo = client.CreateVBO();
+		client.UpdateVBO(vbo, std::make_shared<VBOData>(256, 384));
+		std::vector<Material*> materials;
+		for (unsigned int i = 0; i < kMaterialCount; ++i)
+		{
+			MaterialDesc desc(program);
+			desc.SetMat4(mvp, glm::mat4(1.0f));
+			desc.SetFloat(tint, (float)i);
+			materials.push_back(client.CreateMaterial(desc));
+		}
+		client.Present();
+		server.RunPendingFrame();
+		unsigned int setupDraws = backend->GetDrawCount();
+
+		// Per draw: a model matrix and a draw, every few draws a material switch
+		unsigned long long bytesBefore = client.GetCommandBytesWritten();
+		unsigned int commands = 0;
+		auto e0 = Clock::now();
+		for (unsigned int frame = 0; frame < kFrames; ++frame)
+		{
+			client.SetViewPort(0, 0, 1280, 720);
+			client.Clear();
+			commands += 2;
+			for (unsigned int draw = 0; draw < kDrawsPerFrame; ++draw)
+			{
+				if (draw % kDrawsPerMaterial == 0)
+				{
+					client.UseMaterial(materials[(draw / kDrawsPerMaterial) % kMaterialCount]);
+					++commands;
+				}
+				client.SetGPUProgramParamAsMat4(mvp, glm::translate(glm::mat4(1.0f), glm::vec3((float)draw, (float)frame, 0.0f)));
+				if (draw % 2 == 0)
+				{
+					client.DrawVBO(vbo);
+				}
+				else
+				{
+					client.DrawVBORange(vbo, 0, 96);
+				}
+				commands += 2;
+			}
+			client.Present();
+			++commands;
+		}
+		auto e1 = Clock::now();
+		double bytes = (double)(client.GetCommandBytesWritten() - bytesBefore);
+
+		auto d0 = Clock::now();
+		unsigned int frames = 0;
+		while (server.RunPendingFrame())
+		{
+			++frames;
+		}
+		auto d1 = Clock::now();
+
+		esLogMessage("%u frames of %u draws, %u commands, backend called as %s\n", kFrames, kDrawsPerFrame, commands, binding);
+		Report(bytes, commands, Ms(e0, e1), Ms(d0, d1));
+		unsigned int draws = backend->GetDrawCount() - setupDraws;
+		// Shut both down the way a demo does, neither has a render thread
+		client.Cleanup();
+		server.Cleanup();
+		return CheckDecoded(frames, draws);
+	}
+}
+
+int esMain(ESContext *esContext)
+{
+	bool passed = RunLegacyBaseline();
+	passed = RunBenchmark<ESDevice>("ESDevice") && passed;
+	passed = RunBenchmark<NullESDevice>("NullESDevice") && passed;
+	exit(passed ? 0 : 1);
+	return 0;
+}
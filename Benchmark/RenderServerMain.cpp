@@ -0,0 +1,65 @@
+// Render server for demos started with MTRENDER_SERVER=name.
+//   MTRENDER_SERVER_CLIENTS=a,b    shared rings to create, one per client (default "mtrender")
+//   MTRENDER_SERVER_BACKEND=null   execute without GL, to test the transport locally
+// Runs from esMain until killed, logging the frame rate every few seconds.
+#include "esUtil.h"
+#include "RenderServer.h"
+#include "NullESDevice.h"
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <sstream>
+#include <thread>
+
+using namespace RenderEngine;
+
+int esMain(ESContext *esContext)
+{
+	const char* clients = getenv("MTRENDER_SERVER_CLIENTS");
+	const char* backend = getenv("MTRENDER_SERVER_BACKEND");
+	bool nullBackend = backend != nullptr && strcmp(backend, "null") == 0;
+
+	ESDevice* device;
+	if (nullBackend)
+	{
+		device = new NullESDevice();
+	}
+	else
+	{
+		ESDeviceImp* realDevice = new ESDeviceImp(esContext);
+		realDevice->CreateWindow1("Render Server", 480, 320, ES_WINDOW_RGB | ES_WINDOW_DEPTH | ES_WINDOW_ALPHA);
+		realDevice->AcqiureThreadOwnerShip();
+		// Decoded uploads are temporary copies, the clients own the originals
+		realDevice->SetReleaseUploadedData(false);
+		device = realDevice;
+	}
+	RenderServer server(device);
+	std::stringstream names(clients != nullptr ? clients : "mtrender");
+	std::string name;
+	while (std::getline(names, name, ','))
+	{
+		if (!server.AddClient(name))
+		{
+			exit(1);
+		}
+	}
+
+	typedef std::chrono::steady_clock Clock;
+	Clock::time_point last = Clock::now();
+	unsigned int lastFrames = 0;
+	for (;;)
+	{
+		if (server.RunOnce() == 0)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		Clock::time_point now = Clock::now();
+		double seconds = std::chrono::duration<double>(now - last).count();
+		if (seconds >= 5.0)
+		{
+			esLogMessage("[render] server %u clients %.1f frames/s\n", server.GetClientCount(), (server.GetFrameCount() - lastFrames) / seconds);
+			last = now;
+			lastFrames = server.GetFrameCount();
+		}
+	}
+}
@@ -0,0 +1,73 @@
+// Replays a command capture recorded with MTRENDER_CAPTURE=file.
+//   MTRENDER_REPLAY=file          capture to replay
+//   MTRENDER_REPLAY_BACKEND=null  skip GL, measure the command path alone
+//   MTRENDER_REPLAY_TIMED=1       keep the recorded frame timing instead of running flat out
+// Runs from esMain and exits when the capture has been replayed.
+#include "esUtil.h"
+#include "ThreadBufferESDevice.h"
+#include "NullESDevice.h"
+#include "CommandCapture.h"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+using namespace RenderEngine;
+
+namespace {
+	typedef std::chrono::high_resolution_clock Clock;
+
+	double Ms(Clock::time_point begin, Clock::time_point end)
+	{
+		return std::chrono::duration<double, std::milli>(end - begin).count();
+	}
+}
+
+int esMain(ESContext *esContext)
+{
+	const char* path = getenv("MTRENDER_REPLAY");
+	const char* backend = getenv("MTRENDER_REPLAY_BACKEND");
+	const char* timed = getenv("MTRENDER_REPLAY_TIMED");
+	bool nullBackend = backend != nullptr && strcmp(backend, "null") == 0;
+	bool keepTiming = timed != nullptr && strcmp(timed, "0") != 0;
+	if (path == nullptr)
+	{
+		esLogMessage("set MTRENDER_REPLAY to a capture file\n");
+		exit(1);
+	}
+	CommandReplay replay;
+	if (!replay.Open(path))
+	{
+		exit(1);
+	}
+
+	ThreadBufferESDevice* device = nullBackend ? new ThreadBufferESDevice(new NullESDevice(), false) : new ThreadBufferESDevice(esContext, false);
+	device->CreateWindow1("Replay", 480, 320, ES_WINDOW_RGB | ES_WINDOW_DEPTH | ES_WINDOW_ALPHA);
+	device->Run();
+
+	unsigned int frames = 0;
+	double minMs = 0.0, maxMs = 0.0;
+	double frameTime = 0.0;
+	Clock::time_point start = Clock::now();
+	Clock::time_point last = start;
+	while (device->ReplayFrame(replay, frameTime))
+	{
+		if (keepTiming)
+		{
+			std::this_thread::sleep_until(start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(frameTime)));
+		}
+		// A frame is done once the next one may start, so this is the render thread's pace
+		Clock::time_point now = Clock::now();
+		double ms = Ms(last, now);
+		minMs = frames == 0 ? ms : std::min(minMs, ms);
+		maxMs = std::max(maxMs, ms);
+		last = now;
+		++frames;
+	}
+	double totalMs = Ms(start, Clock::now());
+	esLogMessage("replay %s on %s: %u frames in %.2f ms (recorded %.2f ms), %.3f ms/frame, min %.3f max %.3f\n",
+		path, nullBackend ? "null" : "gles", frames, totalMs, replay.GetDuration() * 1000.0,
+		frames > 0 ? totalMs / frames : 0.0, minMs, maxMs);
+	exit(0);
+}
@@ -0,0 +1,179 @@
+// RingBuffer round trips between a writer and a reader thread.
+// The writer submits blocks of random length, every so often with a streamed
+// payload, and the reader checks each value and byte against the same random
+// sequence. Runs over a plain ring and a mirrored one where available, each
+// at a roomy size and at a page, where both sides keep running out of room
+// and have to wait for the other. Build with -fsanitize=thread to check the
+// ordering of the published positions as well.
+// A last run writes large payloads while the reader is still asleep, so they
+// pile up in heap blocks past kMaxLargePayloadBytes and the rest have to
+// stream through the ring again.
+// MTRENDER_STRESS_ITERATIONS sets the number of blocks per run.
+// Runs from esMain without creating a window and exits with the number of
+// failed runs.
+#include "esUtil.h"
+#include "RingBuffer.h"
+#include <chrono>
+#include <random>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+namespace {
+	const unsigned int kRingSizes[] = { 64 * 1024, 4 * 1024 };
+	const unsigned int kMaxValuesPerBlock = 64;
+	const unsigned int kPayloadEvery = 50;
+	const unsigned int kMaxPayloadSize = 200 * 1000;
+	const unsigned int kEndMarker = 0xFFFFFFFF;
+	const unsigned int kLargeRingSize = 256 * 1024;
+	const unsigned int kLargePayloads = 64;
+	const unsigned int kLargePayloadSize = 1000 * 1000;
+	const unsigned int kReaderDelayMs = 300;
+
+	// Writer and reader each draw from their own generator with the same seed
+	struct Sequence
+	{
+		std::mt19937 random;
+		Sequence() : random(1) {}
+		unsigned int ValueCount() { return random() % kMaxValuesPerBlock + 1; }
+		unsigned int PayloadSize() { return random() % kMaxPayloadSize; }
+	};
+
+	unsigned int Value(unsigned int block, unsigned int index) { return block * 1000 + index; }
+	char PayloadByte(unsigned int block, unsigned int offset) { return (char)(offset * 7 + block); }
+
+	void WriteBlocks(RingBuffer* ring, unsigned int iterations)
+	{
+		Sequence sequence;
+		std::vector<char> payload(kMaxPayloadSize);
+		for (unsigned int i = 0; i < iterations; ++i)
+		{
+			unsigned int count = sequence.ValueCount();
+			for (unsigned int k = 0; k < count; ++k)
+				ring->WriteValueType<unsigned int>(Value(i, k));
+			if (i % kPayloadEvery == 0)
+			{
+				unsigned int size = sequence.PayloadSize();
+				for (unsigned int j = 0; j < size; ++j)
+					payload[j] = PayloadByte(i, j);
+				ring->WriteValueType<unsigned int>(size);
+				ring->WriteStreamingData(&payload[0], size);
+			}
+			ring->WriteSubmitData();
+		}
+		ring->WriteValueType<unsigned int>(kEndMarker);
+		ring->WriteSubmitData();
+	}
+
+	// Returns the number of blocks that arrived damaged
+	unsigned int ReadBlocks(RingBuffer* ring, unsigned int iterations)
+	{
+		Sequence sequence;
+		std::vector<char> payload(kMaxPayloadSize);
+		unsigned int bad = 0;
+		for (unsigned int i = 0; i < iterations; ++i)
+		{
+			bool ok = true;
+			unsigned int count = sequence.ValueCount();
+			for (unsigned int k = 0; k < count; ++k)
+				ok &= ring->ReadValueType<unsigned int>() == Value(i, k);
+			if (i % kPayloadEvery == 0)
+			{
+				unsigned int size = sequence.PayloadSize();
+				unsigned int written = ring->ReadValueType<unsigned int>();
+				if (written != size)
+				{
+					// The stream is out of step, nothing after this can be trusted
+					esLogMessage("block %u: payload size %u, expected %u\n", i, written, size);
+					return bad + iterations - i;
+				}
+				ring->ReadStreamingData(&payload[0], size);
+				for (unsigned int j = 0; j < size && ok; ++j)
+					ok = payload[j] == PayloadByte(i, j);
+			}
+			ring->ReadReleaseData();
+			if (!ok)
+				++bad;
+		}
+		if (ring->ReadValueType<unsigned int>() != kEndMarker)
+			++bad;
+		ring->ReadReleaseData();
+		return bad;
+	}
+
+	bool Run(const char* name, RingBuffer& ring, unsigned int iterations)
+	{
+		auto begin = std::chrono::high_resolution_clock::now();
+		std::thread writer(WriteBlocks, &ring, iterations);
+		unsigned int bad = ReadBlocks(&ring, iterations);
+		writer.join();
+		auto end = std::chrono::high_resolution_clock::now();
+		double ms = std::chrono::duration<double, std::milli>(end - begin).count();
+		esLogMessage("%-10s %6u KB ring  %u blocks in %8.2f ms  %u damaged %s\n",
+			name, ring.GetBufferSize() / 1024, iterations, ms, bad, bad ? "FAILED" : "");
+		return bad == 0;
+	}
+
+	void WriteLargePayloads(RingBuffer* ring)
+	{
+		std::vector<char> payload(kLargePayloadSize);
+		for (unsigned int i = 0; i < kLargePayloads; ++i)
+		{
+			for (unsigned int j = 0; j < kLargePayloadSize; ++j)
+				payload[j] = PayloadByte(i, j);
+			ring->WriteStreamingData(&payload[0], kLargePayloadSize);
+		}
+	}
+
+	bool RunLargePayloads()
+	{
+		RingBuffer ring;
+		ring.Create(kLargeRingSize);
+		auto begin = std::chrono::high_resolution_clock::now();
+		std::thread writer(WriteLargePayloads, &ring);
+		std::this_thread::sleep_for(std::chrono::milliseconds(kReaderDelayMs));
+		std::vector<char> payload(kLargePayloadSize);
+		unsigned int bad = 0;
+		for (unsigned int i = 0; i < kLargePayloads; ++i)
+		{
+			ring.ReadStreamingData(&payload[0], kLargePayloadSize);
+			for (unsigned int j = 0; j < kLargePayloadSize; ++j)
+			{
+				if (payload[j] != PayloadByte(i, j))
+				{
+					++bad;
+					break;
+				}
+			}
+		}
+		writer.join();
+		auto end = std::chrono::high_resolution_clock::now();
+		double ms = std::chrono::duration<double, std::milli>(end - begin).count();
+		esLogMessage("%-10s %6u KB ring  %u x %u KB payloads in %8.2f ms  %u damaged %s\n",
+			"large", kLargeRingSize / 1024, kLargePayloads, kLargePayloadSize / 1000, ms, bad, bad ? "FAILED" : "");
+		return bad == 0;
+	}
+}
+
+int esMain(ESContext *esContext)
+{
+	const char* iterationsEnv = getenv("MTRENDER_STRESS_ITERATIONS");
+	unsigned int iterations = iterationsEnv ? (unsigned int)atoi(iterationsEnv) : 200000;
+	int failed = 0;
+
+	for (unsigned int size : kRingSizes)
+	{
+		RingBuffer plain;
+		plain.Create(size);
+		failed += !Run("plain", plain, iterations);
+
+		RingBuffer mirrored;
+		if (mirrored.CreateMirrored(size))
+			failed += !Run("mirrored", mirrored, iterations);
+		else
+			esLogMessage("mirrored   not available\n");
+	}
+	failed += !RunLargePayloads();
+
+	exit(failed);
+}
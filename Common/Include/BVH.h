@@ -0,0 +1,96 @@
+#ifndef BVH_h
+#define BVH_h
+#include <vector>
+#include <atomic>
+#include "glm/glm.hpp"
+
+namespace RenderEngine {
+
+	// Bounding volume hierarchy over object AABBs, built top-down with binned SAH.
+	// Moving objects only refit the nodes above them; the tree is rebuilt when
+	// the refitted SAH cost degrades past Options::rebuildThreshold or objects are
+	// added or removed. Queries see the state of the last Commit().
+	class BVH
+	{
+	public:
+		struct Options
+		{
+			unsigned int binCount;
+			unsigned int maxLeafSize;
+			// Rebuild once refitted cost exceeds built cost by this factor
+			float rebuildThreshold;
+			unsigned int threadCount;	// 0 = hardware concurrency
+			// Subtrees smaller than this are built and refitted on one thread
+			unsigned int minParallelCount;
+			Options()
+				:binCount(16), maxLeafSize(4), rebuildThreshold(1.3f), threadCount(0), minParallelCount(4096) {}
+		};
+
+		struct Stats
+		{
+			unsigned int objectCount;
+			unsigned int nodeCount;
+			unsigned int depth;
+			// SAH cost relative to the root area, at last build and now
+			float builtCost;
+			float cost;
+			unsigned int buildCount;
+			unsigned int refitCount;
+		};
+
+		explicit BVH(const Options& options = Options());
+
+		// Returns the object id
+		unsigned int Insert(const glm::vec3& center, const glm::vec3& extents);
+		void Remove(unsigned int id);
+		void Update(unsigned int id, const glm::vec3& center, const glm::vec3& extents);
+		void Commit();
+
+		void Build();
+		void Refit();
+
+		void QueryFrustum(const glm::mat4& viewProj, std::vector<unsigned int>& result) const;
+		void QuerySphere(const glm::vec3& center, float radius, std::vector<unsigned int>& result) const;
+		// Nearest object whose bounds the ray enters within maxDistance
+		bool Raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, unsigned int& hitId, float& hitDistance) const;
+
+		const Stats& GetStats() const { return _stats; }
+
+	private:
+		struct Node
+		{
+			glm::vec3 min;
+			unsigned int leftOrFirst;	// first primitive for leaves, left child otherwise
+			glm::vec3 max;
+			unsigned int count;			// 0 for inner nodes
+		};
+
+		void BuildNode(unsigned int nodeIndex, unsigned int begin, unsigned int end, unsigned int depth);
+		void MakeLeaf(Node& node, unsigned int nodeIndex, unsigned int begin, unsigned int end);
+		void RefitNode(unsigned int nodeIndex, unsigned int depth);
+		float ComputeCost(unsigned int nodeIndex, unsigned int depth, unsigned int& maxDepth) const;
+		void CollectSubtree(unsigned int nodeIndex, std::vector<unsigned int>& result) const;
+		unsigned int ParallelDepth() const;
+
+		Options _options;
+		Stats _stats;
+
+		std::vector<glm::vec3> _objectMin;
+		std::vector<glm::vec3> _objectMax;
+		std::vector<unsigned char> _objectAlive;
+		std::vector<unsigned char> _objectDirty;
+		std::vector<unsigned int> _objectLeaf;
+		std::vector<unsigned int> _freeIds;
+		std::vector<unsigned int> _dirtyIds;
+		bool _needsBuild;
+
+		std::vector<Node> _nodes;
+		std::vector<unsigned int> _parents;
+		std::vector<unsigned char> _nodeDirty;
+		std::vector<unsigned int> _primitives;
+		std::vector<glm::vec3> _centroids;
+		std::atomic<unsigned int> _nodeCount;
+		unsigned int _parallelDepth;
+	};
+}
+#endif
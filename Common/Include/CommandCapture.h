@@ -0,0 +1,73 @@
+#ifndef CommandCapture_h
+#define CommandCapture_h
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <chrono>
+
+class RingBuffer;
+
+namespace RenderEngine {
+
+	// Capture files are the blocks a RingBuffer reader consumed, in order,
+	// with its releases and a timestamp after each Present. Commands name
+	// resources by handle, so the stream replays as is on a fresh device.
+	enum CaptureRecordType
+	{
+		kCaptureData,
+		kCaptureRelease,
+		kCaptureFrame,
+	};
+
+	class CommandCapture
+	{
+	public:
+		CommandCapture();
+		~CommandCapture();
+
+		bool Open(const std::string& path);
+		void Close();
+		bool IsOpen() const { return _file != nullptr; }
+
+		void WriteData(const void* data, unsigned int size, unsigned int alignment);
+		void WriteRelease();
+		// Flushes, so a capture cut short still ends on a whole frame
+		void WriteFrame();
+		unsigned int GetFrameCount() const { return _frameCount; }
+
+	private:
+		typedef std::chrono::high_resolution_clock Clock;
+
+		FILE* _file;
+		Clock::time_point _start;
+		unsigned int _frameCount;
+	};
+
+	class CommandReplay
+	{
+	public:
+		CommandReplay();
+
+		// Loads the whole file up front so replay never waits on disk
+		bool Open(const std::string& path);
+		unsigned int GetFrameCount() const { return _frameCount; }
+		// Seconds from the start of the capture to the end of the last frame
+		double GetDuration() const { return _duration; }
+
+		// Writes the blocks of the next frame into buffer the way the original
+		// writer did. frameTime is when that frame ended in the capture.
+		// False once every frame has been fed.
+		bool FeedFrame(RingBuffer& buffer, double& frameTime);
+		void Rewind() { _pos = _begin; }
+
+	private:
+		bool Validate();
+
+		std::vector<char> _data;
+		size_t _begin;
+		size_t _pos;
+		unsigned int _frameCount;
+		double _duration;
+	};
+}
+#endif
@@ -0,0 +1,115 @@
+#ifndef CommandStream_h
+#define CommandStream_h
+#include <vector>
+#include <string.h>
+
+namespace RenderEngine {
+
+	// Compact command encoding: commands are packed back to back into a
+	// batch, each a one byte opcode followed by its fields. Handles, counts
+	// and sizes are LEB128 varints, signed values zigzag varints, everything
+	// else raw bytes without padding.
+	class CommandWriter
+	{
+	public:
+		CommandWriter() :_size(0) {}
+
+		size_t GetSize() const { return _size; }
+		const unsigned char* GetData() const { return _data.empty() ? nullptr : &_data[0]; }
+		void Reset() { _size = 0; }
+
+		void WriteOpcode(unsigned char opcode)
+		{
+			Reserve(1)[0] = opcode;
+			_size += 1;
+		}
+
+		void WriteVarint(unsigned int value)
+		{
+			unsigned char* dest = Reserve(5);
+			size_t count = 0;
+			while (value >= 0x80)
+			{
+				dest[count++] = (unsigned char)(value | 0x80);
+				value >>= 7;
+			}
+			dest[count++] = (unsigned char)value;
+			_size += count;
+		}
+
+		void WriteSignedVarint(int value)
+		{
+			WriteVarint(((unsigned int)value << 1) ^ (unsigned int)(value >> 31));
+		}
+
+		template<class T>
+		void WriteRaw(const T& value)
+		{
+			memcpy(Reserve(sizeof(T)), &value, sizeof(T));
+			_size += sizeof(T);
+		}
+
+	private:
+		unsigned char* Reserve(size_t bytes)
+		{
+			if (_size + bytes > _data.size())
+			{
+				_data.resize(_data.size() * 2 > _size + bytes ? _data.size() * 2 : _size + bytes + 256);
+			}
+			return &_data[_size];
+		}
+
+		std::vector<unsigned char> _data;
+		size_t _size;
+	};
+
+	// Walks a batch written by CommandWriter. Fields must be read in the
+	// order they were written, nothing in the batch says what they are.
+	class CommandReader
+	{
+	public:
+		CommandReader(const void* data, size_t size)
+			:_pos((const unsigned char*)data), _end((const unsigned char*)data + size) {}
+
+		bool AtEnd() const { return _pos >= _end; }
+
+		unsigned char ReadOpcode()
+		{
+			return *_pos++;
+		}
+
+		unsigned int ReadVarint()
+		{
+			unsigned int value = 0;
+			unsigned int shift = 0;
+			unsigned char byte;
+			do
+			{
+				byte = *_pos++;
+				value |= (unsigned int)(byte & 0x7f) << shift;
+				shift += 7;
+			} while ((byte & 0x80) != 0);
+			return value;
+		}
+
+		int ReadSignedVarint()
+		{
+			unsigned int value = ReadVarint();
+			return (int)(value >> 1) ^ -(int)(value & 1);
+		}
+
+		template<class T>
+		T ReadRaw()
+		{
+			T value;
+			memcpy(&value, _pos, sizeof(T));
+			_pos += sizeof(T);
+			return value;
+		}
+
+	private:
+		const unsigned char* _pos;
+		const unsigned char* _end;
+	};
+}
+#endif
@@ -12,11 +12,15 @@ public:
 		kThreadQueue,
 		KThreadDoubleQueue,
 		kSingleThread,
+		// Picked when MTRENDER_SERVER names a running render server
+		kServerClient,
 	};
 private:
 	RenderEngine::ESDevice* _device;
 	RenderEngine::GPUProgram* _program;
 	RenderEngine::Texture2D* _texture;
+	RenderEngine::Material* _material;
+	RenderEngine::PipelineState* _pipelineState;
 	///
 	// Draw a triangle using the shader pair created in Init()
 	std::vector<RenderEngine::Mesh::Ptr> _meshes; //= Mesh::Ptr(new Mesh("Cube", 8, 36));
@@ -12,6 +12,9 @@
 #include <string>
 #include "glm/glm.hpp"
 #include "Mesh.hpp"
+#include "MemoryTracker.h"
+#include <unordered_map>
+#include <deque>
 
 namespace RenderEngine {
 	class ESDevice;	
@@ -44,31 +47,205 @@ namespace RenderEngine {
 		virtual Texture2D* GetRealTexture2D() = 0;
 	};
 
-	struct TextureData
+	enum TextureFormat
+	{
+		kTexFormatRGB8,
+		kTexFormatRGBA8,
+	};
+
+	struct TextureData : public ResidentData
 	{
 		char* pixels;
 		unsigned int length;
 		unsigned int width;
 		unsigned int height;
-		//TO DO format desc
+		TextureFormat format;
 
 		TextureData()
-			:pixels(nullptr),length(0),width(0),height(0)
+			:pixels(nullptr),length(0),width(0),height(0),format(kTexFormatRGB8)
 		{
 
 		}
-		TextureData(char* pixels_, unsigned int width_, unsigned int height_, unsigned int lenght_)
-			:pixels(pixels_), width(width_), height(height_), length(lenght_) {}
+		TextureData(char* pixels_, unsigned int width_, unsigned int height_, unsigned int lenght_, TextureFormat format_ = kTexFormatRGB8)
+			:pixels(pixels_), width(width_), height(height_), length(lenght_), format(format_) {}
 		~TextureData()
 		{
 			delete[] pixels;
 		}
+		// Size and format stay valid after a release
+		bool IsResident() const { return pixels != nullptr; }
+		void ReleaseCPUData()
+		{
+			delete[] pixels;
+			pixels = nullptr;
+		}
+		bool EnsureResident()
+		{
+			if (IsResident())
+			{
+				return true;
+			}
+			if (residency != kResidencyReload || !reloader)
+			{
+				return false;
+			}
+			pixels = new char[length];
+			if (!reloader(*this))
+			{
+				ReleaseCPUData();
+				return false;
+			}
+			return true;
+		}
+		// Refills the reallocated length bytes of pixels under kResidencyReload
+		std::function<bool(TextureData&)> reloader;
 		typedef std::shared_ptr<TextureData> Ptr;
 	private:
 		TextureData(TextureData&);
 		const TextureData& operator=(const TextureData&);
 	};
 
+	enum MaterialParamType
+	{
+		kMaterialParamInt,
+		kMaterialParamFloat,
+		kMaterialParamMat4,
+	};
+
+	// Everything a draw needs from its program, described once up front.
+	// Resources are the ones returned by the device the material is created on.
+	struct MaterialDesc
+	{
+		struct TextureBinding
+		{
+			Texture2D* texture;
+			unsigned int index;
+		};
+		struct Uniform
+		{
+			GPUProgramParam* param;
+			MaterialParamType type;
+			glm::mat4 value;	// ints and floats live in value[0][0]
+		};
+
+		GPUProgram* program;
+		std::vector<TextureBinding> textures;
+		std::vector<Uniform> uniforms;
+
+		MaterialDesc(GPUProgram* program_ = nullptr) :program(program_) {}
+		void AddTexture(Texture2D* texture, unsigned int index)
+		{
+			TextureBinding binding = { texture, index };
+			textures.push_back(binding);
+		}
+		void SetInt(GPUProgramParam* param, int value)
+		{
+			Uniform uniform = { param, kMaterialParamInt, glm::mat4(0.0f) };
+			uniform.value[0][0] = (float)value;
+			uniforms.push_back(uniform);
+		}
+		void SetFloat(GPUProgramParam* param, float value)
+		{
+			Uniform uniform = { param, kMaterialParamFloat, glm::mat4(0.0f) };
+			uniform.value[0][0] = value;
+			uniforms.push_back(uniform);
+		}
+		void SetMat4(GPUProgramParam* param, const glm::mat4& value)
+		{
+			Uniform uniform = { param, kMaterialParamMat4, value };
+			uniforms.push_back(uniform);
+		}
+	};
+
+	// Immutable program, texture and uniform state bound with one UseMaterial.
+	// Binding only touches what differs from the material bound before it.
+	class Material
+	{
+		friend class ESDeviceImp;
+	protected:
+		MaterialDesc _desc;
+		Material(const MaterialDesc& desc) :_desc(desc) {}
+		virtual ~Material() {}
+	public:
+		virtual Material* GetRealMaterial() = 0;
+		const MaterialDesc& GetDesc() const { return _desc; }
+	};
+
+	enum BlendMode
+	{
+		kBlendOpaque,
+		kBlendAlpha,
+		kBlendAdditive,
+		kBlendPremultiplied,
+	};
+
+	enum CullMode
+	{
+		kCullNone,
+		kCullBack,
+		kCullFront,
+	};
+
+	enum CompareFunc
+	{
+		kCompareNever,
+		kCompareLess,
+		kCompareEqual,
+		kCompareLessEqual,
+		kCompareGreater,
+		kCompareNotEqual,
+		kCompareGreaterEqual,
+		kCompareAlways,
+	};
+
+	enum ColorMask
+	{
+		kColorMaskR = 1,
+		kColorMaskG = 2,
+		kColorMaskB = 4,
+		kColorMaskA = 8,
+		kColorMaskAll = 15,
+	};
+
+	// Fixed function state for a draw. The defaults match what the devices
+	// used to enable at start up: depth tested and written with LESS.
+	struct PipelineStateDesc
+	{
+		BlendMode blend;
+		CullMode cull;
+		bool depthTest;
+		bool depthWrite;
+		CompareFunc depthFunc;
+		unsigned int colorMask;
+
+		PipelineStateDesc()
+			:blend(kBlendOpaque), cull(kCullNone), depthTest(true), depthWrite(true), depthFunc(kCompareLess), colorMask(kColorMaskAll) {}
+
+		// Every field packed into 13 bits, so equal hashes mean equal states
+		unsigned int GetHash() const
+		{
+			return (unsigned int)blend | (unsigned int)cull << 2 | (depthTest ? 1u : 0u) << 4 |
+				(depthWrite ? 1u : 0u) << 5 | (unsigned int)depthFunc << 6 | (colorMask & kColorMaskAll) << 9;
+		}
+		bool operator==(const PipelineStateDesc& other) const { return GetHash() == other.GetHash(); }
+		bool operator!=(const PipelineStateDesc& other) const { return GetHash() != other.GetHash(); }
+	};
+
+	// Immutable and shared: creating the same description twice returns the
+	// same object. Devices own their states until they are destroyed.
+	class PipelineState
+	{
+		friend class ESDeviceImp;
+		friend class ThreadESDeviceBase;
+	protected:
+		PipelineStateDesc _desc;
+		PipelineState(const PipelineStateDesc& desc) :_desc(desc) {}
+		virtual ~PipelineState() {}
+	public:
+		virtual PipelineState* GetRealPipelineState() = 0;
+		const PipelineStateDesc& GetDesc() const { return _desc; }
+	};
+
 	class ESDevice {
 	public:
 		virtual ~ESDevice() {};
@@ -87,8 +264,15 @@ namespace RenderEngine {
 		virtual void Present() = 0;
 		virtual VBO* CreateVBO()=0;
 		virtual void UpdateVBO(VBO* vbo,const VBOData::Ptr& vboData)=0;
+		// Rewrites part of a VBO sized by its last UpdateVBO, vertices in that format.
+		// A pointer may be null when its count is 0, the data is copied before returning
+		virtual void UpdateVBORange(VBO* vbo, unsigned int vertexStart, unsigned int vertexCount, const void* vertices,
+			unsigned int indexStart, unsigned int indexCount, const unsigned short* indices) = 0;
+		// Sends the dirty spans of vboData through UpdateVBORange and clears them
+		void UpdateVBODirty(VBO* vbo, VBOData& vboData);
 		virtual void DeleteVBO(VBO* vbo) = 0;
 		virtual void DrawVBO(VBO* vbo) = 0;
+		virtual void DrawVBORange(VBO* vbo, unsigned int indexStart, unsigned int indexCount) = 0;
 		virtual void Cleanup() = 0;
 
 		virtual void UseGPUProgram(GPUProgram* program) = 0;
@@ -106,22 +290,87 @@ namespace RenderEngine {
 		virtual void SetGPUProgramParamAsFloatArray(GPUProgramParam* param, const std::vector<float>& values) = 0;
 
 		virtual void SetGPUProgramParamAsMat4Array(GPUProgramParam* param,  const std::vector<glm::mat4>& values) = 0;
+
+		virtual Material* CreateMaterial(const MaterialDesc& desc) = 0;
+		virtual void DeleteMaterial(Material* material) = 0;
+		virtual void UseMaterial(Material* material) = 0;
+
+		virtual PipelineState* CreatePipelineState(const PipelineStateDesc& desc) = 0;
+		// Only the fields that differ from the bound state reach GL
+		virtual void UsePipelineState(PipelineState* state) = 0;
+		// Distinct states created so far
+		virtual unsigned int GetPipelineStateCount() = 0;
+		// Shared by a proxy device and its real device, readable from any thread
+		virtual MemoryTracker* GetMemoryTracker() = 0;
 		virtual int GetScreenWidth() = 0;
 		virtual int GetScreenHeigt() = 0;
 	};
 
-	class ESDeviceImp : public ESDevice
+	class VBOImp;
+	struct GeometryPage;
+
+	// Final, so a ThreadBufferESDevice bound to it calls it directly
+	class ESDeviceImp final : public ESDevice
 	{
 	private:
 		ESContext * _esContext;
+		Material* _boundMaterial;
+		// Uniforms of the bound material that were set directly, so the
+		// program no longer holds the material's values for them
+		std::vector<GLint> _overriddenUniforms;
+		void OverrideUniform(GPUProgramParam* param);
+		PipelineState* _boundPipelineState;
+		std::unordered_map<unsigned int, PipelineState*> _pipelineStates;
+		// VBOs are ranges in a few shared buffers, one set per vertex format
+		std::vector<GeometryPage*> _geometryPages;
+		GeometryPage* _boundPage;
+		bool _releaseUploadedData;
+		MemoryTracker _memoryTracker;
+
+		// Deletes wait until the GPU is done with the frame that issued them
+		enum PendingDeleteType
+		{
+			kPendingDeleteTexture,
+			kPendingDeleteVBO,
+			kPendingDeleteProgram,
+		};
+		struct PendingDelete
+		{
+			PendingDeleteType type;
+			void* object;
+			unsigned int frame;
+			size_t bytes;
+		};
+		struct FrameFence
+		{
+			unsigned int frame;
+			GLsync fence;
+		};
+		std::deque<PendingDelete> _pendingDeletes;
+		std::deque<FrameFence> _frameFences;
+		unsigned int _frameIndex;
+		// Every frame before this one has finished on the GPU
+		unsigned int _completedFrames;
+
+		bool AllocateGeometry(VBOImp* vbo, unsigned int verticesCount, unsigned int indicesCount, const VertexFormat& format);
+		bool AllocateGeometryInPage(GeometryPage* page, VBOImp* vbo, unsigned int verticesCount, unsigned int indicesCount);
+		void ReleaseGeometry(VBOImp* vbo);
+		void DefragmentGeometryPage(GeometryPage* page);
+		void BindGeometryPage(GeometryPage* page);
+		void DeferDelete(PendingDeleteType type, void* object, size_t bytes);
+		// all skips the fences, for teardown
+		void RetireDeletes(bool all);
+		void DestroyNow(const PendingDelete& pending);
 	public:
-		ESDeviceImp(ESContext* context) :_esContext(context) {
+		ESDeviceImp(ESContext* context) :_esContext(context), _boundMaterial(nullptr), _boundPipelineState(nullptr), _boundPage(nullptr), _releaseUploadedData(true),
+			_frameIndex(0), _completedFrames(0) {
 			esLogMessage("ESDeviceImp");
 		};
-		~ESDeviceImp() {
-			esLogMessage("~ESDeviceImp");
-		}
-		virtual void Cleanup() {}
+		~ESDeviceImp();
+		// Off when a proxy device owns the data, it knows when the caller is done with it
+		void SetReleaseUploadedData(bool release) { _releaseUploadedData = release; }
+		// Retires every pending delete, call on the thread that owns the context
+		virtual void Cleanup();
 		virtual bool CreateWindow1(const std::string& title, int width, int height, int flags);
 		virtual void Clear();
 
@@ -140,8 +389,11 @@ namespace RenderEngine {
 		virtual glm::vec3 Project(const glm::vec3& coord, const glm::mat4& transMat);
 		virtual VBO* CreateVBO();
 		virtual void UpdateVBO(VBO* vbo, const VBOData::Ptr& vboData);
+		virtual void UpdateVBORange(VBO* vbo, unsigned int vertexStart, unsigned int vertexCount, const void* vertices,
+			unsigned int indexStart, unsigned int indexCount, const unsigned short* indices);
 		virtual void DeleteVBO(VBO* vbo);
 		virtual void DrawVBO(VBO* vbo);
+		virtual void DrawVBORange(VBO* vbo, unsigned int indexStart, unsigned int indexCount);
 		virtual int GetScreenWidth();
 		virtual int GetScreenHeigt();
 		//gpu program
@@ -164,6 +416,15 @@ namespace RenderEngine {
 		virtual void SetGPUProgramParamAsFloatArray(GPUProgramParam* param,  const std::vector<float>& values);
 
 		virtual void SetGPUProgramParamAsMat4Array(GPUProgramParam* param, const std::vector<glm::mat4>& values);
+
+		virtual Material* CreateMaterial(const MaterialDesc& desc);
+		virtual void DeleteMaterial(Material* material);
+		virtual void UseMaterial(Material* material);
+
+		virtual PipelineState* CreatePipelineState(const PipelineStateDesc& desc);
+		virtual void UsePipelineState(PipelineState* state);
+		virtual unsigned int GetPipelineStateCount() { return (unsigned int)_pipelineStates.size(); }
+		virtual MemoryTracker* GetMemoryTracker() { return &_memoryTracker; }
 	};
 }
 #endif /* ESDevice_hpp */
@@ -0,0 +1,48 @@
+#ifndef FrustumCuller_h
+#define FrustumCuller_h
+#include <vector>
+#include "glm/glm.hpp"
+
+namespace RenderEngine {
+
+	// World space bounds of many objects in structure-of-arrays layout,
+	// tested against the view frustum four objects at a time.
+	class FrustumCuller
+	{
+	public:
+		struct Stats
+		{
+			unsigned int tested;
+			unsigned int culled;
+		};
+
+		FrustumCuller();
+
+		// Returns the object index
+		unsigned int Add(const glm::vec3& center, const glm::vec3& extents, float radius);
+		void SetBounds(unsigned int index, const glm::vec3& center, const glm::vec3& extents, float radius);
+		void Clear();
+		unsigned int Size() const { return _count; }
+
+		// visible gets one 0/1 flag per object
+		const Stats& Cull(const glm::mat4& viewProj, std::vector<unsigned char>& visible, bool useSIMD = true);
+		const Stats& GetStats() const { return _stats; }
+
+		// Planes as (normal, d) with the normal pointing inside, normalized
+		static void ExtractPlanes(const glm::mat4& viewProj, glm::vec4 planes[6]);
+		// AABB of a box transformed by a rigid or scaled matrix
+		static void TransformBounds(const glm::mat4& world, const glm::vec3& center, const glm::vec3& extents,
+			glm::vec3& worldCenter, glm::vec3& worldExtents);
+
+	private:
+		void Reserve(unsigned int count);
+
+		unsigned int _count;
+		// Padded to a multiple of four so the SIMD loop never reads past the end
+		std::vector<float> _centerX, _centerY, _centerZ;
+		std::vector<float> _extentX, _extentY, _extentZ;
+		std::vector<float> _radius;
+		Stats _stats;
+	};
+}
+#endif
@@ -0,0 +1,108 @@
+#ifndef HandleTable_h
+#define HandleTable_h
+#include <vector>
+#include <deque>
+#include <assert.h>
+
+namespace RenderEngine {
+
+	// 32-bit resource handles: slot index in the low 20 bits, generation in
+	// the high 12. Generations start at 1, so 0 is never a valid handle.
+	enum
+	{
+		kHandleIndexBits = 20,
+		kHandleIndexMask = (1 << kHandleIndexBits) - 1,
+		kHandleGenerationMask = (1 << (32 - kHandleIndexBits)) - 1,
+		kInvalidHandle = 0,
+	};
+
+	inline unsigned int HandleIndex(unsigned int handle) { return handle & kHandleIndexMask; }
+	inline unsigned int HandleGeneration(unsigned int handle) { return handle >> kHandleIndexBits; }
+
+	// Hands out handles on the thread that records commands. Freed slots are
+	// reused in FIFO order so a generation takes as long as possible to repeat.
+	class HandleAllocator
+	{
+	public:
+		unsigned int Allocate()
+		{
+			unsigned int index;
+			if (!_freeIndices.empty())
+			{
+				index = _freeIndices.front();
+				_freeIndices.pop_front();
+			}
+			else
+			{
+				index = (unsigned int)_generations.size();
+				assert(index <= kHandleIndexMask);
+				_generations.push_back(1);
+			}
+			return _generations[index] << kHandleIndexBits | index;
+		}
+
+		void Free(unsigned int handle)
+		{
+			assert(IsValid(handle));
+			unsigned int index = HandleIndex(handle);
+			unsigned int generation = (_generations[index] + 1) & kHandleGenerationMask;
+			_generations[index] = (unsigned short)(generation == 0 ? 1 : generation);
+			_freeIndices.push_back(index);
+		}
+
+		bool IsValid(unsigned int handle) const
+		{
+			unsigned int index = HandleIndex(handle);
+			return handle != kInvalidHandle && index < _generations.size() && _generations[index] == HandleGeneration(handle);
+		}
+
+	private:
+		std::vector<unsigned short> _generations;
+		std::deque<unsigned int> _freeIndices;
+	};
+
+	// Dense handle -> value map for the thread that executes commands. Each
+	// slot remembers the full handle it holds, so a stale handle is caught
+	// with one compare.
+	template<class T>
+	class HandleTable
+	{
+	public:
+		void Set(unsigned int handle, const T& value)
+		{
+			unsigned int index = HandleIndex(handle);
+			if (index >= _slots.size())
+			{
+				_slots.resize(index + 1);
+			}
+			_slots[index].handle = handle;
+			_slots[index].value = value;
+		}
+
+		// T() when the handle is stale or was never set
+		T Get(unsigned int handle) const
+		{
+			unsigned int index = HandleIndex(handle);
+			return index < _slots.size() && _slots[index].handle == handle ? _slots[index].value : T();
+		}
+
+		void Remove(unsigned int handle)
+		{
+			unsigned int index = HandleIndex(handle);
+			if (index < _slots.size() && _slots[index].handle == handle)
+			{
+				_slots[index] = Slot();
+			}
+		}
+
+	private:
+		struct Slot
+		{
+			unsigned int handle;
+			T value;
+			Slot() :handle(kInvalidHandle), value() {}
+		};
+		std::vector<Slot> _slots;
+	};
+}
+#endif
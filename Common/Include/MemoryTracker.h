@@ -0,0 +1,73 @@
+#ifndef MemoryTracker_h
+#define MemoryTracker_h
+#include <atomic>
+#include <functional>
+#include <vector>
+#include <stddef.h>
+
+namespace RenderEngine {
+
+	enum MemoryCategory
+	{
+		kMemoryTexture,
+		// Geometry page buffers, committed as a whole
+		kMemoryGeometry,
+		kMemoryCommandBuffer,
+
+		kMemoryCategoryCount
+	};
+
+	// Byte totals and high-water marks per category. Allocate and Free may be
+	// called from the render thread while the app reads the totals; budget
+	// callbacks only run inside CheckBudget, on the thread that calls it.
+	class MemoryTracker
+	{
+	public:
+		// used is the highest total seen since the previous CheckBudget
+		typedef std::function<void(size_t used, size_t budget)> BudgetCallback;
+
+		MemoryTracker();
+
+		void Allocate(MemoryCategory category, size_t bytes);
+		void Free(MemoryCategory category, size_t bytes);
+
+		size_t GetUsed(MemoryCategory category) const { return _used[category]; }
+		size_t GetPeak(MemoryCategory category) const { return _peak[category]; }
+		unsigned int GetCount(MemoryCategory category) const { return _count[category]; }
+		size_t GetTotalUsed() const { return _totalUsed; }
+		size_t GetTotalPeak() const { return _totalPeak; }
+
+		// Objects the app deleted that wait for the GPU to finish with them.
+		// Their bytes stay in the used totals until the real Free.
+		void AddPendingFree(size_t bytes);
+		void RemovePendingFree(size_t bytes);
+		unsigned int GetPendingFreeCount() const { return _pendingFreeCount; }
+		size_t GetPendingFreeBytes() const { return _pendingFreeBytes; }
+
+		// 0 disables the budget
+		void SetBudget(size_t bytes) { _budget = bytes; }
+		size_t GetBudget() const { return _budget; }
+		void AddBudgetCallback(const BudgetCallback& callback);
+		// Raises the callbacks once each time the total goes over the budget,
+		// call it once a frame. Returns whether the budget is exceeded.
+		bool CheckBudget();
+
+		static const char* GetCategoryName(MemoryCategory category);
+
+	private:
+		static void UpdatePeak(std::atomic<size_t>& peak, size_t value);
+
+		std::atomic<size_t> _used[kMemoryCategoryCount];
+		std::atomic<size_t> _peak[kMemoryCategoryCount];
+		std::atomic<unsigned int> _count[kMemoryCategoryCount];
+		std::atomic<size_t> _totalUsed;
+		std::atomic<size_t> _totalPeak;
+		std::atomic<size_t> _peakSinceCheck;
+		std::atomic<unsigned int> _pendingFreeCount;
+		std::atomic<size_t> _pendingFreeBytes;
+		std::atomic<size_t> _budget;
+		bool _overBudget;
+		std::vector<BudgetCallback> _callbacks;
+	};
+}
+#endif
@@ -5,6 +5,9 @@
 #include <vector>
 #include "glm/glm.hpp"
 #include <memory>
+#include <algorithm>
+#include <functional>
+#include "Residency.h"
 #include <GLES3/gl3.h>
 namespace RenderEngine {
 
@@ -17,7 +20,58 @@ namespace RenderEngine {
 
 	};
 
-	struct VBOData
+	// Shader attribute locations used by DrawVBO
+	enum VertexAttribLocation
+	{
+		kVertexAttribPosition = 0,
+		kVertexAttribTexCoord = 1,
+		kVertexAttribNormal = 2,
+	};
+
+	enum VertexPositionFormat
+	{
+		kVertexPosFloat3,
+		kVertexPosHalf4,		// relative to the mesh AABB, w = 1
+		kVertexPosSNorm16x4,	// relative to the mesh AABB, w = 1
+	};
+
+	enum VertexNormalFormat
+	{
+		kVertexNormalFloat3,
+		kVertexNormalSNorm10x3,		// GL_INT_2_10_10_10_REV, w = 0
+		kVertexNormalOctahedral,	// two snorm16, decoded in the shader
+	};
+
+	enum VertexUVFormat
+	{
+		kVertexUVFloat2,
+		kVertexUVHalf2,
+	};
+
+	// Interleaved vertex layout: position, normal, uv
+	struct VertexFormat
+	{
+		VertexPositionFormat position;
+		VertexNormalFormat normal;
+		VertexUVFormat uv;
+
+		VertexFormat()
+			:position(kVertexPosFloat3), normal(kVertexNormalFloat3), uv(kVertexUVFloat2) {}
+		VertexFormat(VertexPositionFormat position_, VertexNormalFormat normal_, VertexUVFormat uv_)
+			:position(position_), normal(normal_), uv(uv_) {}
+
+		unsigned int GetPositionSize() const { return position == kVertexPosFloat3 ? 12 : 8; }
+		unsigned int GetNormalSize() const { return normal == kVertexNormalFloat3 ? 12 : 4; }
+		unsigned int GetUVSize() const { return uv == kVertexUVFloat2 ? 8 : 4; }
+		unsigned int GetNormalOffset() const { return GetPositionSize(); }
+		unsigned int GetUVOffset() const { return GetPositionSize() + GetNormalSize(); }
+		unsigned int GetStride() const { return GetUVOffset() + GetUVSize(); }
+		bool IsFloat() const { return position == kVertexPosFloat3 && normal == kVertexNormalFloat3 && uv == kVertexUVFloat2; }
+		bool operator==(const VertexFormat& other) const { return position == other.position && normal == other.normal && uv == other.uv; }
+		bool operator!=(const VertexFormat& other) const { return !(*this == other); }
+	};
+
+	struct VBOData : public ResidentData
 	{
 		struct Vertex
 		{
@@ -25,24 +79,114 @@ namespace RenderEngine {
 			glm::vec3 normal;
 			glm::vec2 uv;
 		};
-		VBOData(unsigned int verticesCount_, unsigned int indicesCount_)
-			:verticesCount(verticesCount_), indicesCount(indicesCount_) 
+		VBOData(unsigned int verticesCount_, unsigned int indicesCount_, const VertexFormat& format_ = VertexFormat())
+			:verticesCount(verticesCount_), indicesCount(indicesCount_), format(format_)
+			, decodeOffset(0, 0, 0), decodeScale(1, 1, 1)
+			, dirtyVertexStart(0), dirtyVertexEnd(0), dirtyIndexStart(0), dirtyIndexEnd(0)
 		{
-			_buffer = new char[verticesCount * sizeof(Vertex) + indicesCount * sizeof(unsigned short)];
-			vertices = (Vertex*)_buffer;
-			indices = (unsigned short*)(_buffer + verticesCount * sizeof(Vertex));
+			Allocate();
 		}
 		~VBOData()
 		{
 			delete[] _buffer;
 		}
+		// Counts, format and decode range stay valid after a release
+		bool IsResident() const { return _buffer != nullptr; }
+		void ReleaseCPUData()
+		{
+			delete[] _buffer;
+			_buffer = nullptr;
+			vertices = nullptr;
+			indices = nullptr;
+			ClearDirty();
+		}
+		bool EnsureResident()
+		{
+			if (IsResident())
+			{
+				return true;
+			}
+			if (residency != kResidencyReload || !reloader)
+			{
+				return false;
+			}
+			Allocate();
+			if (!reloader(*this))
+			{
+				ReleaseCPUData();
+				return false;
+			}
+			return true;
+		}
+		unsigned int GetVertexBufferSize() const { return verticesCount * format.GetStride(); }
+		// Maps stored positions back to mesh space, fold it into the model matrix
+		glm::mat4 GetDecodeMatrix() const
+		{
+			glm::mat4 mat(1.0f);
+			mat[0][0] = decodeScale.x;
+			mat[1][1] = decodeScale.y;
+			mat[2][2] = decodeScale.z;
+			mat[3] = glm::vec4(decodeOffset, 1.0f);
+			return mat;
+		}
+		// Grows the dirty span to cover the range, see ESDevice::UpdateVBODirty
+		void MarkVerticesDirty(unsigned int start, unsigned int count)
+		{
+			MarkDirty(dirtyVertexStart, dirtyVertexEnd, start, count);
+		}
+		void MarkIndicesDirty(unsigned int start, unsigned int count)
+		{
+			MarkDirty(dirtyIndexStart, dirtyIndexEnd, start, count);
+		}
+		bool IsDirty() const { return dirtyVertexEnd > dirtyVertexStart || dirtyIndexEnd > dirtyIndexStart; }
+		void ClearDirty()
+		{
+			dirtyVertexStart = dirtyVertexEnd = 0;
+			dirtyIndexStart = dirtyIndexEnd = 0;
+		}
+		// Only addressable as Vertex when format.IsFloat()
 		Vertex* vertices;
 		unsigned short* indices;
 		unsigned int verticesCount;
 		unsigned int indicesCount;
+		VertexFormat format;
+		glm::vec3 decodeOffset;
+		glm::vec3 decodeScale;
+		// Changed since the last ClearDirty, as [start, end)
+		unsigned int dirtyVertexStart;
+		unsigned int dirtyVertexEnd;
+		unsigned int dirtyIndexStart;
+		unsigned int dirtyIndexEnd;
+		// Refills the reallocated vertices and indices under kResidencyReload
+		std::function<bool(VBOData&)> reloader;
 		typedef std::shared_ptr<VBOData> Ptr;
 
 	private:
+		void Allocate()
+		{
+			_buffer = new char[GetVertexBufferSize() + indicesCount * sizeof(unsigned short)];
+			vertices = (Vertex*)_buffer;
+			indices = (unsigned short*)(_buffer + GetVertexBufferSize());
+		}
+
+		static void MarkDirty(unsigned int& dirtyStart, unsigned int& dirtyEnd, unsigned int start, unsigned int count)
+		{
+			if (count == 0)
+			{
+				return;
+			}
+			if (dirtyEnd <= dirtyStart)
+			{
+				dirtyStart = start;
+				dirtyEnd = start + count;
+			}
+			else
+			{
+				dirtyStart = std::min(dirtyStart, start);
+				dirtyEnd = std::max(dirtyEnd, start + count);
+			}
+		}
+
 		char* _buffer;
 	};
 
@@ -51,20 +195,47 @@ namespace RenderEngine {
 	public:
 		typedef std::shared_ptr<Mesh> Ptr;
 
+		// A contiguous index range of vboData, lods[0] is full detail
+		struct LOD
+		{
+			unsigned int indexStart;
+			unsigned int indexCount;
+			// Largest surface deviation from full detail, in mesh units
+			float error;
+		};
+
 	public:
-		static std::vector <Ptr> LoadMeshFromFile(const std::string& file);
+		static std::vector <Ptr> LoadMeshFromFile(const std::string& file, bool optimize = true, unsigned int lodLevels = 3);
+		// Geometry that 16-bit indices cannot address is split into several meshes sharing the name
+		static std::vector <Ptr> CreateFromGeometry(const std::string& name, const std::vector<VBOData::Vertex>& vertices, const std::vector<unsigned int>& indices);
 	public:
 		std::string name;
 		std::shared_ptr<VBOData> vboData;
+		std::vector<LOD> lods;
+		// Bounding box and sphere in mesh space, sharing the center
+		glm::vec3 boundsCenter;
+		glm::vec3 boundsExtents;
+		float boundsRadius;
 
 		glm::vec3 position;
 		glm::vec3 rotation;
 		VBO* vbo;
 		Mesh(const std::string& name_, int vericesCount, int indicesCount = 0)
-			:name(name_), position(0, 0, 0), rotation(0, 0, 0)
+			:name(name_), boundsCenter(0, 0, 0), boundsExtents(0, 0, 0), boundsRadius(0), position(0, 0, 0), rotation(0, 0, 0)
 		{
 			vboData = std::make_shared<VBOData>(vericesCount, indicesCount);
+			LOD lod = { 0, (unsigned int)indicesCount, 0.0f };
+			lods.push_back(lod);
 		}
+
+		void ComputeBounds();
+		// AABB of the bounds after position and rotation
+		void GetWorldBounds(glm::vec3& center, glm::vec3& extents) const;
+		// Appends up to levelCount coarser index ranges to vboData, each targeting
+		// half the triangles of the previous one
+		void GenerateLODs(unsigned int levelCount);
+		// Coarsest LOD whose error projects to at most maxPixelError pixels
+		unsigned int SelectLOD(const glm::vec3& viewPosition, float fovY, float screenHeight, float maxPixelError = 1.0f) const;
 		~Mesh()
 		{
 		}
@@ -0,0 +1,55 @@
+#ifndef MeshOptimizer_h
+#define MeshOptimizer_h
+#include <vector>
+#include "Mesh.hpp"
+
+namespace RenderEngine {
+
+	// Load-time geometry optimization, run on 32-bit indexed triangle lists before
+	// they are split into 16-bit VBOData.
+	class MeshOptimizer
+	{
+	public:
+		struct Options
+		{
+			bool weldVertices;
+			bool optimizeVertexCache;
+			bool optimizeOverdraw;
+			bool optimizeVertexFetch;
+			// Overdraw ordering may raise ACMR up to this factor
+			float overdrawThreshold;
+			// FIFO size used for the ACMR/ATVR report
+			unsigned int statsCacheSize;
+			Options()
+				:weldVertices(true), optimizeVertexCache(true), optimizeOverdraw(true), optimizeVertexFetch(true)
+				, overdrawThreshold(1.05f), statsCacheSize(16) {}
+		};
+
+		struct Stats
+		{
+			unsigned int verticesBefore;
+			unsigned int verticesAfter;
+			unsigned int triangles;
+			float acmrBefore;
+			float acmrAfter;
+			float atvrBefore;
+			float atvrAfter;
+		};
+
+		static Stats Optimize(std::vector<VBOData::Vertex>& vertices, std::vector<unsigned int>& indices, const Options& options = Options());
+
+	public:
+		// Merges bitwise identical vertices, returns the new vertex count
+		static unsigned int WeldVertices(std::vector<VBOData::Vertex>& vertices, std::vector<unsigned int>& indices);
+		// Forsyth's linear-speed post-transform cache optimization
+		static void OptimizeVertexCache(std::vector<unsigned int>& indices, unsigned int vertexCount);
+		// Reorders cache-friendly triangle clusters so outward facing ones are drawn first
+		static void OptimizeOverdraw(std::vector<unsigned int>& indices, const std::vector<VBOData::Vertex>& vertices, float threshold);
+		// Renumbers vertices in first-use order and drops unreferenced ones
+		static void OptimizeVertexFetch(std::vector<VBOData::Vertex>& vertices, std::vector<unsigned int>& indices);
+
+		static float ComputeACMR(const std::vector<unsigned int>& indices, unsigned int vertexCount, unsigned int cacheSize);
+		static float ComputeATVR(const std::vector<unsigned int>& indices, unsigned int vertexCount, unsigned int cacheSize);
+	};
+}
+#endif
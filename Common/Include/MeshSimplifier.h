@@ -0,0 +1,20 @@
+#ifndef MeshSimplifier_h
+#define MeshSimplifier_h
+#include <vector>
+#include "Mesh.hpp"
+
+namespace RenderEngine {
+
+	// Quadric error metric edge collapse. Only the index list is simplified,
+	// every LOD keeps referencing the original vertex buffer.
+	class MeshSimplifier
+	{
+	public:
+		// Collapses edges until the index count reaches targetIndexCount or the next
+		// collapse would move the surface more than targetError (mesh units).
+		// Returns the largest error introduced.
+		static float Simplify(const std::vector<VBOData::Vertex>& vertices, const std::vector<unsigned int>& indices,
+			unsigned int targetIndexCount, float targetError, std::vector<unsigned int>& result);
+	};
+}
+#endif
@@ -0,0 +1,66 @@
+#ifndef NullESDevice_h
+#define NullESDevice_h
+#include "ESDevice.hpp"
+
+namespace RenderEngine {
+
+	// Accepts every call and touches no GL, so replays measure the command
+	// path alone. Resources are small placeholders it owns.
+	class NullESDevice final : public ESDevice
+	{
+	private:
+		std::unordered_map<unsigned int, PipelineState*> _pipelineStates;
+		MemoryTracker _memoryTracker;
+		unsigned int _drawCount;
+	public:
+		NullESDevice() :_drawCount(0) {}
+		~NullESDevice();
+		// Draw calls since the device was created
+		unsigned int GetDrawCount() const { return _drawCount; }
+
+		virtual bool CreateWindow1(const std::string& title, int width, int height, int flags) { return true; }
+		virtual void Clear() {}
+
+		virtual Texture2D* CreateTexture2D(const TextureData::Ptr& data);
+		virtual void DeleteTexture2D(Texture2D* texture);
+		virtual void UseTexture2D(Texture2D* texture, unsigned int index) {}
+		virtual void SetClearColor(float r, float g, float b, float alpha) {}
+		virtual void DrawTriangle(std::vector<glm::vec3>& vertices) { ++_drawCount; }
+		virtual void SetViewPort(int x, int y, int width, int height) {}
+		virtual void AcqiureThreadOwnerShip() {}
+		virtual void ReleaseThreadOwnership() {}
+		virtual void BeginRender() {}
+		virtual void Present() {}
+		virtual VBO* CreateVBO();
+		virtual void UpdateVBO(VBO* vbo, const VBOData::Ptr& vboData) {}
+		virtual void UpdateVBORange(VBO* vbo, unsigned int vertexStart, unsigned int vertexCount, const void* vertices,
+			unsigned int indexStart, unsigned int indexCount, const unsigned short* indices) {}
+		virtual void DeleteVBO(VBO* vbo);
+		virtual void DrawVBO(VBO* vbo) { ++_drawCount; }
+		virtual void DrawVBORange(VBO* vbo, unsigned int indexStart, unsigned int indexCount) { ++_drawCount; }
+		virtual void Cleanup() {}
+
+		virtual void UseGPUProgram(GPUProgram* program) {}
+		virtual GPUProgram* CreateGPUProgram(const std::string& vertexShader, const std::string& fragmentShader);
+		virtual void DeletGPUProgram(GPUProgram* program);
+		virtual GPUProgramParam* GetGPUProgramParam(GPUProgram* program, const std::string& name);
+		virtual void SetGPUProgramParamAsInt(GPUProgramParam* param, int value) {}
+		virtual void SetGPUProgramParamAsFloat(GPUProgramParam* param, float value) {}
+		virtual void SetGPUProgramParamAsMat4(GPUProgramParam* param, const glm::mat4& mat) {}
+		virtual void SetGPUProgramParamAsIntArray(GPUProgramParam* param, const std::vector<int>& values) {}
+		virtual void SetGPUProgramParamAsFloatArray(GPUProgramParam* param, const std::vector<float>& values) {}
+		virtual void SetGPUProgramParamAsMat4Array(GPUProgramParam* param, const std::vector<glm::mat4>& values) {}
+
+		virtual Material* CreateMaterial(const MaterialDesc& desc);
+		virtual void DeleteMaterial(Material* material);
+		virtual void UseMaterial(Material* material) {}
+
+		virtual PipelineState* CreatePipelineState(const PipelineStateDesc& desc);
+		virtual void UsePipelineState(PipelineState* state) {}
+		virtual unsigned int GetPipelineStateCount() { return (unsigned int)_pipelineStates.size(); }
+		virtual MemoryTracker* GetMemoryTracker() { return &_memoryTracker; }
+		virtual int GetScreenWidth() { return 0; }
+		virtual int GetScreenHeigt() { return 0; }
+	};
+}
+#endif
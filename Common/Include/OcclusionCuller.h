@@ -0,0 +1,89 @@
+#ifndef OcclusionCuller_h
+#define OcclusionCuller_h
+#include <vector>
+#include "glm/glm.hpp"
+#include "Mesh.hpp"
+
+namespace RenderEngine {
+
+	// Software occlusion culling. Low-poly occluders are rasterized into a small
+	// CPU depth buffer, tiles spread across threads, then reduced to a
+	// hierarchical depth buffer holding the farthest depth of every 8x8 block.
+	// Bounds are occluded when their nearest depth lies behind every block they cover.
+	class OcclusionCuller
+	{
+	public:
+		struct Options
+		{
+			unsigned int width;		// rounded up to a multiple of the tile size
+			unsigned int height;
+			unsigned int threadCount;	// 0 = hardware concurrency
+			// Fewer triangles than this rasterize on the calling thread
+			unsigned int minParallelTriangles;
+			bool useSIMD;
+			Options()
+				:width(256), height(128), threadCount(0), minParallelTriangles(2048), useSIMD(true) {}
+		};
+
+		struct Stats
+		{
+			unsigned int occluderTriangles;
+			unsigned int tested;
+			unsigned int occluded;
+			float rasterizeMs;
+			float testMs;
+		};
+
+		enum
+		{
+			kTileSize = 32,
+			kHiZBlockSize = 8,
+		};
+
+		explicit OcclusionCuller(const Options& options = Options());
+
+		void BeginFrame(const glm::mat4& viewProj);
+		// Indices are a triangle list into data->vertices, which must be float format
+		void AddOccluder(const glm::mat4& world, const VBOData& data, unsigned int indexStart, unsigned int indexCount);
+		void Rasterize();
+		bool IsVisible(const glm::vec3& center, const glm::vec3& extents);
+
+		const Stats& GetStats() const { return _stats; }
+		unsigned int GetWidth() const { return _width; }
+		unsigned int GetHeight() const { return _height; }
+		// Depth in [0, 1], 1 is the far plane; rows start at the bottom
+		const std::vector<float>& GetDepthBuffer() const { return _depth; }
+		const std::vector<float>& GetHiZ() const { return _hiZ; }
+
+	private:
+		struct Triangle
+		{
+			// Edge functions e(x, y) = a * x + b * y + c, positive inside
+			float edgeA[3];
+			float edgeB[3];
+			float edgeC[3];
+			// Depth plane z = a * x + b * y + c
+			float depthA;
+			float depthB;
+			float depthC;
+			int minX, minY, maxX, maxY;
+		};
+
+		void RasterizeTile(unsigned int tile);
+		void RasterizeTriangle(const Triangle& tri, int tileMinX, int tileMinY, int tileMaxX, int tileMaxY);
+		void BuildHiZ(unsigned int tile);
+
+		Options _options;
+		unsigned int _width;
+		unsigned int _height;
+		unsigned int _tilesX;
+		unsigned int _tilesY;
+		glm::mat4 _viewProj;
+		std::vector<float> _depth;
+		std::vector<float> _hiZ;
+		std::vector<Triangle> _triangles;
+		std::vector<std::vector<unsigned int> > _tileBins;
+		Stats _stats;
+	};
+}
+#endif
@@ -17,7 +17,8 @@ class PlatformMutex
 {
 	friend class Mutex;
 protected:
-	PlatformMutex()
+	// processShared mutexes may be placed in memory mapped by several processes
+	PlatformMutex(bool processShared)
 	{
 
 #ifdef _WIN32
@@ -26,6 +27,8 @@ protected:
 		pthread_mutexattr_t    attr;
 		pthread_mutexattr_init(&attr);
 		pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+		if (processShared)
+			pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
 		pthread_mutex_init(&mutex, &attr);
 		pthread_mutexattr_destroy(&attr);
 #endif
@@ -99,7 +102,7 @@ public:
 		Mutex * m_Mutex;
 	};
 
-	Mutex() {};
+	Mutex(bool processShared = false) : m_Mutex(processShared) {};
 	~Mutex() {};
 
 	void Lock() { m_Mutex.Lock(); }
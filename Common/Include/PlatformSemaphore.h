@@ -14,7 +14,7 @@ class PlatformSemaphore
 {
     friend class Semaphore;
 protected:
-	void Create();
+	void Create(bool processShared);
 	void Destroy();
 
 	void WaitForSignal();
@@ -28,11 +28,11 @@ private:
 #endif
 };
 
-inline void PlatformSemaphore::Create() { 
+inline void PlatformSemaphore::Create(bool processShared) { 
 #ifdef _WIN32
 	m_Semaphore = CreateSemaphoreA(NULL, 0, 256, NULL);
 #else
-	if (sem_init(&m_Semaphore, 0, 0) == -1) ;
+	if (sem_init(&m_Semaphore, processShared ? 1 : 0, 0) == -1) ;
 #endif
 }
 inline void PlatformSemaphore::Destroy() { 
@@ -75,13 +75,15 @@ inline void PlatformSemaphore::Signal() {
 class Semaphore
 {
 public:
-    Semaphore() { m_Semaphore.Create(); }
+    // processShared semaphores may be placed in memory mapped by several processes
+    Semaphore(bool processShared = false) : m_ProcessShared(processShared) { m_Semaphore.Create(processShared); }
     ~Semaphore() { m_Semaphore.Destroy(); }
-    void Reset() { m_Semaphore.Destroy(); m_Semaphore.Create(); }
+    void Reset() { m_Semaphore.Destroy(); m_Semaphore.Create(m_ProcessShared); }
     void WaitForSignal() { m_Semaphore.WaitForSignal(); }
     void Signal() { m_Semaphore.Signal(); }
     
 private:
     PlatformSemaphore m_Semaphore;
+    bool m_ProcessShared;
 };
 #endif // __PLATFORMSEMAPHORE_H
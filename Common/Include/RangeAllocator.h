@@ -0,0 +1,44 @@
+#ifndef RangeAllocator_h
+#define RangeAllocator_h
+#include <map>
+
+namespace RenderEngine {
+
+	// Best fit free list over [0, capacity) in abstract units. Free blocks are
+	// indexed by offset, to coalesce neighbours on free, and by size, to find
+	// the smallest block that fits in O(log n). Holds no memory itself.
+	class RangeAllocator
+	{
+	public:
+		enum
+		{
+			kInvalidOffset = 0xFFFFFFFF,
+		};
+
+		explicit RangeAllocator(unsigned int capacity = 0);
+
+		// Forgets every allocation
+		void Reset(unsigned int capacity);
+		// Returns kInvalidOffset when no free block is large enough
+		unsigned int Allocate(unsigned int size);
+		void Free(unsigned int offset, unsigned int size);
+
+		unsigned int GetCapacity() const { return _capacity; }
+		unsigned int GetUsed() const { return _used; }
+		unsigned int GetFree() const { return _capacity - _used; }
+		unsigned int GetLargestFree() const;
+		unsigned int GetFreeBlockCount() const { return (unsigned int)_byOffset.size(); }
+		// 0 when the free space is one block, towards 1 as it gets scattered
+		float GetFragmentation() const;
+
+	private:
+		void Insert(unsigned int offset, unsigned int size);
+		void Erase(std::map<unsigned int, unsigned int>::iterator block);
+
+		unsigned int _capacity;
+		unsigned int _used;
+		std::map<unsigned int, unsigned int> _byOffset;
+		std::multimap<unsigned int, unsigned int> _bySize;
+	};
+}
+#endif
@@ -0,0 +1,100 @@
+#ifndef RenderQueue_h
+#define RenderQueue_h
+#include <vector>
+#include <unordered_map>
+#include "glm/glm.hpp"
+#include "ESDevice.hpp"
+
+namespace RenderEngine {
+
+	// Collects draws for a frame, radix sorts them by a 64-bit state key and
+	// submits them with only the state changes between consecutive draws.
+	// Key layout from the top bit: layer (4), transparent (1), then program (10),
+	// material (13), vbo (12), depth (24) for opaque draws, which sort front to
+	// back; transparent draws put depth first, inverted, to sort back to front.
+	class RenderQueue
+	{
+	public:
+		struct Options
+		{
+			unsigned int threadCount;	// 0 = hardware concurrency
+			// Fewer draws than this are sorted on the calling thread
+			unsigned int minParallelCount;
+			Options()
+				:threadCount(0), minParallelCount(16384) {}
+		};
+
+		struct Packet
+		{
+			Material* material;
+			PipelineState* state;
+			VBO* vbo;
+			unsigned int indexStart;
+			unsigned int indexCount;
+			// Optional per draw matrix, skipped when mvpParam is null
+			GPUProgramParam* mvpParam;
+			glm::mat4 mvp;
+		};
+
+		struct Stats
+		{
+			unsigned int draws;
+			unsigned int programChanges;
+			unsigned int materialChanges;
+			unsigned int pipelineChanges;
+			unsigned int vboChanges;
+			unsigned int uniformChanges;
+			float sortMs;
+		};
+
+		enum
+		{
+			kLayerCount = 16,
+		};
+
+		explicit RenderQueue(const Options& options = Options());
+
+		// depth is the view distance, layers draw in ascending order
+		void Submit(const Packet& packet, float depth, unsigned int layer = 0, bool transparent = false);
+		void Sort();
+		// Sorts if needed, issues the draws into device and empties the queue
+		void Flush(ESDevice* device);
+		void Clear();
+		// Forget the bound state after something else touched the device
+		void InvalidateState();
+
+		unsigned int Size() const { return (unsigned int)_packets.size(); }
+		const Stats& GetStats() const { return _stats; }
+
+		unsigned long long MakeKey(const Packet& packet, float depth, unsigned int layer, bool transparent);
+
+	private:
+		struct SortItem
+		{
+			unsigned long long key;
+			unsigned int index;
+		};
+
+		unsigned int GetId(std::unordered_map<const void*, unsigned int>& ids, const void* object, unsigned int bits);
+
+		Options _options;
+		Stats _stats;
+		std::vector<Packet> _packets;
+		std::vector<SortItem> _items;
+		std::vector<SortItem> _scratch;
+		std::vector<unsigned int> _histograms;
+		bool _sorted;
+
+		std::unordered_map<const void*, unsigned int> _programIds;
+		std::unordered_map<const void*, unsigned int> _materialIds;
+		std::unordered_map<const void*, unsigned int> _vboIds;
+
+		GPUProgram* _boundProgram;
+		Material* _boundMaterial;
+		PipelineState* _boundState;
+		VBO* _boundVBO;
+		GPUProgramParam* _boundParam;
+		glm::mat4 _boundMVP;
+	};
+}
+#endif
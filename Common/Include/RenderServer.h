@@ -0,0 +1,33 @@
+#ifndef RenderServer_h
+#define RenderServer_h
+#include "ThreadBufferESDevice.h"
+#include <vector>
+
+namespace RenderEngine {
+
+	// Executes the command streams of other processes on one device. Each
+	// client records with ThreadBufferESDevice::ConnectSharedBuffer into its
+	// own shared memory ring and has its own handle namespace; the server
+	// runs them a frame at a time in turn on the thread that calls RunOnce.
+	class RenderServer
+	{
+	public:
+		// Takes ownership of device, which must be current on the calling thread
+		RenderServer(ESDevice* device);
+		~RenderServer();
+
+		// Creates the ring a client connects to by name
+		bool AddClient(const std::string& name);
+		// One frame from every client that has one submitted, returns how many ran
+		unsigned int RunOnce();
+
+		unsigned int GetClientCount() const { return (unsigned int)_clients.size(); }
+		unsigned int GetFrameCount() const { return _frameCount; }
+
+	private:
+		ESDevice* _device;
+		std::vector<ThreadBufferESDevice*> _clients;
+		unsigned int _frameCount;
+	};
+}
+#endif
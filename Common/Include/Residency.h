@@ -0,0 +1,41 @@
+#ifndef Residency_h
+#define Residency_h
+
+namespace RenderEngine {
+
+	// What happens to the CPU copy of a resource once the GPU has it
+	enum ResidencyPolicy
+	{
+		kResidencyKeep,
+		// Freed after upload, uploading it again fails
+		kResidencyDropAfterUpload,
+		// Freed after upload, refilled by its reloader when uploaded again
+		kResidencyReload,
+	};
+
+	// CPU side data handed to ESDevice. Devices call EnsureResident before
+	// reading it and OnUploaded, on the thread that submitted it, once the
+	// render thread no longer needs it.
+	class ResidentData
+	{
+	public:
+		ResidentData() :residency(kResidencyKeep) {}
+		virtual ~ResidentData() {}
+
+		virtual bool IsResident() const = 0;
+		virtual void ReleaseCPUData() = 0;
+		// False when the data was released and can't be reloaded
+		virtual bool EnsureResident() = 0;
+
+		void OnUploaded()
+		{
+			if (residency != kResidencyKeep)
+			{
+				ReleaseCPUData();
+			}
+		}
+
+		ResidencyPolicy residency;
+	};
+}
+#endif
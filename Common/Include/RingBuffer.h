@@ -3,6 +3,8 @@
 
 
 #include <new> // for placement new
+#include <string>
+#include <atomic>
 
 
 #if defined(__GNUC__) || defined(__SNC__)
@@ -11,40 +13,70 @@
 #define ALIGN_OF(T) __alignof(T)
 #endif
 
-class Mutex;
+// POSIX shared memory, for a reader and writer in different processes
+#if !defined(_WIN32) && !defined(__ANDROID__)
+#define RINGBUFFER_SHARED_MEMORY 1
+#endif
+
+// memfd, for a buffer mapped twice back to back
+#if defined(__linux__) && !defined(__ANDROID__)
+#define RINGBUFFER_MIRRORED_MEMORY 1
+#endif
+
 class Semaphore;
+namespace RenderEngine { class CommandCapture; }
 
 class RingBuffer 
 {
 public:
-	typedef unsigned long UInt32;
-	struct BufferState
+	typedef unsigned int UInt32;
+	typedef unsigned long long UInt64;
+	enum { kCacheLineSize = 64 };
+	// Where the reader or the writer is. Only its own side touches it, so
+	// each side's sits on its own cache line.
+	struct alignas(kCacheLineSize) BufferState
 	{
 		// These should not be size_t, as the GfxDevice may run across processes of different
 		// bitness, and the data serialized in the command buffer must match.
-		void Reset() volatile;
-		volatile UInt32 bufferPos;
-		volatile UInt32 bufferEnd;
-		volatile UInt32 bufferWraps;
-		volatile UInt32 checkedPos;
-		volatile UInt32 checkedWraps;
+		void Reset();
+		UInt32 bufferPos;
+		UInt32 bufferEnd;
+		UInt32 bufferWraps;
 	};
 
-	struct BufferHeader
+	// All the two sides share. Each side publishes the wraps and position it
+	// has released or submitted as one word, with release ordering, and the
+	// words sit on separate cache lines so neither side pulls in the other's
+	// line until it runs out of room.
+	struct alignas(kCacheLineSize) BufferHeader
 	{
-		BufferState reader;
-		BufferState writer;
+		void Reset();
+		std::atomic<UInt64> readerChecked;
+		char readerPadding[kCacheLineSize - sizeof(UInt64)];
+		std::atomic<UInt64> writerChecked;
+		char writerPadding[kCacheLineSize - sizeof(UInt64)];
+		std::atomic<int> needsReadSignal;
+		std::atomic<int> needsWriteSignal;
 	};
 
 	typedef unsigned size_t;
 
 	RingBuffer(size_t size);
+	// Empty until Create, CreateShared or OpenShared
+	RingBuffer();
 	~RingBuffer();
 
 	enum
 	{
 		kDefaultAlignment = 4,
-		kDefaultStep = 2048
+		kDefaultStep = 2048,
+		// Streamed payloads this big skip the ring when both sides share the
+		// process: the writer copies them to a pooled heap block and only
+		// passes its address
+		kLargePayloadSize = 64 * 1024,
+		// Past this many bytes in heap blocks the reader hasn't freed, large
+		// payloads stream through the ring again so the writer feels back-pressure
+		kMaxLargePayloadBytes = 16 * 1024 * 1024
 	};
 
 	// Read data from the ringbuffer
@@ -64,8 +96,10 @@ public:
 	// Ringbuffer Streaming support. This will automatically call WriteSubmitData & ReadReleaseData.
 	// It splits the data into smaller chunks (step). So that the size of the ringbuffer can be smaller than the data size passed into this function.
 	// The consumer thread will be reading the streaming data while WriteStreamingData is still called on the producer thread.
-	void						ReadStreamingData(void* data, size_t size, size_t alignment = kDefaultAlignment, size_t step = kDefaultStep);
-	void						WriteStreamingData(const void* data, size_t size, size_t alignment = kDefaultAlignment, size_t step = kDefaultStep);
+	// The step grows with the payload up to a slice of the buffer, large payloads may go through the heap instead.
+	// The writer puts how it sent the data in the stream, so the reader never needs to know.
+	void						ReadStreamingData(void* data, size_t size, size_t alignment = kDefaultAlignment);
+	void						WriteStreamingData(const void* data, size_t size, size_t alignment = kDefaultAlignment);
 
 
 	// Utility functions
@@ -75,8 +109,31 @@ public:
 
 	// Creation methods
 	void	Create(size_t size);
+	// Maps the buffer twice back to back, so a block running off the end
+	// continues in the mirror and reads and writes never wrap. size is
+	// rounded up to whole pages. False where mirroring is not available.
+	bool	CreateMirrored(size_t size);
+	bool	IsMirrored() const { return m_Mirrored; }
+	size_t	GetBufferSize() const { return m_BufferSize; }
+	// Writer side: bytes written since Create, counting the end of the buffer a wrap skipped
+	UInt64	GetBytesWritten() const { return (UInt64)m_Writer.bufferWraps * m_BufferSize + m_Writer.bufferPos; }
 	void	Destroy();
 
+	// The header, locks and data live in the POSIX shared memory object name,
+	// so the reader and the writer may be different processes. CreateShared
+	// makes the object and removes it again in Destroy, OpenShared maps one
+	// another process created. Both return false where shared memory is missing.
+	bool	CreateShared(const char* name, size_t size);
+	bool	OpenShared(const char* name);
+	bool	IsShared() const { return m_Shared != NULL; }
+
+	// Reader side: whether submitted data is waiting, without blocking
+	bool	IsReadDataAvailable() const;
+
+	// Every block the reader takes and every release is appended to capture.
+	// Set it before the reader starts.
+	void	SetReadCapture(RenderEngine::CommandCapture* capture) { m_ReadCapture = capture; }
+
 
 private:
 	size_t Align(size_t pos, size_t alignment) const { return (pos + alignment - 1)&~(alignment - 1); }
@@ -85,33 +142,71 @@ private:
 
 	void	HandleReadOverflow(size_t& dataPos, size_t& dataEnd);
 	void	HandleWriteOverflow(size_t& dataPos, size_t& dataEnd);
+	// A block ended in the mirror, continue from the same bytes in the first copy
+	void	WrapMirrored(BufferState& state) const
+	{
+		state.bufferPos -= m_BufferSize;
+		state.bufferEnd -= m_BufferSize;
+		state.bufferWraps++;
+	}
+	static UInt64 PackChecked(const BufferState& state) { return (UInt64)state.bufferWraps << 32 | state.bufferPos; }
+	static UInt32 CheckedPos(UInt64 checked) { return (UInt32)checked; }
+	static UInt32 CheckedWraps(UInt64 checked) { return (UInt32)(checked >> 32); }
 
 	void	SendReadSignal();
 	void	SendWriteSignal();
 
+	void	CaptureRead(const void* data, size_t size, size_t alignment);
+
+	// How a streamed payload follows its size in the ring
+	enum StreamingMode
+	{
+		kStreamingChunks,
+		// Debug builds check a marker after each chunk
+		kStreamingCheckedChunks,
+		kStreamingHeap,
+	};
+	struct PayloadPool;
+	char*	AllocateLargePayload(size_t size);
+	void	FreeLargePayload(char* block, size_t size);
+
+	struct SharedHeader;
+	void	MapShared(void* memory, size_t mappedSize);
+
 	char* m_Buffer;
 	size_t m_BufferSize;
-	BufferState *m_Reader;
-	BufferState *m_Writer;
+	bool m_Mirrored;
+	BufferState m_Reader;
+	BufferState m_Writer;
 	BufferHeader m_Header;
-	Mutex* m_Mutex;
+	// m_Header, or the one in shared memory. Read only once set up, the
+	// alignment keeps it off the line with the signal flags.
+	alignas(kCacheLineSize) BufferHeader* m_State;
 	Semaphore* m_ReadSemaphore;
 	Semaphore* m_WriteSemaphore;
-	volatile int m_NeedsReadSignal;
-	volatile int m_NeedsWriteSignal;
+	RenderEngine::CommandCapture* m_ReadCapture;
+	PayloadPool* m_PayloadPool;
+	SharedHeader* m_Shared;
+	size_t m_SharedSize;
+	bool m_SharedOwner;
+	std::string m_SharedName;
 };
 
 
 inline void* RingBuffer::GetReadDataPointer(size_t size, size_t alignment)
 {
 	size = Align(size, alignment);
-	size_t dataPos = Align(m_Reader->bufferPos, alignment);
+	size_t dataPos = Align(m_Reader.bufferPos, alignment);
 	size_t dataEnd = dataPos + size;
-	if (dataEnd > m_Reader->bufferEnd)
+	if (dataEnd > m_Reader.bufferEnd)
 	{
 		HandleReadOverflow(dataPos, dataEnd);
 	}
-	m_Reader->bufferPos = dataEnd;
+	m_Reader.bufferPos = dataEnd;
+	if (m_Mirrored && dataEnd >= m_BufferSize)
+		WrapMirrored(m_Reader);
+	if (m_ReadCapture)
+		CaptureRead(&m_Buffer[dataPos], size, alignment);
 	
 	return &m_Buffer[dataPos];
 }
@@ -119,13 +214,15 @@ inline void* RingBuffer::GetReadDataPointer(size_t size, size_t alignment)
 inline void* RingBuffer::GetWriteDataPointer(size_t size, size_t alignment)
 {
 	size = Align(size, alignment);
-	size_t dataPos = Align(m_Writer->bufferPos, alignment);
+	size_t dataPos = Align(m_Writer.bufferPos, alignment);
 	size_t dataEnd = dataPos + size;
-	if (dataEnd > m_Writer->bufferEnd)
+	if (dataEnd > m_Writer.bufferEnd)
 	{
 		HandleWriteOverflow(dataPos, dataEnd);
 	}
-	m_Writer->bufferPos = dataEnd;
+	m_Writer.bufferPos = dataEnd;
+	if (m_Mirrored && dataEnd >= m_BufferSize)
+		WrapMirrored(m_Writer);
 
 	return &m_Buffer[dataPos];
 }
@@ -0,0 +1,68 @@
+#ifndef StaticBatcher_h
+#define StaticBatcher_h
+#include <vector>
+#include "glm/glm.hpp"
+#include "Mesh.hpp"
+
+namespace RenderEngine {
+
+	// Load-time merging of meshes that never move. Meshes sharing a material key
+	// are transformed to world space and packed, in spatial order, into batch
+	// meshes small enough for 16-bit indices. Each batch keeps its own bounds
+	// for culling and one LOD chain built from the LODs of its sources.
+	class StaticBatcher
+	{
+	public:
+		struct Options
+		{
+			// Batches are closed before exceeding this, at most 65536
+			unsigned int maxVertices;
+			Options()
+				:maxVertices(65536) {}
+		};
+
+		struct Batch
+		{
+			// World space, position and rotation are zero
+			Mesh::Ptr mesh;
+			unsigned int materialKey;
+			unsigned int sourceCount;
+		};
+
+		struct Stats
+		{
+			unsigned int meshCount;
+			unsigned int batchCount;
+			unsigned int verticesCount;
+			unsigned int indicesCount;
+		};
+
+		explicit StaticBatcher(const Options& options = Options());
+
+		// Uses the mesh position and rotation as its world transform
+		void Add(const Mesh::Ptr& mesh, unsigned int materialKey);
+		// Meshes may be added several times with different transforms
+		void Add(const Mesh::Ptr& mesh, unsigned int materialKey, const glm::mat4& world);
+		// Empties the batcher
+		std::vector<Batch> Build();
+
+		// Draw calls before batching are meshCount, after are batchCount
+		const Stats& GetStats() const { return _stats; }
+
+	private:
+		struct Entry
+		{
+			Mesh::Ptr mesh;
+			unsigned int materialKey;
+			glm::mat4 world;
+			unsigned int mortonCode;
+		};
+
+		Batch MakeBatch(std::vector<Entry>::const_iterator begin, std::vector<Entry>::const_iterator end);
+
+		Options _options;
+		Stats _stats;
+		std::vector<Entry> _entries;
+	};
+}
+#endif
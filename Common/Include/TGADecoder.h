@@ -0,0 +1,33 @@
+#ifndef TGADecoder_h
+#define TGADecoder_h
+#include <string>
+#include "ESDevice.hpp"
+
+namespace RenderEngine {
+
+	// Decodes uncompressed and RLE TGA images (8-bit grey, 24-bit BGR, 32-bit BGRA)
+	// into bottom-up RGBA8 pixels ready for glTexImage2D.
+	class TGADecoder
+	{
+	public:
+		struct Options
+		{
+			unsigned int threadCount;	// 0 = hardware concurrency
+			unsigned int minPixelsPerThread;
+			bool useSIMD;
+			Options()
+				:threadCount(0), minPixelsPerThread(256 * 256), useSIMD(true) {}
+		};
+
+		static TextureData::Ptr Decode(const char* data, unsigned int size, const Options& options = Options());
+		static TextureData::Ptr LoadFromFile(const std::string& fileName, const Options& options = Options());
+
+	public:
+		// Row conversion kernels, exposed for the benchmark
+		static void ConvertBGRAToRGBA(const unsigned char* src, unsigned char* dst, unsigned int count, bool useSIMD);
+		static void ConvertBGRToRGBA(const unsigned char* src, unsigned char* dst, unsigned int count, bool useSIMD);
+		static void ConvertGreyToRGBA(const unsigned char* src, unsigned char* dst, unsigned int count, bool useSIMD);
+		static void ReverseRGBA(unsigned char* pixels, unsigned int count, bool useSIMD);
+	};
+}
+#endif
@@ -2,22 +2,217 @@
 #define ThreadBufferESDevice_H
 #include "ThreadESDeviceBase.h"
 #include "RingBuffer.h"
+#include "CommandCapture.h"
+#include "CommandStream.h"
 namespace RenderEngine {
 
+	// Every command ThreadBufferESDevice records, in opcode order. A DEVICE
+	// command replays the ESDevice method of the same name with the same
+	// arguments, its encoding follows from their types. A CUSTOM command is
+	// decoded by ThreadBufferESDevice::Run<name>.
+#define GFX_COMMANDS(DEVICE, CUSTOM) \
+	DEVICE(Clear) \
+	DEVICE(UseGPUProgram) \
+	CUSTOM(CreateGPUProgram) \
+	CUSTOM(DeleteGPUProgram) \
+	CUSTOM(CreateTexture2D) \
+	CUSTOM(DeleteTexture2D) \
+	DEVICE(UseTexture2D) \
+	DEVICE(SetClearColor) \
+	CUSTOM(DrawTriangle) \
+	DEVICE(SetViewPort) \
+	CUSTOM(Present) \
+	DEVICE(AcqiureThreadOwnerShip) \
+	DEVICE(ReleaseThreadOwnership) \
+	CUSTOM(CreateVBO) \
+	CUSTOM(UpdateVBO) \
+	CUSTOM(UpdateVBORange) \
+	CUSTOM(DeleteVBO) \
+	DEVICE(DrawVBO) \
+	DEVICE(DrawVBORange) \
+	DEVICE(SetGPUProgramParamAsInt) \
+	DEVICE(SetGPUProgramParamAsFloat) \
+	DEVICE(SetGPUProgramParamAsMat4) \
+	CUSTOM(SetGPUProgramParamAsAffineMat4) \
+	CUSTOM(SetGPUProgramParamAsIntArray) \
+	CUSTOM(SetGPUProgramParamAsFloatArray) \
+	CUSTOM(SetGPUProgramParamAsMat4Array) \
+	CUSTOM(InitThreadGPUProgramParam) \
+	CUSTOM(CreateMaterial) \
+	CUSTOM(DeleteMaterial) \
+	DEVICE(UseMaterial) \
+	CUSTOM(CreatePipelineState) \
+	DEVICE(UsePipelineState) \
+	CUSTOM(Shutdown)
+
+#define GFX_COMMAND_IGNORE(name)
+
 	class ThreadBufferESDevice : public ThreadESDeviceBase
 	{
 	private:
 		RingBuffer * _commandBuffer;
-		const static unsigned int BUFFER_SIZE = 1024 * 1024;
+		// Small commands collect here and reach the ring as one block, on
+		// Present, before a command that streams data, or once it fills up
+		CommandWriter _commands;
+		const static unsigned int kCommandBatchSize = 1024;
+		void EndCommand();
+		void FlushCommands();
+		void RunCommand(CommandReader& reader);
+
+		// Decoders indexed by opcode, opcode 0 is never written. They are
+		// compiled per backend type, so with a final backend the render
+		// thread calls it directly instead of through ESDevice's virtuals.
+		typedef void (ThreadBufferESDevice::*CommandHandler)(CommandReader& reader);
+		const CommandHandler* _commandHandlers;
+		// Instantiated in the cpp for ESDevice, ESDeviceImp and NullESDevice
+		template<class Backend>
+		static const CommandHandler* GetCommandHandlers();
+		template<class Backend>
+		Backend* GetBackend() { return static_cast<Backend*>(_realDevice); }
+#define GFX_DECLARE_CUSTOM_COMMAND(name) template<class Backend> void Run##name(CommandReader& reader);
+		GFX_COMMANDS(GFX_COMMAND_IGNORE, GFX_DECLARE_CUSTOM_COMMAND)
+#undef GFX_DECLARE_CUSTOM_COMMAND
+		// DEVICE commands: Forward runs method now, or records it with args
+		// when the render thread owns the device. RunDeviceCommand decodes
+		// the arguments of Method in order and passes them to Call.
+		template<class... Params, class... Args>
+		void Forward(unsigned char cmd, void (ESDevice::*method)(Params...), const Args&... args);
+		template<class Backend, class Call, class Method>
+		void RunDeviceCommand(CommandReader& reader);
+		template<class... Params>
+		struct ParamList {};
+		template<class... Params>
+		static ParamList<Params...> MethodParams(void (ESDevice::*)(Params...)) { return ParamList<Params...>(); }
+		template<class Backend, class Call, class Next, class... Rest, class... Decoded>
+		void CallDevice(CommandReader& reader, ParamList<Next, Rest...>, const Decoded&... decoded);
+		template<class Backend, class Call, class... Decoded>
+		void CallDevice(CommandReader& reader, ParamList<>, const Decoded&... decoded);
+		template<class T>
+		const T& ResolveArg(const T& value) { return value; }
+		template<class T>
+		T* ResolveArg(T* resource);
+		template<class T>
+		T ReadArg(CommandReader& reader, T*);
+		template<class T>
+		T* ReadArg(CommandReader& reader, T**);
+		// Render thread staging for kGfxCmd_UpdateVBORange
+		std::vector<char> _vboRangeVertices;
+		std::vector<unsigned short> _vboRangeIndices;
+
+		// Commands name resources by handle. Handles are allocated on the
+		// recording thread, the real objects live in tables owned by whichever
+		// thread runs the real device.
+		HandleAllocator _programHandles;
+		HandleAllocator _textureHandles;
+		HandleAllocator _vboHandles;
+		HandleAllocator _paramHandles;
+		HandleAllocator _materialHandles;
+		HandleAllocator _stateHandles;
+		HandleTable<GPUProgram*> _programs;
+		HandleTable<Texture2D*> _textures;
+		HandleTable<VBO*> _vbos;
+		HandleTable<GPUProgramParam*> _params;
+		HandleTable<Material*> _materials;
+		HandleTable<PipelineState*> _states;
+		HandleTable<GPUProgram*>& TableFor(GPUProgram*) { return _programs; }
+		HandleTable<Texture2D*>& TableFor(Texture2D*) { return _textures; }
+		HandleTable<VBO*>& TableFor(VBO*) { return _vbos; }
+		HandleTable<GPUProgramParam*>& TableFor(GPUProgramParam*) { return _params; }
+		HandleTable<Material*>& TableFor(Material*) { return _materials; }
+		HandleTable<PipelineState*>& TableFor(PipelineState*) { return _states; }
+
+		template<class T>
+		T Resolve(const HandleTable<T>& table, unsigned int handle)
+		{
+			T value = table.Get(handle);
+			if (value == nullptr)
+			{
+				esLogMessage("[render] stale or unknown handle 0x%08x", handle);
+			}
+			return value;
+		}
+		// desc names proxies, the result the real objects behind their handles
+		MaterialDesc ResolveMaterialDesc(const MaterialDesc& desc);
+		void WriteMaterialDesc(const MaterialDesc& desc);
+		MaterialDesc ReadMaterialDesc(CommandReader& reader);
+
+		CommandCapture* _capture;
+		unsigned int _replayFramesInFlight;
+		// Commands go to a render server in another process
+		bool _remote;
+		unsigned int _presentCount;
+		unsigned int _commandBufferSize;
+		void CreateCommandBuffer()
+		{
+			RingBuffer* ring = new RingBuffer();
+			if (!ring->CreateMirrored(_commandBufferSize))
+			{
+				ring->Create(_commandBufferSize);
+			}
+			SetCommandBuffer(ring);
+		}
+		// Deletes the ring held so far and takes ring, which may be null. The
+		// real device's tracker is charged for the ring held, so call it while
+		// the real device is alive.
+		void SetCommandBuffer(RingBuffer* ring)
+		{
+			if (_commandBuffer != nullptr)
+			{
+				GetMemoryTracker()->Free(kMemoryCommandBuffer, _commandBuffer->GetBufferSize());
+				delete _commandBuffer;
+			}
+			_commandBuffer = ring;
+			if (_commandBuffer != nullptr)
+			{
+				GetMemoryTracker()->Allocate(kMemoryCommandBuffer, _commandBuffer->GetBufferSize());
+			}
+		}
 	public:
-		ThreadBufferESDevice(ESContext* context, bool returnResImmediately)
-			:ThreadESDeviceBase(context, returnResImmediately) {
-			_commandBuffer = new RingBuffer(BUFFER_SIZE);
+		const static unsigned int BUFFER_SIZE = 1024 * 1024;
+
+		// commandBufferSize is the ring the app thread records into, and the
+		// most it can run ahead of the render thread
+		ThreadBufferESDevice(ESContext* context, bool returnResImmediately, unsigned int commandBufferSize = BUFFER_SIZE)
+			:ThreadESDeviceBase(context, returnResImmediately), _commandBuffer(nullptr), _commandHandlers(GetCommandHandlers<ESDeviceImp>()),
+			_capture(nullptr), _replayFramesInFlight(0), _remote(false), _presentCount(0), _commandBufferSize(commandBufferSize) {
+			CreateCommandBuffer();
 		}
+		// Runs the commands on realDevice, a null backend when replaying. The
+		// render thread calls it as a Backend, the static type passed in;
+		// other backends than the ones the cpp instantiates go as ESDevice*.
+		template<class Backend>
+		ThreadBufferESDevice(Backend* realDevice, bool returnResImmediately, unsigned int commandBufferSize = BUFFER_SIZE)
+			:ThreadESDeviceBase(realDevice, returnResImmediately), _commandBuffer(nullptr), _commandHandlers(GetCommandHandlers<Backend>()),
+			_capture(nullptr), _replayFramesInFlight(0), _remote(false), _presentCount(0), _commandBufferSize(commandBufferSize) {
+			CreateCommandBuffer();
+		}
+		// Without Cleanup the real device is still alive here, RenderServer
+		// deletes its decoders before the device they share
 		~ThreadBufferESDevice() {
-			delete _commandBuffer;
+			SetCommandBuffer(nullptr);
+			delete _capture;
 		}
+		// Records everything the render thread runs to path. Call before Run,
+		// commands issued while the app thread owns the context are not recorded.
+		bool StartCapture(const std::string& path);
+		// Feeds the next captured frame to the render thread, pacing like Present.
+		// False once the capture is exhausted and its last frame has run.
+		bool ReplayFrame(CommandReplay& replay, double& frameTime);
+
+		// Client side of a render server: records into the shared ring name,
+		// which the server created. There is no render thread, don't call Run.
+		// Present doesn't wait for the server, a full ring holds the app back.
+		bool ConnectSharedBuffer(const std::string& name);
+		// Server side: creates the shared ring name and executes from it on the
+		// real device, from whichever thread owns that device.
+		bool ServeSharedBuffer(const std::string& name);
+		// Runs the commands already submitted up to the next Present. Returns
+		// whether a Present ran, false when the ring ran dry first.
+		bool RunPendingFrame();
+		// Bytes the recording thread has put in the ring so far
+		unsigned long long GetCommandBytesWritten() const { return _commandBuffer->GetBytesWritten(); }
 	public:
+		virtual void Cleanup();
 		virtual void Clear();
 		virtual void UseGPUProgram(GPUProgram* program);
 		virtual GPUProgram* CreateGPUProgram(const std::string& vertexShader, const std::string& fragmentShader);
@@ -34,8 +229,11 @@ namespace RenderEngine {
 		virtual void ReleaseThreadOwnership();
 		virtual VBO* CreateVBO();
 		virtual void UpdateVBO(VBO* vbo, const VBOData::Ptr& vboData);
+		virtual void UpdateVBORange(VBO* vbo, unsigned int vertexStart, unsigned int vertexCount, const void* vertices,
+			unsigned int indexStart, unsigned int indexCount, const unsigned short* indices);
 		virtual void DeleteVBO(VBO* vbo);
 		virtual void DrawVBO(VBO* vbo);
+		virtual void DrawVBORange(VBO* vbo, unsigned int indexStart, unsigned int indexCount);
 
 		virtual void SetGPUProgramParamAsInt(GPUProgramParam* param, int value);
 
@@ -49,9 +247,18 @@ namespace RenderEngine {
 
 		virtual void SetGPUProgramParamAsMat4Array(GPUProgramParam* param, const std::vector<glm::mat4>& values);
 
+		virtual Material* CreateMaterial(const MaterialDesc& desc);
+		virtual void DeleteMaterial(Material* material);
+		virtual void UseMaterial(Material* material);
+
+		virtual PipelineState* CreatePipelineState(const PipelineStateDesc& desc);
+		virtual void UsePipelineState(PipelineState* state);
+
 	public:		
 		virtual void InitThreadGPUProgramParam(ThreadedGPUProgram* program, ThreadedGPUProgramParam* param, const std::string& name);
 		virtual void RunOneThreadCommand();
+	protected:
+		virtual void QueueShutdown();
 	};
 }
 #endif
@@ -97,6 +97,9 @@ namespace RenderEngine {
 	public:
 		ThreadESDevice(ESContext* context,bool returnResImmediately, CommandQueue* commandQueue = new LockFreeCommandQueue());
 		~ThreadESDevice();
+	protected:
+		virtual void QueueShutdown();
+	public:
 		virtual void Clear();
 		virtual void UseGPUProgram(GPUProgram* program);
 		virtual GPUProgram* CreateGPUProgram(const std::string& vertexShader, const std::string& fragmentShader);
@@ -113,8 +116,11 @@ namespace RenderEngine {
 		virtual void ReleaseThreadOwnership();
 		virtual VBO* CreateVBO();
 		virtual void UpdateVBO(VBO* vbo, const VBOData::Ptr& vboData);
+		virtual void UpdateVBORange(VBO* vbo, unsigned int vertexStart, unsigned int vertexCount, const void* vertices,
+			unsigned int indexStart, unsigned int indexCount, const unsigned short* indices);
 		virtual void DeleteVBO(VBO* vbo);
 		virtual void DrawVBO(VBO* vbo);
+		virtual void DrawVBORange(VBO* vbo, unsigned int indexStart, unsigned int indexCount);
 
 		virtual void SetGPUProgramParamAsInt(GPUProgramParam* param, int value);
 
@@ -128,6 +134,13 @@ namespace RenderEngine {
 
 		virtual void SetGPUProgramParamAsMat4Array(GPUProgramParam* param,const std::vector<glm::mat4>& values);
 
+		virtual Material* CreateMaterial(const MaterialDesc& desc);
+		virtual void DeleteMaterial(Material* material);
+		virtual void UseMaterial(Material* material);
+
+		virtual PipelineState* CreatePipelineState(const PipelineStateDesc& desc);
+		virtual void UsePipelineState(PipelineState* state);
+
 	public: //thread base
 		virtual void RunOneThreadCommand();
 		virtual void InitThreadGPUProgramParam(ThreadedGPUProgram* program, ThreadedGPUProgramParam* param, const std::string& name);
@@ -176,10 +189,11 @@ namespace RenderEngine {
 			delete _updateQueue;
 			delete _renderQueue;
 		}
-		void Cleanup();
 		virtual void BeginRender();
 		virtual void Present();
 		virtual void RunOneThreadCommand();
+	protected:
+		virtual void QueueShutdown();
 	};
 }
 #endif /* ThreadESDevice_hpp */
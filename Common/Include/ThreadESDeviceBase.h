@@ -4,9 +4,11 @@
 #include <thread>
 #include "esUtil.h"
 #include "PlatformSemaphore.h"
+#include "HandleTable.h"
 namespace RenderEngine {
 
 	class ThreadESDeviceBase;
+	class ThreadedGPUProgramParam;
 
 	class ThreadedGPUProgram : public GPUProgram
 	{
@@ -16,6 +18,10 @@ namespace RenderEngine {
 	public:
 		ThreadESDeviceBase * _threadDevice;
 		GPUProgram * realProgram;
+		// Names the resource in a command stream, devices that need one set it
+		unsigned int handle;
+		// The params handed out for it, for devices that free them with it
+		std::vector<ThreadedGPUProgramParam*> params;
 		GPUProgram* GetRealGUPProgram()
 		{
 			return realProgram;
@@ -23,7 +29,7 @@ namespace RenderEngine {
 		GPUProgramParam* GetParam(const std::string& name);
 	protected:
 		~ThreadedGPUProgram() {}
-		ThreadedGPUProgram(ThreadESDeviceBase* threadDevice) :_threadDevice(threadDevice), realProgram(NULL) {}
+		ThreadedGPUProgram(ThreadESDeviceBase* threadDevice) :_threadDevice(threadDevice), realProgram(NULL), handle(kInvalidHandle) {}
 	};
 
 	class ThreadedTexture2D : public Texture2D
@@ -33,13 +39,14 @@ namespace RenderEngine {
 		friend class ThreadBufferESDevice;
 	public:
 		Texture2D * realTexture;	
+		unsigned int handle;
 		Texture2D* GetRealTexture2D()
 		{
 			return realTexture;
 		}
 	protected:
 		~ThreadedTexture2D() {}
-		ThreadedTexture2D() :realTexture(NULL) {}
+		ThreadedTexture2D() :realTexture(NULL), handle(kInvalidHandle) {}
 	};
 
 	class ThreadedVBO : public VBO
@@ -49,9 +56,12 @@ namespace RenderEngine {
 		friend class ThreadBufferESDevice;
 	public:
 		VBO * realVbo;
+		// Vertex stride of the last UpdateVBO, set on the calling thread
+		unsigned int stride;
+		unsigned int handle;
 	protected:
 		~ThreadedVBO() {}
-		ThreadedVBO() {}
+		ThreadedVBO() :stride(0), handle(kInvalidHandle) {}
 	public:
 		virtual VBO* GetRealVBO()
 		{
@@ -59,15 +69,51 @@ namespace RenderEngine {
 		}
 	};
 
+	class ThreadedMaterial : public Material
+	{
+		friend class ThreadESDevice;
+		friend class DeleteMaterialCMD;
+		friend class ThreadBufferESDevice;
+	public:
+		Material * realMaterial;
+		unsigned int handle;
+		virtual Material* GetRealMaterial()
+		{
+			return realMaterial;
+		}
+		// Only valid on the render thread, once the resources it names exist
+		MaterialDesc GetRealDesc() const;
+	protected:
+		~ThreadedMaterial() {}
+		ThreadedMaterial(const MaterialDesc& desc) :Material(desc), realMaterial(NULL), handle(kInvalidHandle) {}
+	};
+
+	class ThreadedPipelineState : public PipelineState
+	{
+		friend class ThreadESDeviceBase;
+	public:
+		PipelineState * realState;
+		unsigned int handle;
+		virtual PipelineState* GetRealPipelineState()
+		{
+			return realState;
+		}
+	protected:
+		~ThreadedPipelineState() {}
+		ThreadedPipelineState(const PipelineStateDesc& desc) :PipelineState(desc), realState(NULL), handle(kInvalidHandle) {}
+	};
+
 	class ThreadedGPUProgramParam : public GPUProgramParam
 	{
 		friend class ThreadESDeviceBase;
+		friend class ThreadBufferESDevice;
 	protected:
-		ThreadedGPUProgramParam() {}
+		ThreadedGPUProgramParam() :realParam(NULL), handle(kInvalidHandle) {}
 		~ThreadedGPUProgramParam() {}
 
 	public:
 		GPUProgramParam * realParam;
+		unsigned int handle;
 
 		virtual GPUProgramParam* GetRealParam()
 		{
@@ -93,6 +139,10 @@ namespace RenderEngine {
 		std::thread _thread;
 		bool _quit;
 		Semaphore _waitSem[WaitType_Max];
+		std::unordered_map<unsigned int, ThreadedPipelineState*> _pipelineStates;
+		// Uploads queued since the last Present, and those queued before it
+		std::vector<std::weak_ptr<ResidentData>> _queuedUploads;
+		std::vector<std::weak_ptr<ResidentData>> _presentedUploads;
 	protected:
 		bool  _threaded;
 		bool _isInPresenting;
@@ -108,7 +158,19 @@ namespace RenderEngine {
 			, _isInPresenting(false)
 		{
 			esLogMessage("[render] ThreadESDevice");
-			_realDevice = new ESDeviceImp(context);
+			ESDeviceImp* realDevice = new ESDeviceImp(context);
+			realDevice->SetReleaseUploadedData(false);
+			_realDevice = realDevice;
+		}
+		// Takes ownership of realDevice, which must not release uploaded data itself
+		ThreadESDeviceBase(ESDevice* realDevice, bool returnResImmediately)
+			:_returnResImmediately(returnResImmediately)
+			, _threaded(false)
+			, _quit(false)
+			, _isInPresenting(false)
+			, _realDevice(realDevice)
+		{
+			esLogMessage("[render] ThreadESDevice");
 		}
 		virtual bool CreateWindow1(const std::string& title, int width, int height, int flags)
 		{
@@ -116,15 +178,55 @@ namespace RenderEngine {
 		}
 		virtual void Cleanup()
 		{
-			_quit = true;
-			_thread.join();
-			delete _realDevice;
+			StopRenderThread();
+			ReleaseRealDevice();
 		}
 		virtual int GetScreenWidth() { return _realDevice->GetScreenWidth(); }
 		virtual int GetScreenHeigt() { return _realDevice->GetScreenHeigt(); }
 
 		virtual GPUProgramParam* GetGPUProgramParam(GPUProgram* program, const std::string& name);
 
+		virtual unsigned int GetPipelineStateCount() { return (unsigned int)_pipelineStates.size(); }
+		virtual MemoryTracker* GetMemoryTracker() { return _realDevice->GetMemoryTracker(); }
+	protected:
+		// Stops the render thread. The real device's Cleanup runs on whichever
+		// thread owns the context: the render thread, through QueueShutdown,
+		// right before it exits, otherwise the caller.
+		void StopRenderThread()
+		{
+			if (_thread.joinable() && _threaded)
+			{
+				QueueShutdown();
+				_thread.join();
+				return;
+			}
+			// Remote clients and render servers never start a render thread
+			_quit = true;
+			if (_thread.joinable())
+			{
+				_thread.join();
+			}
+			_realDevice->Cleanup();
+		}
+		void ReleaseRealDevice()
+		{
+			delete _realDevice;
+			for (auto& state : _pipelineStates)
+			{
+				delete state.second;
+			}
+			_pipelineStates.clear();
+		}
+		// Queues a command that cleans up the real device and then calls SignalQuit
+		virtual void QueueShutdown() = 0;
+		// Returns the shared proxy for desc; created is set when the real state still has to be made
+		ThreadedPipelineState* FindOrAddPipelineState(const PipelineStateDesc& desc, bool& created);
+		// The data of a queued upload, released under its policy two Presents later
+		void TrackUpload(const std::shared_ptr<ResidentData>& data);
+		// Call from Present once the previous one has run on the render thread
+		void ReleaseConfirmedUploads();
+	public:
+
 		virtual void InitThreadGPUProgramParam(ThreadedGPUProgram* program, ThreadedGPUProgramParam* param, const std::string& name) = 0;
 	public:
 		bool IsCreateResInBlockMode()const
@@ -154,6 +256,11 @@ namespace RenderEngine {
 		{
 			Signal(WaitType_OnwerShip);
 		}
+		// Render thread side of QueueShutdown, the loop ends after this command
+		void SignalQuit()
+		{
+			_quit = true;
+		}
 	private:
 		static void* _Run(void* data)
 		{
@@ -168,8 +275,7 @@ namespace RenderEngine {
 			esLogMessage("[render] __RunCommand()");
 			_threaded = true;
 			_realDevice->AcqiureThreadOwnerShip();
-			glEnable(GL_DEPTH_TEST);
-			glDepthFunc(GL_LESS);
+			_realDevice->UsePipelineState(_realDevice->CreatePipelineState(PipelineStateDesc()));
 			Signal();
 			while (!_quit) {
 				//usleep(10);
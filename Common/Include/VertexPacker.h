@@ -0,0 +1,28 @@
+#ifndef VertexPacker_h
+#define VertexPacker_h
+#include "Mesh.hpp"
+
+namespace RenderEngine {
+
+	// Converts float VBOData into the packed vertex formats at load time.
+	// Packed positions are stored relative to the mesh AABB; draw them with
+	// the model matrix multiplied by VBOData::GetDecodeMatrix().
+	class VertexPacker
+	{
+	public:
+		static VBOData::Ptr Pack(const VBOData::Ptr& source, const VertexFormat& format, bool useSIMD = true);
+		// Decodes any format back to float vertices in mesh space
+		static void Unpack(const VBOData::Ptr& packed, VBOData::Vertex* out);
+		// Re-encodes only the positions of [start, start + count) with the decode
+		// range packed already has, positions outside it clamp. Marks them dirty.
+		static void PackPositions(const VBOData::Vertex* source, VBOData& packed, unsigned int start, unsigned int count);
+
+	public:
+		// Round to nearest, denormals flush to zero, NaN becomes qNaN
+		static void FloatToHalf(const float* src, unsigned short* dst, unsigned int count, bool useSIMD);
+		static float HalfToFloat(unsigned short h);
+		static glm::vec2 EncodeOctahedral(const glm::vec3& n);
+		static glm::vec3 DecodeOctahedral(const glm::vec2& e);
+	};
+}
+#endif
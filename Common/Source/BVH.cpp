@@ -0,0 +1,579 @@
+#include "BVH.h"
+#include "FrustumCuller.h"
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+#include <thread>
+
+namespace RenderEngine {
+
+	namespace {
+		const unsigned int kInvalid = ~0u;
+		// Leaves are forced to split above this size even when SAH disagrees
+		const unsigned int kMaxForcedLeafSize = 16;
+
+		inline float HalfArea(const glm::vec3& min, const glm::vec3& max)
+		{
+			glm::vec3 d = glm::max(max - min, glm::vec3(0.0f));
+			return d.x * d.y + d.y * d.z + d.z * d.x;
+		}
+
+		enum Containment
+		{
+			kOutside,
+			kIntersect,
+			kInside,
+		};
+
+		Containment ClassifyBox(const glm::vec4 planes[6], const glm::vec3& min, const glm::vec3& max)
+		{
+			glm::vec3 center = (min + max) * 0.5f;
+			glm::vec3 extents = (max - min) * 0.5f;
+			Containment result = kInside;
+			for (int p = 0; p < 6; ++p)
+			{
+				glm::vec3 n(planes[p]);
+				float d = glm::dot(n, center) + planes[p].w;
+				float r = glm::dot(glm::abs(n), extents);
+				if (d + r < 0.0f)
+					return kOutside;
+				if (d - r < 0.0f)
+					result = kIntersect;
+			}
+			return result;
+		}
+
+		inline bool BoxSphere(const glm::vec3& min, const glm::vec3& max, const glm::vec3& center, float radiusSq)
+		{
+			glm::vec3 d = center - glm::clamp(center, min, max);
+			return glm::dot(d, d) <= radiusSq;
+		}
+
+		// Slab test, returns the entry distance or FLT_MAX on a miss
+		inline float RayBox(const glm::vec3& origin, const glm::vec3& invDir, float maxDistance, const glm::vec3& min, const glm::vec3& max)
+		{
+			glm::vec3 t0 = (min - origin) * invDir;
+			glm::vec3 t1 = (max - origin) * invDir;
+			glm::vec3 tmin = glm::min(t0, t1);
+			glm::vec3 tmax = glm::max(t0, t1);
+			float enter = std::max(std::max(tmin.x, tmin.y), std::max(tmin.z, 0.0f));
+			float exit = std::min(std::min(tmax.x, tmax.y), std::min(tmax.z, maxDistance));
+			return enter <= exit ? enter : FLT_MAX;
+		}
+	}
+
+	BVH::BVH(const Options& options)
+		:_options(options), _needsBuild(false), _nodeCount(0), _parallelDepth(0)
+	{
+		_stats.objectCount = 0;
+		_stats.nodeCount = 0;
+		_stats.depth = 0;
+		_stats.builtCost = 0;
+		_stats.cost = 0;
+		_stats.buildCount = 0;
+		_stats.refitCount = 0;
+		_options.binCount = std::max(2u, _options.binCount);
+		_options.maxLeafSize = std::max(1u, _options.maxLeafSize);
+	}
+
+	unsigned int BVH::Insert(const glm::vec3& center, const glm::vec3& extents)
+	{
+		unsigned int id;
+		if (!_freeIds.empty())
+		{
+			id = _freeIds.back();
+			_freeIds.pop_back();
+		}
+		else
+		{
+			id = (unsigned int)_objectMin.size();
+			_objectMin.push_back(glm::vec3(0.0f));
+			_objectMax.push_back(glm::vec3(0.0f));
+			_objectAlive.push_back(0);
+			_objectDirty.push_back(0);
+			_objectLeaf.push_back(kInvalid);
+		}
+		_objectMin[id] = center - extents;
+		_objectMax[id] = center + extents;
+		_objectAlive[id] = 1;
+		_needsBuild = true;
+		++_stats.objectCount;
+		return id;
+	}
+
+	void BVH::Remove(unsigned int id)
+	{
+		if (id >= _objectAlive.size() || !_objectAlive[id])
+		{
+			return;
+		}
+		_objectAlive[id] = 0;
+		_freeIds.push_back(id);
+		_needsBuild = true;
+		--_stats.objectCount;
+	}
+
+	void BVH::Update(unsigned int id, const glm::vec3& center, const glm::vec3& extents)
+	{
+		_objectMin[id] = center - extents;
+		_objectMax[id] = center + extents;
+		if (!_needsBuild && !_objectDirty[id])
+		{
+			_objectDirty[id] = 1;
+			_dirtyIds.push_back(id);
+		}
+	}
+
+	void BVH::Commit()
+	{
+		if (_needsBuild)
+		{
+			Build();
+		}
+		else
+		{
+			Refit();
+		}
+	}
+
+	unsigned int BVH::ParallelDepth() const
+	{
+		unsigned int threads = _options.threadCount;
+		if (threads == 0)
+		{
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		}
+		unsigned int depth = 0;
+		while ((1u << depth) < threads)
+		{
+			++depth;
+		}
+		return depth;
+	}
+
+	void BVH::Build()
+	{
+		_primitives.clear();
+		_centroids.resize(_objectMin.size());
+		for (unsigned int id = 0; id < _objectMin.size(); ++id)
+		{
+			_objectDirty[id] = 0;
+			_objectLeaf[id] = kInvalid;
+			if (_objectAlive[id])
+			{
+				_primitives.push_back(id);
+				_centroids[id] = (_objectMin[id] + _objectMax[id]) * 0.5f;
+			}
+		}
+		_dirtyIds.clear();
+		_needsBuild = false;
+
+		unsigned int count = (unsigned int)_primitives.size();
+		_nodes.resize(std::max(1u, count * 2));
+		_parents.assign(_nodes.size(), kInvalid);
+		_nodeDirty.assign(_nodes.size(), 0);
+		_nodeCount = 1;
+		_parallelDepth = ParallelDepth();
+		if (count == 0)
+		{
+			Node& root = _nodes[0];
+			root.min = root.max = glm::vec3(0.0f);
+			root.leftOrFirst = 0;
+			root.count = 0;
+		}
+		else
+		{
+			BuildNode(0, 0, count, 0);
+		}
+		_nodes.resize(_nodeCount);
+		_parents.resize(_nodeCount);
+		_nodeDirty.resize(_nodeCount);
+
+		unsigned int maxDepth = 0;
+		_stats.builtCost = ComputeCost(0, 0, maxDepth);
+		_stats.cost = _stats.builtCost;
+		_stats.depth = maxDepth;
+		_stats.nodeCount = _nodeCount;
+		++_stats.buildCount;
+	}
+
+	void BVH::MakeLeaf(Node& node, unsigned int nodeIndex, unsigned int begin, unsigned int end)
+	{
+		node.leftOrFirst = begin;
+		node.count = end - begin;
+		for (unsigned int i = begin; i < end; ++i)
+		{
+			_objectLeaf[_primitives[i]] = nodeIndex;
+		}
+	}
+
+	void BVH::BuildNode(unsigned int nodeIndex, unsigned int begin, unsigned int end, unsigned int depth)
+	{
+		// _nodes is sized for the worst case up front so references stay valid across threads
+		Node& node = _nodes[nodeIndex];
+		glm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+		glm::vec3 centroidMin(FLT_MAX), centroidMax(-FLT_MAX);
+		for (unsigned int i = begin; i < end; ++i)
+		{
+			unsigned int id = _primitives[i];
+			boundsMin = glm::min(boundsMin, _objectMin[id]);
+			boundsMax = glm::max(boundsMax, _objectMax[id]);
+			centroidMin = glm::min(centroidMin, _centroids[id]);
+			centroidMax = glm::max(centroidMax, _centroids[id]);
+		}
+		node.min = boundsMin;
+		node.max = boundsMax;
+
+		const unsigned int count = end - begin;
+		if (count <= _options.maxLeafSize)
+		{
+			MakeLeaf(node, nodeIndex, begin, end);
+			return;
+		}
+
+		// Binned SAH over all three axes
+		struct Bin
+		{
+			glm::vec3 min;
+			glm::vec3 max;
+			unsigned int count;
+		};
+		const unsigned int binCount = _options.binCount;
+		std::vector<Bin> bins(binCount);
+		std::vector<float> leftCost(binCount);
+		float bestCost = FLT_MAX;
+		int bestAxis = -1;
+		unsigned int bestSplit = 0;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			float extent = centroidMax[axis] - centroidMin[axis];
+			if (extent <= 0.0f)
+			{
+				continue;
+			}
+			float scale = binCount / extent;
+			for (auto& bin : bins)
+			{
+				bin.min = glm::vec3(FLT_MAX);
+				bin.max = glm::vec3(-FLT_MAX);
+				bin.count = 0;
+			}
+			for (unsigned int i = begin; i < end; ++i)
+			{
+				unsigned int id = _primitives[i];
+				unsigned int b = std::min(binCount - 1, (unsigned int)((_centroids[id][axis] - centroidMin[axis]) * scale));
+				bins[b].min = glm::min(bins[b].min, _objectMin[id]);
+				bins[b].max = glm::max(bins[b].max, _objectMax[id]);
+				++bins[b].count;
+			}
+			glm::vec3 sweepMin(FLT_MAX), sweepMax(-FLT_MAX);
+			unsigned int sweepCount = 0;
+			for (unsigned int b = 0; b + 1 < binCount; ++b)
+			{
+				sweepMin = glm::min(sweepMin, bins[b].min);
+				sweepMax = glm::max(sweepMax, bins[b].max);
+				sweepCount += bins[b].count;
+				leftCost[b] = sweepCount ? HalfArea(sweepMin, sweepMax) * sweepCount : 0.0f;
+			}
+			sweepMin = glm::vec3(FLT_MAX);
+			sweepMax = glm::vec3(-FLT_MAX);
+			sweepCount = 0;
+			for (unsigned int b = binCount - 1; b > 0; --b)
+			{
+				sweepMin = glm::min(sweepMin, bins[b].min);
+				sweepMax = glm::max(sweepMax, bins[b].max);
+				sweepCount += bins[b].count;
+				if (sweepCount == count || sweepCount == 0)
+				{
+					continue;
+				}
+				float cost = leftCost[b - 1] + HalfArea(sweepMin, sweepMax) * sweepCount;
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = b;
+				}
+			}
+		}
+
+		unsigned int mid;
+		if (bestAxis < 0)
+		{
+			// All centroids coincide, split the range in half
+			mid = begin + count / 2;
+		}
+		else
+		{
+			float leafCost = HalfArea(boundsMin, boundsMax) * count;
+			if (bestCost >= leafCost && count <= kMaxForcedLeafSize)
+			{
+				MakeLeaf(node, nodeIndex, begin, end);
+				return;
+			}
+			float scale = binCount / (centroidMax[bestAxis] - centroidMin[bestAxis]);
+			float axisMin = centroidMin[bestAxis];
+			const std::vector<glm::vec3>& centroids = _centroids;
+			unsigned int* split = std::partition(&_primitives[0] + begin, &_primitives[0] + end, [&](unsigned int id) {
+				return std::min(binCount - 1, (unsigned int)((centroids[id][bestAxis] - axisMin) * scale)) < bestSplit;
+			});
+			mid = (unsigned int)(split - &_primitives[0]);
+			if (mid == begin || mid == end)
+			{
+				mid = begin + count / 2;
+			}
+		}
+
+		unsigned int left = _nodeCount.fetch_add(2);
+		node.leftOrFirst = left;
+		node.count = 0;
+		_parents[left] = nodeIndex;
+		_parents[left + 1] = nodeIndex;
+		if (depth < _parallelDepth && count >= _options.minParallelCount)
+		{
+			std::thread leftThread(&BVH::BuildNode, this, left, begin, mid, depth + 1);
+			BuildNode(left + 1, mid, end, depth + 1);
+			leftThread.join();
+		}
+		else
+		{
+			BuildNode(left, begin, mid, depth + 1);
+			BuildNode(left + 1, mid, end, depth + 1);
+		}
+	}
+
+	void BVH::Refit()
+	{
+		if (_dirtyIds.empty())
+		{
+			return;
+		}
+		// Flag every node on the path from a moved object to the root
+		for (auto id : _dirtyIds)
+		{
+			_objectDirty[id] = 0;
+			for (unsigned int node = _objectLeaf[id]; node != kInvalid && !_nodeDirty[node]; node = _parents[node])
+			{
+				_nodeDirty[node] = 1;
+			}
+		}
+		_parallelDepth = _dirtyIds.size() >= _options.minParallelCount ? ParallelDepth() : 0;
+		_dirtyIds.clear();
+		RefitNode(0, 0);
+		++_stats.refitCount;
+
+		unsigned int maxDepth = 0;
+		_stats.cost = ComputeCost(0, 0, maxDepth);
+		if (_stats.cost > _stats.builtCost * _options.rebuildThreshold)
+		{
+			Build();
+		}
+	}
+
+	void BVH::RefitNode(unsigned int nodeIndex, unsigned int depth)
+	{
+		if (!_nodeDirty[nodeIndex])
+		{
+			return;
+		}
+		_nodeDirty[nodeIndex] = 0;
+		Node& node = _nodes[nodeIndex];
+		if (node.count > 0)
+		{
+			glm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+			for (unsigned int i = node.leftOrFirst; i < node.leftOrFirst + node.count; ++i)
+			{
+				boundsMin = glm::min(boundsMin, _objectMin[_primitives[i]]);
+				boundsMax = glm::max(boundsMax, _objectMax[_primitives[i]]);
+			}
+			node.min = boundsMin;
+			node.max = boundsMax;
+			return;
+		}
+		unsigned int left = node.leftOrFirst;
+		if (depth < _parallelDepth && _nodeDirty[left] && _nodeDirty[left + 1])
+		{
+			std::thread leftThread(&BVH::RefitNode, this, left, depth + 1);
+			RefitNode(left + 1, depth + 1);
+			leftThread.join();
+		}
+		else
+		{
+			RefitNode(left, depth + 1);
+			RefitNode(left + 1, depth + 1);
+		}
+		node.min = glm::min(_nodes[left].min, _nodes[left + 1].min);
+		node.max = glm::max(_nodes[left].max, _nodes[left + 1].max);
+	}
+
+	float BVH::ComputeCost(unsigned int nodeIndex, unsigned int depth, unsigned int& maxDepth) const
+	{
+		const Node& node = _nodes[nodeIndex];
+		maxDepth = std::max(maxDepth, depth);
+		float rootArea = HalfArea(_nodes[0].min, _nodes[0].max);
+		if (rootArea <= 0.0f)
+		{
+			return 0.0f;
+		}
+		float area = HalfArea(node.min, node.max) / rootArea;
+		if (node.count > 0)
+		{
+			return area * node.count;
+		}
+		return area + ComputeCost(node.leftOrFirst, depth + 1, maxDepth) + ComputeCost(node.leftOrFirst + 1, depth + 1, maxDepth);
+	}
+
+	void BVH::CollectSubtree(unsigned int nodeIndex, std::vector<unsigned int>& result) const
+	{
+		const Node& node = _nodes[nodeIndex];
+		if (node.count > 0)
+		{
+			result.insert(result.end(), _primitives.begin() + node.leftOrFirst, _primitives.begin() + node.leftOrFirst + node.count);
+			return;
+		}
+		CollectSubtree(node.leftOrFirst, result);
+		CollectSubtree(node.leftOrFirst + 1, result);
+	}
+
+	void BVH::QueryFrustum(const glm::mat4& viewProj, std::vector<unsigned int>& result) const
+	{
+		result.clear();
+		if (_primitives.empty())
+		{
+			return;
+		}
+		glm::vec4 planes[6];
+		FrustumCuller::ExtractPlanes(viewProj, planes);
+		std::vector<unsigned int> stack;
+		stack.reserve(64);
+		stack.push_back(0);
+		while (!stack.empty())
+		{
+			unsigned int nodeIndex = stack.back();
+			stack.pop_back();
+			const Node& node = _nodes[nodeIndex];
+			Containment containment = ClassifyBox(planes, node.min, node.max);
+			if (containment == kOutside)
+			{
+				continue;
+			}
+			if (containment == kInside)
+			{
+				CollectSubtree(nodeIndex, result);
+				continue;
+			}
+			if (node.count > 0)
+			{
+				for (unsigned int i = node.leftOrFirst; i < node.leftOrFirst + node.count; ++i)
+				{
+					unsigned int id = _primitives[i];
+					if (ClassifyBox(planes, _objectMin[id], _objectMax[id]) != kOutside)
+					{
+						result.push_back(id);
+					}
+				}
+				continue;
+			}
+			stack.push_back(node.leftOrFirst);
+			stack.push_back(node.leftOrFirst + 1);
+		}
+	}
+
+	void BVH::QuerySphere(const glm::vec3& center, float radius, std::vector<unsigned int>& result) const
+	{
+		result.clear();
+		if (_primitives.empty())
+		{
+			return;
+		}
+		const float radiusSq = radius * radius;
+		std::vector<unsigned int> stack;
+		stack.reserve(64);
+		stack.push_back(0);
+		while (!stack.empty())
+		{
+			const Node& node = _nodes[stack.back()];
+			stack.pop_back();
+			if (!BoxSphere(node.min, node.max, center, radiusSq))
+			{
+				continue;
+			}
+			if (node.count > 0)
+			{
+				for (unsigned int i = node.leftOrFirst; i < node.leftOrFirst + node.count; ++i)
+				{
+					unsigned int id = _primitives[i];
+					if (BoxSphere(_objectMin[id], _objectMax[id], center, radiusSq))
+					{
+						result.push_back(id);
+					}
+				}
+				continue;
+			}
+			stack.push_back(node.leftOrFirst);
+			stack.push_back(node.leftOrFirst + 1);
+		}
+	}
+
+	bool BVH::Raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, unsigned int& hitId, float& hitDistance) const
+	{
+		if (_primitives.empty())
+		{
+			return false;
+		}
+		glm::vec3 dir = glm::normalize(direction);
+		// Division by zero gives +-inf which the slab test handles
+		glm::vec3 invDir(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+		float best = maxDistance;
+		bool hit = false;
+		std::vector<unsigned int> stack;
+		stack.reserve(64);
+		if (RayBox(origin, invDir, best, _nodes[0].min, _nodes[0].max) != FLT_MAX)
+		{
+			stack.push_back(0);
+		}
+		while (!stack.empty())
+		{
+			const Node& node = _nodes[stack.back()];
+			stack.pop_back();
+			if (RayBox(origin, invDir, best, node.min, node.max) == FLT_MAX)
+			{
+				continue;
+			}
+			if (node.count > 0)
+			{
+				for (unsigned int i = node.leftOrFirst; i < node.leftOrFirst + node.count; ++i)
+				{
+					unsigned int id = _primitives[i];
+					float t = RayBox(origin, invDir, best, _objectMin[id], _objectMax[id]);
+					if (t != FLT_MAX && (!hit || t < best))
+					{
+						best = t;
+						hitId = id;
+						hit = true;
+					}
+				}
+				continue;
+			}
+			// Push the far child first so the near one is visited next
+			unsigned int left = node.leftOrFirst;
+			float tLeft = RayBox(origin, invDir, best, _nodes[left].min, _nodes[left].max);
+			float tRight = RayBox(origin, invDir, best, _nodes[left + 1].min, _nodes[left + 1].max);
+			if (tLeft <= tRight)
+			{
+				if (tRight != FLT_MAX) stack.push_back(left + 1);
+				if (tLeft != FLT_MAX) stack.push_back(left);
+			}
+			else
+			{
+				if (tLeft != FLT_MAX) stack.push_back(left);
+				if (tRight != FLT_MAX) stack.push_back(left + 1);
+			}
+		}
+		if (hit)
+		{
+			hitDistance = best;
+		}
+		return hit;
+	}
+}
@@ -0,0 +1,192 @@
+#include "CommandCapture.h"
+#include "RingBuffer.h"
+#include "esUtil.h"
+#include <string.h>
+
+namespace RenderEngine {
+
+	namespace {
+		const char kCaptureMagic[4] = { 'M', 'T', 'R', 'C' };
+		const unsigned int kCaptureVersion = 7;
+		// Big enough that a frame of small commands is a handful of writes
+		const size_t kCaptureFileBuffer = 1024 * 1024;
+
+		template<class T>
+		bool ReadRecord(const std::vector<char>& data, size_t& pos, T& value)
+		{
+			if (pos + sizeof(T) > data.size())
+			{
+				return false;
+			}
+			memcpy(&value, &data[pos], sizeof(T));
+			pos += sizeof(T);
+			return true;
+		}
+	}
+
+	CommandCapture::CommandCapture()
+		:_file(nullptr), _frameCount(0)
+	{
+	}
+
+	CommandCapture::~CommandCapture()
+	{
+		Close();
+	}
+
+	bool CommandCapture::Open(const std::string& path)
+	{
+		Close();
+		_file = fopen(path.c_str(), "wb");
+		if (_file == nullptr)
+		{
+			esLogMessage("[render] can't open capture file %s", path.c_str());
+			return false;
+		}
+		setvbuf(_file, nullptr, _IOFBF, kCaptureFileBuffer);
+		fwrite(kCaptureMagic, sizeof(kCaptureMagic), 1, _file);
+		fwrite(&kCaptureVersion, sizeof(kCaptureVersion), 1, _file);
+		_start = Clock::now();
+		_frameCount = 0;
+		return true;
+	}
+
+	void CommandCapture::Close()
+	{
+		if (_file != nullptr)
+		{
+			fclose(_file);
+			_file = nullptr;
+		}
+	}
+
+	void CommandCapture::WriteData(const void* data, unsigned int size, unsigned int alignment)
+	{
+		unsigned int record[3] = { kCaptureData, size, alignment };
+		fwrite(record, sizeof(record), 1, _file);
+		fwrite(data, size, 1, _file);
+	}
+
+	void CommandCapture::WriteRelease()
+	{
+		unsigned int type = kCaptureRelease;
+		fwrite(&type, sizeof(type), 1, _file);
+	}
+
+	void CommandCapture::WriteFrame()
+	{
+		unsigned int type = kCaptureFrame;
+		double time = std::chrono::duration<double>(Clock::now() - _start).count();
+		fwrite(&type, sizeof(type), 1, _file);
+		fwrite(&time, sizeof(time), 1, _file);
+		fflush(_file);
+		++_frameCount;
+	}
+
+	CommandReplay::CommandReplay()
+		:_begin(0), _pos(0), _frameCount(0), _duration(0.0)
+	{
+	}
+
+	bool CommandReplay::Open(const std::string& path)
+	{
+		_data.clear();
+		FILE* file = fopen(path.c_str(), "rb");
+		if (file == nullptr)
+		{
+			esLogMessage("[render] can't open capture file %s", path.c_str());
+			return false;
+		}
+		fseek(file, 0, SEEK_END);
+		long length = ftell(file);
+		fseek(file, 0, SEEK_SET);
+		if (length > 0)
+		{
+			_data.resize((size_t)length);
+			if (fread(&_data[0], 1, _data.size(), file) != _data.size())
+			{
+				_data.clear();
+			}
+		}
+		fclose(file);
+		if (!Validate())
+		{
+			esLogMessage("[render] %s is not a valid capture", path.c_str());
+			_data.clear();
+			return false;
+		}
+		return true;
+	}
+
+	bool CommandReplay::Validate()
+	{
+		_begin = sizeof(kCaptureMagic) + sizeof(kCaptureVersion);
+		_pos = _begin;
+		_frameCount = 0;
+		_duration = 0.0;
+		unsigned int version;
+		size_t pos = sizeof(kCaptureMagic);
+		if (_data.size() < _begin || memcmp(&_data[0], kCaptureMagic, sizeof(kCaptureMagic)) != 0 ||
+			!ReadRecord(_data, pos, version) || version != kCaptureVersion)
+		{
+			return false;
+		}
+		// A capture cut off mid frame keeps the frames before the cut
+		size_t frameEnd = pos;
+		unsigned int type;
+		while (ReadRecord(_data, pos, type))
+		{
+			if (type == kCaptureData)
+			{
+				unsigned int header[2];
+				if (!ReadRecord(_data, pos, header) || pos + header[0] > _data.size())
+				{
+					break;
+				}
+				pos += header[0];
+			}
+			else if (type == kCaptureFrame)
+			{
+				if (!ReadRecord(_data, pos, _duration))
+				{
+					break;
+				}
+				frameEnd = pos;
+				++_frameCount;
+			}
+			else if (type != kCaptureRelease)
+			{
+				return false;
+			}
+		}
+		_data.resize(frameEnd);
+		return true;
+	}
+
+	bool CommandReplay::FeedFrame(RingBuffer& buffer, double& frameTime)
+	{
+		unsigned int type;
+		while (ReadRecord(_data, _pos, type))
+		{
+			switch (type)
+			{
+			case kCaptureData:
+			{
+				unsigned int header[2];
+				ReadRecord(_data, _pos, header);
+				void* dest = buffer.GetWriteDataPointer(header[0], header[1]);
+				memcpy(dest, &_data[_pos], header[0]);
+				_pos += header[0];
+				break;
+			}
+			case kCaptureRelease:
+				buffer.WriteSubmitData();
+				break;
+			case kCaptureFrame:
+				ReadRecord(_data, _pos, frameTime);
+				return true;
+			}
+		}
+		return false;
+	}
+}
@@ -3,6 +3,13 @@
 #include "ESDevice.hpp"
 #include "ThreadESDevice.hpp"
 #include "ThreadBufferESDevice.h"
+#include "NullESDevice.h"
+#include "TGADecoder.h"
+#include "VertexPacker.h"
+#include "FrustumCuller.h"
+#include "OcclusionCuller.h"
+#include "RenderQueue.h"
+#include "StaticBatcher.h"
 #include <cmath>
 #include <thread>
 #include <iostream>
@@ -61,20 +68,58 @@ DemoBase* DemoBase::Instnce()
 }
 
 VBOData::Ptr _vboData = nullptr;
-glm::mat4 _mvp;
-VBO* _vbo;
-void DemoBase::Init()
-{
-	_meshes = Mesh::LoadMeshFromFile("monkey.babylon");
-	const unsigned int instanceCount = 40;
-	_vboData = std::make_shared<VBOData>(_meshes[0]->vboData->verticesCount*instanceCount, _meshes[0]->vboData->indicesCount*instanceCount);
-	for (int i = 0; i < instanceCount; ++i)
+std::vector<VBOData::Ptr> _packedVBOData;
+std::vector<glm::mat4> _mvps;
+glm::mat4 _viewProj;
+FrustumCuller _culler;
+std::vector<unsigned char> _visible;
+OcclusionCuller* _occlusionCuller = nullptr;
+RenderQueue _renderQueue;
+GPUProgramParam* _mvpParam = nullptr;
+void DemoBase::Init()
+{
+	auto sourceMeshes = Mesh::LoadMeshFromFile("monkey.babylon");
+	// Two 5x4 walls of instances, the front one partly hiding the back one
+	StaticBatcher::Options batcherOptions;
+	batcherOptions.maxVertices = 4096;
+	StaticBatcher batcher(batcherOptions);
+	for (int i = 0; i < 40; ++i)
 	{
-		auto vbufferSize = _meshes[0]->vboData->verticesCount * sizeof(VBOData::Vertex);
-		memcpy(_vboData->vertices + i * _meshes[0]->vboData->verticesCount, _meshes[0]->vboData->vertices, vbufferSize);
-		auto ibufferSzie = _meshes[0]->vboData->indicesCount * sizeof(unsigned short);
-		memcpy(_vboData->indices + i * _meshes[0]->vboData->indicesCount, _meshes[0]->vboData->indices, ibufferSzie);
+		vec3 position((i % 5 - 2) * 2.2f, (i / 5 % 4 - 1.5f) * 2.2f, i < 20 ? 0.0f : -5.0f);
+		batcher.Add(sourceMeshes[0], 0, glm::translate(glm::mat4(1.0f), position));
 	}
+	for (auto& batch : batcher.Build())
+	{
+		_meshes.push_back(batch.mesh);
+	}
+	const StaticBatcher::Stats& batchStats = batcher.GetStats();
+	esLogMessage("[render] static batching: %u meshes -> %u batches, %u draw calls saved\n",
+		batchStats.meshCount, batchStats.batchCount, batchStats.meshCount - batchStats.batchCount);
+
+	unsigned int floatSize = 0, packedSize = 0;
+	for (auto mesh : _meshes)
+	{
+		_packedVBOData.push_back(VertexPacker::Pack(mesh->vboData, VertexFormat(kVertexPosSNorm16x4, kVertexNormalSNorm10x3, kVertexUVHalf2)));
+		// The float copy stays for culling, so static batches re-pack from it when the device is recreated
+		if (mesh != _meshes[0])
+		{
+			VBOData::Ptr source = mesh->vboData;
+			_packedVBOData.back()->residency = kResidencyReload;
+			_packedVBOData.back()->reloader = [source](VBOData& data) {
+				VBOData::Ptr packed = VertexPacker::Pack(source, data.format);
+				memcpy(data.vertices, packed->vertices, packed->GetVertexBufferSize());
+				memcpy(data.indices, packed->indices, packed->indicesCount * sizeof(unsigned short));
+				return true;
+			};
+		}
+		floatSize += mesh->vboData->GetVertexBufferSize();
+		packedSize += _packedVBOData.back()->GetVertexBufferSize();
+	}
+	esLogMessage("[render] packed vertices %u -> %u bytes\n", floatSize, packedSize);
+	// Unanimated copy of the first batch for Update
+	const VBOData& first = *_meshes[0]->vboData;
+	_vboData = std::make_shared<VBOData>(first.verticesCount, 0);
+	memcpy(_vboData->vertices, first.vertices, first.GetVertexBufferSize());
 	_camera = Camera::Ptr(new Camera);
 	_camera->position = vec3(0, 0, 12.0f);
 	_camera->target = vec3(0, 0, 0);
@@ -85,11 +130,32 @@ void DemoBase::OnCreateDevice(ESContext *esContext)
 #ifdef __APPLE__
 	_device = new ESDeviceImp(esContext);
 #else
-	switch (_deviceCreateType)
+	// MTRENDER_SERVER=name sends everything to a RenderServer process instead
+	const char* serverName = getenv("MTRENDER_SERVER");
+	ThreadBufferESDevice* remoteDevice = nullptr;
+	if (serverName != nullptr)
+	{
+		remoteDevice = new ThreadBufferESDevice(new NullESDevice(), _returnResImmediately);
+		if (!remoteDevice->ConnectSharedBuffer(serverName))
+		{
+			delete remoteDevice;
+			remoteDevice = nullptr;
+		}
+	}
+	switch (remoteDevice != nullptr ? kServerClient : _deviceCreateType)
 	{
+	case DemoBase::kServerClient:
+		_device = remoteDevice;
+		break;
 	case DemoBase::kThreadBuffer:
-		_device = new ThreadBufferESDevice(esContext, _returnResImmediately);
+	{
+		// MTRENDER_COMMAND_BUFFER_KB sizes the command ring
+		const char* commandBufferKB = getenv("MTRENDER_COMMAND_BUFFER_KB");
+		unsigned int commandBufferSize = commandBufferKB != nullptr ? (unsigned int)atoi(commandBufferKB) * 1024 : 0;
+		_device = new ThreadBufferESDevice(esContext, _returnResImmediately,
+			commandBufferSize >= 64 * 1024 ? commandBufferSize : ThreadBufferESDevice::BUFFER_SIZE);
 		break;
+	}
 	case DemoBase::kThreadQueue:
 		_device = new ThreadESDevice(esContext, _returnResImmediately);
 		break;
@@ -104,54 +170,99 @@ void DemoBase::OnCreateDevice(ESContext *esContext)
 	ThreadESDeviceBase* threadDevice = dynamic_cast<ThreadESDeviceBase*>(_device);
 
 	_device->CreateWindow1("Hello Triangle", 480, 320, ES_WINDOW_RGB | ES_WINDOW_DEPTH | ES_WINDOW_ALPHA);
+#ifndef __APPLE__
+	if (remoteDevice != nullptr)
+	{
+		// Nothing is drawn here, but the main loop polls this window for input
+		esCreateWindow(esContext, "Hello Triangle", 480, 320, ES_WINDOW_RGB);
+		threadDevice = nullptr;
+	}
+#endif
 	if (threadDevice == nullptr)
 	{
 		_device->AcqiureThreadOwnerShip();
-		glEnable(GL_DEPTH_TEST);
-		// Accept fragment if it closer to the camera than the former one
-		glDepthFunc(GL_LESS);
 	}
 
 #ifndef __APPLE__
+	// MTRENDER_CAPTURE=file records the command stream for ReplayCapture
+	ThreadBufferESDevice* bufferDevice = dynamic_cast<ThreadBufferESDevice*>(_device);
+	const char* capturePath = getenv("MTRENDER_CAPTURE");
+	if (bufferDevice != nullptr && remoteDevice == nullptr && capturePath != nullptr)
+	{
+		bufferDevice->StartCapture(capturePath);
+	}
 	if (threadDevice != nullptr)
 	{
 		threadDevice->Run();
 	}
 #endif
 	_device->SetClearColor(0.0f, 0.0f, 0.6f, 0.0f);
-	int width,dataLen,
-		height;
-	char *buffer = esLoadTGA(esContext->platformData, "splash04.tga", &width, &height,&dataLen);
-	g_textureData  = std::make_shared<TextureData>(buffer, width, height, dataLen);
+	if (g_textureData == nullptr)
+	{
+		g_textureData = TGADecoder::LoadFromFile("splash04.tga");
+		// Dropped once uploaded, decoded again if the device is recreated
+		g_textureData->residency = kResidencyReload;
+		g_textureData->reloader = [](TextureData& data) {
+			TextureData::Ptr decoded = TGADecoder::LoadFromFile("splash04.tga");
+			if (decoded == nullptr || decoded->length != data.length)
+			{
+				return false;
+			}
+			memcpy(data.pixels, decoded->pixels, data.length);
+			return true;
+		};
+	}
 	_texture = _device->CreateTexture2D(g_textureData);
 	_program = _device->CreateGPUProgram(vStr, fStr);
-	for (auto mesh : _meshes)
+	for (size_t i = 0; i < _meshes.size(); ++i)
 	{
-		mesh->vbo = _device->CreateVBO();
-		_device->UpdateVBO(mesh->vbo, _vboData);
+		_meshes[i]->vbo = _device->CreateVBO();
+		_device->UpdateVBO(_meshes[i]->vbo, _packedVBOData[i]);
 	}
 
 	const glm::vec3 up(0, 1, 0);
 	auto viewMat = glm::lookAt(_camera->position, _camera->target, up);
-	_device->UseGPUProgram(_program);
 	auto mvpParam = _program->GetParam("MVP");
 	
 	glm::mat4 projMat = glm::perspective(glm::radians(45.0f), (float)_device->GetScreenWidth() / _device->GetScreenHeigt(), 0.1f, 20.0f);
-	auto mesh = _meshes[0];
-
-	auto w0 = glm::translate(glm::mat4(1.0f), mesh->position);
-	auto w1 = glm::eulerAngleXYZ(mesh->rotation.x, mesh->rotation.y, mesh->rotation.z);
-	auto wordlMat = w0 * w1;
-	_mvp = projMat * viewMat* wordlMat;
-	_device->SetGPUProgramParamAsMat4(mvpParam, _mvp);
-	_device->UseTexture2D(_texture,1);
-	auto textParam = _program->GetParam("baseTex");
-	_device->SetGPUProgramParamAsInt(textParam,1);
-	_vbo = mesh->vbo;
+	// Batches are already in world space
+	_viewProj = projMat * viewMat;
+	_mvps.clear();
+	for (auto& packed : _packedVBOData)
+	{
+		_mvps.push_back(_viewProj * packed->GetDecodeMatrix());
+	}
+	_culler.Clear();
+	for (auto m : _meshes)
+	{
+		glm::vec3 center, extents;
+		m->GetWorldBounds(center, extents);
+		_culler.Add(center, extents, m->boundsRadius);
+	}
+	OcclusionCuller::Options occlusionOptions;
+	occlusionOptions.width = _device->GetScreenWidth() / 2;
+	occlusionOptions.height = _device->GetScreenHeigt() / 2;
+	delete _occlusionCuller;
+	_occlusionCuller = new OcclusionCuller(occlusionOptions);
+	MaterialDesc materialDesc(_program);
+	materialDesc.AddTexture(_texture, 1);
+	materialDesc.SetInt(_program->GetParam("baseTex"), 1);
+	_material = _device->CreateMaterial(materialDesc);
+	// Accept fragment if it closer to the camera than the former one
+	_pipelineState = _device->CreatePipelineState(PipelineStateDesc());
+	_mvpParam = mvpParam;
+	_renderQueue.InvalidateState();
+
+	MemoryTracker* memory = _device->GetMemoryTracker();
+	memory->SetBudget(64 * 1024 * 1024);
+	memory->AddBudgetCallback([](size_t used, size_t budget) {
+		esLogMessage("[render] memory over budget: %u / %u KB\n", (unsigned int)(used / 1024), (unsigned int)(budget / 1024));
+	});
 }
 
 void DemoBase::OnDestroyDevice()
 {
+	_device->DeleteMaterial(_material);
 	_device->DeletGPUProgram(_program);
 	if (_texture != nullptr)
 	{
@@ -161,6 +272,8 @@ void DemoBase::OnDestroyDevice()
 	{
 		_device->DeleteVBO(mesh->vbo);
 	}
+	delete _occlusionCuller;
+	_occlusionCuller = nullptr;
 	_device->Cleanup();
 	delete _device;
 	_device = nullptr;
@@ -197,13 +310,24 @@ void DemoBase::Update(float dt)
 		_meshes[0]->vboData->vertices[i].pos.x = sinf(_rotaion) * _vboData->vertices[i].pos.x;
 		_meshes[0]->vboData->vertices[i].pos.y = cosf(_rotaion) * _vboData->vertices[i].pos.y;
 	}
+	// Only positions changed, Render sends just the vertex span of this batch
+	VertexPacker::PackPositions(_meshes[0]->vboData->vertices, *_packedVBOData[0], 0, _meshes[0]->vboData->verticesCount);
 	for (auto mesh : _meshes)
 	{
 		//mesh->rotation = vec3(mesh->rotation.x + dt * 0.5f, mesh->rotation.y + dt * 0.2f, mesh->rotation.z);
 	}
+	MemoryTracker* memory = _device->GetMemoryTracker();
+	memory->CheckBudget();
 	if (g_accCount % 200 == 0)
 	{
-		esLogMessage("Update avgfps: %f currentFPs: %f delta: %f %u\n", avgFps, newFPs, delta,g_accCount);
+		esLogMessage("[render] memory: texture %u KB geometry %u KB command buffer %u KB, peak %u KB, pending deletes %u (%u KB)\n",
+			(unsigned int)(memory->GetUsed(kMemoryTexture) / 1024), (unsigned int)(memory->GetUsed(kMemoryGeometry) / 1024),
+			(unsigned int)(memory->GetUsed(kMemoryCommandBuffer) / 1024), (unsigned int)(memory->GetTotalPeak() / 1024),
+			memory->GetPendingFreeCount(), (unsigned int)(memory->GetPendingFreeBytes() / 1024));
+		const OcclusionCuller::Stats& occlusion = _occlusionCuller->GetStats();
+		esLogMessage("Update avgfps: %f currentFPs: %f delta: %f %u culled: %u/%u occluded: %u/%u occlusion cpu: %.3fms draws: %u program/material changes: %u/%u pipeline states: %u\n", avgFps, newFPs, delta,g_accCount,
+			_culler.GetStats().culled, _culler.GetStats().tested, occlusion.occluded, occlusion.tested, occlusion.rasterizeMs + occlusion.testMs,
+			_renderQueue.GetStats().draws, _renderQueue.GetStats().programChanges, _renderQueue.GetStats().materialChanges, _device->GetPipelineStateCount());
 	}
 	if (g_accCount >= 2000)
 	{
@@ -219,8 +343,32 @@ void DemoBase::Render()
 {
 	_device->BeginRender();
 	_device->Clear();
-	_device->UpdateVBO(_vbo,_vboData);
-	_device->DrawVBO(_vbo);
+	for (size_t i = 0; i < _meshes.size(); ++i)
+	{
+		_device->UpdateVBODirty(_meshes[i]->vbo, *_packedVBOData[i]);
+	}
+	_culler.Cull(_viewProj, _visible);
+	// The coarsest LOD of every mesh is a good enough occluder
+	_occlusionCuller->BeginFrame(_viewProj);
+	for (auto mesh : _meshes)
+	{
+		auto world = glm::translate(glm::mat4(1.0f), mesh->position) * glm::eulerAngleXYZ(mesh->rotation.x, mesh->rotation.y, mesh->rotation.z);
+		_occlusionCuller->AddOccluder(world, *mesh->vboData, mesh->lods.back().indexStart, mesh->lods.back().indexCount);
+	}
+	_occlusionCuller->Rasterize();
+	for (size_t i = 0; i < _meshes.size(); ++i)
+	{
+		auto mesh = _meshes[i];
+		glm::vec3 center, extents;
+		mesh->GetWorldBounds(center, extents);
+		if (_visible[i] && _occlusionCuller->IsVisible(center, extents))
+		{
+			unsigned int lod = mesh->SelectLOD(_camera->position, glm::radians(45.0f), (float)_device->GetScreenHeigt());
+			RenderQueue::Packet packet = { _material, _pipelineState, mesh->vbo, mesh->lods[lod].indexStart, mesh->lods[lod].indexCount, _mvpParam, _mvps[i] };
+			_renderQueue.Submit(packet, glm::distance(_camera->position, center));
+		}
+	}
+	_renderQueue.Flush(_device);
 	_device->Present();
 }
 
@@ -12,6 +12,7 @@
 #include <stddef.h>
 #include <algorithm>
 #include <map>
+#include "RangeAllocator.h"
 namespace RenderEngine {
 
 	class GPUProgramImp;
@@ -68,8 +69,9 @@ namespace RenderEngine {
 	{
 	public:
 		GLuint textureID;
-		Texture2DImp(GLuint id)
-			:textureID(id) {}
+		size_t memorySize;
+		Texture2DImp(GLuint id, size_t size)
+			:textureID(id), memorySize(size) {}
 
 		Texture2D* GetRealTexture2D()
 		{
@@ -77,21 +79,213 @@ namespace RenderEngine {
 		}
 	};
 
+	class MaterialImp : public Material
+	{
+		friend class ESDeviceImp;
+	public:
+		struct TextureBinding
+		{
+			GLuint unit;
+			GLuint textureID;
+		};
+		struct Uniform
+		{
+			GLint location;
+			MaterialParamType type;
+			glm::mat4 value;
+		};
+		GLuint programID;
+		std::vector<TextureBinding> textures;
+		std::vector<Uniform> uniforms;
+
+		MaterialImp(const MaterialDesc& desc) :Material(desc) {}
+		virtual Material* GetRealMaterial() { return this; }
+
+		bool HasTexture(const TextureBinding& binding) const
+		{
+			for (auto& t : textures)
+			{
+				if (t.unit == binding.unit)
+				{
+					return t.textureID == binding.textureID;
+				}
+			}
+			return false;
+		}
+		bool HasUniform(const Uniform& uniform) const
+		{
+			for (auto& u : uniforms)
+			{
+				if (u.location == uniform.location)
+				{
+					return u.type == uniform.type && u.value == uniform.value;
+				}
+			}
+			return false;
+		}
+	protected:
+		~MaterialImp() {}
+	};
+
+	class PipelineStateImp : public PipelineState
+	{
+	public:
+		PipelineStateImp(const PipelineStateDesc& desc) :PipelineState(desc) {}
+		virtual PipelineState* GetRealPipelineState() { return this; }
+	};
+
+	namespace {
+		// 16-bit indices are rebased into the page, so it can't hold more vertices
+		const unsigned int kGeometryPageVertices = 65536;
+		const unsigned int kGeometryPageIndices = 65536 * 3;
+		const unsigned int kDefragmentMinBlocks = 8;
+		const float kDefragmentThreshold = 0.5f;
+	}
+
 	class VBOImp : public VBO
 	{
 		friend class ESDeviceImp;
 	public:
-		GLuint vertexArrayID;
-		GLuint vertexbuffer;
-		GLuint normalbuffer;
-		GLuint uvbuffer;
-		GLuint elementbuffer;
+		GeometryPage* page;
+		unsigned int pageSlot;
+		unsigned int vertexOffset;
+		unsigned int verticesCount;
+		unsigned int indexOffset;
 		GLuint elementSize;
+		VertexFormat format;
+		// Mesh local indices, kept to rebase them when the page is compacted
+		std::vector<unsigned short> indices;
+		VBOImp()
+			:page(nullptr), pageSlot(0), vertexOffset(0), verticesCount(0), indexOffset(0), elementSize(0) {}
 	protected:
 		~VBOImp() {}
 		virtual VBO* GetRealVBO() { return this; }
 	};
 
+	// One VAO over a vertex and an index buffer shared by every VBO of a format.
+	// Ranges come from free lists. Since GLES 3.0 has no base vertex draws, the
+	// base vertex is folded into the indices at upload time.
+	struct GeometryPage
+	{
+		VertexFormat format;
+		GLuint vertexArrayID;
+		GLuint vertexBuffer;
+		GLuint indexBuffer;
+		RangeAllocator vertices;
+		RangeAllocator indices;
+		std::vector<VBOImp*> vbos;
+		size_t GetMemorySize() const { return (size_t)vertices.GetCapacity() * format.GetStride() + (size_t)indices.GetCapacity() * sizeof(unsigned short); }
+		GeometryPage(const VertexFormat& format_, unsigned int indicesCapacity)
+			:format(format_), vertexArrayID(0), vertexBuffer(0), indexBuffer(0)
+			, vertices(kGeometryPageVertices), indices(indicesCapacity) {}
+	};
+
+	namespace {
+		void SetupPageVertexArray(GeometryPage* page)
+		{
+			glBindVertexArray(page->vertexArrayID);
+			glBindBuffer(GL_ARRAY_BUFFER, page->vertexBuffer);
+			const VertexFormat& format = page->format;
+			const GLsizei stride = format.GetStride();
+
+			glEnableVertexAttribArray(kVertexAttribPosition);
+			switch (format.position)
+			{
+			case kVertexPosHalf4:
+				glVertexAttribPointer(kVertexAttribPosition, 4, GL_HALF_FLOAT, GL_FALSE, stride, (void*)0);
+				break;
+			case kVertexPosSNorm16x4:
+				glVertexAttribPointer(kVertexAttribPosition, 4, GL_SHORT, GL_TRUE, stride, (void*)0);
+				break;
+			default:
+				glVertexAttribPointer(kVertexAttribPosition, 3, GL_FLOAT, GL_FALSE, stride, (void*)0);
+				break;
+			}
+
+			glEnableVertexAttribArray(kVertexAttribNormal);
+			switch (format.normal)
+			{
+			case kVertexNormalSNorm10x3:
+				glVertexAttribPointer(kVertexAttribNormal, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride, (void*)(size_t)format.GetNormalOffset());
+				break;
+			case kVertexNormalOctahedral:
+				glVertexAttribPointer(kVertexAttribNormal, 2, GL_SHORT, GL_TRUE, stride, (void*)(size_t)format.GetNormalOffset());
+				break;
+			default:
+				glVertexAttribPointer(kVertexAttribNormal, 3, GL_FLOAT, GL_FALSE, stride, (void*)(size_t)format.GetNormalOffset());
+				break;
+			}
+
+			glEnableVertexAttribArray(kVertexAttribTexCoord);
+			if (format.uv == kVertexUVHalf2)
+			{
+				glVertexAttribPointer(kVertexAttribTexCoord, 2, GL_HALF_FLOAT, GL_FALSE, stride, (void*)(size_t)format.GetUVOffset());
+			}
+			else
+			{
+				glVertexAttribPointer(kVertexAttribTexCoord, 2, GL_FLOAT, GL_FALSE, stride, (void*)(size_t)format.GetUVOffset());
+			}
+
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, page->indexBuffer);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		}
+
+		void RebaseIndices(const VBOImp* vbo, std::vector<unsigned short>& rebased)
+		{
+			rebased.resize(vbo->indices.size());
+			for (size_t i = 0; i < rebased.size(); ++i)
+			{
+				rebased[i] = (unsigned short)(vbo->indices[i] + vbo->vertexOffset);
+			}
+		}
+	}
+
+	void ESDevice::UpdateVBODirty(VBO* vbo, VBOData& vboData)
+	{
+		if (!vboData.IsDirty())
+		{
+			return;
+		}
+		const unsigned int vertexCount = vboData.dirtyVertexEnd - vboData.dirtyVertexStart;
+		const unsigned int indexCount = vboData.dirtyIndexEnd - vboData.dirtyIndexStart;
+		const char* vertices = (const char*)vboData.vertices + (size_t)vboData.dirtyVertexStart * vboData.format.GetStride();
+		UpdateVBORange(vbo, vboData.dirtyVertexStart, vertexCount, vertexCount > 0 ? vertices : nullptr,
+			vboData.dirtyIndexStart, indexCount, indexCount > 0 ? vboData.indices + vboData.dirtyIndexStart : nullptr);
+		vboData.ClearDirty();
+	}
+
+	ESDeviceImp::~ESDeviceImp()
+	{
+		esLogMessage("~ESDeviceImp");
+		// Cleanup normally got these already. GL can only delete them from a
+		// thread that has the context current, without one they are dropped.
+		if (!_pendingDeletes.empty() || !_frameFences.empty())
+		{
+#ifndef __APPLE__
+			bool hasContext = eglGetCurrentContext() != EGL_NO_CONTEXT;
+#else
+			bool hasContext = true;
+#endif
+			if (hasContext)
+			{
+				RetireDeletes(true);
+			}
+			else
+			{
+				esLogMessage("[render] ~ESDeviceImp without a current context, dropping %u pending deletes", (unsigned int)_pendingDeletes.size());
+			}
+		}
+		for (auto& state : _pipelineStates)
+		{
+			delete state.second;
+		}
+		// Pages outlive the context only when VBOs leak, drop the bookkeeping
+		for (auto page : _geometryPages)
+		{
+			delete page;
+		}
+	}
+
 
 	bool ESDeviceImp::CreateWindow1(const std::string& title, int width, int height, int flags)
 	{
@@ -99,8 +293,22 @@ namespace RenderEngine {
 	}
 	void ESDeviceImp::Clear()
 	{
+		// Masks apply to clears too, so open them up for the duration
+		const PipelineStateDesc* state = _boundPipelineState != nullptr ? &_boundPipelineState->GetDesc() : nullptr;
+		bool masked = state != nullptr && (!state->depthWrite || state->colorMask != kColorMaskAll);
+		if (masked)
+		{
+			glDepthMask(GL_TRUE);
+			glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		}
 		glClearDepthf(1.0f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		if (masked)
+		{
+			glDepthMask(state->depthWrite ? GL_TRUE : GL_FALSE);
+			glColorMask((state->colorMask & kColorMaskR) != 0, (state->colorMask & kColorMaskG) != 0,
+				(state->colorMask & kColorMaskB) != 0, (state->colorMask & kColorMaskA) != 0);
+		}
 	}
 	void ESDeviceImp::SetViewPort(int x, int y, int width, int height)
 	{
@@ -154,30 +362,61 @@ namespace RenderEngine {
 		auto programId = static_cast<GPUProgramImp*>(program)->ProgramID;
 
 		glUseProgram(programId);
+		_boundMaterial = nullptr;
 	}
 	void ESDeviceImp::DeletGPUProgram(GPUProgram* program)
 	{
-		glDeleteProgram(static_cast<GPUProgramImp*>(program)->ProgramID);
-		delete program;
+		DeferDelete(kPendingDeleteProgram, program, 0);
+		_boundMaterial = nullptr;
 	}
 	Texture2D* ESDeviceImp::CreateTexture2D(const TextureData::Ptr& data)
 	{
+		if (!data->EnsureResident())
+		{
+			esLogMessage("[render] texture data was released, creating it without pixels");
+		}
 		GLuint textureID = 0;
 		glActiveTexture(GL_TEXTURE0);
 		glGenTextures(1, &textureID);
 		glBindTexture(GL_TEXTURE_2D, textureID);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, data->width, data->height, 0, GL_RGB, GL_UNSIGNED_BYTE, data->pixels);
+		GLenum format = data->format == kTexFormatRGBA8 ? GL_RGBA : GL_RGB;
+		// RGB rows are not 4-byte aligned unless the width is a multiple of 4
+		glPixelStorei(GL_UNPACK_ALIGNMENT, data->format == kTexFormatRGBA8 ? 4 : 1);
+		glTexImage2D(GL_TEXTURE_2D, 0, format, data->width, data->height, 0, format, GL_UNSIGNED_BYTE, data->pixels);
 		glGenerateMipmap(GL_TEXTURE_2D);
-		return new Texture2DImp(textureID);
+		// Sampler state belongs to the texture, so materials only need to bind it
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		_boundMaterial = nullptr;
+		if (_releaseUploadedData)
+		{
+			data->OnUploaded();
+		}
+		// Whole mip chain, at the uploaded pixel size
+		size_t size = 0;
+		unsigned int pixelSize = data->format == kTexFormatRGBA8 ? 4 : 3;
+		for (unsigned int w = data->width, h = data->height; ; w = std::max(w / 2, 1u), h = std::max(h / 2, 1u))
+		{
+			size += (size_t)w * h * pixelSize;
+			if (w == 1 && h == 1)
+			{
+				break;
+			}
+		}
+		_memoryTracker.Allocate(kMemoryTexture, size);
+		return new Texture2DImp(textureID, size);
 	}
 	void ESDeviceImp::DeleteTexture2D(Texture2D* texture)
 	{
 		Texture2DImp* realTex = static_cast<Texture2DImp*>(texture);
-		glDeleteTextures(1, &realTex->textureID);
-		delete texture;
+		DeferDelete(kPendingDeleteTexture, realTex, realTex->memorySize);
+		_boundMaterial = nullptr;
 	}
 	void ESDeviceImp::UseTexture2D(Texture2D* texture, unsigned int index)
 	{
+		_boundMaterial = nullptr;
 		glActiveTexture(GL_TEXTURE0 + index);
 		glBindTexture(GL_TEXTURE_2D, static_cast<Texture2DImp*>(texture)->textureID);
 
@@ -192,6 +431,7 @@ namespace RenderEngine {
 	}
 	void ESDeviceImp::DrawTriangle(std::vector<glm::vec3>& vertices)
 	{
+		BindGeometryPage(nullptr);
 		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, &vertices[0][0]);
 		glEnableVertexAttribArray(0);
 
@@ -199,18 +439,23 @@ namespace RenderEngine {
 	}
 	void ESDeviceImp::Present()
 	{
+		FrameFence frameFence = { _frameIndex++, glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0) };
+		_frameFences.push_back(frameFence);
 #ifndef __APPLE__
 		eglSwapBuffers(_esContext->eglDisplay, _esContext->eglSurface);
 #endif
+		RetireDeletes(false);
 	}
 	void RenderEngine::ESDeviceImp::Draw2DPoint(const glm::vec2 & pos)
 	{
+		BindGeometryPage(nullptr);
 		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, &pos[0]);
 		glEnableVertexAttribArray(0);
 		glDrawArrays(GL_POINTS, 0, 1);
 	}
 	void RenderEngine::ESDeviceImp::DrawLine(const std::vector<glm::vec3>& line)
 	{
+		BindGeometryPage(nullptr);
 		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, &line[0][0]);
 		glEnableVertexAttribArray(0);
 		glDrawArrays(GL_LINES, 0, 2);
@@ -222,60 +467,326 @@ namespace RenderEngine {
 	}
 	VBO* ESDeviceImp::CreateVBO()
 	{
-		auto vbo = new VBOImp();
-		glGenVertexArrays(1, &vbo->vertexArrayID);
-		glBindVertexArray(vbo->vertexArrayID);
-		glGenBuffers(1, &vbo->vertexbuffer);
-		glGenBuffers(1, &vbo->normalbuffer);
-		glGenBuffers(1, &vbo->uvbuffer);
-		glGenBuffers(1, &vbo->elementbuffer);
-		return vbo;
+		// Storage is taken from a geometry page on the first update
+		return new VBOImp();
 	}
 	void ESDeviceImp::UpdateVBO(VBO* vbo, const VBOData::Ptr& vboData)
 	{
-		auto vboImp = (VBOImp*) vbo;
-
-
-		glBindBuffer(GL_ARRAY_BUFFER, vboImp->vertexbuffer);
-		glBufferData(GL_ARRAY_BUFFER, vboData->verticesCount * sizeof(glm::vec3), vboData->vertices, GL_STATIC_DRAW);
-
-		glBindBuffer(GL_ARRAY_BUFFER, vboImp->normalbuffer);
-		glBufferData(GL_ARRAY_BUFFER, vboData->verticesCount * sizeof(glm::vec3), vboData->vertices, GL_STATIC_DRAW);
-
-		glBindBuffer(GL_ARRAY_BUFFER, vboImp->uvbuffer);
-		glBufferData(GL_ARRAY_BUFFER, vboData->verticesCount * sizeof(glm::vec2), vboData->vertices, GL_STATIC_DRAW);
-
-
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vboImp->elementbuffer);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, vboData->indicesCount * sizeof(unsigned short), vboData->indices, GL_STATIC_DRAW);
-		vboImp->elementSize = vboData->indicesCount;
+		auto vboImp = (VBOImp*) vbo;
+		if (!vboData->EnsureResident())
+		{
+			esLogMessage("[render] UpdateVBO with released data, ignored");
+			return;
+		}
+		if (vboImp->page != nullptr && (vboImp->format != vboData->format
+			|| vboImp->verticesCount != vboData->verticesCount || vboImp->elementSize != vboData->indicesCount))
+		{
+			ReleaseGeometry(vboImp);
+		}
+		vboImp->format = vboData->format;
+		vboImp->indices.assign(vboData->indices, vboData->indices + vboData->indicesCount);
+		if (vboImp->page == nullptr && !AllocateGeometry(vboImp, vboData->verticesCount, vboData->indicesCount, vboData->format))
+		{
+			vboImp->verticesCount = 0;
+			vboImp->elementSize = 0;
+			return;
+		}
+		GeometryPage* page = vboImp->page;
+		const unsigned int stride = vboData->format.GetStride();
+
+		// The copy targets leave the array and element bindings of the VAOs alone
+		glBindBuffer(GL_COPY_WRITE_BUFFER, page->vertexBuffer);
+		glBufferSubData(GL_COPY_WRITE_BUFFER, vboImp->vertexOffset * stride, vboData->GetVertexBufferSize(), vboData->vertices);
+
+		std::vector<unsigned short> rebased;
+		RebaseIndices(vboImp, rebased);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, page->indexBuffer);
+		glBufferSubData(GL_COPY_WRITE_BUFFER, vboImp->indexOffset * sizeof(unsigned short), rebased.size() * sizeof(unsigned short), &rebased[0]);
+		if (_releaseUploadedData)
+		{
+			vboData->OnUploaded();
+		}
+	}
+	void ESDeviceImp::UpdateVBORange(VBO* vbo, unsigned int vertexStart, unsigned int vertexCount, const void* vertices,
+		unsigned int indexStart, unsigned int indexCount, const unsigned short* indices)
+	{
+		auto vboImp = (VBOImp*) vbo;
+		GeometryPage* page = vboImp->page;
+		if (page == nullptr || vertexStart + vertexCount > vboImp->verticesCount || indexStart + indexCount > vboImp->elementSize)
+		{
+			esLogMessage("[render] UpdateVBORange out of the VBO storage, call UpdateVBO first");
+			return;
+		}
+		if (vertexCount > 0)
+		{
+			const unsigned int stride = vboImp->format.GetStride();
+			glBindBuffer(GL_COPY_WRITE_BUFFER, page->vertexBuffer);
+			glBufferSubData(GL_COPY_WRITE_BUFFER, (vboImp->vertexOffset + vertexStart) * stride, vertexCount * stride, vertices);
+		}
+		if (indexCount > 0)
+		{
+			std::copy(indices, indices + indexCount, vboImp->indices.begin() + indexStart);
+			std::vector<unsigned short> rebased(indices, indices + indexCount);
+			for (auto& index : rebased)
+			{
+				index = (unsigned short)(index + vboImp->vertexOffset);
+			}
+			glBindBuffer(GL_COPY_WRITE_BUFFER, page->indexBuffer);
+			glBufferSubData(GL_COPY_WRITE_BUFFER, (vboImp->indexOffset + indexStart) * sizeof(unsigned short), indexCount * sizeof(unsigned short), &rebased[0]);
+		}
 	}
 	void ESDeviceImp::DeleteVBO(VBO* vbo)
 	{
 		VBOImp* vboImp = static_cast<VBOImp*>(vbo);
-		glDeleteBuffers(1, &vboImp->vertexbuffer);
-		glDeleteBuffers(1, &vboImp->elementbuffer);
-		glDeleteBuffers(1, &vboImp->uvbuffer);
-		glDeleteBuffers(1, &vboImp->normalbuffer);
-		glDeleteVertexArrays(1, &vboImp->vertexArrayID);
-		delete vboImp;
+		// The range goes back to its page only once no frame in flight draws from it
+		size_t bytes = (size_t)vboImp->verticesCount * vboImp->format.GetStride() + vboImp->elementSize * sizeof(unsigned short);
+		DeferDelete(kPendingDeleteVBO, vboImp, bytes);
 	}
 	void ESDeviceImp::DrawVBO(VBO* vbo)
+	{
+		DrawVBORange(vbo, 0, static_cast<VBOImp*>(vbo)->elementSize);
+	}
+	void ESDeviceImp::DrawVBORange(VBO* vbo, unsigned int indexStart, unsigned int indexCount)
 	{
 		VBOImp* vboImp = static_cast<VBOImp*>(vbo);
-		glBindVertexArray(vboImp->vertexArrayID);
-		glBindBuffer(GL_ARRAY_BUFFER, vboImp->vertexbuffer);
-		glEnableVertexAttribArray(0);
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(VBOData::Vertex), (void*)0);
+		if (vboImp->page == nullptr)
+		{
+			return;
+		}
+		BindGeometryPage(vboImp->page);
+		glDrawElements(GL_TRIANGLES, indexCount, GL_UNSIGNED_SHORT, (void*)((vboImp->indexOffset + indexStart) * sizeof(unsigned short)));
+	}
 
-		glEnableVertexAttribArray(1);
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(VBOData::Vertex), (void*)offsetof(VBOData::Vertex, normal));
+	void ESDeviceImp::Cleanup()
+	{
+		RetireDeletes(true);
+	}
+
+	void ESDeviceImp::DeferDelete(PendingDeleteType type, void* object, size_t bytes)
+	{
+		PendingDelete pending = { type, object, _frameIndex, bytes };
+		_pendingDeletes.push_back(pending);
+		_memoryTracker.AddPendingFree(bytes);
+	}
+
+	void ESDeviceImp::RetireDeletes(bool all)
+	{
+		while (!_frameFences.empty())
+		{
+			GLsync fence = _frameFences.front().fence;
+			if (!all)
+			{
+				GLenum status = glClientWaitSync(fence, 0, 0);
+				if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+				{
+					break;
+				}
+			}
+			_completedFrames = _frameFences.front().frame + 1;
+			glDeleteSync(fence);
+			_frameFences.pop_front();
+		}
+		// Deletes are queued in frame order, retire them as one batch
+		while (!_pendingDeletes.empty() && (all || _pendingDeletes.front().frame < _completedFrames))
+		{
+			DestroyNow(_pendingDeletes.front());
+			_memoryTracker.RemovePendingFree(_pendingDeletes.front().bytes);
+			_pendingDeletes.pop_front();
+		}
+	}
+
+	void ESDeviceImp::DestroyNow(const PendingDelete& pending)
+	{
+		switch (pending.type)
+		{
+		case kPendingDeleteTexture:
+		{
+			Texture2DImp* texture = static_cast<Texture2DImp*>(pending.object);
+			glDeleteTextures(1, &texture->textureID);
+			_memoryTracker.Free(kMemoryTexture, texture->memorySize);
+			delete texture;
+			break;
+		}
+		case kPendingDeleteVBO:
+		{
+			VBOImp* vbo = static_cast<VBOImp*>(pending.object);
+			ReleaseGeometry(vbo);
+			delete vbo;
+			break;
+		}
+		case kPendingDeleteProgram:
+		{
+			GPUProgram* program = static_cast<GPUProgram*>(pending.object);
+			glDeleteProgram(static_cast<GPUProgramImp*>(program)->ProgramID);
+			delete program;
+			break;
+		}
+		}
+	}
+
+	bool ESDeviceImp::AllocateGeometry(VBOImp* vbo, unsigned int verticesCount, unsigned int indicesCount, const VertexFormat& format)
+	{
+		if (verticesCount == 0 || indicesCount == 0)
+		{
+			return false;
+		}
+		if (verticesCount > kGeometryPageVertices)
+		{
+			esLogMessage("[render] VBO with %u vertices does not fit 16-bit indices", verticesCount);
+			return false;
+		}
+		for (auto page : _geometryPages)
+		{
+			if (page->format == format && AllocateGeometryInPage(page, vbo, verticesCount, indicesCount))
+			{
+				return true;
+			}
+		}
+		// Enough room in total but no block large enough, compact and retry
+		for (auto page : _geometryPages)
+		{
+			if (page->format == format && page->vertices.GetFree() >= verticesCount && page->indices.GetFree() >= indicesCount)
+			{
+				DefragmentGeometryPage(page);
+				if (AllocateGeometryInPage(page, vbo, verticesCount, indicesCount))
+				{
+					return true;
+				}
+			}
+		}
+
+		GeometryPage* page = new GeometryPage(format, std::max(kGeometryPageIndices, indicesCount));
+		glGenVertexArrays(1, &page->vertexArrayID);
+		glGenBuffers(1, &page->vertexBuffer);
+		glGenBuffers(1, &page->indexBuffer);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, page->vertexBuffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, page->vertices.GetCapacity() * format.GetStride(), nullptr, GL_STATIC_DRAW);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, page->indexBuffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, page->indices.GetCapacity() * sizeof(unsigned short), nullptr, GL_STATIC_DRAW);
+		SetupPageVertexArray(page);
+		_boundPage = page;
+		_geometryPages.push_back(page);
+		_memoryTracker.Allocate(kMemoryGeometry, page->GetMemorySize());
+		esLogMessage("[render] geometry page %u created, stride %u, %u indices", (unsigned int)_geometryPages.size(), format.GetStride(), page->indices.GetCapacity());
+		return AllocateGeometryInPage(page, vbo, verticesCount, indicesCount);
+	}
+	bool ESDeviceImp::AllocateGeometryInPage(GeometryPage* page, VBOImp* vbo, unsigned int verticesCount, unsigned int indicesCount)
+	{
+		unsigned int vertexOffset = page->vertices.Allocate(verticesCount);
+		if (vertexOffset == RangeAllocator::kInvalidOffset)
+		{
+			return false;
+		}
+		unsigned int indexOffset = page->indices.Allocate(indicesCount);
+		if (indexOffset == RangeAllocator::kInvalidOffset)
+		{
+			page->vertices.Free(vertexOffset, verticesCount);
+			return false;
+		}
+		vbo->page = page;
+		vbo->vertexOffset = vertexOffset;
+		vbo->verticesCount = verticesCount;
+		vbo->indexOffset = indexOffset;
+		vbo->elementSize = indicesCount;
+		vbo->pageSlot = (unsigned int)page->vbos.size();
+		page->vbos.push_back(vbo);
+		return true;
+	}
+	void ESDeviceImp::ReleaseGeometry(VBOImp* vbo)
+	{
+		GeometryPage* page = vbo->page;
+		if (page == nullptr)
+		{
+			return;
+		}
+		page->vertices.Free(vbo->vertexOffset, vbo->verticesCount);
+		page->indices.Free(vbo->indexOffset, vbo->elementSize);
+		page->vbos[vbo->pageSlot] = page->vbos.back();
+		page->vbos[vbo->pageSlot]->pageSlot = vbo->pageSlot;
+		page->vbos.pop_back();
+		vbo->page = nullptr;
+
+		if (page->vbos.empty())
+		{
+			if (_boundPage == page)
+			{
+				glBindVertexArray(0);
+				_boundPage = nullptr;
+			}
+			glDeleteBuffers(1, &page->vertexBuffer);
+			glDeleteBuffers(1, &page->indexBuffer);
+			glDeleteVertexArrays(1, &page->vertexArrayID);
+			_memoryTracker.Free(kMemoryGeometry, page->GetMemorySize());
+			_geometryPages.erase(std::find(_geometryPages.begin(), _geometryPages.end(), page));
+			delete page;
+		}
+		else if (page->vertices.GetFreeBlockCount() > kDefragmentMinBlocks
+			&& std::max(page->vertices.GetFragmentation(), page->indices.GetFragmentation()) > kDefragmentThreshold)
+		{
+			DefragmentGeometryPage(page);
+		}
+	}
+	void ESDeviceImp::DefragmentGeometryPage(GeometryPage* page)
+	{
+		// Moves every range to the front of fresh buffers. Vertices are copied
+		// on the GPU, indices are rebased from the shadow copy and uploaded.
+		const unsigned int stride = page->format.GetStride();
+		GLuint vertexBuffer, indexBuffer;
+		glGenBuffers(1, &vertexBuffer);
+		glGenBuffers(1, &indexBuffer);
+		// Both copies exist until the old buffers are deleted
+		_memoryTracker.Allocate(kMemoryGeometry, page->GetMemorySize());
+		glBindBuffer(GL_COPY_WRITE_BUFFER, vertexBuffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, page->vertices.GetCapacity() * stride, nullptr, GL_STATIC_DRAW);
+		glBindBuffer(GL_COPY_READ_BUFFER, page->vertexBuffer);
+
+		unsigned int vertexOffset = 0;
+		unsigned int indexOffset = 0;
+		for (auto vbo : page->vbos)
+		{
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, vbo->vertexOffset * stride, vertexOffset * stride, vbo->verticesCount * stride);
+			vbo->vertexOffset = vertexOffset;
+			vbo->indexOffset = indexOffset;
+			vertexOffset += vbo->verticesCount;
+			indexOffset += vbo->elementSize;
+		}
 
-		glEnableVertexAttribArray(2);
-		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(VBOData::Vertex), (void*)offsetof(VBOData::Vertex, uv));
+		std::vector<unsigned short> rebased;
+		rebased.reserve(indexOffset);
+		std::vector<unsigned short> vboIndices;
+		for (auto vbo : page->vbos)
+		{
+			RebaseIndices(vbo, vboIndices);
+			rebased.insert(rebased.end(), vboIndices.begin(), vboIndices.end());
+		}
+		glBindBuffer(GL_COPY_WRITE_BUFFER, indexBuffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, page->indices.GetCapacity() * sizeof(unsigned short), nullptr, GL_STATIC_DRAW);
+		if (!rebased.empty())
+		{
+			glBufferSubData(GL_COPY_WRITE_BUFFER, 0, rebased.size() * sizeof(unsigned short), &rebased[0]);
+		}
 
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vboImp->elementbuffer);
-		glDrawElements(GL_TRIANGLES, vboImp->elementSize, GL_UNSIGNED_SHORT, (void*)0);
+		glDeleteBuffers(1, &page->vertexBuffer);
+		glDeleteBuffers(1, &page->indexBuffer);
+		_memoryTracker.Free(kMemoryGeometry, page->GetMemorySize());
+		page->vertexBuffer = vertexBuffer;
+		page->indexBuffer = indexBuffer;
+		SetupPageVertexArray(page);
+		_boundPage = page;
+
+		page->vertices.Reset(page->vertices.GetCapacity());
+		page->vertices.Allocate(vertexOffset);
+		page->indices.Reset(page->indices.GetCapacity());
+		page->indices.Allocate(indexOffset);
+		esLogMessage("[render] geometry page defragmented, %u vbos, %u vertices, %u indices", (unsigned int)page->vbos.size(), vertexOffset, indexOffset);
+	}
+	void ESDeviceImp::BindGeometryPage(GeometryPage* page)
+	{
+		if (_boundPage != page)
+		{
+			glBindVertexArray(page != nullptr ? page->vertexArrayID : 0);
+			_boundPage = page;
+		}
 	}
 
 	int ESDeviceImp::GetScreenWidth()
@@ -296,32 +807,209 @@ namespace RenderEngine {
 	void ESDeviceImp::SetGPUProgramParamAsInt(GPUProgramParam * param, int value)
 	{
 		glUniform1i(static_cast<GPUProgramParamImp*>(param)->location, value);
+		OverrideUniform(param);
 	}
 
 
 	void ESDeviceImp::SetGPUProgramParamAsFloat(GPUProgramParam* param, float value)
 	{
 		glUniform1f(static_cast<GPUProgramParamImp*>(param)->location, value);
+		OverrideUniform(param);
 	}
 
 	void ESDeviceImp::SetGPUProgramParamAsMat4(GPUProgramParam * param, const glm::mat4 & mat)
 	{
 		glUniformMatrix4fv(static_cast<GPUProgramParamImp*>(param)->location, 1, /*transpose=*/GL_FALSE, &mat[0][0]);
+		OverrideUniform(param);
 	}
 
 	void ESDeviceImp::SetGPUProgramParamAsIntArray(GPUProgramParam * param, const std::vector<int>& values)
 	{
 		glUniform1iv(static_cast<GPUProgramParamImp*>(param)->location, values.size(), &values[0]);
+		OverrideUniform(param);
 	}
 
 	void ESDeviceImp::SetGPUProgramParamAsFloatArray(GPUProgramParam * param,const std::vector<float>& values)
 	{
 		glUniform1fv(static_cast<GPUProgramParamImp*>(param)->location, values.size(), &values[0]);
+		OverrideUniform(param);
 	}
 
 	void ESDeviceImp::SetGPUProgramParamAsMat4Array(GPUProgramParam * param, const std::vector<glm::mat4>& values)
 	{
 		glUniformMatrix4fv(static_cast<GPUProgramParamImp*>(param)->location, values.size(), /*transpose=*/GL_FALSE, &values[0][0][0]);
+		OverrideUniform(param);
+	}
+
+	void ESDeviceImp::OverrideUniform(GPUProgramParam* param)
+	{
+		if (_boundMaterial == nullptr)
+		{
+			return;
+		}
+		GLint location = static_cast<GPUProgramParamImp*>(param)->location;
+		if (std::find(_overriddenUniforms.begin(), _overriddenUniforms.end(), location) == _overriddenUniforms.end())
+		{
+			_overriddenUniforms.push_back(location);
+		}
+	}
+
+	Material* ESDeviceImp::CreateMaterial(const MaterialDesc& desc)
+	{
+		MaterialImp* material = new MaterialImp(desc);
+		material->programID = static_cast<GPUProgramImp*>(desc.program)->ProgramID;
+		for (auto& t : desc.textures)
+		{
+			MaterialImp::TextureBinding binding = { t.index, static_cast<Texture2DImp*>(t.texture)->textureID };
+			material->textures.push_back(binding);
+		}
+		for (auto& u : desc.uniforms)
+		{
+			MaterialImp::Uniform uniform = { static_cast<GPUProgramParamImp*>(u.param)->location, u.type, u.value };
+			material->uniforms.push_back(uniform);
+		}
+		return material;
+	}
+
+	void ESDeviceImp::DeleteMaterial(Material* material)
+	{
+		if (material == _boundMaterial)
+		{
+			_boundMaterial = nullptr;
+		}
+		delete material;
+	}
+
+	void ESDeviceImp::UseMaterial(Material* material)
+	{
+		if (material == _boundMaterial && _overriddenUniforms.empty())
+		{
+			return;
+		}
+		MaterialImp* next = static_cast<MaterialImp*>(material);
+		MaterialImp* prev = static_cast<MaterialImp*>(_boundMaterial);
+		// Uniform values live in the program object, so they carry over only
+		// while the program stays the same
+		bool sameProgram = prev != nullptr && prev->programID == next->programID;
+		if (!sameProgram)
+		{
+			glUseProgram(next->programID);
+		}
+		for (auto& t : next->textures)
+		{
+			if (prev == nullptr || !prev->HasTexture(t))
+			{
+				glActiveTexture(GL_TEXTURE0 + t.unit);
+				glBindTexture(GL_TEXTURE_2D, t.textureID);
+			}
+		}
+		for (auto& u : next->uniforms)
+		{
+			if (sameProgram && prev->HasUniform(u) &&
+				std::find(_overriddenUniforms.begin(), _overriddenUniforms.end(), u.location) == _overriddenUniforms.end())
+			{
+				continue;
+			}
+			switch (u.type)
+			{
+			case kMaterialParamInt:
+				glUniform1i(u.location, (int)u.value[0][0]);
+				break;
+			case kMaterialParamFloat:
+				glUniform1f(u.location, u.value[0][0]);
+				break;
+			case kMaterialParamMat4:
+				glUniformMatrix4fv(u.location, 1, GL_FALSE, &u.value[0][0]);
+				break;
+			}
+		}
+		_boundMaterial = material;
+		_overriddenUniforms.clear();
+	}
+
+	PipelineState* ESDeviceImp::CreatePipelineState(const PipelineStateDesc& desc)
+	{
+		auto iter = _pipelineStates.find(desc.GetHash());
+		if (iter != _pipelineStates.end())
+		{
+			return iter->second;
+		}
+		PipelineState* state = new PipelineStateImp(desc);
+		_pipelineStates.insert(std::make_pair(desc.GetHash(), state));
+		return state;
+	}
+
+	static void ApplyBlend(BlendMode blend)
+	{
+		switch (blend)
+		{
+		case kBlendOpaque:
+			glDisable(GL_BLEND);
+			return;
+		case kBlendAlpha:
+			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			break;
+		case kBlendAdditive:
+			glBlendFunc(GL_ONE, GL_ONE);
+			break;
+		case kBlendPremultiplied:
+			glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+			break;
+		}
+		glEnable(GL_BLEND);
+	}
+
+	static void ApplyCull(CullMode cull)
+	{
+		if (cull == kCullNone)
+		{
+			glDisable(GL_CULL_FACE);
+			return;
+		}
+		glCullFace(cull == kCullBack ? GL_BACK : GL_FRONT);
+		glEnable(GL_CULL_FACE);
+	}
+
+	void ESDeviceImp::UsePipelineState(PipelineState* state)
+	{
+		if (state == _boundPipelineState)
+		{
+			return;
+		}
+		// States are shared per description, so a different object always
+		// differs in at least one field
+		const PipelineStateDesc& next = state->GetDesc();
+		bool all = _boundPipelineState == nullptr;
+		PipelineStateDesc prev = all ? next : _boundPipelineState->GetDesc();
+		if (all || next.blend != prev.blend)
+		{
+			ApplyBlend(next.blend);
+		}
+		if (all || next.cull != prev.cull)
+		{
+			ApplyCull(next.cull);
+		}
+		if (all || next.depthTest != prev.depthTest)
+		{
+			if (next.depthTest)
+				glEnable(GL_DEPTH_TEST);
+			else
+				glDisable(GL_DEPTH_TEST);
+		}
+		if (all || next.depthFunc != prev.depthFunc)
+		{
+			glDepthFunc(GL_NEVER + next.depthFunc);
+		}
+		if (all || next.depthWrite != prev.depthWrite)
+		{
+			glDepthMask(next.depthWrite ? GL_TRUE : GL_FALSE);
+		}
+		if (all || next.colorMask != prev.colorMask)
+		{
+			glColorMask((next.colorMask & kColorMaskR) != 0, (next.colorMask & kColorMaskG) != 0,
+				(next.colorMask & kColorMaskB) != 0, (next.colorMask & kColorMaskA) != 0);
+		}
+		_boundPipelineState = state;
 	}
 
 	void ESDeviceImp::AcqiureThreadOwnerShip()
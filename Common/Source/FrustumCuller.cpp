@@ -0,0 +1,188 @@
+#include "FrustumCuller.h"
+#include <math.h>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CULL_USE_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define CULL_USE_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace RenderEngine {
+
+	FrustumCuller::FrustumCuller()
+		:_count(0)
+	{
+		_stats.tested = 0;
+		_stats.culled = 0;
+	}
+
+	void FrustumCuller::Reserve(unsigned int count)
+	{
+		size_t padded = (count + 3) & ~3u;
+		if (_centerX.size() >= padded)
+		{
+			return;
+		}
+		_centerX.resize(padded, 0.0f);
+		_centerY.resize(padded, 0.0f);
+		_centerZ.resize(padded, 0.0f);
+		_extentX.resize(padded, 0.0f);
+		_extentY.resize(padded, 0.0f);
+		_extentZ.resize(padded, 0.0f);
+		_radius.resize(padded, 0.0f);
+	}
+
+	unsigned int FrustumCuller::Add(const glm::vec3& center, const glm::vec3& extents, float radius)
+	{
+		unsigned int index = _count++;
+		Reserve(_count);
+		SetBounds(index, center, extents, radius);
+		return index;
+	}
+
+	void FrustumCuller::SetBounds(unsigned int index, const glm::vec3& center, const glm::vec3& extents, float radius)
+	{
+		_centerX[index] = center.x;
+		_centerY[index] = center.y;
+		_centerZ[index] = center.z;
+		_extentX[index] = extents.x;
+		_extentY[index] = extents.y;
+		_extentZ[index] = extents.z;
+		_radius[index] = radius;
+	}
+
+	void FrustumCuller::Clear()
+	{
+		_count = 0;
+		_centerX.clear();
+		_centerY.clear();
+		_centerZ.clear();
+		_extentX.clear();
+		_extentY.clear();
+		_extentZ.clear();
+		_radius.clear();
+	}
+
+	void FrustumCuller::ExtractPlanes(const glm::mat4& m, glm::vec4 planes[6])
+	{
+		// Gribb & Hartmann, rows of the column-major matrix
+		glm::vec4 row0(m[0][0], m[1][0], m[2][0], m[3][0]);
+		glm::vec4 row1(m[0][1], m[1][1], m[2][1], m[3][1]);
+		glm::vec4 row2(m[0][2], m[1][2], m[2][2], m[3][2]);
+		glm::vec4 row3(m[0][3], m[1][3], m[2][3], m[3][3]);
+		planes[0] = row3 + row0;
+		planes[1] = row3 - row0;
+		planes[2] = row3 + row1;
+		planes[3] = row3 - row1;
+		planes[4] = row3 + row2;
+		planes[5] = row3 - row2;
+		for (int i = 0; i < 6; ++i)
+		{
+			float length = glm::length(glm::vec3(planes[i]));
+			if (length > 0.0f)
+			{
+				planes[i] /= length;
+			}
+		}
+	}
+
+	void FrustumCuller::TransformBounds(const glm::mat4& world, const glm::vec3& center, const glm::vec3& extents,
+		glm::vec3& worldCenter, glm::vec3& worldExtents)
+	{
+		worldCenter = glm::vec3(world * glm::vec4(center, 1.0f));
+		glm::mat3 absRotation(world);
+		for (int c = 0; c < 3; ++c)
+		{
+			absRotation[c] = glm::abs(absRotation[c]);
+		}
+		worldExtents = absRotation * extents;
+	}
+
+	const FrustumCuller::Stats& FrustumCuller::Cull(const glm::mat4& viewProj, std::vector<unsigned char>& visible, bool useSIMD)
+	{
+		glm::vec4 planes[6];
+		ExtractPlanes(viewProj, planes);
+		visible.resize(_count);
+
+		// An object is outside when its box, or its sphere, is behind any plane;
+		// both are conservative so the smaller projected radius wins.
+		unsigned int culled = 0;
+		unsigned int i = 0;
+#if defined(CULL_USE_SSE2)
+		if (useSIMD)
+		{
+			for (; i + 4 <= _count; i += 4)
+			{
+				__m128 cx = _mm_loadu_ps(&_centerX[i]), cy = _mm_loadu_ps(&_centerY[i]), cz = _mm_loadu_ps(&_centerZ[i]);
+				__m128 ex = _mm_loadu_ps(&_extentX[i]), ey = _mm_loadu_ps(&_extentY[i]), ez = _mm_loadu_ps(&_extentZ[i]);
+				__m128 radius = _mm_loadu_ps(&_radius[i]);
+				__m128 outside = _mm_setzero_ps();
+				for (int p = 0; p < 6; ++p)
+				{
+					const glm::vec4& plane = planes[p];
+					__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(plane.x)), _mm_mul_ps(cy, _mm_set1_ps(plane.y))),
+						_mm_add_ps(_mm_mul_ps(cz, _mm_set1_ps(plane.z)), _mm_set1_ps(plane.w)));
+					__m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ex, _mm_set1_ps(fabsf(plane.x))), _mm_mul_ps(ey, _mm_set1_ps(fabsf(plane.y)))),
+						_mm_mul_ps(ez, _mm_set1_ps(fabsf(plane.z))));
+					r = _mm_min_ps(r, radius);
+					outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(d, r), _mm_setzero_ps()));
+				}
+				int mask = _mm_movemask_ps(outside);
+				for (int lane = 0; lane < 4; ++lane)
+				{
+					visible[i + lane] = (mask >> lane) & 1 ? 0 : 1;
+				}
+				culled += (mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + ((mask >> 3) & 1);
+			}
+		}
+#elif defined(CULL_USE_NEON)
+		if (useSIMD)
+		{
+			for (; i + 4 <= _count; i += 4)
+			{
+				float32x4_t cx = vld1q_f32(&_centerX[i]), cy = vld1q_f32(&_centerY[i]), cz = vld1q_f32(&_centerZ[i]);
+				float32x4_t ex = vld1q_f32(&_extentX[i]), ey = vld1q_f32(&_extentY[i]), ez = vld1q_f32(&_extentZ[i]);
+				float32x4_t radius = vld1q_f32(&_radius[i]);
+				uint32x4_t outside = vdupq_n_u32(0);
+				for (int p = 0; p < 6; ++p)
+				{
+					const glm::vec4& plane = planes[p];
+					float32x4_t d = vmlaq_n_f32(vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(plane.w), cx, plane.x), cy, plane.y), cz, plane.z);
+					float32x4_t r = vmlaq_n_f32(vmlaq_n_f32(vmulq_n_f32(ex, fabsf(plane.x)), ey, fabsf(plane.y)), ez, fabsf(plane.z));
+					r = vminq_f32(r, radius);
+					outside = vorrq_u32(outside, vcltq_f32(vaddq_f32(d, r), vdupq_n_f32(0.0f)));
+				}
+				uint32_t lanes[4];
+				vst1q_u32(lanes, outside);
+				for (int lane = 0; lane < 4; ++lane)
+				{
+					visible[i + lane] = lanes[lane] ? 0 : 1;
+					culled += lanes[lane] ? 1 : 0;
+				}
+			}
+		}
+#endif
+		for (; i < _count; ++i)
+		{
+			glm::vec3 center(_centerX[i], _centerY[i], _centerZ[i]);
+			glm::vec3 extents(_extentX[i], _extentY[i], _extentZ[i]);
+			bool outside = false;
+			for (int p = 0; p < 6 && !outside; ++p)
+			{
+				const glm::vec4& plane = planes[p];
+				float d = center.x * plane.x + center.y * plane.y + (center.z * plane.z + plane.w);
+				float r = extents.x * fabsf(plane.x) + extents.y * fabsf(plane.y) + extents.z * fabsf(plane.z);
+				outside = d + std::min(r, _radius[i]) < 0.0f;
+			}
+			visible[i] = outside ? 0 : 1;
+			culled += outside ? 1 : 0;
+		}
+
+		_stats.tested = _count;
+		_stats.culled = culled;
+		return _stats;
+	}
+}
@@ -0,0 +1,91 @@
+#include "MemoryTracker.h"
+#include <assert.h>
+
+namespace RenderEngine {
+
+	MemoryTracker::MemoryTracker()
+		:_totalUsed(0), _totalPeak(0), _peakSinceCheck(0), _pendingFreeCount(0), _pendingFreeBytes(0), _budget(0), _overBudget(false)
+	{
+		for (int i = 0; i < kMemoryCategoryCount; ++i)
+		{
+			_used[i] = 0;
+			_peak[i] = 0;
+			_count[i] = 0;
+		}
+	}
+
+	void MemoryTracker::Allocate(MemoryCategory category, size_t bytes)
+	{
+		UpdatePeak(_peak[category], _used[category] += bytes);
+		++_count[category];
+		size_t total = _totalUsed += bytes;
+		UpdatePeak(_totalPeak, total);
+		UpdatePeak(_peakSinceCheck, total);
+	}
+
+	void MemoryTracker::Free(MemoryCategory category, size_t bytes)
+	{
+		assert(_used[category] >= bytes && _count[category] > 0);
+		_used[category] -= bytes;
+		--_count[category];
+		_totalUsed -= bytes;
+	}
+
+	void MemoryTracker::AddPendingFree(size_t bytes)
+	{
+		++_pendingFreeCount;
+		_pendingFreeBytes += bytes;
+	}
+
+	void MemoryTracker::RemovePendingFree(size_t bytes)
+	{
+		assert(_pendingFreeCount > 0 && _pendingFreeBytes >= bytes);
+		--_pendingFreeCount;
+		_pendingFreeBytes -= bytes;
+	}
+
+	void MemoryTracker::AddBudgetCallback(const BudgetCallback& callback)
+	{
+		_callbacks.push_back(callback);
+	}
+
+	bool MemoryTracker::CheckBudget()
+	{
+		// A spike that was freed again before this call still counts
+		size_t used = _peakSinceCheck.exchange(_totalUsed);
+		size_t budget = _budget;
+		bool over = budget > 0 && used > budget;
+		if (over && !_overBudget)
+		{
+			for (auto& callback : _callbacks)
+			{
+				callback(used, budget);
+			}
+		}
+		_overBudget = over;
+		return over;
+	}
+
+	const char* MemoryTracker::GetCategoryName(MemoryCategory category)
+	{
+		switch (category)
+		{
+		case kMemoryTexture:
+			return "texture";
+		case kMemoryGeometry:
+			return "geometry";
+		case kMemoryCommandBuffer:
+			return "command buffer";
+		default:
+			return "unknown";
+		}
+	}
+
+	void MemoryTracker::UpdatePeak(std::atomic<size_t>& peak, size_t value)
+	{
+		size_t current = peak;
+		while (value > current && !peak.compare_exchange_weak(current, value))
+		{
+		}
+	}
+}
@@ -1,10 +1,17 @@
 #include "Mesh.hpp"
+#include "MeshOptimizer.h"
+#include "MeshSimplifier.h"
+#include "FrustumCuller.h"
 #include "rapidjson/rapidjson.h"
 #include "rapidjson/document.h"
 #include "esUtil.h"
+#include <string.h>
+#include <math.h>
+#include "glm/gtc/matrix_transform.hpp"
+#include "glm/gtx/euler_angles.hpp"
 using namespace RenderEngine;
 using namespace  rapidjson;
-std::vector<Mesh::Ptr> Mesh::LoadMeshFromFile(const std::string & file)
+std::vector<Mesh::Ptr> Mesh::LoadMeshFromFile(const std::string & file, bool optimize, unsigned int lodLevels)
 {
 	auto meshes = std::vector<Mesh::Ptr>();
 	auto data = readFileData(file);
@@ -36,8 +43,7 @@ std::vector<Mesh::Ptr> Mesh::LoadMeshFromFile(const std::string & file)
 		}
 		// the number of interesting vertices information for us
 		auto verticesCount = verticesArray.Size() / verticesStep;
-		// number of faces is logically the size of the array divided by 3 (A, B, C)
-		auto mesh = std::make_shared<Mesh>( (*iter)["name"].GetString(), verticesCount, indicesArray.Size());
+		std::vector<VBOData::Vertex> vertices(verticesCount);
 
 		// Filling the Vertices array of our mesh first
 		for (unsigned index = 0; index < verticesCount; index++)
@@ -49,27 +55,225 @@ std::vector<Mesh::Ptr> Mesh::LoadMeshFromFile(const std::string & file)
 			float ny = verticesArray[index * verticesStep + 4].GetFloat();
 			float nz = -verticesArray[index * verticesStep + 5].GetFloat();
 
-			mesh->vboData->vertices[index].pos = glm::vec3(x, y, z);
-			mesh->vboData->vertices[index].normal = glm::vec3(nx, ny, nz);
+			vertices[index].pos = glm::vec3(x, y, z);
+			vertices[index].normal = glm::vec3(nx, ny, nz);
+			vertices[index].uv = glm::vec2(0, 0);
 			if (uvCount > 0)
 			{
 				float u = verticesArray[index * verticesStep + 6].GetFloat();
 				float v = verticesArray[index * verticesStep + 7].GetFloat();
-				mesh->vboData->vertices[index].uv = glm::vec2(u, v);
+				vertices[index].uv = glm::vec2(u, v);
 			}
 		}
 
 		// Then filling the Faces array
+		std::vector<unsigned int> indices(indicesArray.Size());
 		for (unsigned index = 0; index < indicesArray.Size(); index++)
 		{
-			mesh->vboData->indices[index] = indicesArray[index].GetInt();
+			indices[index] = indicesArray[index].GetInt();
+		}
+
+		std::string name = (*iter)["name"].GetString();
+		if (optimize)
+		{
+			auto stats = MeshOptimizer::Optimize(vertices, indices);
+			esLogMessage("[render] optimize mesh %s: vertices %u -> %u, ACMR %.3f -> %.3f, ATVR %.3f -> %.3f",
+				name.c_str(), stats.verticesBefore, stats.verticesAfter,
+				stats.acmrBefore, stats.acmrAfter, stats.atvrBefore, stats.atvrAfter);
 		}
 
 		// Getting the position you've set in Blender
 		auto position =(*iter)["position"].GetArray();
-		mesh->position = glm::vec3(position[0].GetFloat(), position[1].GetFloat(), position[2].GetFloat());
-		meshes.push_back(mesh);
+		for (auto& mesh : CreateFromGeometry(name, vertices, indices))
+		{
+			mesh->position = glm::vec3(position[0].GetFloat(), position[1].GetFloat(), position[2].GetFloat());
+			if (lodLevels > 0)
+			{
+				mesh->GenerateLODs(lodLevels);
+				for (size_t i = 1; i < mesh->lods.size(); ++i)
+				{
+					esLogMessage("[render] mesh %s LOD%u: %u triangles, error %.4f", name.c_str(),
+						(unsigned int)i, mesh->lods[i].indexCount / 3, mesh->lods[i].error);
+				}
+			}
+			meshes.push_back(mesh);
+		}
 	}
 	return meshes;
 			
 }
+
+std::vector<Mesh::Ptr> Mesh::CreateFromGeometry(const std::string& name, const std::vector<VBOData::Vertex>& vertices, const std::vector<unsigned int>& indices)
+{
+	const unsigned int kMaxVertices = 65536;
+	std::vector<Mesh::Ptr> meshes;
+	if (vertices.size() <= kMaxVertices)
+	{
+		auto mesh = std::make_shared<Mesh>(name, vertices.size(), indices.size());
+		if (!vertices.empty())
+			memcpy(mesh->vboData->vertices, &vertices[0], vertices.size() * sizeof(VBOData::Vertex));
+		for (size_t i = 0; i < indices.size(); ++i)
+		{
+			mesh->vboData->indices[i] = (unsigned short)indices[i];
+		}
+		mesh->ComputeBounds();
+		meshes.push_back(mesh);
+		return meshes;
+	}
+
+	// Greedy split in triangle order, each part gets its own 16-bit vertex numbering
+	const unsigned int kUnused = ~0u;
+	std::vector<unsigned int> remap(vertices.size(), kUnused);
+	std::vector<unsigned int> partVertices;
+	std::vector<unsigned int> partIndices;
+	auto flush = [&]() {
+		auto mesh = std::make_shared<Mesh>(name, partVertices.size(), partIndices.size());
+		for (size_t i = 0; i < partVertices.size(); ++i)
+		{
+			mesh->vboData->vertices[i] = vertices[partVertices[i]];
+			remap[partVertices[i]] = kUnused;
+		}
+		for (size_t i = 0; i < partIndices.size(); ++i)
+		{
+			mesh->vboData->indices[i] = (unsigned short)partIndices[i];
+		}
+		mesh->ComputeBounds();
+		meshes.push_back(mesh);
+		partVertices.clear();
+		partIndices.clear();
+	};
+	for (size_t t = 0; t + 2 < indices.size(); t += 3)
+	{
+		unsigned int newVertices = 0;
+		for (int k = 0; k < 3; ++k)
+		{
+			if (remap[indices[t + k]] == kUnused)
+				++newVertices;
+		}
+		if (partVertices.size() + newVertices > kMaxVertices)
+		{
+			flush();
+		}
+		for (int k = 0; k < 3; ++k)
+		{
+			unsigned int v = indices[t + k];
+			if (remap[v] == kUnused)
+			{
+				remap[v] = (unsigned int)partVertices.size();
+				partVertices.push_back(v);
+			}
+			partIndices.push_back(remap[v]);
+		}
+	}
+	if (!partIndices.empty())
+	{
+		flush();
+	}
+	return meshes;
+}
+
+void Mesh::ComputeBounds()
+{
+	if (vboData->verticesCount == 0)
+	{
+		boundsCenter = glm::vec3(0, 0, 0);
+		boundsExtents = glm::vec3(0, 0, 0);
+		boundsRadius = 0;
+		return;
+	}
+	glm::vec3 minPos = vboData->vertices[0].pos, maxPos = vboData->vertices[0].pos;
+	for (unsigned int i = 1; i < vboData->verticesCount; ++i)
+	{
+		minPos = glm::min(minPos, vboData->vertices[i].pos);
+		maxPos = glm::max(maxPos, vboData->vertices[i].pos);
+	}
+	boundsCenter = (minPos + maxPos) * 0.5f;
+	boundsExtents = (maxPos - minPos) * 0.5f;
+	float radiusSq = 0;
+	for (unsigned int i = 0; i < vboData->verticesCount; ++i)
+	{
+		glm::vec3 d = vboData->vertices[i].pos - boundsCenter;
+		radiusSq = std::max(radiusSq, glm::dot(d, d));
+	}
+	boundsRadius = sqrtf(radiusSq);
+}
+
+void Mesh::GetWorldBounds(glm::vec3& center, glm::vec3& extents) const
+{
+	auto world = glm::translate(glm::mat4(1.0f), position) * glm::eulerAngleXYZ(rotation.x, rotation.y, rotation.z);
+	FrustumCuller::TransformBounds(world, boundsCenter, boundsExtents, center, extents);
+}
+
+void Mesh::GenerateLODs(unsigned int levelCount)
+{
+	// Drop previously generated levels
+	lods.resize(1);
+	const LOD base = lods[0];
+	std::vector<VBOData::Vertex> vertices(vboData->vertices, vboData->vertices + vboData->verticesCount);
+	std::vector<unsigned int> baseIndices(vboData->indices + base.indexStart, vboData->indices + base.indexStart + base.indexCount);
+
+	// Never trade more than a tenth of the mesh size for fewer triangles
+	const float maxError = boundsRadius * 0.1f;
+	std::vector<std::vector<unsigned int> > levels;
+	unsigned int previousCount = base.indexCount;
+	for (unsigned int level = 0; level < levelCount; ++level)
+	{
+		unsigned int target = previousCount / 6 * 3;
+		std::vector<unsigned int> simplified;
+		float error = MeshSimplifier::Simplify(vertices, baseIndices, target, maxError, simplified);
+		// Not worth a level if it barely removes anything
+		if (simplified.empty() || simplified.size() > previousCount * 9 / 10)
+		{
+			break;
+		}
+		MeshOptimizer::OptimizeVertexCache(simplified, vboData->verticesCount);
+		LOD lod = { 0, (unsigned int)simplified.size(), error };
+		lods.push_back(lod);
+		levels.push_back(simplified);
+		previousCount = (unsigned int)simplified.size();
+	}
+	if (levels.empty())
+	{
+		return;
+	}
+
+	unsigned int totalIndices = base.indexCount;
+	for (auto& level : levels)
+	{
+		totalIndices += (unsigned int)level.size();
+	}
+	auto data = std::make_shared<VBOData>(vboData->verticesCount, totalIndices);
+	memcpy(data->vertices, vboData->vertices, vboData->GetVertexBufferSize());
+	memcpy(data->indices, vboData->indices + base.indexStart, base.indexCount * sizeof(unsigned short));
+	lods[0].indexStart = 0;
+	unsigned int offset = base.indexCount;
+	for (size_t i = 0; i < levels.size(); ++i)
+	{
+		lods[i + 1].indexStart = offset;
+		for (auto index : levels[i])
+		{
+			data->indices[offset++] = (unsigned short)index;
+		}
+	}
+	vboData = data;
+}
+
+unsigned int Mesh::SelectLOD(const glm::vec3& viewPosition, float fovY, float screenHeight, float maxPixelError) const
+{
+	float distance = glm::length(position + boundsCenter - viewPosition) - boundsRadius;
+	if (distance <= 0 || lods.size() < 2)
+	{
+		return 0;
+	}
+	float pixelsPerUnit = screenHeight / (2.0f * tanf(fovY * 0.5f) * distance);
+	unsigned int lod = 0;
+	for (unsigned int i = 1; i < lods.size(); ++i)
+	{
+		if (lods[i].error * pixelsPerUnit > maxPixelError)
+		{
+			break;
+		}
+		lod = i;
+	}
+	return lod;
+}
@@ -0,0 +1,458 @@
+#include "MeshOptimizer.h"
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <unordered_map>
+
+namespace RenderEngine {
+
+	namespace {
+		// Tuning from Tom Forsyth, "Linear-Speed Vertex Cache Optimisation"
+		const int kForsythCacheSize = 32;
+		const float kCacheDecayPower = 1.5f;
+		const float kLastTriScore = 0.75f;
+		const float kValenceBoostScale = 2.0f;
+		const float kValenceBoostPower = 0.5f;
+
+		const unsigned int kOverdrawCacheSize = 16;
+
+		float VertexScore(int cachePosition, unsigned int remainingTriangles)
+		{
+			if (remainingTriangles == 0)
+			{
+				return -1.0f;
+			}
+			float score = 0.0f;
+			if (cachePosition >= 0)
+			{
+				if (cachePosition < 3)
+				{
+					// The last triangle's vertices score a fixed amount so that
+					// the next triangle does not simply reuse the same edge
+					score = kLastTriScore;
+				}
+				else
+				{
+					float scaled = 1.0f - float(cachePosition - 3) / (kForsythCacheSize - 3);
+					score = powf(scaled, kCacheDecayPower);
+				}
+			}
+			score += kValenceBoostScale * powf((float)remainingTriangles, -kValenceBoostPower);
+			return score;
+		}
+
+		// FIFO post-transform cache simulation using per-vertex timestamps
+		class FIFOCache
+		{
+		public:
+			FIFOCache(unsigned int vertexCount, unsigned int cacheSize)
+				:_cacheSize(cacheSize), _timestamp(cacheSize + 1), _time(vertexCount, 0) {}
+			bool Access(unsigned int vertex)
+			{
+				if (_timestamp - _time[vertex] > _cacheSize)
+				{
+					_time[vertex] = _timestamp++;
+					return false;
+				}
+				return true;
+			}
+			unsigned int AccessTriangle(const unsigned int* tri)
+			{
+				return (Access(tri[0]) ? 0 : 1) + (Access(tri[1]) ? 0 : 1) + (Access(tri[2]) ? 0 : 1);
+			}
+			void Reset()
+			{
+				_timestamp += _cacheSize + 1;
+			}
+		private:
+			unsigned int _cacheSize;
+			unsigned int _timestamp;
+			std::vector<unsigned int> _time;
+		};
+
+		unsigned int CountCacheMisses(const std::vector<unsigned int>& indices, unsigned int vertexCount, unsigned int cacheSize)
+		{
+			FIFOCache cache(vertexCount, cacheSize);
+			unsigned int misses = 0;
+			for (size_t i = 0; i + 2 < indices.size(); i += 3)
+			{
+				misses += cache.AccessTriangle(&indices[i]);
+			}
+			return misses;
+		}
+
+		struct VertexHash
+		{
+			size_t operator()(const VBOData::Vertex& v) const
+			{
+				unsigned int words[sizeof(VBOData::Vertex) / 4];
+				memcpy(words, &v, sizeof(words));
+				size_t h = 2166136261u;
+				for (auto w : words)
+				{
+					h = (h ^ w) * 16777619u;
+				}
+				return h;
+			}
+		};
+		struct VertexEqual
+		{
+			bool operator()(const VBOData::Vertex& a, const VBOData::Vertex& b) const
+			{
+				return memcmp(&a, &b, sizeof(VBOData::Vertex)) == 0;
+			}
+		};
+
+		struct OverdrawCluster
+		{
+			unsigned int begin;
+			unsigned int end;
+			float sortKey;
+		};
+	}
+
+	unsigned int MeshOptimizer::WeldVertices(std::vector<VBOData::Vertex>& vertices, std::vector<unsigned int>& indices)
+	{
+		std::unordered_map<VBOData::Vertex, unsigned int, VertexHash, VertexEqual> unique;
+		unique.reserve(vertices.size());
+		std::vector<unsigned int> remap(vertices.size());
+		std::vector<VBOData::Vertex> welded;
+		welded.reserve(vertices.size());
+		for (size_t i = 0; i < vertices.size(); ++i)
+		{
+			auto result = unique.insert(std::make_pair(vertices[i], (unsigned int)welded.size()));
+			if (result.second)
+			{
+				welded.push_back(vertices[i]);
+			}
+			remap[i] = result.first->second;
+		}
+		for (auto& index : indices)
+		{
+			index = remap[index];
+		}
+		vertices.swap(welded);
+		return (unsigned int)vertices.size();
+	}
+
+	void MeshOptimizer::OptimizeVertexCache(std::vector<unsigned int>& indices, unsigned int vertexCount)
+	{
+		const size_t triCount = indices.size() / 3;
+		if (triCount == 0)
+		{
+			return;
+		}
+
+		// Vertex -> triangle adjacency, trimmed as triangles get emitted
+		std::vector<unsigned int> remaining(vertexCount, 0);
+		for (size_t i = 0; i < triCount * 3; ++i)
+		{
+			remaining[indices[i]]++;
+		}
+		std::vector<unsigned int> adjacencyOffset(vertexCount + 1, 0);
+		for (unsigned int v = 0; v < vertexCount; ++v)
+		{
+			adjacencyOffset[v + 1] = adjacencyOffset[v] + remaining[v];
+		}
+		std::vector<unsigned int> adjacency(triCount * 3);
+		{
+			std::vector<unsigned int> cursor(adjacencyOffset.begin(), adjacencyOffset.end() - 1);
+			for (size_t i = 0; i < triCount * 3; ++i)
+			{
+				adjacency[cursor[indices[i]]++] = (unsigned int)(i / 3);
+			}
+		}
+
+		std::vector<int> cachePosition(vertexCount, -1);
+		std::vector<float> vertexScore(vertexCount);
+		for (unsigned int v = 0; v < vertexCount; ++v)
+		{
+			vertexScore[v] = VertexScore(-1, remaining[v]);
+		}
+		std::vector<float> triScore(triCount);
+		std::vector<char> emitted(triCount, 0);
+		int best = 0;
+		for (size_t t = 0; t < triCount; ++t)
+		{
+			const unsigned int* tri = &indices[t * 3];
+			triScore[t] = vertexScore[tri[0]] + vertexScore[tri[1]] + vertexScore[tri[2]];
+			if (triScore[t] > triScore[best])
+			{
+				best = (int)t;
+			}
+		}
+
+		std::vector<unsigned int> output;
+		output.reserve(triCount * 3);
+		unsigned int cache[kForsythCacheSize + 3];
+		unsigned int cacheCount = 0;
+		size_t scanCursor = 0;
+
+		for (size_t emittedCount = 0; emittedCount < triCount; ++emittedCount)
+		{
+			if (best < 0)
+			{
+				// Nothing adjacent to the cache is left, continue with the next unused triangle
+				while (emitted[scanCursor])
+				{
+					++scanCursor;
+				}
+				best = (int)scanCursor;
+			}
+			const unsigned int tri[3] = { indices[best * 3], indices[best * 3 + 1], indices[best * 3 + 2] };
+			output.insert(output.end(), tri, tri + 3);
+			emitted[best] = 1;
+
+			for (int k = 0; k < 3; ++k)
+			{
+				unsigned int v = tri[k];
+				unsigned int* adj = &adjacency[adjacencyOffset[v]];
+				unsigned int* last = adj + remaining[v] - 1;
+				for (unsigned int* it = adj; it <= last; ++it)
+				{
+					if (*it == (unsigned int)best)
+					{
+						std::swap(*it, *last);
+						break;
+					}
+				}
+				remaining[v]--;
+			}
+
+			unsigned int newCache[kForsythCacheSize + 3];
+			unsigned int newCount = 0;
+			for (int k = 0; k < 3; ++k)
+			{
+				newCache[newCount++] = tri[k];
+			}
+			for (unsigned int i = 0; i < cacheCount; ++i)
+			{
+				unsigned int v = cache[i];
+				if (v != tri[0] && v != tri[1] && v != tri[2])
+				{
+					newCache[newCount++] = v;
+				}
+			}
+
+			for (unsigned int i = 0; i < newCount; ++i)
+			{
+				unsigned int v = newCache[i];
+				cachePosition[v] = i < (unsigned int)kForsythCacheSize ? (int)i : -1;
+				vertexScore[v] = VertexScore(cachePosition[v], remaining[v]);
+			}
+
+			best = -1;
+			float bestScore = -1.0f;
+			for (unsigned int i = 0; i < newCount; ++i)
+			{
+				unsigned int v = newCache[i];
+				const unsigned int* adj = &adjacency[adjacencyOffset[v]];
+				for (unsigned int j = 0; j < remaining[v]; ++j)
+				{
+					unsigned int t = adj[j];
+					const unsigned int* other = &indices[t * 3];
+					triScore[t] = vertexScore[other[0]] + vertexScore[other[1]] + vertexScore[other[2]];
+					if (triScore[t] > bestScore)
+					{
+						bestScore = triScore[t];
+						best = (int)t;
+					}
+				}
+			}
+
+			cacheCount = std::min(newCount, (unsigned int)kForsythCacheSize);
+			memcpy(cache, newCache, cacheCount * sizeof(unsigned int));
+		}
+
+		indices.swap(output);
+	}
+
+	void MeshOptimizer::OptimizeOverdraw(std::vector<unsigned int>& indices, const std::vector<VBOData::Vertex>& vertices, float threshold)
+	{
+		const unsigned int triCount = (unsigned int)(indices.size() / 3);
+		if (triCount == 0)
+		{
+			return;
+		}
+
+		// Hard boundaries: triangles that miss the cache on all three vertices
+		// start a new cluster, reordering there costs nothing
+		std::vector<unsigned int> hard;
+		{
+			FIFOCache cache((unsigned int)vertices.size(), kOverdrawCacheSize);
+			for (unsigned int t = 0; t < triCount; ++t)
+			{
+				if (cache.AccessTriangle(&indices[t * 3]) == 3)
+				{
+					hard.push_back(t);
+				}
+			}
+			if (hard.empty() || hard[0] != 0)
+			{
+				hard.insert(hard.begin(), 0);
+			}
+			hard.push_back(triCount);
+		}
+
+		// Soft boundaries: split hard clusters further as long as the extra
+		// cache resets keep the cluster ACMR within the threshold
+		std::vector<OverdrawCluster> clusters;
+		FIFOCache cache((unsigned int)vertices.size(), kOverdrawCacheSize);
+		for (size_t c = 0; c + 1 < hard.size(); ++c)
+		{
+			unsigned int begin = hard[c];
+			unsigned int end = hard[c + 1];
+			cache.Reset();
+			unsigned int clusterMisses = 0;
+			for (unsigned int t = begin; t < end; ++t)
+			{
+				clusterMisses += cache.AccessTriangle(&indices[t * 3]);
+			}
+			float limit = threshold * clusterMisses / (end - begin);
+
+			cache.Reset();
+			unsigned int start = begin;
+			unsigned int misses = 0;
+			for (unsigned int t = begin; t < end; ++t)
+			{
+				misses += cache.AccessTriangle(&indices[t * 3]);
+				if (t + 1 < end && float(misses) / (t + 1 - start) <= limit)
+				{
+					OverdrawCluster cluster = { start, t + 1, 0.0f };
+					clusters.push_back(cluster);
+					start = t + 1;
+					misses = 0;
+					cache.Reset();
+				}
+			}
+			OverdrawCluster cluster = { start, end, 0.0f };
+			clusters.push_back(cluster);
+		}
+
+		glm::vec3 meshCentroid(0.0f);
+		float meshArea = 0.0f;
+		for (unsigned int t = 0; t < triCount; ++t)
+		{
+			const glm::vec3& a = vertices[indices[t * 3]].pos;
+			const glm::vec3& b = vertices[indices[t * 3 + 1]].pos;
+			const glm::vec3& c = vertices[indices[t * 3 + 2]].pos;
+			float area = glm::length(glm::cross(b - a, c - a));
+			meshCentroid += (a + b + c) * (area / 3.0f);
+			meshArea += area;
+		}
+		meshCentroid /= std::max(meshArea, 1e-20f);
+
+		// Clusters facing away from the mesh center are likely in front, draw them first
+		for (auto& cluster : clusters)
+		{
+			glm::vec3 centroid(0.0f);
+			glm::vec3 normal(0.0f);
+			float area = 0.0f;
+			for (unsigned int t = cluster.begin; t < cluster.end; ++t)
+			{
+				const glm::vec3& a = vertices[indices[t * 3]].pos;
+				const glm::vec3& b = vertices[indices[t * 3 + 1]].pos;
+				const glm::vec3& c = vertices[indices[t * 3 + 2]].pos;
+				glm::vec3 n = glm::cross(b - a, c - a);
+				float triArea = glm::length(n);
+				centroid += (a + b + c) * (triArea / 3.0f);
+				normal += n;
+				area += triArea;
+			}
+			centroid /= std::max(area, 1e-20f);
+			float normalLength = glm::length(normal);
+			cluster.sortKey = normalLength > 0.0f ? glm::dot(centroid - meshCentroid, normal / normalLength) : 0.0f;
+		}
+		std::stable_sort(clusters.begin(), clusters.end(), [](const OverdrawCluster& a, const OverdrawCluster& b) {
+			return a.sortKey > b.sortKey;
+		});
+
+		std::vector<unsigned int> output;
+		output.reserve(indices.size());
+		for (auto& cluster : clusters)
+		{
+			output.insert(output.end(), indices.begin() + cluster.begin * 3, indices.begin() + cluster.end * 3);
+		}
+		indices.swap(output);
+	}
+
+	void MeshOptimizer::OptimizeVertexFetch(std::vector<VBOData::Vertex>& vertices, std::vector<unsigned int>& indices)
+	{
+		const unsigned int kUnused = ~0u;
+		std::vector<unsigned int> remap(vertices.size(), kUnused);
+		std::vector<VBOData::Vertex> ordered;
+		ordered.reserve(vertices.size());
+		for (auto& index : indices)
+		{
+			if (remap[index] == kUnused)
+			{
+				remap[index] = (unsigned int)ordered.size();
+				ordered.push_back(vertices[index]);
+			}
+			index = remap[index];
+		}
+		vertices.swap(ordered);
+	}
+
+	float MeshOptimizer::ComputeACMR(const std::vector<unsigned int>& indices, unsigned int vertexCount, unsigned int cacheSize)
+	{
+		size_t triCount = indices.size() / 3;
+		if (triCount == 0)
+		{
+			return 0.0f;
+		}
+		return float(CountCacheMisses(indices, vertexCount, cacheSize)) / triCount;
+	}
+
+	float MeshOptimizer::ComputeATVR(const std::vector<unsigned int>& indices, unsigned int vertexCount, unsigned int cacheSize)
+	{
+		std::vector<char> used(vertexCount, 0);
+		unsigned int usedCount = 0;
+		for (auto index : indices)
+		{
+			if (!used[index])
+			{
+				used[index] = 1;
+				++usedCount;
+			}
+		}
+		if (usedCount == 0)
+		{
+			return 0.0f;
+		}
+		return float(CountCacheMisses(indices, vertexCount, cacheSize)) / usedCount;
+	}
+
+	MeshOptimizer::Stats MeshOptimizer::Optimize(std::vector<VBOData::Vertex>& vertices, std::vector<unsigned int>& indices, const Options& options)
+	{
+		Stats stats;
+		indices.resize(indices.size() / 3 * 3);
+		unsigned int vertexCount = (unsigned int)vertices.size();
+		stats.verticesBefore = (unsigned int)vertices.size();
+		stats.triangles = (unsigned int)(indices.size() / 3);
+		stats.acmrBefore = ComputeACMR(indices, vertexCount, options.statsCacheSize);
+		stats.atvrBefore = ComputeATVR(indices, vertexCount, options.statsCacheSize);
+
+		if (options.weldVertices)
+		{
+			WeldVertices(vertices, indices);
+		}
+		if (options.optimizeVertexCache)
+		{
+			OptimizeVertexCache(indices, (unsigned int)vertices.size());
+		}
+		if (options.optimizeOverdraw)
+		{
+			OptimizeOverdraw(indices, vertices, options.overdrawThreshold);
+		}
+		if (options.optimizeVertexFetch)
+		{
+			OptimizeVertexFetch(vertices, indices);
+		}
+
+		stats.verticesAfter = (unsigned int)vertices.size();
+		stats.acmrAfter = ComputeACMR(indices, stats.verticesAfter, options.statsCacheSize);
+		stats.atvrAfter = ComputeATVR(indices, stats.verticesAfter, options.statsCacheSize);
+		return stats;
+	}
+}
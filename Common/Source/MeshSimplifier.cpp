@@ -0,0 +1,282 @@
+#include "MeshSimplifier.h"
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <unordered_map>
+
+namespace RenderEngine {
+
+	namespace {
+		// Garland & Heckbert plane quadric, area weighted so that the error
+		// is a mean squared distance in mesh units
+		struct Quadric
+		{
+			double a00, a01, a02, a11, a12, a22;
+			double b0, b1, b2;
+			double c;
+			double w;
+
+			Quadric()
+				:a00(0), a01(0), a02(0), a11(0), a12(0), a22(0), b0(0), b1(0), b2(0), c(0), w(0) {}
+
+			static Quadric FromPlane(const glm::dvec3& n, double d, double weight)
+			{
+				Quadric q;
+				q.a00 = weight * n.x * n.x;
+				q.a01 = weight * n.x * n.y;
+				q.a02 = weight * n.x * n.z;
+				q.a11 = weight * n.y * n.y;
+				q.a12 = weight * n.y * n.z;
+				q.a22 = weight * n.z * n.z;
+				q.b0 = weight * n.x * d;
+				q.b1 = weight * n.y * d;
+				q.b2 = weight * n.z * d;
+				q.c = weight * d * d;
+				q.w = weight;
+				return q;
+			}
+
+			Quadric& operator+=(const Quadric& o)
+			{
+				a00 += o.a00; a01 += o.a01; a02 += o.a02;
+				a11 += o.a11; a12 += o.a12; a22 += o.a22;
+				b0 += o.b0; b1 += o.b1; b2 += o.b2;
+				c += o.c;
+				w += o.w;
+				return *this;
+			}
+
+			double Error(const glm::vec3& p) const
+			{
+				double x = p.x, y = p.y, z = p.z;
+				double e = a00 * x * x + a11 * y * y + a22 * z * z
+					+ 2.0 * (a01 * x * y + a02 * x * z + a12 * y * z)
+					+ 2.0 * (b0 * x + b1 * y + b2 * z) + c;
+				return w > 0.0 ? fabs(e) / w : 0.0;
+			}
+		};
+
+		struct PositionHash
+		{
+			size_t operator()(const glm::vec3& p) const
+			{
+				unsigned int words[3];
+				memcpy(words, &p, sizeof(words));
+				size_t h = 2166136261u;
+				for (auto w : words)
+				{
+					h = (h ^ w) * 16777619u;
+				}
+				return h;
+			}
+		};
+
+		struct Collapse
+		{
+			unsigned int from;	// wedge that disappears
+			unsigned int to;	// wedge it is merged into
+			float error;
+			bool operator<(const Collapse& other) const { return error < other.error; }
+		};
+
+		inline unsigned long long EdgeKey(unsigned int a, unsigned int b)
+		{
+			if (a > b) std::swap(a, b);
+			return ((unsigned long long)a << 32) | b;
+		}
+	}
+
+	float MeshSimplifier::Simplify(const std::vector<VBOData::Vertex>& vertices, const std::vector<unsigned int>& indices,
+		unsigned int targetIndexCount, float targetError, std::vector<unsigned int>& result)
+	{
+		result = indices;
+		const unsigned int vertexCount = (unsigned int)vertices.size();
+		if (vertexCount == 0 || indices.size() < 3)
+		{
+			return 0.0f;
+		}
+
+		// Wedges sharing a position are one vertex topologically
+		std::vector<unsigned int> position(vertexCount);
+		std::vector<unsigned int> wedgeCount(vertexCount, 0);
+		{
+			std::unordered_map<glm::vec3, unsigned int, PositionHash> unique;
+			unique.reserve(vertexCount);
+			for (unsigned int i = 0; i < vertexCount; ++i)
+			{
+				auto it = unique.insert(std::make_pair(vertices[i].pos, i)).first;
+				position[i] = it->second;
+				++wedgeCount[it->second];
+			}
+		}
+
+		std::vector<Quadric> quadrics(vertexCount);
+		std::unordered_map<unsigned long long, unsigned int> edgeFaces;
+		for (size_t t = 0; t + 2 < result.size(); t += 3)
+		{
+			unsigned int p[3] = { position[result[t]], position[result[t + 1]], position[result[t + 2]] };
+			glm::dvec3 v0(vertices[p[0]].pos), v1(vertices[p[1]].pos), v2(vertices[p[2]].pos);
+			glm::dvec3 n = glm::cross(v1 - v0, v2 - v0);
+			double area = glm::length(n);
+			if (area > 0.0)
+			{
+				n /= area;
+				Quadric q = Quadric::FromPlane(n, -glm::dot(n, v0), area * 0.5);
+				for (int k = 0; k < 3; ++k)
+				{
+					quadrics[p[k]] += q;
+				}
+			}
+			for (int k = 0; k < 3; ++k)
+			{
+				++edgeFaces[EdgeKey(p[k], p[(k + 1) % 3])];
+			}
+		}
+
+		// UV seams, open borders and non-manifold edges keep their vertices
+		std::vector<char> locked(vertexCount, 0);
+		for (unsigned int i = 0; i < vertexCount; ++i)
+		{
+			if (wedgeCount[i] > 1)
+				locked[i] = 1;
+		}
+		for (auto& edge : edgeFaces)
+		{
+			if (edge.second != 2)
+			{
+				locked[edge.first >> 32] = 1;
+				locked[edge.first & 0xffffffff] = 1;
+			}
+		}
+
+		float resultError = 0.0f;
+		std::vector<Collapse> collapses;
+		std::vector<unsigned int> triangleOffsets(vertexCount + 1);
+		std::vector<unsigned int> adjacency;
+		std::vector<unsigned int> remap(vertexCount);
+		std::vector<char> touched(vertexCount);
+		while (result.size() > targetIndexCount)
+		{
+			collapses.clear();
+			for (size_t t = 0; t + 2 < result.size(); t += 3)
+			{
+				for (int k = 0; k < 3; ++k)
+				{
+					unsigned int a = result[t + k], b = result[t + (k + 1) % 3];
+					unsigned int pa = position[a], pb = position[b];
+					Quadric q = quadrics[pa];
+					q += quadrics[pb];
+					if (!locked[pa])
+					{
+						Collapse c = { a, b, (float)sqrt(q.Error(vertices[pb].pos)) };
+						collapses.push_back(c);
+					}
+					if (!locked[pb])
+					{
+						Collapse c = { b, a, (float)sqrt(q.Error(vertices[pa].pos)) };
+						collapses.push_back(c);
+					}
+				}
+			}
+			std::sort(collapses.begin(), collapses.end());
+
+			// Triangles around each position
+			std::fill(triangleOffsets.begin(), triangleOffsets.end(), 0);
+			for (size_t i = 0; i < result.size(); ++i)
+			{
+				++triangleOffsets[position[result[i]] + 1];
+			}
+			for (unsigned int i = 0; i < vertexCount; ++i)
+			{
+				triangleOffsets[i + 1] += triangleOffsets[i];
+			}
+			adjacency.resize(result.size());
+			{
+				std::vector<unsigned int> fill(triangleOffsets.begin(), triangleOffsets.end() - 1);
+				for (size_t i = 0; i < result.size(); ++i)
+				{
+					adjacency[fill[position[result[i]]]++] = (unsigned int)(i / 3);
+				}
+			}
+
+			for (unsigned int i = 0; i < vertexCount; ++i)
+			{
+				remap[i] = i;
+			}
+			std::fill(touched.begin(), touched.end(), 0);
+			size_t triangleCount = result.size() / 3;
+			unsigned int collapsed = 0;
+			for (auto& c : collapses)
+			{
+				if (c.error > targetError || triangleCount * 3 <= targetIndexCount)
+				{
+					break;
+				}
+				unsigned int pa = position[c.from], pb = position[c.to];
+				if (touched[pa] || touched[pb])
+				{
+					continue;
+				}
+
+				// Reject collapses that would flip or fold a surviving triangle
+				bool flips = false;
+				unsigned int removed = 0;
+				for (unsigned int j = triangleOffsets[pa]; j < triangleOffsets[pa + 1] && !flips; ++j)
+				{
+					const unsigned int* tri = &result[adjacency[j] * 3];
+					unsigned int p[3] = { position[tri[0]], position[tri[1]], position[tri[2]] };
+					if (p[0] == pb || p[1] == pb || p[2] == pb)
+					{
+						++removed;
+						continue;
+					}
+					glm::vec3 v[3] = { vertices[p[0]].pos, vertices[p[1]].pos, vertices[p[2]].pos };
+					glm::vec3 before = glm::cross(v[1] - v[0], v[2] - v[0]);
+					for (int k = 0; k < 3; ++k)
+					{
+						if (p[k] == pa)
+							v[k] = vertices[pb].pos;
+					}
+					glm::vec3 after = glm::cross(v[1] - v[0], v[2] - v[0]);
+					// Also rejects rotations past ~75 degrees, which leave slivers
+					flips = glm::dot(before, after) <= 0.25f * glm::length(before) * glm::length(after);
+				}
+				if (flips)
+				{
+					continue;
+				}
+
+				remap[c.from] = c.to;
+				quadrics[pb] += quadrics[pa];
+				touched[pa] = touched[pb] = 1;
+				for (unsigned int j = triangleOffsets[pa]; j < triangleOffsets[pa + 1]; ++j)
+				{
+					const unsigned int* tri = &result[adjacency[j] * 3];
+					touched[position[tri[0]]] = touched[position[tri[1]]] = touched[position[tri[2]]] = 1;
+				}
+				resultError = std::max(resultError, c.error);
+				triangleCount -= removed;
+				++collapsed;
+			}
+			if (collapsed == 0)
+			{
+				break;
+			}
+
+			size_t write = 0;
+			for (size_t t = 0; t + 2 < result.size(); t += 3)
+			{
+				unsigned int a = remap[result[t]], b = remap[result[t + 1]], c = remap[result[t + 2]];
+				if (position[a] == position[b] || position[b] == position[c] || position[a] == position[c])
+				{
+					continue;
+				}
+				result[write++] = a;
+				result[write++] = b;
+				result[write++] = c;
+			}
+			result.resize(write);
+		}
+		return resultError;
+	}
+}
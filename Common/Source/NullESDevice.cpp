@@ -0,0 +1,131 @@
+#include "NullESDevice.h"
+#include <map>
+
+namespace RenderEngine {
+
+	namespace {
+		class NullGPUProgramParam : public GPUProgramParam
+		{
+		public:
+			~NullGPUProgramParam() {}
+			virtual GPUProgramParam* GetRealParam() { return this; }
+		};
+
+		class NullGPUProgram : public GPUProgram
+		{
+		public:
+			// Params belong to their program, like the GL ones
+			std::map<std::string, NullGPUProgramParam*> params;
+			~NullGPUProgram()
+			{
+				for (auto& param : params)
+				{
+					delete param.second;
+				}
+			}
+			virtual GPUProgram* GetRealGUPProgram() { return this; }
+			virtual GPUProgramParam* GetParam(const std::string& name)
+			{
+				NullGPUProgramParam*& param = params[name];
+				if (param == nullptr)
+				{
+					param = new NullGPUProgramParam();
+				}
+				return param;
+			}
+		};
+
+		class NullTexture2D : public Texture2D
+		{
+		public:
+			~NullTexture2D() {}
+			virtual Texture2D* GetRealTexture2D() { return this; }
+		};
+
+		class NullVBO : public VBO
+		{
+		public:
+			~NullVBO() {}
+			virtual VBO* GetRealVBO() { return this; }
+		};
+
+		class NullMaterial : public Material
+		{
+		public:
+			NullMaterial(const MaterialDesc& desc) :Material(desc) {}
+			~NullMaterial() {}
+			virtual Material* GetRealMaterial() { return this; }
+		};
+
+		class NullPipelineState : public PipelineState
+		{
+		public:
+			NullPipelineState(const PipelineStateDesc& desc) :PipelineState(desc) {}
+			~NullPipelineState() {}
+			virtual PipelineState* GetRealPipelineState() { return this; }
+		};
+	}
+
+	NullESDevice::~NullESDevice()
+	{
+		for (auto& state : _pipelineStates)
+		{
+			delete static_cast<NullPipelineState*>(state.second);
+		}
+	}
+
+	Texture2D* NullESDevice::CreateTexture2D(const TextureData::Ptr& data)
+	{
+		return new NullTexture2D();
+	}
+
+	void NullESDevice::DeleteTexture2D(Texture2D* texture)
+	{
+		delete static_cast<NullTexture2D*>(texture);
+	}
+
+	VBO* NullESDevice::CreateVBO()
+	{
+		return new NullVBO();
+	}
+
+	void NullESDevice::DeleteVBO(VBO* vbo)
+	{
+		delete static_cast<NullVBO*>(vbo);
+	}
+
+	GPUProgram* NullESDevice::CreateGPUProgram(const std::string& vertexShader, const std::string& fragmentShader)
+	{
+		return new NullGPUProgram();
+	}
+
+	void NullESDevice::DeletGPUProgram(GPUProgram* program)
+	{
+		delete static_cast<NullGPUProgram*>(program);
+	}
+
+	GPUProgramParam* NullESDevice::GetGPUProgramParam(GPUProgram* program, const std::string& name)
+	{
+		return program->GetParam(name);
+	}
+
+	Material* NullESDevice::CreateMaterial(const MaterialDesc& desc)
+	{
+		return new NullMaterial(desc);
+	}
+
+	void NullESDevice::DeleteMaterial(Material* material)
+	{
+		delete static_cast<NullMaterial*>(material);
+	}
+
+	PipelineState* NullESDevice::CreatePipelineState(const PipelineStateDesc& desc)
+	{
+		PipelineState*& state = _pipelineStates[desc.GetHash()];
+		if (state == nullptr)
+		{
+			state = new NullPipelineState(desc);
+		}
+		return state;
+	}
+}
@@ -0,0 +1,341 @@
+#include "OcclusionCuller.h"
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define OCCLUSION_USE_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define OCCLUSION_USE_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace RenderEngine {
+
+	namespace {
+		// Triangles reaching further than this outside the screen are dropped,
+		// which only costs occlusion, never correctness
+		const float kGuardBand = 4096.0f;
+
+		typedef std::chrono::high_resolution_clock Clock;
+
+		inline float ElapsedMs(Clock::time_point begin)
+		{
+			return std::chrono::duration<float, std::milli>(Clock::now() - begin).count();
+		}
+
+		inline unsigned int RoundUp(unsigned int value, unsigned int multiple)
+		{
+			return (std::max(value, 1u) + multiple - 1) / multiple * multiple;
+		}
+	}
+
+	OcclusionCuller::OcclusionCuller(const Options& options)
+		:_options(options)
+	{
+		_width = RoundUp(options.width, kTileSize);
+		_height = RoundUp(options.height, kTileSize);
+		_tilesX = _width / kTileSize;
+		_tilesY = _height / kTileSize;
+		_depth.assign(_width * _height, 1.0f);
+		_hiZ.assign((_width / kHiZBlockSize) * (_height / kHiZBlockSize), 1.0f);
+		_tileBins.resize(_tilesX * _tilesY);
+		_stats = Stats();
+	}
+
+	void OcclusionCuller::BeginFrame(const glm::mat4& viewProj)
+	{
+		_viewProj = viewProj;
+		_triangles.clear();
+		std::fill(_depth.begin(), _depth.end(), 1.0f);
+		std::fill(_hiZ.begin(), _hiZ.end(), 1.0f);
+		_stats = Stats();
+	}
+
+	void OcclusionCuller::AddOccluder(const glm::mat4& world, const VBOData& data, unsigned int indexStart, unsigned int indexCount)
+	{
+		const glm::mat4 mvp = _viewProj * world;
+		const float width = (float)_width;
+		const float height = (float)_height;
+		for (unsigned int t = indexStart; t + 2 < indexStart + indexCount; t += 3)
+		{
+			glm::vec3 screen[3];
+			bool clipped = false;
+			for (int k = 0; k < 3 && !clipped; ++k)
+			{
+				glm::vec4 clip = mvp * glm::vec4(data.vertices[data.indices[t + k]].pos, 1.0f);
+				// No near plane clipping, triangles crossing it are simply not occluders
+				if (clip.w <= 0.0f || clip.z < -clip.w)
+				{
+					clipped = true;
+					break;
+				}
+				float invW = 1.0f / clip.w;
+				screen[k] = glm::vec3((clip.x * invW * 0.5f + 0.5f) * width,
+					(clip.y * invW * 0.5f + 0.5f) * height,
+					clip.z * invW * 0.5f + 0.5f);
+				clipped = fabsf(screen[k].x) > kGuardBand || fabsf(screen[k].y) > kGuardBand;
+			}
+			if (clipped)
+			{
+				continue;
+			}
+
+			const glm::vec3& v0 = screen[0];
+			const glm::vec3& v1 = screen[1];
+			const glm::vec3& v2 = screen[2];
+			float area = (v1.x - v0.x) * (v2.y - v0.y) - (v2.x - v0.x) * (v1.y - v0.y);
+			// Counter-clockwise front faces only
+			if (area <= 0.0f)
+			{
+				continue;
+			}
+
+			Triangle tri;
+			float minX = std::min(std::min(v0.x, v1.x), v2.x);
+			float maxX = std::max(std::max(v0.x, v1.x), v2.x);
+			float minY = std::min(std::min(v0.y, v1.y), v2.y);
+			float maxY = std::max(std::max(v0.y, v1.y), v2.y);
+			// Pixels whose centers fall inside the bounding box
+			tri.minX = std::max(0, (int)ceilf(minX - 0.5f));
+			tri.maxX = std::min((int)_width - 1, (int)floorf(maxX - 0.5f));
+			tri.minY = std::max(0, (int)ceilf(minY - 0.5f));
+			tri.maxY = std::min((int)_height - 1, (int)floorf(maxY - 0.5f));
+			if (tri.minX > tri.maxX || tri.minY > tri.maxY)
+			{
+				continue;
+			}
+			for (int e = 0; e < 3; ++e)
+			{
+				const glm::vec3& a = screen[e];
+				const glm::vec3& b = screen[(e + 1) % 3];
+				tri.edgeA[e] = a.y - b.y;
+				tri.edgeB[e] = b.x - a.x;
+				tri.edgeC[e] = -(tri.edgeA[e] * a.x + tri.edgeB[e] * a.y);
+			}
+			float invArea = 1.0f / area;
+			tri.depthA = ((v1.z - v0.z) * (v2.y - v0.y) - (v2.z - v0.z) * (v1.y - v0.y)) * invArea;
+			tri.depthB = ((v2.z - v0.z) * (v1.x - v0.x) - (v1.z - v0.z) * (v2.x - v0.x)) * invArea;
+			tri.depthC = v0.z - tri.depthA * v0.x - tri.depthB * v0.y;
+			_triangles.push_back(tri);
+		}
+	}
+
+	void OcclusionCuller::Rasterize()
+	{
+		Clock::time_point begin = Clock::now();
+		for (auto& bin : _tileBins)
+		{
+			bin.clear();
+		}
+		for (unsigned int i = 0; i < _triangles.size(); ++i)
+		{
+			const Triangle& tri = _triangles[i];
+			for (int ty = tri.minY / kTileSize; ty <= tri.maxY / kTileSize; ++ty)
+			{
+				for (int tx = tri.minX / kTileSize; tx <= tri.maxX / kTileSize; ++tx)
+				{
+					_tileBins[ty * _tilesX + tx].push_back(i);
+				}
+			}
+		}
+		_stats.occluderTriangles = (unsigned int)_triangles.size();
+
+		// Tiles own disjoint pixels and HiZ blocks, so workers never share writes
+		const unsigned int tileCount = _tilesX * _tilesY;
+		unsigned int threadCount = _options.threadCount;
+		if (threadCount == 0)
+		{
+			threadCount = std::max(1u, std::thread::hardware_concurrency());
+		}
+		if (_triangles.size() < _options.minParallelTriangles)
+		{
+			threadCount = 1;
+		}
+		threadCount = std::min(threadCount, tileCount);
+
+		std::atomic<unsigned int> nextTile(0);
+		auto worker = [this, &nextTile, tileCount]() {
+			for (unsigned int tile = nextTile++; tile < tileCount; tile = nextTile++)
+			{
+				RasterizeTile(tile);
+				BuildHiZ(tile);
+			}
+		};
+		std::vector<std::thread> threads;
+		for (unsigned int i = 1; i < threadCount; ++i)
+		{
+			threads.push_back(std::thread(worker));
+		}
+		worker();
+		for (auto& thread : threads)
+		{
+			thread.join();
+		}
+		_stats.rasterizeMs += ElapsedMs(begin);
+	}
+
+	void OcclusionCuller::RasterizeTile(unsigned int tile)
+	{
+		int tileMinX = (tile % _tilesX) * kTileSize;
+		int tileMinY = (tile / _tilesX) * kTileSize;
+		int tileMaxX = tileMinX + kTileSize - 1;
+		int tileMaxY = tileMinY + kTileSize - 1;
+		for (auto index : _tileBins[tile])
+		{
+			RasterizeTriangle(_triangles[index], tileMinX, tileMinY, tileMaxX, tileMaxY);
+		}
+	}
+
+	void OcclusionCuller::RasterizeTriangle(const Triangle& tri, int tileMinX, int tileMinY, int tileMaxX, int tileMaxY)
+	{
+		// The tile is a multiple of four wide, so aligning down keeps the span inside it
+		int x0 = std::max(tri.minX, tileMinX) & ~3;
+		int x1 = std::min(tri.maxX, tileMaxX);
+		int y0 = std::max(tri.minY, tileMinY);
+		int y1 = std::min(tri.maxY, tileMaxY);
+		for (int y = y0; y <= y1; ++y)
+		{
+			const float fy = y + 0.5f;
+			float rowEdge[3];
+			for (int e = 0; e < 3; ++e)
+			{
+				rowEdge[e] = tri.edgeB[e] * fy + tri.edgeC[e];
+			}
+			const float rowDepth = tri.depthB * fy + tri.depthC;
+			float* row = &_depth[y * _width];
+			int x = x0;
+#if defined(OCCLUSION_USE_SSE2)
+			if (_options.useSIMD)
+			{
+				const __m128 zero = _mm_setzero_ps();
+				const __m128 a0 = _mm_set1_ps(tri.edgeA[0]), a1 = _mm_set1_ps(tri.edgeA[1]), a2 = _mm_set1_ps(tri.edgeA[2]);
+				const __m128 r0 = _mm_set1_ps(rowEdge[0]), r1 = _mm_set1_ps(rowEdge[1]), r2 = _mm_set1_ps(rowEdge[2]);
+				const __m128 da = _mm_set1_ps(tri.depthA), dr = _mm_set1_ps(rowDepth);
+				__m128 fx = _mm_add_ps(_mm_set1_ps((float)x), _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f));
+				for (; x <= x1; x += 4)
+				{
+					__m128 e0 = _mm_add_ps(_mm_mul_ps(a0, fx), r0);
+					__m128 e1 = _mm_add_ps(_mm_mul_ps(a1, fx), r1);
+					__m128 e2 = _mm_add_ps(_mm_mul_ps(a2, fx), r2);
+					__m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+					__m128 depth = _mm_add_ps(_mm_mul_ps(da, fx), dr);
+					__m128 old = _mm_loadu_ps(row + x);
+					__m128 nearest = _mm_min_ps(old, depth);
+					_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, old)));
+					fx = _mm_add_ps(fx, _mm_set1_ps(4.0f));
+				}
+			}
+#elif defined(OCCLUSION_USE_NEON)
+			if (_options.useSIMD)
+			{
+				const float32x4_t zero = vdupq_n_f32(0.0f);
+				const float offsets[4] = { 0.5f, 1.5f, 2.5f, 3.5f };
+				float32x4_t fx = vaddq_f32(vdupq_n_f32((float)x), vld1q_f32(offsets));
+				for (; x <= x1; x += 4)
+				{
+					float32x4_t e0 = vaddq_f32(vmulq_n_f32(fx, tri.edgeA[0]), vdupq_n_f32(rowEdge[0]));
+					float32x4_t e1 = vaddq_f32(vmulq_n_f32(fx, tri.edgeA[1]), vdupq_n_f32(rowEdge[1]));
+					float32x4_t e2 = vaddq_f32(vmulq_n_f32(fx, tri.edgeA[2]), vdupq_n_f32(rowEdge[2]));
+					uint32x4_t inside = vandq_u32(vandq_u32(vcgeq_f32(e0, zero), vcgeq_f32(e1, zero)), vcgeq_f32(e2, zero));
+					float32x4_t depth = vaddq_f32(vmulq_n_f32(fx, tri.depthA), vdupq_n_f32(rowDepth));
+					float32x4_t old = vld1q_f32(row + x);
+					vst1q_f32(row + x, vbslq_f32(inside, vminq_f32(old, depth), old));
+					fx = vaddq_f32(fx, vdupq_n_f32(4.0f));
+				}
+			}
+#endif
+			for (; x <= x1; ++x)
+			{
+				const float fx = x + 0.5f;
+				if (tri.edgeA[0] * fx + rowEdge[0] >= 0.0f &&
+					tri.edgeA[1] * fx + rowEdge[1] >= 0.0f &&
+					tri.edgeA[2] * fx + rowEdge[2] >= 0.0f)
+				{
+					row[x] = std::min(row[x], tri.depthA * fx + rowDepth);
+				}
+			}
+		}
+	}
+
+	void OcclusionCuller::BuildHiZ(unsigned int tile)
+	{
+		const unsigned int blocksX = _width / kHiZBlockSize;
+		const unsigned int blocksPerTile = kTileSize / kHiZBlockSize;
+		unsigned int tileBlockX = (tile % _tilesX) * blocksPerTile;
+		unsigned int tileBlockY = (tile / _tilesX) * blocksPerTile;
+		for (unsigned int by = tileBlockY; by < tileBlockY + blocksPerTile; ++by)
+		{
+			for (unsigned int bx = tileBlockX; bx < tileBlockX + blocksPerTile; ++bx)
+			{
+				float farthest = 0.0f;
+				for (unsigned int y = by * kHiZBlockSize; y < (by + 1) * kHiZBlockSize; ++y)
+				{
+					const float* row = &_depth[y * _width + bx * kHiZBlockSize];
+					for (unsigned int x = 0; x < kHiZBlockSize; ++x)
+					{
+						farthest = std::max(farthest, row[x]);
+					}
+				}
+				_hiZ[by * blocksX + bx] = farthest;
+			}
+		}
+	}
+
+	bool OcclusionCuller::IsVisible(const glm::vec3& center, const glm::vec3& extents)
+	{
+		Clock::time_point begin = Clock::now();
+		++_stats.tested;
+		glm::vec2 screenMin(FLT_MAX), screenMax(-FLT_MAX);
+		float nearest = FLT_MAX;
+		bool visible = false;
+		for (int i = 0; i < 8 && !visible; ++i)
+		{
+			glm::vec3 corner = center + extents * glm::vec3(i & 1 ? 1.0f : -1.0f, i & 2 ? 1.0f : -1.0f, i & 4 ? 1.0f : -1.0f);
+			glm::vec4 clip = _viewProj * glm::vec4(corner, 1.0f);
+			// Boxes reaching behind the near plane are never occluded
+			if (clip.w <= 0.0f || clip.z < -clip.w)
+			{
+				visible = true;
+				break;
+			}
+			float invW = 1.0f / clip.w;
+			glm::vec2 screen((clip.x * invW * 0.5f + 0.5f) * _width, (clip.y * invW * 0.5f + 0.5f) * _height);
+			screenMin = glm::min(screenMin, screen);
+			screenMax = glm::max(screenMax, screen);
+			nearest = std::min(nearest, clip.z * invW * 0.5f + 0.5f);
+		}
+
+		if (!visible)
+		{
+			int minX = std::max(0, (int)floorf(screenMin.x));
+			int minY = std::max(0, (int)floorf(screenMin.y));
+			int maxX = std::min((int)_width - 1, (int)floorf(screenMax.x));
+			int maxY = std::min((int)_height - 1, (int)floorf(screenMax.y));
+			// Off screen boxes are left to frustum culling
+			visible = minX > maxX || minY > maxY;
+			const unsigned int blocksX = _width / kHiZBlockSize;
+			for (int by = minY / kHiZBlockSize; by <= maxY / kHiZBlockSize && !visible; ++by)
+			{
+				for (int bx = minX / kHiZBlockSize; bx <= maxX / kHiZBlockSize; ++bx)
+				{
+					if (_hiZ[by * blocksX + bx] >= nearest)
+					{
+						visible = true;
+						break;
+					}
+				}
+			}
+		}
+		if (!visible)
+		{
+			++_stats.occluded;
+		}
+		_stats.testMs += ElapsedMs(begin);
+		return visible;
+	}
+}
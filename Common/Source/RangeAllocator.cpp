@@ -0,0 +1,107 @@
+#include "RangeAllocator.h"
+#include <assert.h>
+#include <iterator>
+
+namespace RenderEngine {
+
+	RangeAllocator::RangeAllocator(unsigned int capacity)
+	{
+		Reset(capacity);
+	}
+
+	void RangeAllocator::Reset(unsigned int capacity)
+	{
+		_capacity = capacity;
+		_used = 0;
+		_byOffset.clear();
+		_bySize.clear();
+		if (capacity > 0)
+		{
+			Insert(0, capacity);
+		}
+	}
+
+	unsigned int RangeAllocator::Allocate(unsigned int size)
+	{
+		if (size == 0)
+		{
+			return kInvalidOffset;
+		}
+		auto fit = _bySize.lower_bound(size);
+		if (fit == _bySize.end())
+		{
+			return kInvalidOffset;
+		}
+		unsigned int offset = fit->second;
+		unsigned int blockSize = fit->first;
+		Erase(_byOffset.find(offset));
+		if (blockSize > size)
+		{
+			Insert(offset + size, blockSize - size);
+		}
+		_used += size;
+		return offset;
+	}
+
+	void RangeAllocator::Free(unsigned int offset, unsigned int size)
+	{
+		if (size == 0 || offset == kInvalidOffset)
+		{
+			return;
+		}
+		assert(offset + size <= _capacity && size <= _used);
+		_used -= size;
+
+		auto next = _byOffset.lower_bound(offset);
+		assert(next == _byOffset.end() || next->first >= offset + size);
+		if (next != _byOffset.end() && next->first == offset + size)
+		{
+			size += next->second;
+			auto erased = next++;
+			Erase(erased);
+		}
+		if (next != _byOffset.begin())
+		{
+			auto prev = std::prev(next);
+			assert(prev->first + prev->second <= offset);
+			if (prev->first + prev->second == offset)
+			{
+				offset = prev->first;
+				size += prev->second;
+				Erase(prev);
+			}
+		}
+		Insert(offset, size);
+	}
+
+	unsigned int RangeAllocator::GetLargestFree() const
+	{
+		return _bySize.empty() ? 0 : _bySize.rbegin()->first;
+	}
+
+	float RangeAllocator::GetFragmentation() const
+	{
+		unsigned int free = GetFree();
+		return free == 0 ? 0.0f : 1.0f - (float)GetLargestFree() / (float)free;
+	}
+
+	void RangeAllocator::Insert(unsigned int offset, unsigned int size)
+	{
+		_byOffset[offset] = size;
+		_bySize.insert(std::make_pair(size, offset));
+	}
+
+	void RangeAllocator::Erase(std::map<unsigned int, unsigned int>::iterator block)
+	{
+		auto range = _bySize.equal_range(block->second);
+		for (auto iter = range.first; iter != range.second; ++iter)
+		{
+			if (iter->second == block->first)
+			{
+				_bySize.erase(iter);
+				break;
+			}
+		}
+		_byOffset.erase(block);
+	}
+}
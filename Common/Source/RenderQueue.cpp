@@ -0,0 +1,236 @@
+#include "RenderQueue.h"
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+namespace RenderEngine {
+
+	namespace {
+		const unsigned int kLayerBits = 4;
+		const unsigned int kProgramBits = 10;
+		const unsigned int kMaterialBits = 13;
+		const unsigned int kVBOBits = 12;
+		const unsigned int kDepthBits = 24;
+		const unsigned int kRadixBits = 8;
+		const unsigned int kRadixSize = 1 << kRadixBits;
+
+		inline unsigned long long Mask(unsigned int bits)
+		{
+			return (1ull << bits) - 1;
+		}
+
+		// The bit pattern of a non-negative float grows with its value, so the
+		// top bits are a depth that needs no range
+		inline unsigned long long QuantizeDepth(float depth)
+		{
+			depth = std::max(depth, 0.0f);
+			unsigned int bits;
+			memcpy(&bits, &depth, sizeof(bits));
+			return bits >> (32 - kDepthBits);
+		}
+
+		template<typename Function>
+		void ParallelFor(unsigned int threadCount, const Function& function)
+		{
+			std::vector<std::thread> threads;
+			for (unsigned int i = 1; i < threadCount; ++i)
+			{
+				threads.push_back(std::thread(function, i));
+			}
+			function(0);
+			for (auto& thread : threads)
+			{
+				thread.join();
+			}
+		}
+	}
+
+	RenderQueue::RenderQueue(const Options& options)
+		:_options(options)
+		,_sorted(true)
+	{
+		_stats = Stats();
+		InvalidateState();
+	}
+
+	unsigned int RenderQueue::GetId(std::unordered_map<const void*, unsigned int>& ids, const void* object, unsigned int bits)
+	{
+		auto iter = ids.find(object);
+		if (iter == ids.end())
+		{
+			// Ids past the field width wrap, which only costs grouping
+			iter = ids.insert(std::make_pair(object, (unsigned int)ids.size())).first;
+		}
+		return iter->second & (unsigned int)Mask(bits);
+	}
+
+	unsigned long long RenderQueue::MakeKey(const Packet& packet, float depth, unsigned int layer, bool transparent)
+	{
+		unsigned long long program = GetId(_programIds, packet.material->GetDesc().program, kProgramBits);
+		unsigned long long material = GetId(_materialIds, packet.material, kMaterialBits);
+		unsigned long long vbo = GetId(_vboIds, packet.vbo, kVBOBits);
+		unsigned long long quantized = QuantizeDepth(depth);
+		unsigned long long key = (unsigned long long)(layer & (kLayerCount - 1)) << (64 - kLayerBits);
+		if (transparent)
+		{
+			key |= 1ull << (63 - kLayerBits);
+			key |= (~quantized & Mask(kDepthBits)) << (kProgramBits + kMaterialBits + kVBOBits);
+			key |= program << (kMaterialBits + kVBOBits);
+			key |= material << kVBOBits;
+			key |= vbo;
+		}
+		else
+		{
+			key |= program << (kMaterialBits + kVBOBits + kDepthBits);
+			key |= material << (kVBOBits + kDepthBits);
+			key |= vbo << kDepthBits;
+			key |= quantized;
+		}
+		return key;
+	}
+
+	void RenderQueue::Submit(const Packet& packet, float depth, unsigned int layer, bool transparent)
+	{
+		SortItem item = { MakeKey(packet, depth, layer, transparent), (unsigned int)_packets.size() };
+		_packets.push_back(packet);
+		_items.push_back(item);
+		_sorted = false;
+	}
+
+	void RenderQueue::Sort()
+	{
+		auto begin = std::chrono::high_resolution_clock::now();
+		_stats = Stats();
+		const unsigned int count = (unsigned int)_items.size();
+		unsigned int threadCount = _options.threadCount;
+		if (threadCount == 0)
+		{
+			threadCount = std::max(1u, std::thread::hardware_concurrency());
+		}
+		if (count < _options.minParallelCount)
+		{
+			threadCount = 1;
+		}
+		const unsigned int chunk = (count + threadCount - 1) / std::max(threadCount, 1u);
+		_scratch.resize(count);
+		_histograms.resize(threadCount * kRadixSize);
+
+		// Stable LSD radix sort, one byte per pass. Each thread histograms and
+		// then scatters its own contiguous chunk, which keeps the sort stable.
+		for (unsigned int shift = 0; shift < 64 && count > 1; shift += kRadixBits)
+		{
+			std::fill(_histograms.begin(), _histograms.end(), 0);
+			ParallelFor(threadCount, [this, shift, chunk, count](unsigned int thread) {
+				unsigned int* histogram = &_histograms[thread * kRadixSize];
+				unsigned int end = std::min(count, (thread + 1) * chunk);
+				for (unsigned int i = thread * chunk; i < end; ++i)
+				{
+					++histogram[(_items[i].key >> shift) & (kRadixSize - 1)];
+				}
+			});
+
+			// Passes where every key has the same byte would not move anything
+			unsigned int offset = 0;
+			bool skip = false;
+			for (unsigned int digit = 0; digit < kRadixSize && !skip; ++digit)
+			{
+				unsigned int total = 0;
+				for (unsigned int thread = 0; thread < threadCount; ++thread)
+				{
+					unsigned int& slot = _histograms[thread * kRadixSize + digit];
+					unsigned int value = slot;
+					slot = offset + total;
+					total += value;
+				}
+				skip = total == count;
+				offset += total;
+			}
+			if (skip)
+			{
+				continue;
+			}
+
+			ParallelFor(threadCount, [this, shift, chunk, count](unsigned int thread) {
+				unsigned int* offsets = &_histograms[thread * kRadixSize];
+				unsigned int end = std::min(count, (thread + 1) * chunk);
+				for (unsigned int i = thread * chunk; i < end; ++i)
+				{
+					_scratch[offsets[(_items[i].key >> shift) & (kRadixSize - 1)]++] = _items[i];
+				}
+			});
+			_items.swap(_scratch);
+		}
+		_sorted = true;
+		_stats.sortMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - begin).count();
+	}
+
+	void RenderQueue::Flush(ESDevice* device)
+	{
+		if (!_sorted)
+		{
+			Sort();
+		}
+		else
+		{
+			float sortMs = _stats.sortMs;
+			_stats = Stats();
+			_stats.sortMs = sortMs;
+		}
+		for (auto& item : _items)
+		{
+			const Packet& packet = _packets[item.index];
+			if (packet.material != _boundMaterial)
+			{
+				device->UseMaterial(packet.material);
+				_boundMaterial = packet.material;
+				++_stats.materialChanges;
+				// The material may upload the same uniform, so the MVP is sent again
+				_boundParam = nullptr;
+				GPUProgram* program = packet.material->GetDesc().program;
+				if (program != _boundProgram)
+				{
+					_boundProgram = program;
+					++_stats.programChanges;
+				}
+			}
+			if (packet.state != _boundState)
+			{
+				device->UsePipelineState(packet.state);
+				_boundState = packet.state;
+				++_stats.pipelineChanges;
+			}
+			if (packet.mvpParam != nullptr && (packet.mvpParam != _boundParam || packet.mvp != _boundMVP))
+			{
+				device->SetGPUProgramParamAsMat4(packet.mvpParam, packet.mvp);
+				_boundParam = packet.mvpParam;
+				_boundMVP = packet.mvp;
+				++_stats.uniformChanges;
+			}
+			if (packet.vbo != _boundVBO)
+			{
+				_boundVBO = packet.vbo;
+				++_stats.vboChanges;
+			}
+			device->DrawVBORange(packet.vbo, packet.indexStart, packet.indexCount);
+			++_stats.draws;
+		}
+		Clear();
+	}
+
+	void RenderQueue::Clear()
+	{
+		_packets.clear();
+		_items.clear();
+		_sorted = true;
+	}
+
+	void RenderQueue::InvalidateState()
+	{
+		_boundProgram = nullptr;
+		_boundMaterial = nullptr;
+		_boundState = nullptr;
+		_boundVBO = nullptr;
+		_boundParam = nullptr;
+	}
+}
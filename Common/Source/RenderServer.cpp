@@ -0,0 +1,44 @@
+#include "RenderServer.h"
+
+namespace RenderEngine {
+
+	RenderServer::RenderServer(ESDevice* device)
+		:_device(device), _frameCount(0)
+	{
+		_device->UsePipelineState(_device->CreatePipelineState(PipelineStateDesc()));
+	}
+
+	RenderServer::~RenderServer()
+	{
+		// The decoders share _device, so they are never cleaned up themselves
+		for (auto client : _clients)
+		{
+			delete client;
+		}
+		delete _device;
+	}
+
+	bool RenderServer::AddClient(const std::string& name)
+	{
+		ThreadBufferESDevice* client = new ThreadBufferESDevice(_device, false);
+		if (!client->ServeSharedBuffer(name))
+		{
+			delete client;
+			return false;
+		}
+		_clients.push_back(client);
+		esLogMessage("[render] serving %s", name.c_str());
+		return true;
+	}
+
+	unsigned int RenderServer::RunOnce()
+	{
+		unsigned int frames = 0;
+		for (auto client : _clients)
+		{
+			frames += client->RunPendingFrame() ? 1 : 0;
+		}
+		_frameCount += frames;
+		return frames;
+	}
+}
@@ -3,9 +3,80 @@
 #include "RingBuffer.h"
 #include "PlatformMutex.h"
 #include "PlatformSemaphore.h"
+#include "CommandCapture.h"
 #include <assert.h>
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+#ifdef RINGBUFFER_SHARED_MEMORY
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef RINGBUFFER_MIRRORED_MEMORY
+#include <sys/syscall.h>
+#endif
 #define min(a,b)            (((a) < (b)) ? (a) : (b))
+#define max(a,b)            (((a) > (b)) ? (a) : (b))
+
+// Follows each chunk of a kStreamingCheckedChunks payload
+static const int kStreamingMagic = 1234;
+
+// Start of a shared ring, the data follows at kDataOffset
+struct RingBuffer::SharedHeader
+{
+	enum { kReadyMagic = 0x52494E47 };
+	static const unsigned int kDataOffset;
+
+	SharedHeader(UInt32 size)
+		: readSemaphore(true), writeSemaphore(true), bufferSize(size), ready(0) {}
+
+	BufferHeader header;
+	Semaphore readSemaphore;
+	Semaphore writeSemaphore;
+	UInt32 bufferSize;
+	// Written last, so a process that maps the object early doesn't use it half made
+	std::atomic<UInt32> ready;
+};
+
+const unsigned int RingBuffer::SharedHeader::kDataOffset = (sizeof(RingBuffer::SharedHeader) + 63) & ~63u;
+
+// Heap blocks for large payloads, in power of two classes from
+// kLargePayloadSize up. The writer takes them, the reader gives them back.
+struct RingBuffer::PayloadPool
+{
+	enum
+	{
+		kClassCount = 8,
+		kMaxFreePerClass = 2
+	};
+	static int GetClass(size_t size)
+	{
+		int sizeClass = 0;
+		while (sizeClass < kClassCount && ((size_t)kLargePayloadSize << sizeClass) < size)
+			++sizeClass;
+		return sizeClass;
+	}
+	// Larger payloads get exactly their size and are never pooled
+	static size_t GetBlockSize(size_t size)
+	{
+		int sizeClass = GetClass(size);
+		return sizeClass < kClassCount ? (size_t)kLargePayloadSize << sizeClass : size;
+	}
+
+	PayloadPool() :bytesInFlight(0) {}
+	~PayloadPool()
+	{
+		for (int i = 0; i < kClassCount; ++i)
+			for (size_t j = 0; j < freeBlocks[i].size(); ++j)
+				delete[] freeBlocks[i][j];
+	}
 
+	Mutex mutex;
+	std::vector<char*> freeBlocks[kClassCount];
+	std::atomic<size_t> bytesInFlight;
+};
 
 RingBuffer::RingBuffer(size_t size)
 {
@@ -14,6 +85,11 @@ RingBuffer::RingBuffer(size_t size)
 	Create(size);
 }
 
+RingBuffer::RingBuffer()
+{
+	SetDefaults();
+}
+
 RingBuffer::~RingBuffer()
 {
 	Destroy();
@@ -22,42 +98,190 @@ RingBuffer::~RingBuffer()
 
 void RingBuffer::Create(size_t size)
 {
-	m_Reader = &m_Header.reader;
-	m_Writer = &m_Header.writer;
+	m_State = &m_Header;
 	if (size != 0)
 		m_Buffer = new char[size];
 	m_BufferSize = size;
-	m_Reader->Reset();
-	m_Writer->Reset();
-	m_Writer->bufferEnd = size;
+	m_Reader.Reset();
+	m_Writer.Reset();
+	m_Writer.bufferEnd = size;
+	m_State->Reset();
 
-	m_Mutex = new Mutex;
+	m_PayloadPool = new PayloadPool;
 	m_ReadSemaphore = new Semaphore;
 	m_WriteSemaphore = new Semaphore;
 	
 }
 
+bool RingBuffer::CreateMirrored(size_t size)
+{
+#ifdef RINGBUFFER_MIRRORED_MEMORY
+	Destroy();
+	size = Align(size, (size_t)sysconf(_SC_PAGESIZE));
+	assert(size >= 2 * kDefaultStep);
+	// Called through syscall, older C libraries don't wrap it
+	int fd = (int)syscall(SYS_memfd_create, "RingBuffer", 0);
+	if (fd == -1)
+		return false;
+	void* memory = MAP_FAILED;
+	if (ftruncate(fd, size) == 0)
+	{
+		// Reserve both halves first so nothing else lands in the second one
+		memory = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (memory != MAP_FAILED &&
+			(mmap(memory, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+			mmap((char*)memory + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED))
+		{
+			munmap(memory, 2 * size);
+			memory = MAP_FAILED;
+		}
+	}
+	close(fd);
+	if (memory == MAP_FAILED)
+		return false;
+	Create(0);
+	m_Buffer = (char*)memory;
+	m_BufferSize = size;
+	m_Writer.bufferEnd = size;
+	m_Mirrored = true;
+	return true;
+#else
+	return false;
+#endif
+}
+
 
 void RingBuffer::Destroy()
 {
 	if (m_Buffer == NULL) return;
-	delete m_Buffer;
-	m_Reader->Reset();
-	m_Writer->Reset();
+#ifdef RINGBUFFER_SHARED_MEMORY
+	if (m_Shared != NULL)
+	{
+		if (m_SharedOwner)
+		{
+			m_Shared->~SharedHeader();
+			shm_unlink(m_SharedName.c_str());
+		}
+		munmap(m_Shared, m_SharedSize);
+		SetDefaults();
+		return;
+	}
+#endif
+#ifdef RINGBUFFER_MIRRORED_MEMORY
+	if (m_Mirrored)
+		munmap(m_Buffer, 2 * m_BufferSize);
+	else
+#endif
+	delete[] m_Buffer;
+	m_Reader.Reset();
+	m_Writer.Reset();
 
-	delete m_Mutex;
 	delete m_ReadSemaphore;
 	delete m_WriteSemaphore;
+	delete m_PayloadPool;
 	
 	SetDefaults();
 }
 
 
-void RingBuffer::ReadStreamingData(void* data, size_t size, size_t alignment, size_t step)
+bool RingBuffer::CreateShared(const char* name, size_t size)
+{
+#ifdef RINGBUFFER_SHARED_MEMORY
+	assert(size >= 2 * kDefaultStep);
+	Destroy();
+	// A server that died without Destroy leaves its object behind
+	shm_unlink(name);
+	int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd == -1)
+		return false;
+	size_t mappedSize = SharedHeader::kDataOffset + size;
+	void* memory = ftruncate(fd, mappedSize) == 0 ? mmap(NULL, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (memory == MAP_FAILED)
+	{
+		shm_unlink(name);
+		return false;
+	}
+	SharedHeader* shared = new (memory) SharedHeader(size);
+	shared->header.Reset();
+	shared->ready.store(SharedHeader::kReadyMagic, std::memory_order_release);
+	MapShared(memory, mappedSize);
+	m_SharedOwner = true;
+	m_SharedName = name;
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool RingBuffer::OpenShared(const char* name)
+{
+#ifdef RINGBUFFER_SHARED_MEMORY
+	Destroy();
+	int fd = shm_open(name, O_RDWR, 0600);
+	if (fd == -1)
+		return false;
+	struct stat info;
+	void* memory = MAP_FAILED;
+	if (fstat(fd, &info) == 0 && (size_t)info.st_size > SharedHeader::kDataOffset)
+		memory = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (memory == MAP_FAILED)
+		return false;
+	SharedHeader* shared = (SharedHeader*)memory;
+	if (shared->ready.load(std::memory_order_acquire) != SharedHeader::kReadyMagic || SharedHeader::kDataOffset + shared->bufferSize != (size_t)info.st_size)
+	{
+		munmap(memory, info.st_size);
+		return false;
+	}
+	MapShared(memory, info.st_size);
+	return true;
+#else
+	return false;
+#endif
+}
+
+void RingBuffer::MapShared(void* memory, size_t mappedSize)
+{
+	m_Shared = (SharedHeader*)memory;
+	m_SharedSize = mappedSize;
+	m_State = &m_Shared->header;
+	m_Buffer = (char*)memory + SharedHeader::kDataOffset;
+	m_BufferSize = m_Shared->bufferSize;
+	// Each process keeps its own side's state, starting where the ring was left
+	UInt64 readerChecked = m_State->readerChecked.load(std::memory_order_acquire);
+	UInt64 writerChecked = m_State->writerChecked.load(std::memory_order_acquire);
+	m_Reader.bufferPos = CheckedPos(readerChecked);
+	m_Reader.bufferWraps = CheckedWraps(readerChecked);
+	m_Reader.bufferEnd = m_Reader.bufferPos;
+	m_Writer.bufferPos = CheckedPos(writerChecked);
+	m_Writer.bufferWraps = CheckedWraps(writerChecked);
+	m_Writer.bufferEnd = m_Writer.bufferPos;
+	m_ReadSemaphore = &m_Shared->readSemaphore;
+	m_WriteSemaphore = &m_Shared->writeSemaphore;
+}
+
+bool RingBuffer::IsReadDataAvailable() const
+{
+	return m_State->writerChecked.load(std::memory_order_acquire) != PackChecked(m_Reader);
+}
+
+void RingBuffer::ReadStreamingData(void* data, size_t size, size_t alignment)
 {
 	// This should not be size_t, as the GfxDevice may run across processes of different
 	// bitness, and the data serialized in the command buffer must match.
 	size_t sz = ReadValueType<UInt32>();
+	UInt32 mode = ReadValueType<UInt32>();
+	if (mode == kStreamingHeap)
+	{
+		char* block = ReadValueType<char*>();
+		ReadReleaseData();
+		if (data)
+			memcpy(data, block, size);
+		FreeLargePayload(block, sz);
+		return;
+	}
+	size_t step = ReadValueType<UInt32>();
 
 	char* dest = (char*)data;
 	for (size_t offset = 0; offset < size; offset += step)
@@ -67,7 +291,13 @@ void RingBuffer::ReadStreamingData(void* data, size_t size, size_t alignment, si
 		if (data)
 			memcpy(dest, src, bytes);
 
-		int magic = ReadValueType<int>();
+		if (mode == kStreamingCheckedChunks)
+		{
+			// Read whatever the build, the writer decides whether it is there
+			int magic = ReadValueType<int>();
+			assert(magic == kStreamingMagic);
+			(void)magic;
+		}
 
 		ReadReleaseData();
 		dest += step;
@@ -76,34 +306,56 @@ void RingBuffer::ReadStreamingData(void* data, size_t size, size_t alignment, si
 
 void RingBuffer::ReadReleaseData()
 {
-	if (m_Reader->checkedWraps == m_Reader->bufferWraps)
-	{
-		// We only update the position
-		m_Reader->checkedPos = m_Reader->bufferPos;
-	}
-	else
-	{
-
-		Mutex::AutoLock lock(*m_Mutex);
-		m_Reader->checkedPos = m_Reader->bufferPos;
-		m_Reader->checkedWraps = m_Reader->bufferWraps;
-	}
+	// Everything read before this may now be overwritten
+	m_State->readerChecked.store(PackChecked(m_Reader), std::memory_order_release);
 	SendReadSignal();
+	if (m_ReadCapture)
+		m_ReadCapture->WriteRelease();
+}
+
+void RingBuffer::CaptureRead(const void* data, size_t size, size_t alignment)
+{
+	m_ReadCapture->WriteData(data, size, alignment);
 }
 
-void RingBuffer::WriteStreamingData(const void* data, size_t size, size_t alignment, size_t step)
+void RingBuffer::WriteStreamingData(const void* data, size_t size, size_t alignment)
 {
 	// This should not be size_t, as the GfxDevice may run across processes of different
 	// bitness, and the data serialized in the command buffer must match.
 	WriteValueType<UInt32>(size);
 
+	// Addresses mean nothing to another process or to a capture
+	char* block = NULL;
+	if (size >= kLargePayloadSize && m_Shared == NULL && m_ReadCapture == NULL)
+		block = AllocateLargePayload(size);
+	if (block != NULL)
+	{
+		memcpy(block, data, size);
+		WriteValueType<UInt32>(kStreamingHeap);
+		WriteValueType<char*>(block);
+		WriteSubmitData();
+		return;
+	}
+
+	// One chunk when it fits in a slice of the buffer. Without wraps to waste
+	// space at the end, a mirrored buffer can take bigger slices.
+	size_t step = min(max(Align(size, alignment), (size_t)kDefaultStep), m_BufferSize / (m_Mirrored ? 4 : 8));
+#ifdef NDEBUG
+	UInt32 mode = kStreamingChunks;
+#else
+	UInt32 mode = kStreamingCheckedChunks;
+#endif
+	WriteValueType<UInt32>(mode);
+	WriteValueType<UInt32>(step);
+
 	const char* src = (const char*)data;
 	for (size_t offset = 0; offset < size; offset += step)
 	{
 		size_t bytes = min(size - offset, step);
 		void* dest = GetWriteDataPointer(bytes, alignment);
 		memcpy(dest, src, bytes);
-		WriteValueType<int>(1234);
+		if (mode == kStreamingCheckedChunks)
+			WriteValueType<int>(kStreamingMagic);
 
 		// In the NaCl Web Player, make sure that only complete commands are submitted, as we are not truely
 		// asynchronous.
@@ -115,82 +367,107 @@ void RingBuffer::WriteStreamingData(const void* data, size_t size, size_t alignm
 	WriteSubmitData();
 }
 
-void RingBuffer::WriteSubmitData()
+char* RingBuffer::AllocateLargePayload(size_t size)
 {
-	if (m_Writer->checkedWraps == m_Writer->bufferWraps)
+	size_t blockSize = PayloadPool::GetBlockSize(size);
+	if (m_PayloadPool->bytesInFlight.fetch_add(blockSize) + blockSize > kMaxLargePayloadBytes)
 	{
-		// We only update the position
-		m_Writer->checkedPos = m_Writer->bufferPos;
+		m_PayloadPool->bytesInFlight.fetch_sub(blockSize);
+		return NULL;
 	}
-	else
+	int sizeClass = PayloadPool::GetClass(size);
+	if (sizeClass < PayloadPool::kClassCount)
 	{
+		Mutex::AutoLock lock(m_PayloadPool->mutex);
+		std::vector<char*>& freeBlocks = m_PayloadPool->freeBlocks[sizeClass];
+		if (!freeBlocks.empty())
+		{
+			char* block = freeBlocks.back();
+			freeBlocks.pop_back();
+			return block;
+		}
+	}
+	return new char[blockSize];
+}
 
-		Mutex::AutoLock lock(*m_Mutex);
-		m_Writer->checkedPos = m_Writer->bufferPos;
-		m_Writer->checkedWraps = m_Writer->bufferWraps;
+void RingBuffer::FreeLargePayload(char* block, size_t size)
+{
+	size_t blockSize = PayloadPool::GetBlockSize(size);
+	m_PayloadPool->bytesInFlight.fetch_sub(blockSize);
+	int sizeClass = PayloadPool::GetClass(size);
+	if (sizeClass < PayloadPool::kClassCount)
+	{
+		Mutex::AutoLock lock(m_PayloadPool->mutex);
+		std::vector<char*>& freeBlocks = m_PayloadPool->freeBlocks[sizeClass];
+		if (freeBlocks.size() < PayloadPool::kMaxFreePerClass)
+		{
+			freeBlocks.push_back(block);
+			return;
+		}
 	}
+	delete[] block;
+}
+
+void RingBuffer::WriteSubmitData()
+{
+	// Everything written before this becomes visible to the reader
+	m_State->writerChecked.store(PackChecked(m_Writer), std::memory_order_release);
 	SendWriteSignal();
 }
 
 void RingBuffer::SetDefaults()
 {
+	// Each side writes its state on every command, neither may share a line
+	// with the other's or with the published positions
+	static_assert(offsetof(RingBuffer, m_Reader) % kCacheLineSize == 0, "reader state must start a cache line");
+	static_assert(offsetof(RingBuffer, m_Writer) - offsetof(RingBuffer, m_Reader) >= kCacheLineSize, "reader and writer state share a cache line");
+	static_assert(offsetof(RingBuffer, m_Header) - offsetof(RingBuffer, m_Writer) >= kCacheLineSize, "writer state shares a cache line with the header");
+	static_assert(offsetof(BufferHeader, writerChecked) - offsetof(BufferHeader, readerChecked) >= kCacheLineSize, "published positions share a cache line");
 	m_Buffer = NULL;
 	m_BufferSize = 0;
-	m_Mutex = NULL;
+	m_Mirrored = false;
+	m_Reader.Reset();
+	m_Writer.Reset();
 	m_ReadSemaphore = NULL;
 	m_WriteSemaphore = NULL;
-	m_NeedsReadSignal = 0;
-	m_NeedsWriteSignal = 0;
+	m_State = &m_Header;
+	m_Header.Reset();
+	m_ReadCapture = NULL;
+	m_PayloadPool = NULL;
+	m_Shared = NULL;
+	m_SharedSize = 0;
+	m_SharedOwner = false;
+	m_SharedName.clear();
 };
 
-inline int AtomicIncrement(int volatile* i)
-{
-#if _WIN32
-	return  _InterlockedIncrement((long volatile*)i);
-#else
-	return __sync_add_and_fetch(i, 1);
-#endif
-}
-
-inline bool AtomicCompareExchange(int volatile* i, int newValue, int expectedValue)
-{
-#if _WIN32
-	return _InterlockedCompareExchange((long volatile*)i, (long)newValue, (long)expectedValue) == expectedValue;
-#else
-	return __sync_bool_compare_and_swap(i, expectedValue, newValue);
-#endif
-}
-
 void RingBuffer::HandleReadOverflow(size_t& dataPos, size_t& dataEnd)
 {
-
-	Mutex::AutoLock lock(*m_Mutex);
-
-	if (dataEnd > m_BufferSize)
+	if (dataEnd > m_BufferSize && !m_Mirrored)
 	{
 		dataEnd -= dataPos;
 		dataPos = 0;
-		m_Reader->bufferPos = 0;
-		m_Reader->bufferWraps++;
+		m_Reader.bufferPos = 0;
+		m_Reader.bufferWraps++;
 	}
 
 	for (;;)
 	{
 		// Get how many buffer lengths writer is ahead of reader
 		// This may be -1 if we are waiting for the writer to wrap
-		size_t comparedPos = m_Writer->checkedPos;
-		size_t comparedWraps = m_Writer->checkedWraps;
-		size_t wrapDist = comparedWraps - m_Reader->bufferWraps;
-		m_Reader->bufferEnd = (wrapDist == 0) ? comparedPos : (wrapDist == 1) ? m_BufferSize : 0;
-
-		if (dataEnd <= m_Reader->bufferEnd)
+		UInt64 compared = m_State->writerChecked.load(std::memory_order_acquire);
+		size_t comparedPos = CheckedPos(compared);
+		size_t wrapDist = CheckedWraps(compared) - m_Reader.bufferWraps;
+		// A mirrored reader may read on past the end into the writer's next lap
+		size_t lapEnd = m_Mirrored ? comparedPos + m_BufferSize : m_BufferSize;
+		m_Reader.bufferEnd = (wrapDist == 0) ? comparedPos : (wrapDist == 1) ? lapEnd : 0;
+
+		if (dataEnd <= m_Reader.bufferEnd)
 		{
 			break;
 		}
-		AtomicIncrement(&m_NeedsWriteSignal);
-
-		m_Mutex->Unlock();
-		if (comparedPos != m_Writer->checkedPos || comparedWraps != m_Writer->checkedWraps)
+		m_State->needsWriteSignal.store(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (compared != m_State->writerChecked.load(std::memory_order_relaxed))
 		{
 			// Writer position changed while we requested a signal
 			// Request might be missed, so we signal ourselves to avoid deadlock
@@ -199,41 +476,37 @@ void RingBuffer::HandleReadOverflow(size_t& dataPos, size_t& dataEnd)
 		SendReadSignal();
 		// Wait for writer thread
 		m_WriteSemaphore->WaitForSignal();
-		m_Mutex->Lock();
 	}
 }
 
 void RingBuffer::HandleWriteOverflow(size_t& dataPos, size_t& dataEnd)
 {
-
-
-
-	Mutex::AutoLock lock(*m_Mutex);
-
-	if (dataEnd > m_BufferSize)
+	if (dataEnd > m_BufferSize && !m_Mirrored)
 	{
 		dataEnd -= dataPos;
 		dataPos = 0;
-		m_Writer->bufferPos = 0;
-		m_Writer->bufferWraps++;
+		m_Writer.bufferPos = 0;
+		m_Writer.bufferWraps++;
 	}
 
 	for (;;)
 	{
 		// Get how many buffer lengths writer is ahead of reader
 		// This may be 2 if we are waiting for the reader to wrap
-		size_t comparedPos = m_Reader->checkedPos;
-		size_t comparedWraps = m_Reader->checkedWraps;
-		size_t wrapDist = m_Writer->bufferWraps - comparedWraps;
-		m_Writer->bufferEnd = (wrapDist == 0) ? m_BufferSize : (wrapDist == 1) ? comparedPos : 0;
-
-		if (dataEnd <= m_Writer->bufferEnd)
+		UInt64 compared = m_State->readerChecked.load(std::memory_order_acquire);
+		size_t comparedPos = CheckedPos(compared);
+		size_t wrapDist = m_Writer.bufferWraps - CheckedWraps(compared);
+		// A mirrored writer may write on past the end up to where the reader is
+		size_t lapEnd = m_Mirrored ? comparedPos + m_BufferSize : m_BufferSize;
+		m_Writer.bufferEnd = (wrapDist == 0) ? lapEnd : (wrapDist == 1) ? comparedPos : 0;
+
+		if (dataEnd <= m_Writer.bufferEnd)
 		{
 			break;
 		}
-		AtomicIncrement(&m_NeedsReadSignal);
-		m_Mutex->Unlock();
-		if (comparedPos != m_Reader->checkedPos || comparedWraps != m_Reader->checkedWraps)
+		m_State->needsReadSignal.store(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (compared != m_State->readerChecked.load(std::memory_order_relaxed))
 		{
 			// Reader position changed while we requested a signal
 			// Request might be missed, so we signal ourselves to avoid deadlock
@@ -242,13 +515,17 @@ void RingBuffer::HandleWriteOverflow(size_t& dataPos, size_t& dataEnd)
 		SendWriteSignal();
 		// Wait for reader thread
 		m_ReadSemaphore->WaitForSignal();
-		m_Mutex->Lock();
 	}
 }
 
+// The fence pairs with the one after a request is stored: either the waiting
+// side sees the new position, or this side sees the request
 void RingBuffer::SendReadSignal()
 {
-	if (AtomicCompareExchange(&m_NeedsReadSignal, 0, 1))
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int expected = 1;
+	if (m_State->needsReadSignal.load(std::memory_order_relaxed) == expected &&
+		m_State->needsReadSignal.compare_exchange_strong(expected, 0))
 	{
 		m_ReadSemaphore->Signal();
 	}
@@ -256,17 +533,25 @@ void RingBuffer::SendReadSignal()
 
 void RingBuffer::SendWriteSignal()
 {
-	if (AtomicCompareExchange(&m_NeedsWriteSignal, 0, 1))
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int expected = 1;
+	if (m_State->needsWriteSignal.load(std::memory_order_relaxed) == expected &&
+		m_State->needsWriteSignal.compare_exchange_strong(expected, 0))
 	{
 		m_WriteSemaphore->Signal();
 	}
 }
-void RingBuffer::BufferState::Reset() volatile
+void RingBuffer::BufferState::Reset()
 {
 	bufferPos = 0;
 	bufferEnd = 0;
 	bufferWraps = 0;
-	checkedPos = 0;
-	checkedWraps = 0;
 }
 
+void RingBuffer::BufferHeader::Reset()
+{
+	readerChecked.store(0);
+	writerChecked.store(0);
+	needsReadSignal.store(0);
+	needsWriteSignal.store(0);
+}
\ No newline at end of file
@@ -0,0 +1,192 @@
+#include "StaticBatcher.h"
+#include "FrustumCuller.h"
+#include "esUtil.h"
+#include <float.h>
+#include <algorithm>
+#include "glm/gtc/matrix_transform.hpp"
+#include "glm/gtx/euler_angles.hpp"
+
+namespace RenderEngine {
+
+	namespace {
+		const unsigned int kMaxBatchVertices = 65536;
+
+		// Spreads the low 10 bits so that three values interleave
+		inline unsigned int ExpandBits(unsigned int v)
+		{
+			v = (v * 0x00010001u) & 0xFF0000FFu;
+			v = (v * 0x00000101u) & 0x0F00F00Fu;
+			v = (v * 0x00000011u) & 0xC30C30C3u;
+			v = (v * 0x00000005u) & 0x49249249u;
+			return v;
+		}
+
+		inline unsigned int MortonCode(const glm::vec3& normalized)
+		{
+			glm::vec3 p = glm::clamp(normalized * 1023.0f, glm::vec3(0.0f), glm::vec3(1023.0f));
+			return ExpandBits((unsigned int)p.x) << 2 | ExpandBits((unsigned int)p.y) << 1 | ExpandBits((unsigned int)p.z);
+		}
+
+		glm::vec3 WorldCenter(const Mesh& mesh, const glm::mat4& world)
+		{
+			return glm::vec3(world * glm::vec4(mesh.boundsCenter, 1.0f));
+		}
+	}
+
+	StaticBatcher::StaticBatcher(const Options& options)
+		:_options(options)
+	{
+		_options.maxVertices = std::min(std::max(_options.maxVertices, 3u), kMaxBatchVertices);
+		_stats = Stats();
+	}
+
+	void StaticBatcher::Add(const Mesh::Ptr& mesh, unsigned int materialKey)
+	{
+		auto world = glm::translate(glm::mat4(1.0f), mesh->position) * glm::eulerAngleXYZ(mesh->rotation.x, mesh->rotation.y, mesh->rotation.z);
+		Add(mesh, materialKey, world);
+	}
+
+	void StaticBatcher::Add(const Mesh::Ptr& mesh, unsigned int materialKey, const glm::mat4& world)
+	{
+		if (!mesh->vboData->format.IsFloat())
+		{
+			esLogMessage("[render] StaticBatcher: mesh %s has packed vertices, skipped", mesh->name.c_str());
+			return;
+		}
+		Entry entry = { mesh, materialKey, world, 0 };
+		_entries.push_back(entry);
+	}
+
+	std::vector<StaticBatcher::Batch> StaticBatcher::Build()
+	{
+		_stats = Stats();
+		_stats.meshCount = (unsigned int)_entries.size();
+		std::vector<Batch> batches;
+		if (_entries.empty())
+		{
+			return batches;
+		}
+
+		// Morton order over all centers keeps each batch spatially compact,
+		// which is what makes its bounds worth culling
+		glm::vec3 sceneMin(FLT_MAX), sceneMax(-FLT_MAX);
+		for (auto& entry : _entries)
+		{
+			glm::vec3 center = WorldCenter(*entry.mesh, entry.world);
+			sceneMin = glm::min(sceneMin, center);
+			sceneMax = glm::max(sceneMax, center);
+		}
+		glm::vec3 invSize = 1.0f / glm::max(sceneMax - sceneMin, glm::vec3(1e-6f));
+		for (auto& entry : _entries)
+		{
+			entry.mortonCode = MortonCode((WorldCenter(*entry.mesh, entry.world) - sceneMin) * invSize);
+		}
+		std::stable_sort(_entries.begin(), _entries.end(), [](const Entry& a, const Entry& b) {
+			return a.materialKey != b.materialKey ? a.materialKey < b.materialKey : a.mortonCode < b.mortonCode;
+		});
+
+		auto begin = _entries.cbegin();
+		unsigned int vertices = 0;
+		for (auto iter = _entries.cbegin(); iter != _entries.cend(); ++iter)
+		{
+			unsigned int count = iter->mesh->vboData->verticesCount;
+			if (iter != begin && (iter->materialKey != begin->materialKey || vertices + count > _options.maxVertices))
+			{
+				batches.push_back(MakeBatch(begin, iter));
+				begin = iter;
+				vertices = 0;
+			}
+			vertices += count;
+		}
+		batches.push_back(MakeBatch(begin, _entries.cend()));
+		_entries.clear();
+
+		_stats.batchCount = (unsigned int)batches.size();
+		for (auto& batch : batches)
+		{
+			_stats.verticesCount += batch.mesh->vboData->verticesCount;
+			_stats.indicesCount += batch.mesh->vboData->indicesCount;
+		}
+		return batches;
+	}
+
+	StaticBatcher::Batch StaticBatcher::MakeBatch(std::vector<Entry>::const_iterator begin, std::vector<Entry>::const_iterator end)
+	{
+		unsigned int verticesCount = 0;
+		size_t levelCount = 0;
+		for (auto iter = begin; iter != end; ++iter)
+		{
+			verticesCount += iter->mesh->vboData->verticesCount;
+			levelCount = std::max(levelCount, iter->mesh->lods.size());
+		}
+		// Level i of the batch is level i of every source, or its coarsest one
+		unsigned int indicesCount = 0;
+		for (size_t level = 0; level < levelCount; ++level)
+		{
+			for (auto iter = begin; iter != end; ++iter)
+			{
+				indicesCount += iter->mesh->lods[std::min(level, iter->mesh->lods.size() - 1)].indexCount;
+			}
+		}
+
+		Batch batch;
+		batch.mesh = std::make_shared<Mesh>(begin->mesh->name + "_batch", verticesCount, indicesCount);
+		batch.materialKey = begin->materialKey;
+		batch.sourceCount = (unsigned int)(end - begin);
+		VBOData& data = *batch.mesh->vboData;
+
+		std::vector<unsigned int> baseVertices;
+		std::vector<float> scales;
+		std::vector<bool> mirrored;
+		unsigned int baseVertex = 0;
+		for (auto iter = begin; iter != end; ++iter)
+		{
+			const VBOData& source = *iter->mesh->vboData;
+			glm::mat3 linear(iter->world);
+			glm::mat3 normalMatrix = glm::transpose(glm::inverse(linear));
+			for (unsigned int i = 0; i < source.verticesCount; ++i)
+			{
+				VBOData::Vertex& v = data.vertices[baseVertex + i];
+				v.pos = glm::vec3(iter->world * glm::vec4(source.vertices[i].pos, 1.0f));
+				glm::vec3 normal = normalMatrix * source.vertices[i].normal;
+				float length = glm::length(normal);
+				v.normal = length > 0.0f ? normal / length : normal;
+				v.uv = source.vertices[i].uv;
+			}
+			baseVertices.push_back(baseVertex);
+			baseVertex += source.verticesCount;
+			// LOD errors are in mesh units, scale them by the largest axis
+			scales.push_back(std::max(std::max(glm::length(linear[0]), glm::length(linear[1])), glm::length(linear[2])));
+			mirrored.push_back(glm::determinant(linear) < 0.0f);
+		}
+
+		batch.mesh->lods.clear();
+		unsigned int indexOffset = 0;
+		for (size_t level = 0; level < levelCount; ++level)
+		{
+			Mesh::LOD lod = { indexOffset, 0, 0.0f };
+			size_t sourceIndex = 0;
+			for (auto iter = begin; iter != end; ++iter, ++sourceIndex)
+			{
+				const Mesh& source = *iter->mesh;
+				const Mesh::LOD& sourceLod = source.lods[std::min(level, source.lods.size() - 1)];
+				const unsigned short* indices = source.vboData->indices + sourceLod.indexStart;
+				unsigned short* out = data.indices + indexOffset;
+				unsigned short base = (unsigned short)baseVertices[sourceIndex];
+				for (unsigned int i = 0; i + 2 < sourceLod.indexCount; i += 3)
+				{
+					// Mirroring transforms flip the winding, swap it back
+					out[i] = (unsigned short)(indices[i] + base);
+					out[i + 1] = (unsigned short)(indices[mirrored[sourceIndex] ? i + 2 : i + 1] + base);
+					out[i + 2] = (unsigned short)(indices[mirrored[sourceIndex] ? i + 1 : i + 2] + base);
+				}
+				indexOffset += sourceLod.indexCount;
+				lod.indexCount += sourceLod.indexCount;
+				lod.error = std::max(lod.error, sourceLod.error * scales[sourceIndex]);
+			}
+			batch.mesh->lods.push_back(lod);
+		}
+		batch.mesh->ComputeBounds();
+		return batch;
+	}
+}
@@ -0,0 +1,545 @@
+#include "TGADecoder.h"
+#include "esUtil.h"
+#include <limits.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TGA_USE_SSE2 1
+#include <emmintrin.h>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define TGA_USE_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace RenderEngine {
+
+	namespace {
+		enum
+		{
+			kTGAHeaderSize = 18,
+			kTGADescRightToLeft = 1 << 4,
+			kTGADescTopToBottom = 1 << 5,
+		};
+
+		enum TGAImageType
+		{
+			kTGATrueColor = 2,
+			kTGAGrey = 3,
+			kTGARLETrueColor = 10,
+			kTGARLEGrey = 11,
+		};
+
+		struct TGAHeader
+		{
+			unsigned int idLength;
+			unsigned int colorMapType;
+			unsigned int imageType;
+			unsigned int colorMapLength;
+			unsigned int colorMapEntrySize;
+			unsigned int width;
+			unsigned int height;
+			unsigned int bitsPerPixel;
+			unsigned int descriptor;
+		};
+
+		inline unsigned int ReadU16(const unsigned char* p)
+		{
+			return p[0] | (p[1] << 8);
+		}
+
+		bool ParseHeader(const unsigned char* data, unsigned int size, TGAHeader& header)
+		{
+			if (size < kTGAHeaderSize)
+			{
+				return false;
+			}
+			header.idLength = data[0];
+			header.colorMapType = data[1];
+			header.imageType = data[2];
+			header.colorMapLength = ReadU16(data + 5);
+			header.colorMapEntrySize = data[7];
+			header.width = ReadU16(data + 12);
+			header.height = ReadU16(data + 14);
+			header.bitsPerPixel = data[16];
+			header.descriptor = data[17];
+			return true;
+		}
+
+		// Position of a band start inside the RLE packet stream.
+		// For run packets srcOffset stays on the repeated value until the packet ends.
+		struct RLECursor
+		{
+			size_t srcOffset;
+			unsigned int packetLeft;
+			bool run;
+		};
+
+		// Walks packet headers only, so the cost is proportional to the packet count
+		// rather than the pixel count, and records where each band starts.
+		bool ScanRLE(const unsigned char* src, size_t size, size_t offset, unsigned int bpp, size_t totalPixels,
+			const std::vector<size_t>& bandStarts, std::vector<RLECursor>& cursors)
+		{
+			cursors.resize(bandStarts.size());
+			size_t band = 0;
+			size_t pixel = 0;
+			while (pixel < totalPixels)
+			{
+				if (offset >= size)
+				{
+					return false;
+				}
+				unsigned int header = src[offset];
+				unsigned int count = (header & 0x7F) + 1;
+				bool run = (header & 0x80) != 0;
+				size_t dataOffset = offset + 1;
+				size_t packetBytes = run ? bpp : count * bpp;
+				if (dataOffset + packetBytes > size)
+				{
+					return false;
+				}
+				while (band < bandStarts.size() && bandStarts[band] < pixel + count)
+				{
+					size_t skip = bandStarts[band] - pixel;
+					RLECursor& cursor = cursors[band];
+					if (skip == 0)
+					{
+						cursor.srcOffset = offset;
+						cursor.packetLeft = 0;
+						cursor.run = false;
+					}
+					else
+					{
+						cursor.srcOffset = run ? dataOffset : dataOffset + skip * bpp;
+						cursor.packetLeft = count - (unsigned int)skip;
+						cursor.run = run;
+					}
+					++band;
+				}
+				pixel += count;
+				offset = dataOffset + packetBytes;
+			}
+			return band == bandStarts.size();
+		}
+
+		typedef void(*RowConverter)(const unsigned char* src, unsigned char* dst, unsigned int count, bool useSIMD);
+
+		struct DecodeContext
+		{
+			const unsigned char* src;
+			size_t pixelOffset;
+			unsigned char* dst;
+			unsigned int width;
+			unsigned int height;
+			unsigned int bpp;
+			bool topToBottom;
+			bool rightToLeft;
+			bool useSIMD;
+			RowConverter converter;
+
+			unsigned char* DstRow(unsigned int fileRow) const
+			{
+				// Output is bottom-up, the order glTexImage2D expects
+				unsigned int row = topToBottom ? height - 1 - fileRow : fileRow;
+				return dst + (size_t)row * width * 4;
+			}
+			void EmitRow(const unsigned char* srcRow, unsigned int fileRow) const
+			{
+				unsigned char* dstRow = DstRow(fileRow);
+				converter(srcRow, dstRow, width, useSIMD);
+				if (rightToLeft)
+				{
+					TGADecoder::ReverseRGBA(dstRow, width, useSIMD);
+				}
+			}
+		};
+
+		void DecodeRawRows(const DecodeContext& ctx, unsigned int rowBegin, unsigned int rowEnd)
+		{
+			size_t pitch = (size_t)ctx.width * ctx.bpp;
+			for (unsigned int row = rowBegin; row < rowEnd; ++row)
+			{
+				ctx.EmitRow(ctx.src + ctx.pixelOffset + row * pitch, row);
+			}
+		}
+
+		inline void FillRun(unsigned char* dst, const unsigned char* value, unsigned int bpp, unsigned int count)
+		{
+			switch (bpp)
+			{
+			case 1:
+				memset(dst, value[0], count);
+				break;
+			case 4:
+			{
+				unsigned int v;
+				memcpy(&v, value, 4);
+				for (unsigned int i = 0; i < count; ++i)
+				{
+					memcpy(dst + i * 4, &v, 4);
+				}
+				break;
+			}
+			default:
+				for (unsigned int i = 0; i < count; ++i)
+				{
+					dst[i * 3 + 0] = value[0];
+					dst[i * 3 + 1] = value[1];
+					dst[i * 3 + 2] = value[2];
+				}
+				break;
+			}
+		}
+
+		void DecodeRLERows(const DecodeContext& ctx, RLECursor cursor, unsigned int rowBegin, unsigned int rowEnd)
+		{
+			const unsigned int bpp = ctx.bpp;
+			std::vector<unsigned char> nativeRow(ctx.width * bpp);
+			unsigned char* rowData = &nativeRow[0];
+			for (unsigned int row = rowBegin; row < rowEnd; ++row)
+			{
+				unsigned int x = 0;
+				while (x < ctx.width)
+				{
+					if (cursor.packetLeft == 0)
+					{
+						unsigned int header = ctx.src[cursor.srcOffset++];
+						cursor.packetLeft = (header & 0x7F) + 1;
+						cursor.run = (header & 0x80) != 0;
+					}
+					unsigned int count = std::min(cursor.packetLeft, ctx.width - x);
+					if (cursor.run)
+					{
+						FillRun(rowData + x * bpp, ctx.src + cursor.srcOffset, bpp, count);
+					}
+					else
+					{
+						memcpy(rowData + x * bpp, ctx.src + cursor.srcOffset, count * bpp);
+						cursor.srcOffset += count * bpp;
+					}
+					cursor.packetLeft -= count;
+					x += count;
+					if (cursor.run && cursor.packetLeft == 0)
+					{
+						cursor.srcOffset += bpp;
+					}
+				}
+				ctx.EmitRow(rowData, row);
+			}
+		}
+
+		unsigned int ChooseThreadCount(const TGADecoder::Options& options, unsigned int width, unsigned int height)
+		{
+			unsigned int threads = options.threadCount;
+			if (threads == 0)
+			{
+				threads = std::max(1u, std::thread::hardware_concurrency());
+			}
+			size_t pixels = (size_t)width * height;
+			size_t byWork = std::max<size_t>(1, pixels / std::max(1u, options.minPixelsPerThread));
+			threads = (unsigned int)std::min<size_t>(threads, byWork);
+			return std::max(1u, std::min(threads, height));
+		}
+	}
+
+	void TGADecoder::ConvertBGRAToRGBA(const unsigned char* src, unsigned char* dst, unsigned int count, bool useSIMD)
+	{
+		unsigned int i = 0;
+		if (useSIMD)
+		{
+#if defined(TGA_USE_SSE2)
+			const __m128i maskGA = _mm_set1_epi32((int)0xFF00FF00);
+			for (; i + 4 <= count; i += 4)
+			{
+				__m128i v = _mm_loadu_si128((const __m128i*)(src + i * 4));
+				__m128i ga = _mm_and_si128(v, maskGA);
+				__m128i rb = _mm_andnot_si128(maskGA, v);
+				rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+				_mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(ga, rb));
+			}
+#elif defined(TGA_USE_NEON)
+			for (; i + 16 <= count; i += 16)
+			{
+				uint8x16x4_t v = vld4q_u8(src + i * 4);
+				uint8x16_t b = v.val[0];
+				v.val[0] = v.val[2];
+				v.val[2] = b;
+				vst4q_u8(dst + i * 4, v);
+			}
+#endif
+		}
+		for (; i < count; ++i)
+		{
+			const unsigned char* s = src + i * 4;
+			unsigned char* d = dst + i * 4;
+			unsigned char b = s[0];
+			d[0] = s[2];
+			d[1] = s[1];
+			d[2] = b;
+			d[3] = s[3];
+		}
+	}
+
+	void TGADecoder::ConvertBGRToRGBA(const unsigned char* src, unsigned char* dst, unsigned int count, bool useSIMD)
+	{
+		unsigned int i = 0;
+		if (useSIMD)
+		{
+#if defined(TGA_USE_SSE2)
+#if defined(__SSSE3__)
+			const __m128i shuffle = _mm_setr_epi8(2, 1, 0, -128, 5, 4, 3, -128, 8, 7, 6, -128, 11, 10, 9, -128);
+			const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+			// 16 byte loads cover 5.3 pixels, keep the last load inside the source row
+			for (; i + 6 <= count; i += 4)
+			{
+				__m128i v = _mm_loadu_si128((const __m128i*)(src + i * 3));
+				_mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha));
+			}
+#else
+			const __m128i maskG = _mm_set1_epi32(0x0000FF00);
+			const __m128i maskRB = _mm_set1_epi32(0x00FF00FF);
+			const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+			// Four unaligned 32-bit loads, the last one reads one byte past its pixel
+			for (; i + 5 <= count; i += 4)
+			{
+				int p[4];
+				memcpy(&p[0], src + i * 3, 4);
+				memcpy(&p[1], src + i * 3 + 3, 4);
+				memcpy(&p[2], src + i * 3 + 6, 4);
+				memcpy(&p[3], src + i * 3 + 9, 4);
+				__m128i v = _mm_setr_epi32(p[0], p[1], p[2], p[3]);
+				__m128i g = _mm_and_si128(v, maskG);
+				__m128i rb = _mm_and_si128(v, maskRB);
+				rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+				_mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(_mm_or_si128(g, rb), alpha));
+			}
+#endif
+#elif defined(TGA_USE_NEON)
+			const uint8x16_t alpha = vdupq_n_u8(255);
+			for (; i + 16 <= count; i += 16)
+			{
+				uint8x16x3_t s = vld3q_u8(src + i * 3);
+				uint8x16x4_t d;
+				d.val[0] = s.val[2];
+				d.val[1] = s.val[1];
+				d.val[2] = s.val[0];
+				d.val[3] = alpha;
+				vst4q_u8(dst + i * 4, d);
+			}
+#endif
+		}
+		for (; i < count; ++i)
+		{
+			const unsigned char* s = src + i * 3;
+			unsigned char* d = dst + i * 4;
+			d[0] = s[2];
+			d[1] = s[1];
+			d[2] = s[0];
+			d[3] = 255;
+		}
+	}
+
+	void TGADecoder::ConvertGreyToRGBA(const unsigned char* src, unsigned char* dst, unsigned int count, bool useSIMD)
+	{
+		unsigned int i = 0;
+		if (useSIMD)
+		{
+#if defined(TGA_USE_SSE2)
+			const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+			for (; i + 16 <= count; i += 16)
+			{
+				__m128i g = _mm_loadu_si128((const __m128i*)(src + i));
+				__m128i lo = _mm_unpacklo_epi8(g, g);
+				__m128i hi = _mm_unpackhi_epi8(g, g);
+				__m128i* d = (__m128i*)(dst + i * 4);
+				_mm_storeu_si128(d + 0, _mm_or_si128(_mm_unpacklo_epi16(lo, lo), alpha));
+				_mm_storeu_si128(d + 1, _mm_or_si128(_mm_unpackhi_epi16(lo, lo), alpha));
+				_mm_storeu_si128(d + 2, _mm_or_si128(_mm_unpacklo_epi16(hi, hi), alpha));
+				_mm_storeu_si128(d + 3, _mm_or_si128(_mm_unpackhi_epi16(hi, hi), alpha));
+			}
+#elif defined(TGA_USE_NEON)
+			const uint8x16_t alpha = vdupq_n_u8(255);
+			for (; i + 16 <= count; i += 16)
+			{
+				uint8x16_t g = vld1q_u8(src + i);
+				uint8x16x4_t d;
+				d.val[0] = g;
+				d.val[1] = g;
+				d.val[2] = g;
+				d.val[3] = alpha;
+				vst4q_u8(dst + i * 4, d);
+			}
+#endif
+		}
+		for (; i < count; ++i)
+		{
+			unsigned char* d = dst + i * 4;
+			d[0] = d[1] = d[2] = src[i];
+			d[3] = 255;
+		}
+	}
+
+	void TGADecoder::ReverseRGBA(unsigned char* pixels, unsigned int count, bool useSIMD)
+	{
+		unsigned int* p = (unsigned int*)pixels;
+		unsigned int lo = 0;
+		unsigned int hi = count;
+		if (useSIMD)
+		{
+#if defined(TGA_USE_SSE2)
+			for (; hi - lo >= 8; lo += 4, hi -= 4)
+			{
+				__m128i a = _mm_loadu_si128((const __m128i*)(p + lo));
+				__m128i b = _mm_loadu_si128((const __m128i*)(p + hi - 4));
+				_mm_storeu_si128((__m128i*)(p + lo), _mm_shuffle_epi32(b, _MM_SHUFFLE(0, 1, 2, 3)));
+				_mm_storeu_si128((__m128i*)(p + hi - 4), _mm_shuffle_epi32(a, _MM_SHUFFLE(0, 1, 2, 3)));
+			}
+#elif defined(TGA_USE_NEON)
+			for (; hi - lo >= 8; lo += 4, hi -= 4)
+			{
+				uint32x4_t a = vrev64q_u32(vld1q_u32(p + lo));
+				uint32x4_t b = vrev64q_u32(vld1q_u32(p + hi - 4));
+				vst1q_u32(p + lo, vcombine_u32(vget_high_u32(b), vget_low_u32(b)));
+				vst1q_u32(p + hi - 4, vcombine_u32(vget_high_u32(a), vget_low_u32(a)));
+			}
+#endif
+		}
+		std::reverse(p + lo, p + hi);
+	}
+
+	TextureData::Ptr TGADecoder::Decode(const char* data, unsigned int size, const Options& options)
+	{
+		const unsigned char* src = (const unsigned char*)data;
+		TGAHeader header;
+		if (!ParseHeader(src, size, header))
+		{
+			esLogMessage("[render] TGADecoder: truncated header");
+			return nullptr;
+		}
+
+		bool rle = header.imageType == kTGARLETrueColor || header.imageType == kTGARLEGrey;
+		bool grey = header.imageType == kTGAGrey || header.imageType == kTGARLEGrey;
+		bool trueColor = header.imageType == kTGATrueColor || header.imageType == kTGARLETrueColor;
+		if (!grey && !trueColor)
+		{
+			esLogMessage("[render] TGADecoder: unsupported image type %u", header.imageType);
+			return nullptr;
+		}
+
+		DecodeContext ctx;
+		if (grey && header.bitsPerPixel == 8)
+		{
+			ctx.converter = &TGADecoder::ConvertGreyToRGBA;
+		}
+		else if (trueColor && header.bitsPerPixel == 24)
+		{
+			ctx.converter = &TGADecoder::ConvertBGRToRGBA;
+		}
+		else if (trueColor && header.bitsPerPixel == 32)
+		{
+			ctx.converter = &TGADecoder::ConvertBGRAToRGBA;
+		}
+		else
+		{
+			esLogMessage("[render] TGADecoder: unsupported depth %u for image type %u", header.bitsPerPixel, header.imageType);
+			return nullptr;
+		}
+		if (header.width == 0 || header.height == 0)
+		{
+			return nullptr;
+		}
+
+		ctx.src = src;
+		ctx.width = header.width;
+		ctx.height = header.height;
+		ctx.bpp = header.bitsPerPixel / 8;
+		ctx.topToBottom = (header.descriptor & kTGADescTopToBottom) != 0;
+		ctx.rightToLeft = (header.descriptor & kTGADescRightToLeft) != 0;
+		ctx.useSIMD = options.useSIMD;
+		ctx.pixelOffset = kTGAHeaderSize + header.idLength;
+		if (header.colorMapType != 0)
+		{
+			ctx.pixelOffset += header.colorMapLength * ((header.colorMapEntrySize + 7) / 8);
+		}
+
+		size_t totalPixels = (size_t)ctx.width * ctx.height;
+		// The header is untrusted, a tiny RLE file can claim 65535x65535
+		if (totalPixels > UINT_MAX / 4)
+		{
+			esLogMessage("[render] TGADecoder: %ux%u is too large", ctx.width, ctx.height);
+			return nullptr;
+		}
+		if (!rle && ctx.pixelOffset + totalPixels * ctx.bpp > size)
+		{
+			esLogMessage("[render] TGADecoder: truncated pixel data");
+			return nullptr;
+		}
+
+		unsigned int threadCount = ChooseThreadCount(options, ctx.width, ctx.height);
+		std::vector<unsigned int> bandRows(threadCount + 1);
+		for (unsigned int i = 0; i <= threadCount; ++i)
+		{
+			bandRows[i] = (unsigned int)((size_t)ctx.height * i / threadCount);
+		}
+
+		std::vector<RLECursor> cursors;
+		if (rle)
+		{
+			std::vector<size_t> bandStarts(threadCount);
+			for (unsigned int i = 0; i < threadCount; ++i)
+			{
+				bandStarts[i] = (size_t)bandRows[i] * ctx.width;
+			}
+			if (!ScanRLE(src, size, ctx.pixelOffset, ctx.bpp, totalPixels, bandStarts, cursors))
+			{
+				esLogMessage("[render] TGADecoder: truncated RLE data");
+				return nullptr;
+			}
+		}
+
+		size_t length = totalPixels * 4;
+		char* pixels = new char[length];
+		ctx.dst = (unsigned char*)pixels;
+
+		std::vector<std::thread> workers;
+		for (unsigned int i = 0; i < threadCount; ++i)
+		{
+			if (rle)
+			{
+				if (i + 1 < threadCount)
+					workers.push_back(std::thread(&DecodeRLERows, std::cref(ctx), cursors[i], bandRows[i], bandRows[i + 1]));
+				else
+					DecodeRLERows(ctx, cursors[i], bandRows[i], bandRows[i + 1]);
+			}
+			else
+			{
+				if (i + 1 < threadCount)
+					workers.push_back(std::thread(&DecodeRawRows, std::cref(ctx), bandRows[i], bandRows[i + 1]));
+				else
+					DecodeRawRows(ctx, bandRows[i], bandRows[i + 1]);
+			}
+		}
+		for (auto& worker : workers)
+		{
+			worker.join();
+		}
+
+		return std::make_shared<TextureData>(pixels, ctx.width, ctx.height, (unsigned int)length, kTexFormatRGBA8);
+	}
+
+	TextureData::Ptr TGADecoder::LoadFromFile(const std::string& fileName, const Options& options)
+	{
+		std::string data = readFileData(fileName);
+		if (data.empty())
+		{
+			esLogMessage("[render] TGADecoder FAILED to load : { %s }", fileName.c_str());
+			return nullptr;
+		}
+		return Decode(data.c_str(), (unsigned int)data.size(), options);
+	}
+}
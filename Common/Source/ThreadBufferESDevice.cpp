@@ -1,199 +1,280 @@
 #include "ThreadBufferESDevice.h"
+#include "NullESDevice.h"
+#include <type_traits>
 namespace RenderEngine
 {
+	// One byte opcodes in the compact encoding
 	enum GfxCommandType
 	{
-		kGfxCmd_Unused = 10000,
-
-		kGfxCmd_Clear,
-		kGfxCmd_UseGPUProgram,
-		kGfxCmd_CreateGPUProgram,
-		kGfxCmd_DeleteGPUProgram,
-		kGfxCmd_CreateTexture2D,
-		kGfxCmd_DeleteTexture2D,
-		kGfxCmd_UseTexture2D,
-		kGfxCmd_SetClearColor,
-		kGfxCmd_DrawTriangle,
-		kGfxCmd_SetViewPort,
-		kGfxCmd_Present,
-		kGfxCmd_AcqiureThreadOwnerShip,
-		kGfxCmd_ReleaseThreadOwnership,
-		kGfxCmd_CreateVBO,
-		kGfxCmd_UpdateVBO,
-		kGfxCmd_DeleteVBO,
-		kGfxCmd_DrawVBO,
-		kGfxCmd_SetGPUProgramAsInt,
-		kGfxCmd_SetGPUProgramAsFloat,
-		kGfxCmd_SetGPUProgramAsMat4,
-		kGfxCmd_SetGPUProgramAsIntArray,
-		kGfxCmd_SetGPUProgramAsFloatArray,
-		kGfxCmd_SetGPUProgramAsMat4Array,
-		kGfxCmd_InitThreadGPUProgramParam,
+		kGfxCmd_Unused = 0,
+
+#define GFX_COMMAND_OPCODE(name) kGfxCmd_##name,
+		GFX_COMMANDS(GFX_COMMAND_OPCODE, GFX_COMMAND_OPCODE)
+#undef GFX_COMMAND_OPCODE
 
 		kGfxCmd_Count
 	};
 
-	void ThreadBufferESDevice::Clear()
-	{
-		if (!_threaded)
-		{
-			_realDevice->Clear();
-			return;
+	namespace {
+		// How a device method argument travels: unsigned values as varints,
+		// signed ones zigzagged, everything else raw. Resources go as handles.
+		template<class T>
+		struct CommandArg
+		{
+			static void Write(CommandWriter& writer, const T& value) { writer.WriteRaw(value); }
+			static T Read(CommandReader& reader) { return reader.ReadRaw<T>(); }
+		};
+
+		template<>
+		struct CommandArg<unsigned int>
+		{
+			static void Write(CommandWriter& writer, unsigned int value) { writer.WriteVarint(value); }
+			static unsigned int Read(CommandReader& reader) { return reader.ReadVarint(); }
+		};
+
+		template<>
+		struct CommandArg<int>
+		{
+			static void Write(CommandWriter& writer, int value) { writer.WriteSignedVarint(value); }
+			static int Read(CommandReader& reader) { return reader.ReadSignedVarint(); }
+		};
+
+		unsigned int HandleOf(GPUProgram* program) { return static_cast<ThreadedGPUProgram*>(program)->handle; }
+		unsigned int HandleOf(Texture2D* texture) { return static_cast<ThreadedTexture2D*>(texture)->handle; }
+		unsigned int HandleOf(VBO* vbo) { return static_cast<ThreadedVBO*>(vbo)->handle; }
+		unsigned int HandleOf(GPUProgramParam* param) { return static_cast<ThreadedGPUProgramParam*>(param)->handle; }
+		unsigned int HandleOf(Material* material) { return static_cast<ThreadedMaterial*>(material)->handle; }
+		unsigned int HandleOf(PipelineState* state) { return static_cast<ThreadedPipelineState*>(state)->handle; }
+
+		template<class T>
+		void WriteArg(CommandWriter& writer, const T& value)
+		{
+			CommandArg<T>::Write(writer, value);
+		}
+
+		template<class T>
+		void WriteArg(CommandWriter& writer, T* resource)
+		{
+			writer.WriteVarint(HandleOf(resource));
+		}
+
+		// DEVICE commands call the backend by name, so a final backend is
+		// called directly
+#define GFX_DEVICE_COMMAND_CALL(name) \
+		struct Call##name \
+		{ \
+			template<class Backend, class... Args> \
+			static void Run(Backend* backend, const Args&... args) { backend->name(args...); } \
+		};
+		GFX_COMMANDS(GFX_DEVICE_COMMAND_CALL, GFX_COMMAND_IGNORE)
+#undef GFX_DEVICE_COMMAND_CALL
+
+		bool IsAffine(const glm::mat4& mat)
+		{
+			return mat[0][3] == 0.0f && mat[1][3] == 0.0f && mat[2][3] == 0.0f && mat[3][3] == 1.0f;
 		}
-		_commandBuffer->WriteValueType(kGfxCmd_Clear);
-		_commandBuffer->WriteSubmitData();
 	}
 
-	void ThreadBufferESDevice::UseGPUProgram(GPUProgram* program)
+	template<class... Params, class... Args>
+	void ThreadBufferESDevice::Forward(unsigned char cmd, void (ESDevice::*method)(Params...), const Args&... args)
 	{
-		ThreadedGPUProgram* threadedP = static_cast<ThreadedGPUProgram*>(program);
-		if (!_threaded)
-		{
-			_realDevice->UseGPUProgram(threadedP->realProgram);
-		}
-		else
+		if (!_threaded)
 		{
-			_commandBuffer->WriteValueType(kGfxCmd_UseGPUProgram);
-			_commandBuffer->WriteValueType<ThreadedGPUProgram*>(threadedP);
-			_commandBuffer->WriteSubmitData();
+			(_realDevice->*method)(ResolveArg(args)...);
+			return;
 		}
+		_commands.WriteOpcode(cmd);
+		// The parameter types pick the encoding, not whatever the caller passed
+		int expand[] = { 0, (WriteArg(_commands, static_cast<const typename std::decay<Params>::type&>(args)), 0)... };
+		(void)expand;
+		EndCommand();
 	}
-	struct GfxCmdCreateGPUProgramData
+
+	template<class T>
+	T* ThreadBufferESDevice::ResolveArg(T* resource)
 	{
-		ThreadedGPUProgram* program;
-		unsigned int vSize;
-		unsigned int fSize;
-	};
+		return Resolve(TableFor(resource), HandleOf(resource));
+	}
+
+	template<class T>
+	T ThreadBufferESDevice::ReadArg(CommandReader& reader, T*)
+	{
+		return CommandArg<T>::Read(reader);
+	}
+
+	template<class T>
+	T* ThreadBufferESDevice::ReadArg(CommandReader& reader, T**)
+	{
+		return Resolve(TableFor((T*)nullptr), reader.ReadVarint());
+	}
+
+	template<class Backend, class Call, class Method>
+	void ThreadBufferESDevice::RunDeviceCommand(CommandReader& reader)
+	{
+		CallDevice<Backend, Call>(reader, MethodParams((Method)nullptr));
+	}
+
+	// One argument per step, so they are decoded in the order they were written
+	template<class Backend, class Call, class Next, class... Rest, class... Decoded>
+	void ThreadBufferESDevice::CallDevice(CommandReader& reader, ParamList<Next, Rest...>, const Decoded&... decoded)
+	{
+		typename std::decay<Next>::type value = ReadArg(reader, (typename std::decay<Next>::type*)nullptr);
+		CallDevice<Backend, Call>(reader, ParamList<Rest...>(), decoded..., value);
+	}
+
+	template<class Backend, class Call, class... Decoded>
+	void ThreadBufferESDevice::CallDevice(CommandReader&, ParamList<>, const Decoded&... decoded)
+	{
+		Call::Run(GetBackend<Backend>(), decoded...);
+	}
+
+	void ThreadBufferESDevice::Clear()
+	{
+		Forward(kGfxCmd_Clear, &ESDevice::Clear);
+	}
+
+	void ThreadBufferESDevice::UseGPUProgram(GPUProgram* program)
+	{
+		Forward(kGfxCmd_UseGPUProgram, &ESDevice::UseGPUProgram, program);
+	}
 	RenderEngine::GPUProgram* ThreadBufferESDevice::CreateGPUProgram(const std::string& vertexShader, const std::string& fragmentShader)
 	{
-		ThreadedGPUProgram* program = new ThreadedGPUProgram(this);
-		if (!_threaded)
-		{
-			program->realProgram = _realDevice->CreateGPUProgram(vertexShader, fragmentShader);
-		}
-		else
-		{
-			_commandBuffer->WriteValueType(kGfxCmd_CreateGPUProgram);
-			GfxCmdCreateGPUProgramData data{
-				program,vertexShader.size(),fragmentShader.size()
-			};
-			_commandBuffer->WriteValueType(data);
-			_commandBuffer->WriteStreamingData(vertexShader.c_str(), vertexShader.size());
-			_commandBuffer->WriteStreamingData(fragmentShader.c_str(), fragmentShader.size());
-		}
+		ThreadedGPUProgram* program = new ThreadedGPUProgram(this);
+		program->handle = _programHandles.Allocate();
+		if (!_threaded)
+		{
+			_programs.Set(program->handle, _realDevice->CreateGPUProgram(vertexShader, fragmentShader));
+		}
+		else
+		{
+			_commands.WriteOpcode(kGfxCmd_CreateGPUProgram);
+			_commands.WriteVarint(program->handle);
+			_commands.WriteVarint((unsigned int)vertexShader.size());
+			_commands.WriteVarint((unsigned int)fragmentShader.size());
+			FlushCommands();
+			_commandBuffer->WriteStreamingData(vertexShader.c_str(), vertexShader.size());
+			_commandBuffer->WriteStreamingData(fragmentShader.c_str(), fragmentShader.size());
+		}
 		return program;
 	}
 
 	void ThreadBufferESDevice::DeletGPUProgram(GPUProgram* program)
 	{
-		ThreadedGPUProgram* threadedP = static_cast<ThreadedGPUProgram*>(program);
-		if (!_threaded)
-		{
-			_realDevice->DeletGPUProgram(threadedP->realProgram);
-			delete threadedP;
-		}
-		else
-		{
-			_commandBuffer->WriteValueType(kGfxCmd_DeleteGPUProgram);
-			_commandBuffer->WriteValueType<ThreadedGPUProgram*>(threadedP);
-			_commandBuffer->WriteSubmitData();
-		}
-	}
-	struct GfxCmdCreateTextureData
-	{
-		ThreadedTexture2D* texture;
-		unsigned int width;
-		unsigned int height;
-		unsigned int dataLen;
-	};
+		ThreadedGPUProgram* threadedP = static_cast<ThreadedGPUProgram*>(program);
+		// The real params die with their program, so their handles go with it
+		if (!_threaded)
+		{
+			_realDevice->DeletGPUProgram(Resolve(_programs, threadedP->handle));
+			_programs.Remove(threadedP->handle);
+			for (auto param : threadedP->params)
+			{
+				_params.Remove(param->handle);
+			}
+		}
+		else
+		{
+			_commands.WriteOpcode(kGfxCmd_DeleteGPUProgram);
+			_commands.WriteVarint(threadedP->handle);
+			_commands.WriteVarint((unsigned int)threadedP->params.size());
+			for (auto param : threadedP->params)
+			{
+				_commands.WriteVarint(param->handle);
+			}
+			EndCommand();
+		}
+		// Commands only carry the handles, so the proxies can go right away
+		for (auto param : threadedP->params)
+		{
+			_paramHandles.Free(param->handle);
+			delete param;
+		}
+		_programHandles.Free(threadedP->handle);
+		delete threadedP;
+	}
 	Texture2D* ThreadBufferESDevice::CreateTexture2D(const TextureData::Ptr& data)
 	{
-		ThreadedTexture2D* texture = new ThreadedTexture2D();
-		GfxCmdCreateTextureData cmddata{
-			texture,data->width,data->height,data->length
-		};
-		_commandBuffer->WriteValueType(kGfxCmd_CreateTexture2D);
-		_commandBuffer->WriteValueType(cmddata);
-		_commandBuffer->WriteStreamingData(data->pixels, data->length);
+		ThreadedTexture2D* texture = new ThreadedTexture2D();
+		texture->handle = _textureHandles.Allocate();
+		if (!data->EnsureResident())
+		{
+			esLogMessage("[render] texture data was released, creating it without pixels");
+		}
+		// A zero length tells the render thread there are no pixels
+		unsigned int dataLen = data->IsResident() ? data->length : 0;
+		_commands.WriteOpcode(kGfxCmd_CreateTexture2D);
+		_commands.WriteVarint(texture->handle);
+		_commands.WriteVarint(data->width);
+		_commands.WriteVarint(data->height);
+		_commands.WriteVarint(dataLen);
+		_commands.WriteVarint(data->format);
+		FlushCommands();
+		_commandBuffer->WriteStreamingData(data->pixels, dataLen);
+		// The pixels now live in the ring buffer
+		data->OnUploaded();
 		return texture;
 	}
 
 	void ThreadBufferESDevice::DeleteTexture2D(Texture2D* texture)
 	{
-		ThreadedTexture2D* threadedText = static_cast<ThreadedTexture2D*>(texture);
-		if (!_threaded)
-		{
-			_realDevice->DeleteTexture2D(threadedText->realTexture);
-			delete threadedText;
-		}
-		else
-		{
-			_commandBuffer->WriteValueType(kGfxCmd_DeleteTexture2D);
-			_commandBuffer->WriteValueType(threadedText);
-			_commandBuffer->WriteSubmitData();
+		ThreadedTexture2D* threadedText = static_cast<ThreadedTexture2D*>(texture);
+		if (!_threaded)
+		{
+			_realDevice->DeleteTexture2D(Resolve(_textures, threadedText->handle));
+			_textures.Remove(threadedText->handle);
+		}
+		else
+		{
+			_commands.WriteOpcode(kGfxCmd_DeleteTexture2D);
+			_commands.WriteVarint(threadedText->handle);
+			EndCommand();
 		}
+		_textureHandles.Free(threadedText->handle);
+		delete threadedText;
 	}
 
 	void ThreadBufferESDevice::UseTexture2D(Texture2D* texture, unsigned int index)
 	{
-		ThreadedTexture2D* threadedText = static_cast<ThreadedTexture2D*>(texture);
-		if (!_threaded)
-		{
-			_realDevice->UseTexture2D(threadedText->realTexture,index);
-		}
-		else
-		{
-			_commandBuffer->WriteValueType(kGfxCmd_UseTexture2D);
-			_commandBuffer->WriteValueType(threadedText);
-			_commandBuffer->WriteValueType(index);
-			_commandBuffer->WriteSubmitData();
-		}
+		Forward(kGfxCmd_UseTexture2D, &ESDevice::UseTexture2D, texture, index);
 	}
 
 	void ThreadBufferESDevice::SetClearColor(float r, float g, float b, float alpha)
 	{
-		if (!_threaded)
-		{
-			_realDevice->SetClearColor(r, g, b, alpha);
-		}
-		else
-		{
-			_commandBuffer->WriteValueType(kGfxCmd_SetClearColor);
-			glm::vec4 data(r, g, b, alpha);
-			_commandBuffer->WriteValueType(data);
-			_commandBuffer->WriteSubmitData();
-		}
-
+		Forward(kGfxCmd_SetClearColor, &ESDevice::SetClearColor, r, g, b, alpha);
 	}
 
 	void ThreadBufferESDevice::DrawTriangle(std::vector<glm::vec3>& vertices)
 	{
-		if (!_threaded)
-		{
-			_realDevice->DrawTriangle(vertices);
-		}
+		if (!_threaded)
+		{
+			_realDevice->DrawTriangle(vertices);
+		}
 		else
 		{
-			_commandBuffer->WriteValueType(kGfxCmd_DrawTriangle);
+			_commands.WriteOpcode(kGfxCmd_DrawTriangle);
 			unsigned int size = vertices.size() * sizeof(glm::vec3);
-			_commandBuffer->WriteValueType(size);
+			_commands.WriteVarint(size);
+			FlushCommands();
 			_commandBuffer->WriteStreamingData(&vertices[0], size);
-		}
+		}
 	}
 
 	void ThreadBufferESDevice::SetViewPort(int x, int y, int width, int height)
 	{
-		if (!_threaded)
-		{
-			_realDevice->SetViewPort(x, y, width, height);
-		}
-		else
-		{
-			_commandBuffer->WriteValueType(kGfxCmd_SetViewPort);
-			glm::vec<4, int> data(x,y,width,height);
-			_commandBuffer->WriteValueType<glm::vec<4, int>>(data);
-			_commandBuffer->WriteSubmitData();
-		}
+		Forward(kGfxCmd_SetViewPort, &ESDevice::SetViewPort, x, y, width, height);
+	}
+
+	void ThreadBufferESDevice::Cleanup()
+	{
+		StopRenderThread();
+		// The ring's charge goes back before the real device and its tracker do
+		SetCommandBuffer(nullptr);
+		ReleaseRealDevice();
+	}
+
+	void ThreadBufferESDevice::QueueShutdown()
+	{
+		_commands.WriteOpcode(kGfxCmd_Shutdown);
+		FlushCommands();
 	}
 
 	void ThreadBufferESDevice::BeginRender()
@@ -203,32 +284,118 @@ namespace RenderEngine
 
 	void ThreadBufferESDevice::Present()
 	{
-		if (_isInPresenting)
-		{
-			WaitForPresent();
-		}
-		_isInPresenting = true;
+		if (_remote)
+		{
+			_commands.WriteOpcode(kGfxCmd_Present);
+			FlushCommands();
+			return;
+		}
+		if (_isInPresenting)
+		{
+			WaitForPresent();
+		}
+		_isInPresenting = true;
 		if (!_threaded)
 		{
 			_realDevice->Present();
 			_isInPresenting = false;
-		}
-		else
-		{
-			_commandBuffer->WriteValueType(kGfxCmd_Present);
-			_commandBuffer->WriteSubmitData();
+		}
+		else
+		{
+			_commands.WriteOpcode(kGfxCmd_Present);
+			FlushCommands();
 		}
 	}
 
+	bool ThreadBufferESDevice::StartCapture(const std::string& path)
+	{
+		assert(!_threaded && _capture == nullptr);
+		_capture = new CommandCapture();
+		if (!_capture->Open(path))
+		{
+			delete _capture;
+			_capture = nullptr;
+			return false;
+		}
+		_commandBuffer->SetReadCapture(_capture);
+		return true;
+	}
+
+	bool ThreadBufferESDevice::ReplayFrame(CommandReplay& replay, double& frameTime)
+	{
+		bool fed = replay.FeedFrame(*_commandBuffer, frameTime);
+		// The frame ended with its Present, wait for the one before it like
+		// Present does. Counted here, the render thread clears _isInPresenting
+		// whenever it gets ahead.
+		if (fed)
+		{
+			++_replayFramesInFlight;
+		}
+		while (_replayFramesInFlight > (fed ? 1u : 0u))
+		{
+			WaitForPresent();
+			--_replayFramesInFlight;
+		}
+		return fed;
+	}
+
+	namespace {
+		// POSIX shared memory names start with a slash
+		std::string SharedBufferName(const std::string& name)
+		{
+			return !name.empty() && name[0] == '/' ? name : "/" + name;
+		}
+	}
+
+	bool ThreadBufferESDevice::ConnectSharedBuffer(const std::string& name)
+	{
+		assert(!_threaded);
+		RingBuffer* shared = new RingBuffer();
+		if (!shared->OpenShared(SharedBufferName(name).c_str()))
+		{
+			esLogMessage("[render] no render server at %s", name.c_str());
+			delete shared;
+			return false;
+		}
+		SetCommandBuffer(shared);
+		_remote = true;
+		_threaded = true;
+		return true;
+	}
+
+	bool ThreadBufferESDevice::ServeSharedBuffer(const std::string& name)
+	{
+		RingBuffer* shared = new RingBuffer();
+		if (!shared->CreateShared(SharedBufferName(name).c_str(), _commandBufferSize))
+		{
+			esLogMessage("[render] can't create shared command buffer %s", name.c_str());
+			delete shared;
+			return false;
+		}
+		SetCommandBuffer(shared);
+		return true;
+	}
+
+	bool ThreadBufferESDevice::RunPendingFrame()
+	{
+		unsigned int presentCount = _presentCount;
+		while (_presentCount == presentCount && _commandBuffer->IsReadDataAvailable())
+		{
+			RunOneThreadCommand();
+		}
+		return _presentCount != presentCount;
+	}
+
 	void ThreadBufferESDevice::AcqiureThreadOwnerShip()
 	{
 		esLogMessage("[render] AcqiureThreadOwnerShip %d", (int)_threaded);
-		if (!_threaded)
+		// The server keeps its context
+		if (!_threaded || _remote)
 		{
 			return;
 		}
-		_commandBuffer->WriteValueType(kGfxCmd_ReleaseThreadOwnership);
-		_commandBuffer->WriteSubmitData();
+		_commands.WriteOpcode(kGfxCmd_ReleaseThreadOwnership);
+		FlushCommands();
 		WaitForOwnerShip();
 		_realDevice->AcqiureThreadOwnerShip();
 		_threaded = false;
@@ -242,424 +409,609 @@ namespace RenderEngine
 			return;
 		}
 		_realDevice->ReleaseThreadOwnership();
-		_commandBuffer->WriteValueType(kGfxCmd_AcqiureThreadOwnerShip);
-		_commandBuffer->WriteSubmitData();
+		_commands.WriteOpcode(kGfxCmd_AcqiureThreadOwnerShip);
+		FlushCommands();
 		WaitForOwnerShip();
 		_threaded = true;
 	}
-	struct GfxCmdUpdateVBOData
-	{
-		ThreadedVBO* vbo;
-		unsigned int verticesCount;
-		unsigned int indicesCount;
-
-	};
 	VBO* ThreadBufferESDevice::CreateVBO()
 	{
 		ThreadedVBO* threadvbo = new ThreadedVBO();
-		if (!_threaded)
-		{
-			threadvbo->realVbo =  _realDevice->CreateVBO();
-		}
-		else
-		{
-			_commandBuffer->WriteValueType(kGfxCmd_CreateVBO);
-			_commandBuffer->WriteValueType(threadvbo);
-			_commandBuffer->WriteSubmitData();
+		threadvbo->handle = _vboHandles.Allocate();
+		if (!_threaded)
+		{
+			_vbos.Set(threadvbo->handle, _realDevice->CreateVBO());
+		}
+		else
+		{
+			_commands.WriteOpcode(kGfxCmd_CreateVBO);
+			_commands.WriteVarint(threadvbo->handle);
+			EndCommand();
 		}
 		return threadvbo;
 	}
 	void ThreadBufferESDevice::UpdateVBO(VBO* vbo, const VBOData::Ptr& vboData)
 	{
-		if (!_threaded)
-		{
-			_realDevice->UpdateVBO(vbo,vboData);
-		}
-		else
-		{
-			_commandBuffer->WriteValueType(kGfxCmd_UpdateVBO);
-			GfxCmdUpdateVBOData data{
-				(ThreadedVBO*)vbo,vboData->verticesCount,vboData->indicesCount
-			};
-			_commandBuffer->WriteValueType(data);
-			//BeginProfile("kGfxCmd_UpdateVBO write");
-			_commandBuffer->WriteStreamingData(vboData->vertices,data.verticesCount*sizeof(VBOData::Vertex));
-			_commandBuffer->WriteStreamingData(vboData->indices,data.indicesCount*sizeof(unsigned short));
-			//EndProfile();
-		}
+		ThreadedVBO* threadVbo = static_cast<ThreadedVBO*>(vbo);
+		if (!vboData->EnsureResident())
+		{
+			esLogMessage("[render] UpdateVBO with released data, ignored");
+			return;
+		}
+		threadVbo->stride = vboData->format.GetStride();
+		if (!_threaded)
+		{
+			_realDevice->UpdateVBO(Resolve(_vbos, threadVbo->handle),vboData);
+		}
+		else
+		{
+			_commands.WriteOpcode(kGfxCmd_UpdateVBO);
+			_commands.WriteVarint(threadVbo->handle);
+			_commands.WriteVarint(vboData->verticesCount);
+			_commands.WriteVarint(vboData->indicesCount);
+			_commands.WriteRaw(vboData->format);
+			FlushCommands();
+			//BeginProfile("kGfxCmd_UpdateVBO write");
+			_commandBuffer->WriteStreamingData(vboData->vertices,vboData->GetVertexBufferSize());
+			_commandBuffer->WriteStreamingData(vboData->indices,vboData->indicesCount*sizeof(unsigned short));
+			//EndProfile();
+		}
+		vboData->OnUploaded();
+	}
+	void ThreadBufferESDevice::UpdateVBORange(VBO* vbo, unsigned int vertexStart, unsigned int vertexCount, const void* vertices,
+		unsigned int indexStart, unsigned int indexCount, const unsigned short* indices)
+	{
+		ThreadedVBO* threadVbo = static_cast<ThreadedVBO*>(vbo);
+		if (!_threaded)
+		{
+			_realDevice->UpdateVBORange(Resolve(_vbos, threadVbo->handle), vertexStart, vertexCount, vertices, indexStart, indexCount, indices);
+		}
+		else
+		{
+			unsigned int vertexSize = vertexCount * threadVbo->stride;
+			_commands.WriteOpcode(kGfxCmd_UpdateVBORange);
+			_commands.WriteVarint(threadVbo->handle);
+			_commands.WriteVarint(vertexStart);
+			_commands.WriteVarint(vertexCount);
+			_commands.WriteVarint(vertexSize);
+			_commands.WriteVarint(indexStart);
+			_commands.WriteVarint(indexCount);
+			FlushCommands();
+			_commandBuffer->WriteStreamingData(vertices, vertexSize);
+			_commandBuffer->WriteStreamingData(indices, indexCount * sizeof(unsigned short));
+		}
 	}
 
 	void ThreadBufferESDevice::DeleteVBO(VBO* vbo)
 	{
 		ThreadedVBO* threadedVbo = static_cast<ThreadedVBO*>(vbo);
-		if (!_threaded)
-		{
-			_realDevice->DeleteVBO(threadedVbo->realVbo);
-			delete threadedVbo;
-		}
-		else
-		{
-			_commandBuffer->WriteValueType(kGfxCmd_DeleteVBO);
-			_commandBuffer->WriteValueType(threadedVbo);
-			_commandBuffer->WriteSubmitData();
+		if (!_threaded)
+		{
+			_realDevice->DeleteVBO(Resolve(_vbos, threadedVbo->handle));
+			_vbos.Remove(threadedVbo->handle);
+		}
+		else
+		{
+			_commands.WriteOpcode(kGfxCmd_DeleteVBO);
+			_commands.WriteVarint(threadedVbo->handle);
+			EndCommand();
 		}
+		_vboHandles.Free(threadedVbo->handle);
+		delete threadedVbo;
 	}
 
 	void ThreadBufferESDevice::DrawVBO(VBO* vbo)
 	{
-		ThreadedVBO* threadedVbo = static_cast<ThreadedVBO*>(vbo);
-		if (!_threaded)
-		{
-			_realDevice->DrawVBO(threadedVbo->realVbo);
-		}
-		else
-		{
-			_commandBuffer->WriteValueType(kGfxCmd_DrawVBO);
-			_commandBuffer->WriteValueType(threadedVbo);
-			_commandBuffer->WriteSubmitData();
-		}
+		Forward(kGfxCmd_DrawVBO, &ESDevice::DrawVBO, vbo);
+	}
+
+	void ThreadBufferESDevice::DrawVBORange(VBO* vbo, unsigned int indexStart, unsigned int indexCount)
+	{
+		Forward(kGfxCmd_DrawVBORange, &ESDevice::DrawVBORange, vbo, indexStart, indexCount);
 	}
 
 	void ThreadBufferESDevice::SetGPUProgramParamAsInt(GPUProgramParam* param, int value)
 	{
-		ThreadedGPUProgramParam* threadParam = static_cast<ThreadedGPUProgramParam*>(param);
-		if (!_threaded)
-		{
-			_realDevice->SetGPUProgramParamAsInt(threadParam->realParam,value);
-		}
-		else
-		{
-			_commandBuffer->WriteValueType(kGfxCmd_SetGPUProgramAsInt);
-			_commandBuffer->WriteValueType(threadParam);
-			_commandBuffer->WriteValueType(value);
-			_commandBuffer->WriteSubmitData();
-		}
+		Forward(kGfxCmd_SetGPUProgramParamAsInt, &ESDevice::SetGPUProgramParamAsInt, param, value);
 	}
 
 	void ThreadBufferESDevice::SetGPUProgramParamAsFloat(GPUProgramParam* param, float value)
 	{
-		ThreadedGPUProgramParam* threadParam = static_cast<ThreadedGPUProgramParam*>(param);
-		if (!_threaded)
-		{
-			_realDevice->SetGPUProgramParamAsFloat(threadParam->realParam, value);
-		}
-		else
-		{
-			_commandBuffer->WriteValueType(kGfxCmd_SetGPUProgramAsFloat);
-			_commandBuffer->WriteValueType(threadParam);
-			_commandBuffer->WriteValueType(value);
-			_commandBuffer->WriteSubmitData();
-		}
+		Forward(kGfxCmd_SetGPUProgramParamAsFloat, &ESDevice::SetGPUProgramParamAsFloat, param, value);
 	}
 
 	void ThreadBufferESDevice::SetGPUProgramParamAsMat4(GPUProgramParam* param, const glm::mat4& mat)
 	{
-		ThreadedGPUProgramParam* threadParam = static_cast<ThreadedGPUProgramParam*>(param);
-		if (!_threaded)
-		{
-			_realDevice->SetGPUProgramParamAsMat4(threadParam->realParam, mat);
-		}
-		else
-		{
-			_commandBuffer->WriteValueType(kGfxCmd_SetGPUProgramAsMat4);
-			_commandBuffer->WriteValueType(threadParam);
-			_commandBuffer->WriteValueType(mat);
-			_commandBuffer->WriteSubmitData();
+		if (_threaded && IsAffine(mat))
+		{
+			_commands.WriteOpcode(kGfxCmd_SetGPUProgramParamAsAffineMat4);
+			_commands.WriteVarint(HandleOf(param));
+			for (int column = 0; column < 4; ++column)
+			{
+				_commands.WriteRaw(glm::vec3(mat[column]));
+			}
+			EndCommand();
+			return;
 		}
+		Forward(kGfxCmd_SetGPUProgramParamAsMat4, &ESDevice::SetGPUProgramParamAsMat4, param, mat);
 	}
 
 	void ThreadBufferESDevice::SetGPUProgramParamAsIntArray(GPUProgramParam* param, const std::vector<int>& values)
 	{
 		ThreadedGPUProgramParam* threadParam = static_cast<ThreadedGPUProgramParam*>(param);
-		if (!_threaded)
-		{
-			_realDevice->SetGPUProgramParamAsIntArray(threadParam->realParam, values);
-		}
-		else
-		{
-			_commandBuffer->WriteValueType(kGfxCmd_SetGPUProgramAsIntArray);
-			_commandBuffer->WriteValueType(threadParam);
-			unsigned int size = values.size() * sizeof(int);
-			_commandBuffer->WriteValueType(size);
-			_commandBuffer->WriteStreamingData(&values[0], size);
+		if (!_threaded)
+		{
+			_realDevice->SetGPUProgramParamAsIntArray(Resolve(_params, threadParam->handle), values);
+		}
+		else
+		{
+			_commands.WriteOpcode(kGfxCmd_SetGPUProgramParamAsIntArray);
+			_commands.WriteVarint(threadParam->handle);
+			unsigned int size = values.size() * sizeof(int);
+			_commands.WriteVarint(size);
+			FlushCommands();
+			_commandBuffer->WriteStreamingData(&values[0], size);
 		}
 	}
 
 	void ThreadBufferESDevice::SetGPUProgramParamAsFloatArray(GPUProgramParam* param, const std::vector<float>& values)
 	{
 		ThreadedGPUProgramParam* threadParam = static_cast<ThreadedGPUProgramParam*>(param);
-		if (!_threaded)
-		{
-			_realDevice->SetGPUProgramParamAsFloatArray(threadParam->realParam, values);
-		}
-		else
-		{
-			_commandBuffer->WriteValueType(kGfxCmd_SetGPUProgramAsFloatArray);
-			_commandBuffer->WriteValueType(threadParam);
-			unsigned int size = values.size() * sizeof(float);
-			_commandBuffer->WriteValueType(size);
-			_commandBuffer->WriteStreamingData(&values[0], size);
+		if (!_threaded)
+		{
+			_realDevice->SetGPUProgramParamAsFloatArray(Resolve(_params, threadParam->handle), values);
+		}
+		else
+		{
+			_commands.WriteOpcode(kGfxCmd_SetGPUProgramParamAsFloatArray);
+			_commands.WriteVarint(threadParam->handle);
+			unsigned int size = values.size() * sizeof(float);
+			_commands.WriteVarint(size);
+			FlushCommands();
+			_commandBuffer->WriteStreamingData(&values[0], size);
 		}
 	}
 
 	void ThreadBufferESDevice::SetGPUProgramParamAsMat4Array(GPUProgramParam* param, const std::vector<glm::mat4>& values)
 	{
 		ThreadedGPUProgramParam* threadParam = static_cast<ThreadedGPUProgramParam*>(param);
-		if (!_threaded)
-		{
-			_realDevice->SetGPUProgramParamAsMat4Array(threadParam->realParam, values);
-		}
-		else
-		{
-			_commandBuffer->WriteValueType(kGfxCmd_SetGPUProgramAsMat4Array);
-			_commandBuffer->WriteValueType(threadParam);
-			unsigned int size = values.size() * sizeof(glm::mat4);
-			_commandBuffer->WriteValueType(size);
-			_commandBuffer->WriteStreamingData(&values[0][0][0], size);
+		if (!_threaded)
+		{
+			_realDevice->SetGPUProgramParamAsMat4Array(Resolve(_params, threadParam->handle), values);
+		}
+		else
+		{
+			_commands.WriteOpcode(kGfxCmd_SetGPUProgramParamAsMat4Array);
+			_commands.WriteVarint(threadParam->handle);
+			unsigned int size = values.size() * sizeof(glm::mat4);
+			_commands.WriteVarint(size);
+			FlushCommands();
+			_commandBuffer->WriteStreamingData(&values[0][0][0], size);
 		}
 	}
 
 	void ThreadBufferESDevice::InitThreadGPUProgramParam(ThreadedGPUProgram* program, ThreadedGPUProgramParam* param, const std::string& name)
 	{
-		if (!_threaded)
-		{
-			param->realParam = _realDevice->GetGPUProgramParam(program->realProgram, name);
-		}
-		else
-		{
-			_commandBuffer->WriteValueType(kGfxCmd_InitThreadGPUProgramParam);
-			_commandBuffer->WriteValueType(program);
-			_commandBuffer->WriteValueType(param);
-			unsigned int size = name.size() * sizeof(char);
-			_commandBuffer->WriteValueType(size);
-			_commandBuffer->WriteStreamingData(&name[0], size);
+		param->handle = _paramHandles.Allocate();
+		program->params.push_back(param);
+		if (!_threaded)
+		{
+			_params.Set(param->handle, _realDevice->GetGPUProgramParam(Resolve(_programs, program->handle), name));
+		}
+		else
+		{
+			_commands.WriteOpcode(kGfxCmd_InitThreadGPUProgramParam);
+			_commands.WriteVarint(program->handle);
+			_commands.WriteVarint(param->handle);
+			unsigned int size = name.size() * sizeof(char);
+			_commands.WriteVarint(size);
+			FlushCommands();
+			_commandBuffer->WriteStreamingData(&name[0], size);
 		}
 	}
 	
-	void ThreadBufferESDevice::RunOneThreadCommand()
+	Material* ThreadBufferESDevice::CreateMaterial(const MaterialDesc& desc)
 	{
-		GfxCommandType cmd = _commandBuffer->ReadValueType<GfxCommandType>();
-		switch (cmd)
-		{
-		case RenderEngine::kGfxCmd_Clear:
-		{
-			_realDevice->Clear();
-			_commandBuffer->ReadReleaseData();
-			break;
-		}	
-		case RenderEngine::kGfxCmd_UseGPUProgram:
-		{
-			ThreadedGPUProgram* program = _commandBuffer->ReadValueType<ThreadedGPUProgram*>();
-			_realDevice->UseGPUProgram(program->realProgram);
-			_commandBuffer->ReadReleaseData();
-			break;
-		}
-		case RenderEngine::kGfxCmd_CreateGPUProgram:
-		{
-			auto data = _commandBuffer->ReadValueType<GfxCmdCreateGPUProgramData>();
-			std::string vertexShader, fragmentShader;
-			vertexShader.resize(data.vSize);
-			fragmentShader.resize(data.fSize);
-			_commandBuffer->ReadStreamingData((void*)vertexShader.c_str(), vertexShader.size());	
-			_commandBuffer->ReadStreamingData((void*)fragmentShader.c_str(), fragmentShader.size());
-			data.program->realProgram = _realDevice->CreateGPUProgram(vertexShader, fragmentShader);
-			break;
-		}
-			
-		case RenderEngine::kGfxCmd_DeleteGPUProgram:
-		{
-			ThreadedGPUProgram* program = _commandBuffer->ReadValueType<ThreadedGPUProgram*>();
-			_realDevice->DeletGPUProgram(program->realProgram);
-			delete program;
-			_commandBuffer->ReadReleaseData();
-			break;
-		}
-		case RenderEngine::kGfxCmd_CreateTexture2D:
-		{	
-			auto data = _commandBuffer->ReadValueType<GfxCmdCreateTextureData>();			
-			char *buff = new char[data.dataLen];
-			_commandBuffer->ReadStreamingData(buff, data.dataLen);
-			TextureData::Ptr textureData = std::make_shared<TextureData>(buff,data.width,data.height,data.dataLen);
-			data.texture->realTexture = _realDevice->CreateTexture2D(textureData);
-			break; 
-		}
-
-		case RenderEngine::kGfxCmd_DeleteTexture2D:
-		{
-			auto texture = _commandBuffer->ReadValueType<ThreadedTexture2D*>();
-			_realDevice->DeleteTexture2D(texture->realTexture);
-			_commandBuffer->ReadReleaseData();
-			delete texture;
-			break;
-		}
-		case RenderEngine::kGfxCmd_UseTexture2D:
-		{
-			auto texture = _commandBuffer->ReadValueType<ThreadedTexture2D*>();
-			auto index = _commandBuffer->ReadValueType<unsigned int>();
-			_realDevice->UseTexture2D(texture->realTexture,index);
-			_commandBuffer->ReadReleaseData();
-			break;
-		}
-			
-		case RenderEngine::kGfxCmd_SetClearColor:
-		{
-			auto data = _commandBuffer->ReadValueType<glm::vec4>();
-			_realDevice->SetClearColor(data.r, data.g, data.b, data.a);
-			_commandBuffer->ReadReleaseData();
-			break;
-		}
-			
-		case RenderEngine::kGfxCmd_DrawTriangle:
-		{
-			auto size = _commandBuffer->ReadValueType<unsigned int>();
-			std::vector<glm::vec3> vertices(size / sizeof(glm::vec3));
-			vertices.resize(size / sizeof(glm::vec3));
-			_commandBuffer->ReadStreamingData((void*)&vertices[0], size);
-			_realDevice->DrawTriangle(vertices);
-			break;
+		ThreadedMaterial* material = new ThreadedMaterial(desc);
+		material->handle = _materialHandles.Allocate();
+		if (!_threaded)
+		{
+			_materials.Set(material->handle, _realDevice->CreateMaterial(ResolveMaterialDesc(desc)));
 		}
-			
-		case RenderEngine::kGfxCmd_SetViewPort:
+		else
 		{
-			glm::vec<4, int> data = _commandBuffer->ReadValueType<glm::vec<4, int> >();
-			_realDevice->SetViewPort(data.x, data.y, data.z, data.w);
-			_commandBuffer->ReadReleaseData();
-			break;
+			_commands.WriteOpcode(kGfxCmd_CreateMaterial);
+			_commands.WriteVarint(material->handle);
+			WriteMaterialDesc(desc);
 		}
-			
-		case RenderEngine::kGfxCmd_Present:
+		return material;
+	}
+
+	void ThreadBufferESDevice::DeleteMaterial(Material* material)
+	{
+		ThreadedMaterial* threadedMaterial = static_cast<ThreadedMaterial*>(material);
+		if (!_threaded)
 		{
-			_realDevice->Present();
-			_commandBuffer->ReadReleaseData();
-			SignalPresent();
-			break;
+			_realDevice->DeleteMaterial(Resolve(_materials, threadedMaterial->handle));
+			_materials.Remove(threadedMaterial->handle);
 		}
-			
-		case RenderEngine::kGfxCmd_AcqiureThreadOwnerShip:
-		{	
-			_realDevice->AcqiureThreadOwnerShip();
-			_commandBuffer->ReadReleaseData();
-			break; 
+		else
+		{
+			_commands.WriteOpcode(kGfxCmd_DeleteMaterial);
+			_commands.WriteVarint(threadedMaterial->handle);
+			EndCommand();
 		}
-		case RenderEngine::kGfxCmd_ReleaseThreadOwnership:
+		_materialHandles.Free(threadedMaterial->handle);
+		delete threadedMaterial;
+	}
+
+	void ThreadBufferESDevice::UseMaterial(Material* material)
+	{
+		Forward(kGfxCmd_UseMaterial, &ESDevice::UseMaterial, material);
+	}
+
+	PipelineState* ThreadBufferESDevice::CreatePipelineState(const PipelineStateDesc& desc)
+	{
+		bool created;
+		ThreadedPipelineState* state = FindOrAddPipelineState(desc, created);
+		if (!created)
 		{
-			_realDevice->ReleaseThreadOwnership();
-			_commandBuffer->ReadReleaseData();
-			break;
+			return state;
 		}
-		case RenderEngine::kGfxCmd_CreateVBO:
+		state->handle = _stateHandles.Allocate();
+		if (!_threaded)
 		{
-			ThreadedVBO* threadedVbo = _commandBuffer->ReadValueType<ThreadedVBO*>();
-			threadedVbo->realVbo = _realDevice->CreateVBO();
-			_commandBuffer->ReadReleaseData();
-			break;
+			_states.Set(state->handle, _realDevice->CreatePipelineState(desc));
 		}
-		case RenderEngine::kGfxCmd_UpdateVBO:
-		{	
-			GfxCmdUpdateVBOData data = _commandBuffer->ReadValueType<GfxCmdUpdateVBOData>();
-			BeginProfile("kGfxCmd_UpdateVBO alloc");
-			VBOData::Ptr vboData = std::make_shared<VBOData>(data.verticesCount, data.indicesCount);
-			EndProfile();
-			BeginProfile("kGfxCmd_UpdateVBO write");
-			_commandBuffer->ReadStreamingData((void*)vboData->vertices, data.verticesCount * sizeof(VBOData::Vertex));
-			_commandBuffer->ReadStreamingData((void*)vboData->indices, data.indicesCount * sizeof(unsigned short));
-			EndProfile();
-			_realDevice->UpdateVBO(data.vbo->realVbo, vboData);
-			vboData.reset();
-			break;
+		else
+		{
+			_commands.WriteOpcode(kGfxCmd_CreatePipelineState);
+			_commands.WriteVarint(state->handle);
+			_commands.WriteRaw(desc);
+			EndCommand();
 		}
-		case RenderEngine::kGfxCmd_DeleteVBO:
+		return state;
+	}
+
+	void ThreadBufferESDevice::UsePipelineState(PipelineState* state)
+	{
+		Forward(kGfxCmd_UsePipelineState, &ESDevice::UsePipelineState, state);
+	}
+
+	MaterialDesc ThreadBufferESDevice::ResolveMaterialDesc(const MaterialDesc& desc)
+	{
+		MaterialDesc realDesc(Resolve(_programs, static_cast<ThreadedGPUProgram*>(desc.program)->handle));
+		for (auto& t : desc.textures)
 		{
-			ThreadedVBO* threadedVbo = _commandBuffer->ReadValueType<ThreadedVBO*>();
-			_realDevice->DeleteVBO(threadedVbo->realVbo);
-			delete threadedVbo;
-			_commandBuffer->ReadReleaseData();
-			break;
+			realDesc.AddTexture(Resolve(_textures, static_cast<ThreadedTexture2D*>(t.texture)->handle), t.index);
 		}
-		case RenderEngine::kGfxCmd_DrawVBO:
+		for (auto u : desc.uniforms)
 		{
-			ThreadedVBO* threadedVbo = _commandBuffer->ReadValueType<ThreadedVBO*>();
-			_realDevice->DrawVBO(threadedVbo->realVbo);
-			_commandBuffer->ReadReleaseData();
-			break;
+			u.param = Resolve(_params, static_cast<ThreadedGPUProgramParam*>(u.param)->handle);
+			realDesc.uniforms.push_back(u);
 		}
-		case kGfxCmd_SetGPUProgramAsInt:
+		return realDesc;
+	}
+
+	void ThreadBufferESDevice::WriteMaterialDesc(const MaterialDesc& desc)
+	{
+		_commands.WriteVarint(static_cast<ThreadedGPUProgram*>(desc.program)->handle);
+		_commands.WriteVarint((unsigned int)desc.textures.size());
+		for (auto& t : desc.textures)
 		{
-			ThreadedGPUProgramParam* threadParam = _commandBuffer->ReadValueType<ThreadedGPUProgramParam*>();
-			int value = _commandBuffer->ReadValueType<int>();
-			_realDevice->SetGPUProgramParamAsInt(threadParam->realParam, value);
-			_commandBuffer->ReadReleaseData();
-			break;
+			_commands.WriteVarint(static_cast<ThreadedTexture2D*>(t.texture)->handle);
+			_commands.WriteVarint(t.index);
 		}
-		case kGfxCmd_SetGPUProgramAsFloat:
+		_commands.WriteVarint((unsigned int)desc.uniforms.size());
+		for (auto& u : desc.uniforms)
+		{
+			_commands.WriteVarint(static_cast<ThreadedGPUProgramParam*>(u.param)->handle);
+			_commands.WriteVarint(u.type);
+			// Only the scalars and matrices a uniform can hold are sent
+			if (u.type == kMaterialParamMat4)
+			{
+				_commands.WriteRaw(u.value);
+			}
+			else
+			{
+				_commands.WriteRaw(u.value[0][0]);
+			}
+		}
+		EndCommand();
+	}
+
+	MaterialDesc ThreadBufferESDevice::ReadMaterialDesc(CommandReader& reader)
+	{
+		MaterialDesc desc(Resolve(_programs, reader.ReadVarint()));
+		unsigned int textureCount = reader.ReadVarint();
+		for (unsigned int i = 0; i < textureCount; ++i)
 		{
-			ThreadedGPUProgramParam* threadParam = _commandBuffer->ReadValueType<ThreadedGPUProgramParam*>();
-			float value = _commandBuffer->ReadValueType<float>();
-			_realDevice->SetGPUProgramParamAsFloat(threadParam->realParam, value);
-			_commandBuffer->ReadReleaseData();
-			break;
+			Texture2D* texture = Resolve(_textures, reader.ReadVarint());
+			desc.AddTexture(texture, reader.ReadVarint());
 		}
+		unsigned int uniformCount = reader.ReadVarint();
+		for (unsigned int i = 0; i < uniformCount; ++i)
+		{
+			MaterialDesc::Uniform u;
+			u.param = Resolve(_params, reader.ReadVarint());
+			u.type = (MaterialParamType)reader.ReadVarint();
+			if (u.type == kMaterialParamMat4)
+			{
+				u.value = reader.ReadRaw<glm::mat4>();
+			}
+			else
+			{
+				u.value = glm::mat4(0.0f);
+				u.value[0][0] = reader.ReadRaw<float>();
+			}
+			desc.uniforms.push_back(u);
+		}
+		return desc;
+	}
 
-		case kGfxCmd_SetGPUProgramAsMat4:
+	void ThreadBufferESDevice::EndCommand()
+	{
+		if (_commands.GetSize() >= kCommandBatchSize)
 		{
-			ThreadedGPUProgramParam* threadParam = _commandBuffer->ReadValueType<ThreadedGPUProgramParam*>();
-			auto value = _commandBuffer->ReadValueType<glm::mat4>();
-			_realDevice->SetGPUProgramParamAsMat4(threadParam->realParam, value);
-			_commandBuffer->ReadReleaseData();
-			break;
+			FlushCommands();
 		}
+	}
 
-		case kGfxCmd_SetGPUProgramAsIntArray:
+	void ThreadBufferESDevice::FlushCommands()
+	{
+		if (_commands.GetSize() == 0)
 		{
-			ThreadedGPUProgramParam* threadParam = _commandBuffer->ReadValueType<ThreadedGPUProgramParam*>();
-			auto size = _commandBuffer->ReadValueType<unsigned int>();
-			std::vector<int> values;
-			values.resize(size/sizeof(int));
-			_commandBuffer->ReadStreamingData(&values[0], size);
-			_realDevice->SetGPUProgramParamAsIntArray(threadParam->realParam, values);
-			break;
+			return;
 		}
+		// One aligned block, so the reader takes the whole batch at once
+		unsigned int size = (unsigned int)_commands.GetSize();
+		_commandBuffer->WriteValueType(size);
+		memcpy(_commandBuffer->GetWriteDataPointer(size, RingBuffer::kDefaultAlignment), _commands.GetData(), size);
+		_commandBuffer->WriteSubmitData();
+		_commands.Reset();
+	}
 
-		case kGfxCmd_SetGPUProgramAsFloatArray:
+	void ThreadBufferESDevice::RunOneThreadCommand()
+	{
+		unsigned int size = _commandBuffer->ReadValueType<unsigned int>();
+		CommandReader reader(_commandBuffer->GetReadDataPointer(size, RingBuffer::kDefaultAlignment), size);
+		while (!reader.AtEnd())
 		{
-			ThreadedGPUProgramParam* threadParam = _commandBuffer->ReadValueType<ThreadedGPUProgramParam*>();
-			auto size = _commandBuffer->ReadValueType<unsigned int>();
-			std::vector<float> values;
-			values.resize(size/sizeof(float));
-			_commandBuffer->ReadStreamingData(&values[0], size);
-			_realDevice->SetGPUProgramParamAsFloatArray(threadParam->realParam, values);
-			break;
+			RunCommand(reader);
 		}
+		_commandBuffer->ReadReleaseData();
+	}
 
-		case kGfxCmd_SetGPUProgramAsMat4Array:
+	void ThreadBufferESDevice::RunCommand(CommandReader& reader)
+	{
+		unsigned char cmd = reader.ReadOpcode();
+		assert(cmd < kGfxCmd_Count && _commandHandlers[cmd] != nullptr);
+		(this->*_commandHandlers[cmd])(reader);
+	}
+
+	template<class Backend>
+	void ThreadBufferESDevice::RunCreateGPUProgram(CommandReader& reader)
+	{
+		unsigned int program = reader.ReadVarint();
+		std::string vertexShader, fragmentShader;
+		vertexShader.resize(reader.ReadVarint());
+		fragmentShader.resize(reader.ReadVarint());
+		_commandBuffer->ReadStreamingData((void*)vertexShader.c_str(), vertexShader.size());	
+		_commandBuffer->ReadStreamingData((void*)fragmentShader.c_str(), fragmentShader.size());
+		_programs.Set(program, GetBackend<Backend>()->CreateGPUProgram(vertexShader, fragmentShader));
+	}
+
+	template<class Backend>
+	void ThreadBufferESDevice::RunDeleteGPUProgram(CommandReader& reader)
+	{
+		unsigned int program = reader.ReadVarint();
+		GetBackend<Backend>()->DeletGPUProgram(Resolve(_programs, program));
+		_programs.Remove(program);
+		unsigned int paramCount = reader.ReadVarint();
+		for (unsigned int i = 0; i < paramCount; ++i)
 		{
-			ThreadedGPUProgramParam* threadParam = _commandBuffer->ReadValueType<ThreadedGPUProgramParam*>();
-			auto size = _commandBuffer->ReadValueType<unsigned int>();
-			std::vector<glm::mat4> values;
-			values.resize(size/sizeof(glm::mat4));
-			_commandBuffer->ReadStreamingData(&values[0], size);
-			_realDevice->SetGPUProgramParamAsMat4Array(threadParam->realParam, values);
-			break;
+			_params.Remove(reader.ReadVarint());
 		}
+	}
+
+	template<class Backend>
+	void ThreadBufferESDevice::RunCreateTexture2D(CommandReader& reader)
+	{
+		unsigned int texture = reader.ReadVarint();
+		unsigned int width = reader.ReadVarint();
+		unsigned int height = reader.ReadVarint();
+		unsigned int dataLen = reader.ReadVarint();
+		TextureFormat format = (TextureFormat)reader.ReadVarint();
+		char *buff = dataLen > 0 ? new char[dataLen] : nullptr;
+		_commandBuffer->ReadStreamingData(buff, dataLen);
+		TextureData::Ptr textureData = std::make_shared<TextureData>(buff,width,height,dataLen,format);
+		_textures.Set(texture, GetBackend<Backend>()->CreateTexture2D(textureData));
+	}
+
+	template<class Backend>
+	void ThreadBufferESDevice::RunDeleteTexture2D(CommandReader& reader)
+	{
+		unsigned int texture = reader.ReadVarint();
+		GetBackend<Backend>()->DeleteTexture2D(Resolve(_textures, texture));
+		_textures.Remove(texture);
+	}
 
-		case kGfxCmd_InitThreadGPUProgramParam:
+	template<class Backend>
+	void ThreadBufferESDevice::RunDrawTriangle(CommandReader& reader)
+	{
+		unsigned int size = reader.ReadVarint();
+		std::vector<glm::vec3> vertices(size / sizeof(glm::vec3));
+		_commandBuffer->ReadStreamingData((void*)&vertices[0], size);
+		GetBackend<Backend>()->DrawTriangle(vertices);
+	}
+
+	template<class Backend>
+	void ThreadBufferESDevice::RunPresent(CommandReader&)
+	{
+		GetBackend<Backend>()->Present();
+		// Release before signalling, Present is always the last command of its batch
+		_commandBuffer->ReadReleaseData();
+		if (_capture != nullptr)
 		{
-			ThreadedGPUProgram* program = _commandBuffer->ReadValueType<ThreadedGPUProgram*>();
-			ThreadedGPUProgramParam* threadParam = _commandBuffer->ReadValueType<ThreadedGPUProgramParam*>();
-			auto size = _commandBuffer->ReadValueType<unsigned int>();
-			std::string name;
-			name.resize(size/sizeof(char));
-			_commandBuffer->ReadStreamingData((void*)name.c_str(), size);
-			threadParam->realParam = _realDevice->GetGPUProgramParam(program->realProgram, name);
-			break;
+			_capture->WriteFrame();
 		}
+		++_presentCount;
+		SignalPresent();
+	}
 
-		default:
-			assert(false);
-			break;
+	template<class Backend>
+	void ThreadBufferESDevice::RunShutdown(CommandReader&)
+	{
+		GetBackend<Backend>()->Cleanup();
+		SignalQuit();
+	}
+
+	template<class Backend>
+	void ThreadBufferESDevice::RunCreateVBO(CommandReader& reader)
+	{
+		unsigned int vbo = reader.ReadVarint();
+		_vbos.Set(vbo, GetBackend<Backend>()->CreateVBO());
+	}
+
+	template<class Backend>
+	void ThreadBufferESDevice::RunUpdateVBO(CommandReader& reader)
+	{
+		unsigned int vbo = reader.ReadVarint();
+		unsigned int verticesCount = reader.ReadVarint();
+		unsigned int indicesCount = reader.ReadVarint();
+		VertexFormat format = reader.ReadRaw<VertexFormat>();
+		BeginProfile("kGfxCmd_UpdateVBO alloc");
+		VBOData::Ptr vboData = std::make_shared<VBOData>(verticesCount, indicesCount, format);
+		EndProfile();
+		BeginProfile("kGfxCmd_UpdateVBO write");
+		_commandBuffer->ReadStreamingData((void*)vboData->vertices, vboData->GetVertexBufferSize());
+		_commandBuffer->ReadStreamingData((void*)vboData->indices, indicesCount * sizeof(unsigned short));
+		EndProfile();
+		GetBackend<Backend>()->UpdateVBO(Resolve(_vbos, vbo), vboData);
+		vboData.reset();
+	}
+
+	template<class Backend>
+	void ThreadBufferESDevice::RunUpdateVBORange(CommandReader& reader)
+	{
+		unsigned int vbo = reader.ReadVarint();
+		unsigned int vertexStart = reader.ReadVarint();
+		unsigned int vertexCount = reader.ReadVarint();
+		unsigned int vertexSize = reader.ReadVarint();
+		unsigned int indexStart = reader.ReadVarint();
+		unsigned int indexCount = reader.ReadVarint();
+		_vboRangeVertices.resize(vertexSize);
+		_vboRangeIndices.resize(indexCount);
+		_commandBuffer->ReadStreamingData(_vboRangeVertices.empty() ? nullptr : &_vboRangeVertices[0], _vboRangeVertices.size());
+		_commandBuffer->ReadStreamingData(_vboRangeIndices.empty() ? nullptr : &_vboRangeIndices[0], indexCount * sizeof(unsigned short));
+		GetBackend<Backend>()->UpdateVBORange(Resolve(_vbos, vbo), vertexStart, vertexCount, _vboRangeVertices.empty() ? nullptr : &_vboRangeVertices[0],
+			indexStart, indexCount, _vboRangeIndices.empty() ? nullptr : &_vboRangeIndices[0]);
+	}
+
+	template<class Backend>
+	void ThreadBufferESDevice::RunDeleteVBO(CommandReader& reader)
+	{
+		unsigned int vbo = reader.ReadVarint();
+		GetBackend<Backend>()->DeleteVBO(Resolve(_vbos, vbo));
+		_vbos.Remove(vbo);
+	}
+
+	template<class Backend>
+	void ThreadBufferESDevice::RunSetGPUProgramParamAsAffineMat4(CommandReader& reader)
+	{
+		unsigned int param = reader.ReadVarint();
+		glm::mat4 value(1.0f);
+		for (int column = 0; column < 4; ++column)
+		{
+			value[column] = glm::vec4(reader.ReadRaw<glm::vec3>(), column == 3 ? 1.0f : 0.0f);
 		}
+		GetBackend<Backend>()->SetGPUProgramParamAsMat4(Resolve(_params, param), value);
+	}
+
+	template<class Backend>
+	void ThreadBufferESDevice::RunSetGPUProgramParamAsIntArray(CommandReader& reader)
+	{
+		unsigned int param = reader.ReadVarint();
+		unsigned int size = reader.ReadVarint();
+		std::vector<int> values;
+		values.resize(size/sizeof(int));
+		_commandBuffer->ReadStreamingData(&values[0], size);
+		GetBackend<Backend>()->SetGPUProgramParamAsIntArray(Resolve(_params, param), values);
+	}
+
+	template<class Backend>
+	void ThreadBufferESDevice::RunSetGPUProgramParamAsFloatArray(CommandReader& reader)
+	{
+		unsigned int param = reader.ReadVarint();
+		unsigned int size = reader.ReadVarint();
+		std::vector<float> values;
+		values.resize(size/sizeof(float));
+		_commandBuffer->ReadStreamingData(&values[0], size);
+		GetBackend<Backend>()->SetGPUProgramParamAsFloatArray(Resolve(_params, param), values);
+	}
+
+	template<class Backend>
+	void ThreadBufferESDevice::RunSetGPUProgramParamAsMat4Array(CommandReader& reader)
+	{
+		unsigned int param = reader.ReadVarint();
+		unsigned int size = reader.ReadVarint();
+		std::vector<glm::mat4> values;
+		values.resize(size/sizeof(glm::mat4));
+		_commandBuffer->ReadStreamingData(&values[0], size);
+		GetBackend<Backend>()->SetGPUProgramParamAsMat4Array(Resolve(_params, param), values);
+	}
+
+	template<class Backend>
+	void ThreadBufferESDevice::RunInitThreadGPUProgramParam(CommandReader& reader)
+	{
+		unsigned int program = reader.ReadVarint();
+		unsigned int param = reader.ReadVarint();
+		unsigned int size = reader.ReadVarint();
+		std::string name;
+		name.resize(size/sizeof(char));
+		_commandBuffer->ReadStreamingData((void*)name.c_str(), size);
+		_params.Set(param, GetBackend<Backend>()->GetGPUProgramParam(Resolve(_programs, program), name));
+	}
+
+	template<class Backend>
+	void ThreadBufferESDevice::RunCreateMaterial(CommandReader& reader)
+	{
+		unsigned int material = reader.ReadVarint();
+		_materials.Set(material, GetBackend<Backend>()->CreateMaterial(ReadMaterialDesc(reader)));
 	}
 
+	template<class Backend>
+	void ThreadBufferESDevice::RunDeleteMaterial(CommandReader& reader)
+	{
+		unsigned int material = reader.ReadVarint();
+		GetBackend<Backend>()->DeleteMaterial(Resolve(_materials, material));
+		_materials.Remove(material);
+	}
 
+	template<class Backend>
+	void ThreadBufferESDevice::RunCreatePipelineState(CommandReader& reader)
+	{
+		unsigned int state = reader.ReadVarint();
+		auto desc = reader.ReadRaw<PipelineStateDesc>();
+		_states.Set(state, GetBackend<Backend>()->CreatePipelineState(desc));
+	}
+
+	template<class Backend>
+	const ThreadBufferESDevice::CommandHandler* ThreadBufferESDevice::GetCommandHandlers()
+	{
+#define GFX_DEVICE_COMMAND_HANDLER(name) &ThreadBufferESDevice::RunDeviceCommand<Backend, Call##name, decltype(&ESDevice::name)>,
+#define GFX_CUSTOM_COMMAND_HANDLER(name) &ThreadBufferESDevice::Run##name<Backend>,
+		static const CommandHandler handlers[kGfxCmd_Count] =
+		{
+			nullptr,
+			GFX_COMMANDS(GFX_DEVICE_COMMAND_HANDLER, GFX_CUSTOM_COMMAND_HANDLER)
+		};
+#undef GFX_DEVICE_COMMAND_HANDLER
+#undef GFX_CUSTOM_COMMAND_HANDLER
+		return handlers;
+	}
 
+	template const ThreadBufferESDevice::CommandHandler* ThreadBufferESDevice::GetCommandHandlers<ESDevice>();
+	template const ThreadBufferESDevice::CommandHandler* ThreadBufferESDevice::GetCommandHandlers<ESDeviceImp>();
+	template const ThreadBufferESDevice::CommandHandler* ThreadBufferESDevice::GetCommandHandlers<NullESDevice>();
 }
\ No newline at end of file
@@ -74,6 +74,18 @@ namespace RenderEngine {
 		}
 		void OnExecuteEnd(ThreadESDevice* threadDevice);
 	};
+	class ShutdownCMD : public ThreadDeviceCommand
+	{
+	public:
+		void Execute(ESDevice* device)
+		{
+			device->Cleanup();
+		}
+		void OnExecuteEnd(ThreadESDevice* threadDevice)
+		{
+			threadDevice->SignalQuit();
+		}
+	};
 	class DrawVBOCMD : public ThreadDeviceCommand
 	{
 	private:
@@ -85,6 +97,20 @@ namespace RenderEngine {
 			device->DrawVBO(_vbo->realVbo);
 		}
 	};
+	class DrawVBORangeCMD : public ThreadDeviceCommand
+	{
+	private:
+		ThreadedVBO * _vbo;
+		unsigned int _indexStart;
+		unsigned int _indexCount;
+	public:
+		DrawVBORangeCMD(ThreadedVBO* vbo, unsigned int indexStart, unsigned int indexCount)
+			:_vbo(vbo), _indexStart(indexStart), _indexCount(indexCount) {}
+		void Execute(ESDevice* device)
+		{
+			device->DrawVBORange(_vbo->realVbo, _indexStart, _indexCount);
+		}
+	};
 	class DeleteVBOCMD : public ThreadDeviceCommand
 	{
 	private:
@@ -110,6 +136,28 @@ namespace RenderEngine {
 			device->UpdateVBO(_vbo->realVbo, _vboData);
 		}
 	};
+	class UpdateVBORangeCMD : public ThreadDeviceCommand
+	{
+	private:
+		ThreadedVBO * _vbo;
+		unsigned int _vertexStart;
+		unsigned int _vertexCount;
+		unsigned int _indexStart;
+		std::vector<char> _vertices;
+		std::vector<unsigned short> _indices;
+	public:
+		// Copies only the changed bytes, the caller may reuse its buffers right away
+		UpdateVBORangeCMD(ThreadedVBO *vbo, unsigned int vertexStart, unsigned int vertexCount, const void* vertices,
+			unsigned int indexStart, unsigned int indexCount, const unsigned short* indices)
+			:_vbo(vbo), _vertexStart(vertexStart), _vertexCount(vertexCount), _indexStart(indexStart)
+			, _vertices((const char*)vertices, (const char*)vertices + (size_t)vertexCount * vbo->stride)
+			, _indices(indices, indices + indexCount) {}
+		void Execute(ESDevice* device)
+		{
+			device->UpdateVBORange(_vbo->realVbo, _vertexStart, _vertexCount, _vertices.empty() ? nullptr : &_vertices[0],
+				_indexStart, (unsigned int)_indices.size(), _indices.empty() ? nullptr : &_indices[0]);
+		}
+	};
 	class CreateVBOCMD : public ThreadDeviceCommand
 	{
 	private:
@@ -306,6 +354,10 @@ namespace RenderEngine {
 			delete _commandQueue;
 		}
 	}
+	void ThreadESDevice::QueueShutdown()
+	{
+		_commandQueue->Push(new ShutdownCMD());
+	}
 	void ThreadESDevice::BeginRender()
 	{
 	}
@@ -321,7 +373,8 @@ namespace RenderEngine {
 			_realDevice->Present();
 			_isInPresenting = false;
 			return;
-		}
+		}
+		ReleaseConfirmedUploads();
 		_commandQueue->Push(new PresentCMD());
 	}
 	void RenderEngine::ThreadESDevice::AcqiureThreadOwnerShip()
@@ -452,18 +505,38 @@ namespace RenderEngine {
 	}
 	void ThreadESDevice::UpdateVBO(VBO* vbo, const VBOData::Ptr& vboData)
 	{
-		ThreadedVBO* threadVbo = static_cast<ThreadedVBO*>(vbo);
+		ThreadedVBO* threadVbo = static_cast<ThreadedVBO*>(vbo);
+		if (!vboData->EnsureResident())
+		{
+			esLogMessage("[render] UpdateVBO with released data, ignored");
+			return;
+		}
+		threadVbo->stride = vboData->format.GetStride();
 		if (!_threaded)
 		{
 			_realDevice->UpdateVBO(threadVbo->realVbo,vboData);
+			vboData->OnUploaded();
 		}
 		else
 		{
 			UpdateVBOCMD* cmd = new UpdateVBOCMD(vboData, threadVbo);
 			_commandQueue->Push(cmd);
-
+			TrackUpload(vboData);
 		}
-	}
+	}
+	void ThreadESDevice::UpdateVBORange(VBO* vbo, unsigned int vertexStart, unsigned int vertexCount, const void* vertices,
+		unsigned int indexStart, unsigned int indexCount, const unsigned short* indices)
+	{
+		ThreadedVBO* threadVbo = static_cast<ThreadedVBO*>(vbo);
+		if (!_threaded)
+		{
+			_realDevice->UpdateVBORange(threadVbo->realVbo, vertexStart, vertexCount, vertices, indexStart, indexCount, indices);
+		}
+		else
+		{
+			_commandQueue->Push(new UpdateVBORangeCMD(threadVbo, vertexStart, vertexCount, vertices, indexStart, indexCount, indices));
+		}
+	}
 	void ThreadESDevice::DeleteVBO(VBO* vbo)
 	{
 		ThreadedVBO* threadedVbo = static_cast<ThreadedVBO*>(vbo);
@@ -488,7 +561,19 @@ namespace RenderEngine {
 		else
 		{
 			_commandQueue->Push(new DrawVBOCMD(threadedVbo));
-		}
+		}
+	}
+	void ThreadESDevice::DrawVBORange(VBO* vbo, unsigned int indexStart, unsigned int indexCount)
+	{
+		ThreadedVBO* threadedVbo = static_cast<ThreadedVBO*>(vbo);
+		if (!_threaded)
+		{
+			_realDevice->DrawVBORange(threadedVbo->realVbo, indexStart, indexCount);
+		}
+		else
+		{
+			_commandQueue->Push(new DrawVBORangeCMD(threadedVbo, indexStart, indexCount));
+		}
 	}
 	class SetGPUProgramParamAsIntCMD : public ThreadDeviceCommand
 	{
@@ -645,11 +730,150 @@ namespace RenderEngine {
 		}
 	}
 
+	class CreateMaterialCMD : public ThreadDeviceCommand
+	{
+	private:
+		ThreadedMaterial * _material;
+	public:
+		CreateMaterialCMD(ThreadedMaterial* material) :_material(material) {}
+		void Execute(ESDevice* device)
+		{
+			_material->realMaterial = device->CreateMaterial(_material->GetRealDesc());
+		}
+	};
+
+	class DeleteMaterialCMD : public ThreadDeviceCommand
+	{
+	private:
+		ThreadedMaterial * _material;
+	public:
+		DeleteMaterialCMD(ThreadedMaterial* material) :_material(material) {}
+		void Execute(ESDevice* device)
+		{
+			device->DeleteMaterial(_material->realMaterial);
+			delete _material;
+		}
+	};
+
+	class UseMaterialCMD : public ThreadDeviceCommand
+	{
+	private:
+		ThreadedMaterial * _material;
+	public:
+		UseMaterialCMD(ThreadedMaterial* material) :_material(material) {}
+		void Execute(ESDevice* device)
+		{
+			device->UseMaterial(_material->realMaterial);
+		}
+	};
+
+	Material* ThreadESDevice::CreateMaterial(const MaterialDesc& desc)
+	{
+		ThreadedMaterial* material = new ThreadedMaterial(desc);
+		if (!_threaded)
+		{
+			material->realMaterial = _realDevice->CreateMaterial(material->GetRealDesc());
+		}
+		else
+		{
+			_commandQueue->Push(new CreateMaterialCMD(material));
+		}
+		return material;
+	}
+
+	void ThreadESDevice::DeleteMaterial(Material* material)
+	{
+		ThreadedMaterial* threadedMaterial = static_cast<ThreadedMaterial*>(material);
+		if (!_threaded)
+		{
+			_realDevice->DeleteMaterial(threadedMaterial->realMaterial);
+			delete threadedMaterial;
+		}
+		else
+		{
+			_commandQueue->Push(new DeleteMaterialCMD(threadedMaterial));
+		}
+	}
+
+	void ThreadESDevice::UseMaterial(Material* material)
+	{
+		ThreadedMaterial* threadedMaterial = static_cast<ThreadedMaterial*>(material);
+		if (!_threaded)
+		{
+			_realDevice->UseMaterial(threadedMaterial->realMaterial);
+		}
+		else
+		{
+			_commandQueue->Push(new UseMaterialCMD(threadedMaterial));
+		}
+	}
+
+	class CreatePipelineStateCMD : public ThreadDeviceCommand
+	{
+	private:
+		ThreadedPipelineState * _state;
+	public:
+		CreatePipelineStateCMD(ThreadedPipelineState* state) :_state(state) {}
+		void Execute(ESDevice* device)
+		{
+			_state->realState = device->CreatePipelineState(_state->GetDesc());
+		}
+	};
+
+	class UsePipelineStateCMD : public ThreadDeviceCommand
+	{
+	private:
+		ThreadedPipelineState * _state;
+	public:
+		UsePipelineStateCMD(ThreadedPipelineState* state) :_state(state) {}
+		void Execute(ESDevice* device)
+		{
+			device->UsePipelineState(_state->realState);
+		}
+	};
+
+	PipelineState* ThreadESDevice::CreatePipelineState(const PipelineStateDesc& desc)
+	{
+		bool created;
+		ThreadedPipelineState* state = FindOrAddPipelineState(desc, created);
+		if (!created)
+		{
+			return state;
+		}
+		if (!_threaded)
+		{
+			state->realState = _realDevice->CreatePipelineState(desc);
+		}
+		else
+		{
+			_commandQueue->Push(new CreatePipelineStateCMD(state));
+		}
+		return state;
+	}
+
+	void ThreadESDevice::UsePipelineState(PipelineState* state)
+	{
+		ThreadedPipelineState* threadedState = static_cast<ThreadedPipelineState*>(state);
+		if (!_threaded)
+		{
+			_realDevice->UsePipelineState(threadedState->realState);
+		}
+		else
+		{
+			_commandQueue->Push(new UsePipelineStateCMD(threadedState));
+		}
+	}
+
 	Texture2D* ThreadESDevice::CreateTexture2D(const TextureData::Ptr& data)
 	{
 		ThreadedTexture2D* texture = new ThreadedTexture2D();
+		if (!data->EnsureResident())
+		{
+			esLogMessage("[render] texture data was released, creating it without pixels");
+		}
 		CreateTexture2DCMD* cmd = new CreateTexture2DCMD(data, texture);
 		_commandQueue->Push(cmd);				
+		TrackUpload(data);
 		return texture;
 	}
 
@@ -725,11 +949,19 @@ namespace RenderEngine {
 		}
 	}
 
-	void ThreadDoubleQueueESDevice::Cleanup()
+	void ThreadDoubleQueueESDevice::QueueShutdown()
 	{
-		_mainThreadSem.Signal();
-		_renderThreadSem.Signal();
-		ThreadESDevice::Cleanup();
+		// Called between frames: let the render thread run the frame Present
+		// handed it, then hand over what was recorded since, shutdown last
+		ThreadESDevice::QueueShutdown();
+		BeginRender();
+		if (!_suspend)
+		{
+			_mainThreadSem.WaitForSignal();
+		}
+		std::swap(_renderQueue, _updateQueue);
+		_commandQueue = _updateQueue;
+		BeginRender();
 	}
 
 }
\ No newline at end of file
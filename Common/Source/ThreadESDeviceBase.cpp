@@ -7,6 +7,54 @@ namespace RenderEngine {
 		return _threadDevice->GetGPUProgramParam(this, name);
 	}
 
+	MaterialDesc ThreadedMaterial::GetRealDesc() const
+	{
+		MaterialDesc desc(_desc.program->GetRealGUPProgram());
+		for (auto& t : _desc.textures)
+		{
+			desc.AddTexture(t.texture->GetRealTexture2D(), t.index);
+		}
+		for (auto u : _desc.uniforms)
+		{
+			u.param = u.param->GetRealParam();
+			desc.uniforms.push_back(u);
+		}
+		return desc;
+	}
+
+	ThreadedPipelineState* ThreadESDeviceBase::FindOrAddPipelineState(const PipelineStateDesc& desc, bool& created)
+	{
+		auto iter = _pipelineStates.find(desc.GetHash());
+		created = iter == _pipelineStates.end();
+		if (created)
+		{
+			iter = _pipelineStates.insert(std::make_pair(desc.GetHash(), new ThreadedPipelineState(desc))).first;
+		}
+		return iter->second;
+	}
+
+	void ThreadESDeviceBase::TrackUpload(const std::shared_ptr<ResidentData>& data)
+	{
+		if (data->residency != kResidencyKeep)
+		{
+			_queuedUploads.push_back(data);
+		}
+	}
+
+	void ThreadESDeviceBase::ReleaseConfirmedUploads()
+	{
+		// Everything queued before the previous Present has been executed
+		for (auto& upload : _presentedUploads)
+		{
+			if (auto data = upload.lock())
+			{
+				data->OnUploaded();
+			}
+		}
+		_presentedUploads.swap(_queuedUploads);
+		_queuedUploads.clear();
+	}
+
 	GPUProgramParam * ThreadESDeviceBase::GetGPUProgramParam(GPUProgram * program, const std::string & name)
 	{
 		ThreadedGPUProgramParam* param = new ThreadedGPUProgramParam();
@@ -0,0 +1,537 @@
+#include "VertexPacker.h"
+#include "esUtil.h"
+#include <string.h>
+#include <cmath>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VP_USE_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define VP_USE_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace RenderEngine {
+
+	namespace {
+		union FloatBits
+		{
+			float f;
+			unsigned int u;
+		};
+
+		inline unsigned short QuantizeHalf(float v)
+		{
+			FloatBits bits;
+			bits.f = v;
+			int s = (bits.u >> 16) & 0x8000;
+			int em = bits.u & 0x7fffffff;
+			// rebias exponent 127 -> 15 and round the dropped 13 bits
+			int h = (em - (112 << 23) + (1 << 12)) >> 13;
+			h = em < (113 << 23) ? 0 : h;
+			h = em >= (143 << 23) ? 0x7c00 : h;
+			h = em > (255 << 23) ? 0x7e00 : h;
+			return (unsigned short)(s | h);
+		}
+
+		inline int RoundToInt(float v)
+		{
+			return (int)(v + std::copysign(0.5f, v));
+		}
+
+		inline float Clamp1(float v)
+		{
+			return std::min(std::max(v, -1.0f), 1.0f);
+		}
+
+		inline int SNorm16(float v)
+		{
+			return RoundToInt(Clamp1(v) * 32767.0f);
+		}
+
+		inline unsigned int PackSNorm10(const glm::vec3& n)
+		{
+			unsigned int x = RoundToInt(Clamp1(n.x) * 511.0f) & 0x3ff;
+			unsigned int y = RoundToInt(Clamp1(n.y) * 511.0f) & 0x3ff;
+			unsigned int z = RoundToInt(Clamp1(n.z) * 511.0f) & 0x3ff;
+			return x | (y << 10) | (z << 20);
+		}
+
+		inline float UnpackSNorm10(unsigned int bits)
+		{
+			int v = (int)(bits << 22) >> 22;
+			return std::max(v / 511.0f, -1.0f);
+		}
+
+		inline float UnpackSNorm16(short v)
+		{
+			return std::max(v / 32767.0f, -1.0f);
+		}
+
+		// Encoded attributes of one vertex, as integers ready to be narrowed
+		struct PackedVertex
+		{
+			int pos[3];
+			int normal[2];
+			int uv[2];
+		};
+
+		void WriteVertex(char* dst, const VertexFormat& format, const VBOData::Vertex& src, const PackedVertex& packed)
+		{
+			switch (format.position)
+			{
+			case kVertexPosHalf4:
+			{
+				unsigned short p[4] = { (unsigned short)packed.pos[0], (unsigned short)packed.pos[1], (unsigned short)packed.pos[2], 0x3c00 };
+				memcpy(dst, p, sizeof(p));
+				break;
+			}
+			case kVertexPosSNorm16x4:
+			{
+				short p[4] = { (short)packed.pos[0], (short)packed.pos[1], (short)packed.pos[2], 32767 };
+				memcpy(dst, p, sizeof(p));
+				break;
+			}
+			default:
+				memcpy(dst, &src.pos, sizeof(src.pos));
+				break;
+			}
+			dst += format.GetPositionSize();
+
+			switch (format.normal)
+			{
+			case kVertexNormalSNorm10x3:
+			{
+				unsigned int n = (unsigned int)packed.normal[0];
+				memcpy(dst, &n, sizeof(n));
+				break;
+			}
+			case kVertexNormalOctahedral:
+			{
+				short n[2] = { (short)packed.normal[0], (short)packed.normal[1] };
+				memcpy(dst, n, sizeof(n));
+				break;
+			}
+			default:
+				memcpy(dst, &src.normal, sizeof(src.normal));
+				break;
+			}
+			dst += format.GetNormalSize();
+
+			if (format.uv == kVertexUVHalf2)
+			{
+				unsigned short uv[2] = { (unsigned short)packed.uv[0], (unsigned short)packed.uv[1] };
+				memcpy(dst, uv, sizeof(uv));
+			}
+			else
+			{
+				memcpy(dst, &src.uv, sizeof(src.uv));
+			}
+		}
+
+		void PackScalar(const VBOData::Vertex& src, const VertexFormat& format, const glm::vec3& center, const glm::vec3& invScale, PackedVertex& out)
+		{
+			glm::vec3 p = (src.pos - center) * invScale;
+			for (int i = 0; i < 3; ++i)
+			{
+				out.pos[i] = format.position == kVertexPosHalf4 ? QuantizeHalf(Clamp1(p[i])) : SNorm16(p[i]);
+			}
+			if (format.normal == kVertexNormalOctahedral)
+			{
+				glm::vec2 e = VertexPacker::EncodeOctahedral(src.normal);
+				out.normal[0] = SNorm16(e.x);
+				out.normal[1] = SNorm16(e.y);
+			}
+			else
+			{
+				out.normal[0] = (int)PackSNorm10(src.normal);
+				out.normal[1] = 0;
+			}
+			out.uv[0] = QuantizeHalf(src.uv.x);
+			out.uv[1] = QuantizeHalf(src.uv.y);
+		}
+
+#if defined(VP_USE_SSE2) || defined(VP_USE_NEON)
+#if defined(VP_USE_SSE2)
+		typedef __m128 Float4;
+		typedef __m128i Int4;
+
+		inline Float4 Load(const float* p) { return _mm_loadu_ps(p); }
+		inline Float4 Set1(float v) { return _mm_set1_ps(v); }
+		inline Float4 Add(Float4 a, Float4 b) { return _mm_add_ps(a, b); }
+		inline Float4 Sub(Float4 a, Float4 b) { return _mm_sub_ps(a, b); }
+		inline Float4 Mul(Float4 a, Float4 b) { return _mm_mul_ps(a, b); }
+		inline Float4 Div(Float4 a, Float4 b) { return _mm_div_ps(a, b); }
+		inline Float4 Min(Float4 a, Float4 b) { return _mm_min_ps(a, b); }
+		inline Float4 Max(Float4 a, Float4 b) { return _mm_max_ps(a, b); }
+		inline Float4 Abs(Float4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+		inline Float4 CopySign(Float4 mag, Float4 sign) { return _mm_or_ps(Abs(mag), _mm_and_ps(sign, _mm_set1_ps(-0.0f))); }
+		inline Float4 SelectNegative(Float4 v, Float4 ifNegative, Float4 otherwise)
+		{
+			Float4 mask = _mm_cmplt_ps(v, _mm_setzero_ps());
+			return _mm_or_ps(_mm_and_ps(mask, ifNegative), _mm_andnot_ps(mask, otherwise));
+		}
+		inline Int4 Truncate(Float4 v) { return _mm_cvttps_epi32(v); }
+		inline Int4 AsInt(Float4 v) { return _mm_castps_si128(v); }
+		inline Int4 ISet1(int v) { return _mm_set1_epi32(v); }
+		inline Int4 IAdd(Int4 a, Int4 b) { return _mm_add_epi32(a, b); }
+		inline Int4 ISub(Int4 a, Int4 b) { return _mm_sub_epi32(a, b); }
+		inline Int4 IAnd(Int4 a, Int4 b) { return _mm_and_si128(a, b); }
+		inline Int4 IOr(Int4 a, Int4 b) { return _mm_or_si128(a, b); }
+		template <int N> inline Int4 IShl(Int4 a) { return _mm_slli_epi32(a, N); }
+		template <int N> inline Int4 IShr(Int4 a) { return _mm_srli_epi32(a, N); }
+		// v < limit ? a : b
+		inline Int4 ISelectLess(Int4 v, Int4 limit, Int4 a, Int4 b)
+		{
+			Int4 mask = _mm_cmplt_epi32(v, limit);
+			return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+		}
+		inline void IStore(int* p, Int4 v) { _mm_storeu_si128((__m128i*)p, v); }
+		inline void Transpose4(Float4& r0, Float4& r1, Float4& r2, Float4& r3) { _MM_TRANSPOSE4_PS(r0, r1, r2, r3); }
+#else
+		typedef float32x4_t Float4;
+		typedef int32x4_t Int4;
+
+		inline Float4 Load(const float* p) { return vld1q_f32(p); }
+		inline Float4 Set1(float v) { return vdupq_n_f32(v); }
+		inline Float4 Add(Float4 a, Float4 b) { return vaddq_f32(a, b); }
+		inline Float4 Sub(Float4 a, Float4 b) { return vsubq_f32(a, b); }
+		inline Float4 Mul(Float4 a, Float4 b) { return vmulq_f32(a, b); }
+		inline Float4 Div(Float4 a, Float4 b)
+		{
+			Float4 r = vrecpeq_f32(b);
+			r = vmulq_f32(vrecpsq_f32(b, r), r);
+			r = vmulq_f32(vrecpsq_f32(b, r), r);
+			return vmulq_f32(a, r);
+		}
+		inline Float4 Min(Float4 a, Float4 b) { return vminq_f32(a, b); }
+		inline Float4 Max(Float4 a, Float4 b) { return vmaxq_f32(a, b); }
+		inline Float4 Abs(Float4 a) { return vabsq_f32(a); }
+		inline Float4 CopySign(Float4 mag, Float4 sign) { return vbslq_f32(vdupq_n_u32(0x80000000), sign, vabsq_f32(mag)); }
+		inline Float4 SelectNegative(Float4 v, Float4 ifNegative, Float4 otherwise)
+		{
+			return vbslq_f32(vcltq_f32(v, vdupq_n_f32(0.0f)), ifNegative, otherwise);
+		}
+		inline Int4 Truncate(Float4 v) { return vcvtq_s32_f32(v); }
+		inline Int4 AsInt(Float4 v) { return vreinterpretq_s32_f32(v); }
+		inline Int4 ISet1(int v) { return vdupq_n_s32(v); }
+		inline Int4 IAdd(Int4 a, Int4 b) { return vaddq_s32(a, b); }
+		inline Int4 ISub(Int4 a, Int4 b) { return vsubq_s32(a, b); }
+		inline Int4 IAnd(Int4 a, Int4 b) { return vandq_s32(a, b); }
+		inline Int4 IOr(Int4 a, Int4 b) { return vorrq_s32(a, b); }
+		template <int N> inline Int4 IShl(Int4 a) { return vshlq_n_s32(a, N); }
+		template <int N> inline Int4 IShr(Int4 a) { return vreinterpretq_s32_u32(vshrq_n_u32(vreinterpretq_u32_s32(a), N)); }
+		inline Int4 ISelectLess(Int4 v, Int4 limit, Int4 a, Int4 b) { return vbslq_s32(vcltq_s32(v, limit), a, b); }
+		inline void IStore(int* p, Int4 v) { vst1q_s32(p, v); }
+		inline void Transpose4(Float4& r0, Float4& r1, Float4& r2, Float4& r3)
+		{
+			float32x4x2_t t01 = vtrnq_f32(r0, r1);
+			float32x4x2_t t23 = vtrnq_f32(r2, r3);
+			r0 = vcombine_f32(vget_low_f32(t01.val[0]), vget_low_f32(t23.val[0]));
+			r1 = vcombine_f32(vget_low_f32(t01.val[1]), vget_low_f32(t23.val[1]));
+			r2 = vcombine_f32(vget_high_f32(t01.val[0]), vget_high_f32(t23.val[0]));
+			r3 = vcombine_f32(vget_high_f32(t01.val[1]), vget_high_f32(t23.val[1]));
+		}
+#endif
+		inline Float4 Clamp1(Float4 v) { return Min(Max(v, Set1(-1.0f)), Set1(1.0f)); }
+		inline Int4 RoundToInt(Float4 v) { return Truncate(Add(v, CopySign(Set1(0.5f), v))); }
+		inline Int4 SNorm16(Float4 v) { return RoundToInt(Mul(Clamp1(v), Set1(32767.0f))); }
+		inline Int4 SNorm10(Float4 v) { return IAnd(RoundToInt(Mul(Clamp1(v), Set1(511.0f))), ISet1(0x3ff)); }
+
+		inline Int4 QuantizeHalf(Float4 v)
+		{
+			Int4 bits = AsInt(v);
+			Int4 s = IAnd(IShr<16>(bits), ISet1(0x8000));
+			Int4 em = IAnd(bits, ISet1(0x7fffffff));
+			Int4 h = IShr<13>(IAdd(ISub(em, ISet1(112 << 23)), ISet1(1 << 12)));
+			h = ISelectLess(em, ISet1(113 << 23), ISet1(0), h);
+			h = ISelectLess(em, ISet1(143 << 23), h, ISet1(0x7c00));
+			h = ISelectLess(ISet1(255 << 23), em, ISet1(0x7e00), h);
+			return IOr(s, h);
+		}
+
+		// Packs four vertices, the 32 byte float vertex transposes into two 4x4 blocks
+		void PackBlockSIMD(const VBOData::Vertex* src, const VertexFormat& format, const glm::vec3& center, const glm::vec3& invScale, PackedVertex* out)
+		{
+			const float* v = &src[0].pos.x;
+			Float4 px = Load(v), py = Load(v + 8), pz = Load(v + 16), nx = Load(v + 24);
+			Float4 ny = Load(v + 4), nz = Load(v + 12), tu = Load(v + 20), tv = Load(v + 28);
+			Transpose4(px, py, pz, nx);
+			Transpose4(ny, nz, tu, tv);
+
+			int pos[3][4];
+			Float4 p[3] = {
+				Mul(Sub(px, Set1(center.x)), Set1(invScale.x)),
+				Mul(Sub(py, Set1(center.y)), Set1(invScale.y)),
+				Mul(Sub(pz, Set1(center.z)), Set1(invScale.z)),
+			};
+			for (int i = 0; i < 3; ++i)
+			{
+				IStore(pos[i], format.position == kVertexPosHalf4 ? QuantizeHalf(Clamp1(p[i])) : SNorm16(p[i]));
+			}
+
+			int normal[2][4];
+			if (format.normal == kVertexNormalOctahedral)
+			{
+				Float4 l1 = Add(Add(Abs(nx), Abs(ny)), Abs(nz));
+				l1 = Max(l1, Set1(1e-20f));
+				Float4 ox = Div(nx, l1);
+				Float4 oy = Div(ny, l1);
+				Float4 fx = CopySign(Sub(Set1(1.0f), Abs(oy)), ox);
+				Float4 fy = CopySign(Sub(Set1(1.0f), Abs(ox)), oy);
+				IStore(normal[0], SNorm16(SelectNegative(nz, fx, ox)));
+				IStore(normal[1], SNorm16(SelectNegative(nz, fy, oy)));
+			}
+			else
+			{
+				IStore(normal[0], IOr(IOr(SNorm10(nx), IShl<10>(SNorm10(ny))), IShl<20>(SNorm10(nz))));
+				IStore(normal[1], ISet1(0));
+			}
+
+			int uv[2][4];
+			IStore(uv[0], QuantizeHalf(tu));
+			IStore(uv[1], QuantizeHalf(tv));
+
+			for (int lane = 0; lane < 4; ++lane)
+			{
+				PackedVertex& o = out[lane];
+				o.pos[0] = pos[0][lane];
+				o.pos[1] = pos[1][lane];
+				o.pos[2] = pos[2][lane];
+				o.normal[0] = normal[0][lane];
+				o.normal[1] = normal[1][lane];
+				o.uv[0] = uv[0][lane];
+				o.uv[1] = uv[1][lane];
+			}
+		}
+#endif
+	}
+
+	VBOData::Ptr VertexPacker::Pack(const VBOData::Ptr& source, const VertexFormat& format, bool useSIMD)
+	{
+		if (!source->format.IsFloat())
+		{
+			esLogMessage("[render] VertexPacker: source VBOData is already packed\n");
+			return nullptr;
+		}
+		VBOData::Ptr packed = std::make_shared<VBOData>(source->verticesCount, source->indicesCount, format);
+		memcpy(packed->indices, source->indices, source->indicesCount * sizeof(unsigned short));
+
+		const unsigned int count = source->verticesCount;
+		const VBOData::Vertex* vertices = source->vertices;
+		glm::vec3 center(0.0f), invScale(1.0f);
+		if (format.position != kVertexPosFloat3 && count > 0)
+		{
+			glm::vec3 minPos = vertices[0].pos, maxPos = vertices[0].pos;
+			for (unsigned int i = 1; i < count; ++i)
+			{
+				minPos = glm::min(minPos, vertices[i].pos);
+				maxPos = glm::max(maxPos, vertices[i].pos);
+			}
+			center = (minPos + maxPos) * 0.5f;
+			glm::vec3 extent = (maxPos - minPos) * 0.5f;
+			for (int i = 0; i < 3; ++i)
+			{
+				invScale[i] = extent[i] > 0.0f ? 1.0f / extent[i] : 0.0f;
+			}
+			packed->decodeOffset = center;
+			packed->decodeScale = extent;
+		}
+
+		if (format.IsFloat())
+		{
+			memcpy(packed->vertices, vertices, source->GetVertexBufferSize());
+			return packed;
+		}
+
+		const unsigned int stride = format.GetStride();
+		char* dst = (char*)packed->vertices;
+		unsigned int i = 0;
+		PackedVertex block[4];
+#if defined(VP_USE_SSE2) || defined(VP_USE_NEON)
+		if (useSIMD)
+		{
+			for (; i + 4 <= count; i += 4)
+			{
+				PackBlockSIMD(vertices + i, format, center, invScale, block);
+				for (int lane = 0; lane < 4; ++lane)
+				{
+					WriteVertex(dst + (size_t)(i + lane) * stride, format, vertices[i + lane], block[lane]);
+				}
+			}
+		}
+#endif
+		for (; i < count; ++i)
+		{
+			PackScalar(vertices[i], format, center, invScale, block[0]);
+			WriteVertex(dst + (size_t)i * stride, format, vertices[i], block[0]);
+		}
+		return packed;
+	}
+
+	void VertexPacker::PackPositions(const VBOData::Vertex* source, VBOData& packed, unsigned int start, unsigned int count)
+	{
+		const VertexFormat& format = packed.format;
+		const unsigned int stride = format.GetStride();
+		glm::vec3 invScale;
+		for (int i = 0; i < 3; ++i)
+		{
+			invScale[i] = packed.decodeScale[i] > 0.0f ? 1.0f / packed.decodeScale[i] : 0.0f;
+		}
+		char* dst = (char*)packed.vertices + (size_t)start * stride;
+		for (unsigned int i = start; i < start + count; ++i, dst += stride)
+		{
+			if (format.position == kVertexPosFloat3)
+			{
+				memcpy(dst, &source[i].pos, sizeof(source[i].pos));
+				continue;
+			}
+			glm::vec3 p = (source[i].pos - packed.decodeOffset) * invScale;
+			if (format.position == kVertexPosHalf4)
+			{
+				unsigned short h[3] = { QuantizeHalf(Clamp1(p.x)), QuantizeHalf(Clamp1(p.y)), QuantizeHalf(Clamp1(p.z)) };
+				memcpy(dst, h, sizeof(h));
+			}
+			else
+			{
+				short s[3] = { (short)SNorm16(p.x), (short)SNorm16(p.y), (short)SNorm16(p.z) };
+				memcpy(dst, s, sizeof(s));
+			}
+		}
+		packed.MarkVerticesDirty(start, count);
+	}
+
+	void VertexPacker::Unpack(const VBOData::Ptr& packed, VBOData::Vertex* out)
+	{
+		const VertexFormat& format = packed->format;
+		const unsigned int stride = format.GetStride();
+		const char* src = (const char*)packed->vertices;
+		for (unsigned int i = 0; i < packed->verticesCount; ++i, src += stride)
+		{
+			VBOData::Vertex& v = out[i];
+			const char* p = src;
+			switch (format.position)
+			{
+			case kVertexPosHalf4:
+			{
+				unsigned short h[4];
+				memcpy(h, p, sizeof(h));
+				v.pos = glm::vec3(HalfToFloat(h[0]), HalfToFloat(h[1]), HalfToFloat(h[2])) * packed->decodeScale + packed->decodeOffset;
+				break;
+			}
+			case kVertexPosSNorm16x4:
+			{
+				short s[4];
+				memcpy(s, p, sizeof(s));
+				v.pos = glm::vec3(UnpackSNorm16(s[0]), UnpackSNorm16(s[1]), UnpackSNorm16(s[2])) * packed->decodeScale + packed->decodeOffset;
+				break;
+			}
+			default:
+				memcpy(&v.pos, p, sizeof(v.pos));
+				break;
+			}
+			p += format.GetPositionSize();
+
+			switch (format.normal)
+			{
+			case kVertexNormalSNorm10x3:
+			{
+				unsigned int n;
+				memcpy(&n, p, sizeof(n));
+				v.normal = glm::vec3(UnpackSNorm10(n), UnpackSNorm10(n >> 10), UnpackSNorm10(n >> 20));
+				break;
+			}
+			case kVertexNormalOctahedral:
+			{
+				short s[2];
+				memcpy(s, p, sizeof(s));
+				v.normal = DecodeOctahedral(glm::vec2(UnpackSNorm16(s[0]), UnpackSNorm16(s[1])));
+				break;
+			}
+			default:
+				memcpy(&v.normal, p, sizeof(v.normal));
+				break;
+			}
+			p += format.GetNormalSize();
+
+			if (format.uv == kVertexUVHalf2)
+			{
+				unsigned short h[2];
+				memcpy(h, p, sizeof(h));
+				v.uv = glm::vec2(HalfToFloat(h[0]), HalfToFloat(h[1]));
+			}
+			else
+			{
+				memcpy(&v.uv, p, sizeof(v.uv));
+			}
+		}
+	}
+
+	void VertexPacker::FloatToHalf(const float* src, unsigned short* dst, unsigned int count, bool useSIMD)
+	{
+		unsigned int i = 0;
+#if defined(VP_USE_SSE2) || defined(VP_USE_NEON)
+		if (useSIMD)
+		{
+			int h[4];
+			for (; i + 4 <= count; i += 4)
+			{
+				IStore(h, QuantizeHalf(Load(src + i)));
+				dst[i] = (unsigned short)h[0];
+				dst[i + 1] = (unsigned short)h[1];
+				dst[i + 2] = (unsigned short)h[2];
+				dst[i + 3] = (unsigned short)h[3];
+			}
+		}
+#endif
+		for (; i < count; ++i)
+		{
+			dst[i] = QuantizeHalf(src[i]);
+		}
+	}
+
+	float VertexPacker::HalfToFloat(unsigned short h)
+	{
+		unsigned int sign = (h & 0x8000) << 16;
+		unsigned int exponent = (h >> 10) & 0x1f;
+		unsigned int mantissa = h & 0x3ff;
+		FloatBits bits;
+		if (exponent == 0x1f)
+		{
+			bits.u = sign | 0x7f800000 | (mantissa << 13);
+		}
+		else if (exponent == 0)
+		{
+			bits.f = std::ldexp((float)mantissa, -24);
+			bits.u |= sign;
+		}
+		else
+		{
+			bits.u = sign | ((exponent + 112) << 23) | (mantissa << 13);
+		}
+		return bits.f;
+	}
+
+	glm::vec2 VertexPacker::EncodeOctahedral(const glm::vec3& n)
+	{
+		float l1 = std::max(std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z), 1e-20f);
+		glm::vec2 e(n.x / l1, n.y / l1);
+		if (n.z < 0.0f)
+		{
+			e = glm::vec2(std::copysign(1.0f - std::fabs(e.y), e.x), std::copysign(1.0f - std::fabs(e.x), e.y));
+		}
+		return e;
+	}
+
+	glm::vec3 VertexPacker::DecodeOctahedral(const glm::vec2& e)
+	{
+		glm::vec3 n(e.x, e.y, 1.0f - std::fabs(e.x) - std::fabs(e.y));
+		if (n.z < 0.0f)
+		{
+			n.x = std::copysign(1.0f - std::fabs(e.y), e.x);
+			n.y = std::copysign(1.0f - std::fabs(e.x), e.y);
+		}
+		return glm::normalize(n);
+	}
+}
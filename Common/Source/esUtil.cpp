@@ -395,7 +395,7 @@ std::string ESUTIL_API readFileData(const std::string& filename)
 	esFileClose(f);
 	return result;
 #else
-	std::ifstream f(filename);
+	std::ifstream f(filename, std::ios::binary);
 
 	return std::string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
 #endif
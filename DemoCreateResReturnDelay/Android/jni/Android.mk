@@ -25,6 +25,20 @@ LOCAL_SRC_FILES := $(COMMON_SRC_PATH)/esShader.cpp \
 				   $(COMMON_SRC_PATH)/ESDevice.cpp \
 				   $(COMMON_SRC_PATH)/ThreadESDevice.cpp \
 				   $(COMMON_SRC_PATH)/DemoBase.cpp \
+				   $(COMMON_SRC_PATH)/TGADecoder.cpp \
+				   $(COMMON_SRC_PATH)/MeshOptimizer.cpp \
+				   $(COMMON_SRC_PATH)/VertexPacker.cpp \
+				   $(COMMON_SRC_PATH)/MeshSimplifier.cpp \
+				   $(COMMON_SRC_PATH)/FrustumCuller.cpp \
+				   $(COMMON_SRC_PATH)/BVH.cpp \
+				   $(COMMON_SRC_PATH)/OcclusionCuller.cpp \
+				   $(COMMON_SRC_PATH)/RenderQueue.cpp \
+				   $(COMMON_SRC_PATH)/StaticBatcher.cpp \
+				   $(COMMON_SRC_PATH)/RangeAllocator.cpp \
+				   $(COMMON_SRC_PATH)/MemoryTracker.cpp \
+				   $(COMMON_SRC_PATH)/CommandCapture.cpp \
+				   $(COMMON_SRC_PATH)/NullESDevice.cpp \
+				   $(COMMON_SRC_PATH)/RenderServer.cpp \
 				   $(SRC_PATH)/DemoReturnDelay.cpp
 				   
 				   